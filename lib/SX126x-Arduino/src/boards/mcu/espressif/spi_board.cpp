@@ -14,4 +14,32 @@ void initSPI(void)
 	SPI_LORA.begin(_hwConfig.PIN_LORA_SCLK, _hwConfig.PIN_LORA_MISO, _hwConfig.PIN_LORA_MOSI, _hwConfig.PIN_LORA_NSS);
 #endif
 }
+
+/**
+ * Write a buffer to the SPI bus in one transaction
+ * The core fills the SPI FIFO in 64 byte blocks instead
+ * of starting a separate transfer for every byte
+ * @param buffer
+ * 		Data to be sent
+ * @param size
+ * 		Number of bytes to send
+ */
+void spiWriteBurst(const uint8_t *buffer, uint16_t size)
+{
+	SPI_LORA.writeBytes((uint8_t *)buffer, size);
+}
+
+/**
+ * Read a buffer from the SPI bus in one transaction
+ * NOP (0x00) bytes are clocked out while reading
+ * @param buffer
+ * 		Buffer for the received data
+ * @param size
+ * 		Number of bytes to read
+ */
+void spiReadBurst(uint8_t *buffer, uint16_t size)
+{
+	memset(buffer, 0x00, size);
+	SPI_LORA.transferBytes(buffer, buffer, size);
+}
 #endif
\ No newline at end of file
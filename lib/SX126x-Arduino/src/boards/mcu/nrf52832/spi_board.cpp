@@ -13,4 +13,32 @@ void initSPI(void)
 	// SPI_LORA.begin(NRF_SPI2, _hwConfig.PIN_LORA_MISO, _hwConfig.PIN_LORA_SCLK, _hwConfig.PIN_LORA_MOSI);
 	SPI_LORA.begin();
 }
+
+/**
+ * Write a buffer to the SPI bus in one transaction
+ * The core hands the whole buffer to the SPIM EasyDMA
+ * instead of starting a separate transfer for every byte
+ * @param buffer
+ * 		Data to be sent
+ * @param size
+ * 		Number of bytes to send
+ */
+void spiWriteBurst(const uint8_t *buffer, uint16_t size)
+{
+	SPI_LORA.transfer(buffer, NULL, size);
+}
+
+/**
+ * Read a buffer from the SPI bus in one transaction
+ * NOP (0x00) bytes are clocked out while reading
+ * @param buffer
+ * 		Buffer for the received data
+ * @param size
+ * 		Number of bytes to read
+ */
+void spiReadBurst(uint8_t *buffer, uint16_t size)
+{
+	memset(buffer, 0x00, size);
+	SPI_LORA.transfer(buffer, buffer, size);
+}
 #endif
\ No newline at end of file
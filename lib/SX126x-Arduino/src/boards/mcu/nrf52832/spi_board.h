@@ -4,4 +4,6 @@
 extern SPIClass SPI_LORA;
 
 void initSPI(void);
+void spiWriteBurst(const uint8_t *buffer, uint16_t size);
+void spiReadBurst(uint8_t *buffer, uint16_t size);
 #endif // SPI_BOARD_H
\ No newline at end of file
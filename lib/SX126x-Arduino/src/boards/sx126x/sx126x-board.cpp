@@ -43,11 +43,72 @@ Maintainer: Miguel Luis and Gregory Cristian
 
 extern "C"
 {
-	SPISettings spiSettings = SPISettings(2000000, MSBFIRST, SPI_MODE0);
+	SPISettings spiSettings = SPISettings(SX126X_SPI_FREQUENCY, MSBFIRST, SPI_MODE0);
+
+	// Payload transfers (WriteBuffer / ReadBuffer) and the time spent on the SPI bus for them
+	static volatile uint32_t spiTransfers = 0;
+	static volatile uint32_t spiBytes = 0;
+	static volatile uint32_t spiTime = 0;
+
+	/**
+	 * Add a finished payload transfer to the SPI timing counters
+	 * @param start
+	 * 		micros() when NSS was pulled low
+	 * @param size
+	 * 		Number of payload bytes transferred
+	 */
+	static inline void spiCountTransfer(uint32_t start, uint8_t size)
+	{
+		spiTime += micros() - start;
+		spiBytes += size;
+		spiTransfers++;
+	}
 
 	// No need to initialize DIO3 as output everytime, do it once and remember it
 	bool dio3IsOutput = false;
 
+	// Statistics of SX126xWaitOnBusy
+	static SX126xBusyStats_t busyStats = {0, 0, 0, 0, 0, 0};
+
+#if defined ESP32 || defined NRF52
+	// Given by the BUSY falling edge interrupt, taken by SX126xWaitOnBusy
+	static SemaphoreHandle_t busySemaphore = NULL;
+
+	/**
+	 * Interrupt handler for the falling edge of BUSY
+	 * Wakes up the task waiting in SX126xWaitOnBusy
+	 */
+#ifdef ESP32
+	static void IRAM_ATTR SX126xOnBusyIrq(void)
+#else
+	static void SX126xOnBusyIrq(void)
+#endif
+	{
+		BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+		xSemaphoreGiveFromISR(busySemaphore, &xHigherPriorityTaskWoken);
+#ifdef ESP32
+		if (xHigherPriorityTaskWoken == pdTRUE)
+		{
+			portYIELD_FROM_ISR();
+		}
+#else
+		portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+#endif
+	}
+
+	/**
+	 * Create the BUSY semaphore on first use and attach the BUSY interrupt
+	 */
+	static void SX126xBusyIrqInit(void)
+	{
+		if (busySemaphore == NULL)
+		{
+			busySemaphore = xSemaphoreCreateBinary();
+		}
+		attachInterrupt(_hwConfig.PIN_LORA_BUSY, SX126xOnBusyIrq, FALLING);
+	}
+#endif
+
 	void SX126xIoInit(void)
 	{
 
@@ -58,6 +119,9 @@ extern "C"
 		pinMode(_hwConfig.PIN_LORA_NSS, OUTPUT);
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
 		pinMode(_hwConfig.PIN_LORA_BUSY, INPUT);
+#if defined ESP32 || defined NRF52
+		SX126xBusyIrqInit();
+#endif
 		pinMode(_hwConfig.PIN_LORA_DIO_1, INPUT);
 		pinMode(_hwConfig.PIN_LORA_RESET, OUTPUT);
 		digitalWrite(_hwConfig.PIN_LORA_RESET, HIGH);
@@ -79,6 +143,9 @@ extern "C"
 		pinMode(_hwConfig.PIN_LORA_NSS, OUTPUT);
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
 		pinMode(_hwConfig.PIN_LORA_BUSY, INPUT);
+#if defined ESP32 || defined NRF52
+		SX126xBusyIrqInit();
+#endif
 		pinMode(_hwConfig.PIN_LORA_DIO_1, INPUT);
 		// pinMode(_hwConfig.PIN_LORA_RESET, OUTPUT);
 		// digitalWrite(_hwConfig.PIN_LORA_RESET, HIGH);
@@ -99,6 +166,9 @@ extern "C"
 	{
 		dio3IsOutput = false;
 		detachInterrupt(_hwConfig.PIN_LORA_DIO_1);
+#if defined ESP32 || defined NRF52
+		detachInterrupt(_hwConfig.PIN_LORA_BUSY);
+#endif
 		pinMode(_hwConfig.PIN_LORA_NSS, INPUT);
 		pinMode(_hwConfig.PIN_LORA_BUSY, INPUT);
 		pinMode(_hwConfig.PIN_LORA_DIO_1, INPUT);
@@ -115,15 +185,67 @@ extern "C"
 		dio3IsOutput = false;
 	}
 
+#if SX126X_TRACE
+	__attribute__((weak)) void SX126xTraceHook(uint8_t event, bool exit, uint16_t arg)
+	{
+	}
+#endif
+
 	void SX126xWaitOnBusy(void)
 	{
-		int timeout = 1000;
+		busyStats.waits++;
+		if (digitalRead(_hwConfig.PIN_LORA_BUSY) == LOW)
+		{
+			return;
+		}
+#if SX126X_TRACE
+		// Only waits for a BUSY that is high are traced, the others take a few cycles
+		SX126xTraceHook(SX126X_TRACE_WAIT_ON_BUSY, false, 0);
+#endif
+
+		busyStats.asserted++;
+		uint32_t busyStart = micros();
+		uint32_t busyTime = 0;
+
+		// Most commands release BUSY within a few us, spin before going to sleep
 		while (digitalRead(_hwConfig.PIN_LORA_BUSY) == HIGH)
 		{
-			delay(1);
-			timeout -= 1;
-			if (timeout < 0)
+			busyTime = micros() - busyStart;
+			if (busyTime >= SX126X_BUSY_SPIN_US)
 			{
+				break;
+			}
+		}
+
+		if (digitalRead(_hwConfig.PIN_LORA_BUSY) == HIGH)
+		{
+			busyStats.blocked++;
+#if defined ESP32 || defined NRF52
+			// Drop an edge left over from an earlier command
+			xSemaphoreTake(busySemaphore, 0);
+			while (digitalRead(_hwConfig.PIN_LORA_BUSY) == HIGH)
+			{
+				busyTime = micros() - busyStart;
+				if ((busyTime >= SX126X_BUSY_TIMEOUT * 1000UL) ||
+					(xSemaphoreTake(busySemaphore, pdMS_TO_TICKS(SX126X_BUSY_TIMEOUT - busyTime / 1000UL)) != pdTRUE))
+				{
+					break;
+				}
+			}
+#else
+			while (digitalRead(_hwConfig.PIN_LORA_BUSY) == HIGH)
+			{
+				busyTime = micros() - busyStart;
+				if (busyTime >= SX126X_BUSY_TIMEOUT * 1000UL)
+				{
+					break;
+				}
+				delay(1);
+			}
+#endif
+			if (digitalRead(_hwConfig.PIN_LORA_BUSY) == HIGH)
+			{
+				busyStats.timeouts++;
 /// \todo This error should be reported to the main app
 #ifdef ESP32
 				log_e("LORA Busy timeout waiting for BUSY low");
@@ -131,9 +253,28 @@ extern "C"
 #ifdef NRF52
 				LOG_LV2("LORA", "[SX126xWaitOnBusy] Timeout waiting for BUSY low");
 #endif
-				return;
 			}
 		}
+
+		busyTime = micros() - busyStart;
+		busyStats.timeUs += busyTime;
+		if (busyTime > busyStats.maxUs)
+		{
+			busyStats.maxUs = busyTime;
+		}
+#if SX126X_TRACE
+		SX126xTraceHook(SX126X_TRACE_WAIT_ON_BUSY, true, 0);
+#endif
+	}
+
+	void SX126xGetBusyStats(SX126xBusyStats_t *stats)
+	{
+		*stats = busyStats;
+	}
+
+	void SX126xResetBusyStats(void)
+	{
+		memset(&busyStats, 0, sizeof(SX126xBusyStats_t));
 	}
 
 	void SX126xWakeup(void)
@@ -147,10 +288,11 @@ extern "C"
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
 
+		BoardEnableIrq();
+
 		// Wait for chip to be ready.
+		// Outside of the critical section, the wait can block on the BUSY interrupt
 		SX126xWaitOnBusy();
-
-		BoardEnableIrq();
 	}
 
 	void SX126xWriteCommand(RadioCommands_t command, uint8_t *buffer, uint16_t size)
@@ -161,11 +303,7 @@ extern "C"
 
 		SPI_LORA.beginTransaction(spiSettings);
 		SPI_LORA.transfer((uint8_t)command);
-
-		for (uint16_t i = 0; i < size; i++)
-		{
-			SPI_LORA.transfer(buffer[i]);
-		}
+		spiWriteBurst(buffer, size);
 
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
@@ -178,17 +316,15 @@ extern "C"
 
 	void SX126xReadCommand(RadioCommands_t command, uint8_t *buffer, uint16_t size)
 	{
+		uint8_t header[2] = {(uint8_t)command, 0x00};
+
 		SX126xCheckDeviceReady();
 
 		digitalWrite(_hwConfig.PIN_LORA_NSS, LOW);
 
 		SPI_LORA.beginTransaction(spiSettings);
-		SPI_LORA.transfer((uint8_t)command);
-		SPI_LORA.transfer(0x00);
-		for (uint16_t i = 0; i < size; i++)
-		{
-			buffer[i] = SPI_LORA.transfer(0x00);
-		}
+		spiWriteBurst(header, 2);
+		spiReadBurst(buffer, size);
 
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
@@ -198,19 +334,15 @@ extern "C"
 
 	void SX126xWriteRegisters(uint16_t address, uint8_t *buffer, uint16_t size)
 	{
+		uint8_t header[3] = {RADIO_WRITE_REGISTER, (uint8_t)((address & 0xFF00) >> 8), (uint8_t)(address & 0x00FF)};
+
 		SX126xCheckDeviceReady();
 
 		digitalWrite(_hwConfig.PIN_LORA_NSS, LOW);
 
 		SPI_LORA.beginTransaction(spiSettings);
-		SPI_LORA.transfer(RADIO_WRITE_REGISTER);
-		SPI_LORA.transfer((address & 0xFF00) >> 8);
-		SPI_LORA.transfer(address & 0x00FF);
-
-		for (uint16_t i = 0; i < size; i++)
-		{
-			SPI_LORA.transfer(buffer[i]);
-		}
+		spiWriteBurst(header, 3);
+		spiWriteBurst(buffer, size);
 
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
@@ -225,19 +357,15 @@ extern "C"
 
 	void SX126xReadRegisters(uint16_t address, uint8_t *buffer, uint16_t size)
 	{
+		uint8_t header[4] = {RADIO_READ_REGISTER, (uint8_t)((address & 0xFF00) >> 8), (uint8_t)(address & 0x00FF), 0x00};
+
 		SX126xCheckDeviceReady();
 
 		digitalWrite(_hwConfig.PIN_LORA_NSS, LOW);
 
 		SPI_LORA.beginTransaction(spiSettings);
-		SPI_LORA.transfer(RADIO_READ_REGISTER);
-		SPI_LORA.transfer((address & 0xFF00) >> 8);
-		SPI_LORA.transfer(address & 0x00FF);
-		SPI_LORA.transfer(0x00);
-		for (uint16_t i = 0; i < size; i++)
-		{
-			buffer[i] = SPI_LORA.transfer(0x00);
-		}
+		spiWriteBurst(header, 4);
+		spiReadBurst(buffer, size);
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
 
@@ -253,43 +381,62 @@ extern "C"
 
 	void SX126xWriteBuffer(uint8_t offset, uint8_t *buffer, uint8_t size)
 	{
+		uint8_t header[2] = {RADIO_WRITE_BUFFER, offset};
+
+#if SX126X_TRACE
+		SX126xTraceHook(SX126X_TRACE_WRITE_BUFFER, false, size);
+#endif
 		SX126xCheckDeviceReady();
 
+		uint32_t spiStart = micros();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, LOW);
 
 		SPI_LORA.beginTransaction(spiSettings);
-		SPI_LORA.transfer(RADIO_WRITE_BUFFER);
-		SPI_LORA.transfer(offset);
-		for (uint16_t i = 0; i < size; i++)
-		{
-			SPI_LORA.transfer(buffer[i]);
-		}
+		spiWriteBurst(header, 2);
+		spiWriteBurst(buffer, size);
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
+		spiCountTransfer(spiStart, size);
 
 		SX126xWaitOnBusy();
+#if SX126X_TRACE
+		SX126xTraceHook(SX126X_TRACE_WRITE_BUFFER, true, size);
+#endif
 	}
 
 	void SX126xReadBuffer(uint8_t offset, uint8_t *buffer, uint8_t size)
 	{
+		uint8_t header[3] = {RADIO_READ_BUFFER, offset, 0x00};
+
 		SX126xCheckDeviceReady();
 
+		uint32_t spiStart = micros();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, LOW);
 
 		SPI_LORA.beginTransaction(spiSettings);
-		SPI_LORA.transfer(RADIO_READ_BUFFER);
-		SPI_LORA.transfer(offset);
-		SPI_LORA.transfer(0x00);
-		for (uint16_t i = 0; i < size; i++)
-		{
-			buffer[i] = SPI_LORA.transfer(0x00);
-		}
+		spiWriteBurst(header, 3);
+		spiReadBurst(buffer, size);
 		SPI_LORA.endTransaction();
 		digitalWrite(_hwConfig.PIN_LORA_NSS, HIGH);
+		spiCountTransfer(spiStart, size);
 
 		SX126xWaitOnBusy();
 	}
 
+	void SX126xGetSpiStats(uint32_t *nb_transfers, uint32_t *nb_bytes, uint32_t *time_us)
+	{
+		*nb_transfers = spiTransfers;
+		*nb_bytes = spiBytes;
+		*time_us = spiTime;
+	}
+
+	void SX126xResetSpiStats(void)
+	{
+		spiTransfers = 0;
+		spiBytes = 0;
+		spiTime = 0;
+	}
+
 	void SX126xSetRfTxPower(int8_t power)
 	{
 		SX126xSetTxParams(power, RADIO_RAMP_40_US);
@@ -40,6 +40,47 @@ Maintainer: Miguel Luis and Gregory Cristian
 
 #include <Arduino.h>
 
+/** SPI clock for the radio, can be set in platformio.ini */
+#ifndef SX126X_SPI_FREQUENCY
+#define SX126X_SPI_FREQUENCY 2000000
+#endif
+
+/** Time in us to poll BUSY before waiting for its interrupt, can be set in platformio.ini */
+#ifndef SX126X_BUSY_SPIN_US
+#define SX126X_BUSY_SPIN_US 50
+#endif
+
+/** Time in ms to wait for BUSY low before giving up, can be set in platformio.ini */
+#ifndef SX126X_BUSY_TIMEOUT
+#define SX126X_BUSY_TIMEOUT 1000
+#endif
+
+/** Report entry and exit of buffer writes and BUSY waits to SX126xTraceHook, can be set in platformio.ini
+ *  Follows MESH_TRACE of the application if not set */
+#ifndef SX126X_TRACE
+#ifdef MESH_TRACE
+#define SX126X_TRACE MESH_TRACE
+#else
+#define SX126X_TRACE 0
+#endif
+#endif
+
+/** Events reported to SX126xTraceHook */
+#define SX126X_TRACE_WRITE_BUFFER 0
+#define SX126X_TRACE_WAIT_ON_BUSY 1
+
+/**@brief Statistics of the waits for the BUSY signal
+ */
+typedef struct
+{
+	uint32_t waits;	   // Calls of SX126xWaitOnBusy
+	uint32_t asserted; // BUSY was high when the wait started
+	uint32_t blocked;  // BUSY was still high after the spin and the task waited for the interrupt
+	uint32_t timeouts; // BUSY did not go low within SX126X_BUSY_TIMEOUT
+	uint32_t timeUs;   // Summed time in us BUSY was high
+	uint32_t maxUs;	   // Longest time in us BUSY was high
+} SX126xBusyStats_t;
+
 extern "C"
 {
 	/**@brief Initializes the radio I/Os pins interface
@@ -66,7 +107,10 @@ extern "C"
  */
 	void SX126xReset(void);
 
-	/**@brief Blocking loop to wait while the Busy pin in high
+	/**@brief Wait while the Busy pin is high
+ *
+ * Polls BUSY for up to SX126X_BUSY_SPIN_US, then sleeps until the
+ * falling edge interrupt of BUSY or SX126X_BUSY_TIMEOUT
  */
 	void SX126xWaitOnBusy(void);
 
@@ -159,6 +203,38 @@ extern "C"
  */
 	void SX126xResetStats(void);
 
+	/**@brief Gets the SPI bus time spent on packet payloads
+ *
+ * \param [OUT] nb_transfers Number of WriteBuffer / ReadBuffer calls
+ * \param [OUT] nb_bytes     Number of payload bytes transferred
+ * \param [OUT] time_us      Time in us between NSS low and NSS high, summed over all transfers
+ */
+	void SX126xGetSpiStats(uint32_t *nb_transfers, uint32_t *nb_bytes, uint32_t *time_us);
+
+	/**@brief Resets values read by GetSpiStats
+ */
+	void SX126xResetSpiStats(void);
+
+	/**@brief Gets the statistics of the waits for the BUSY signal
+ *
+ * \param [OUT] stats Copy of the BUSY wait counters
+ */
+	void SX126xGetBusyStats(SX126xBusyStats_t *stats);
+
+	/**@brief Resets values read by GetBusyStats
+ */
+	void SX126xResetBusyStats(void);
+
+	/**@brief Called at entry and exit of the traced driver functions if SX126X_TRACE is set
+ *
+ * The default does nothing, the application can replace it to record the events
+ *
+ * \param [in]  event         SX126X_TRACE_WRITE_BUFFER or SX126X_TRACE_WAIT_ON_BUSY
+ * \param [in]  exit          False at the entry, true at the exit of the function
+ * \param [in]  arg           Number of bytes for buffer writes, 0 else
+ */
+	void SX126xTraceHook(uint8_t event, bool exit, uint16_t arg);
+
 	/**@brief Radio hardware and global parameters
  */
 	extern SX126x_t SX126x;
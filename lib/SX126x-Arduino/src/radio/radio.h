@@ -390,5 +390,20 @@ extern "C"
  *         board implementation
  */
 	extern const struct Radio_s Radio;
+
+	/*!
+ * \brief Radio interrupt notification prototype.
+ *
+ * \remark Called from the interrupt context, must be short
+ */
+	typedef void (*RadioIrqNotify_t)(void);
+
+	/*!
+ * \brief Registers a function that is called when a radio interrupt or timeout
+ *        is pending, e.g. to wake up the task that calls Radio.IrqProcess()
+ *
+ * \param [IN] notify Function to call, NULL to disable the notification
+ */
+	void RadioSetIrqNotify(RadioIrqNotify_t notify);
 };
 #endif // __RADIO_H__
@@ -450,6 +450,8 @@ extern "C"
 
 	bool IrqFired = false;
 
+	RadioIrqNotify_t IrqNotify = NULL;
+
 	bool TimerRxTimeout = false;
 	bool TimerTxTimeout = false;
 
@@ -1181,6 +1183,10 @@ extern "C"
 		BoardDisableIrq();
 		TimerTxTimeout = true;
 		BoardEnableIrq();
+		if (IrqNotify != NULL)
+		{
+			IrqNotify();
+		}
 	}
 
 	void RadioOnRxTimeoutIrq(void)
@@ -1192,6 +1198,10 @@ extern "C"
 		BoardDisableIrq();
 		TimerRxTimeout = true;
 		BoardEnableIrq();
+		if (IrqNotify != NULL)
+		{
+			IrqNotify();
+		}
 	}
 
 #ifdef ESP8266
@@ -1203,6 +1213,15 @@ extern "C"
 		BoardDisableIrq();
 		IrqFired = true;
 		BoardEnableIrq();
+		if (IrqNotify != NULL)
+		{
+			IrqNotify();
+		}
+	}
+
+	void RadioSetIrqNotify(RadioIrqNotify_t notify)
+	{
+		IrqNotify = notify;
 	}
 
 	void RadioIrqProcess(void)
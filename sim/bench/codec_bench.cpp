@@ -0,0 +1,157 @@
+/**
+ * Benchmark of the chat text codec in src/EmyChat/text_codec.cpp
+ *
+ * Compresses a set of typical chat messages and reports:
+ * - ratio      compressed size / original size (lower is better)
+ * - smaller    messages that got smaller and are sent compressed
+ * - enc, dec   CPU cycles per byte of text (TSC on x86, otherwise ns)
+ * Every message is decompressed again and compared with the original.
+ * The worst case line uses 242 spaces, every position checks all entries that start with a space and none matches.
+ */
+#include <chrono>
+#include <vector>
+#include "main.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static inline uint64_t benchTicks(void)
+{
+	return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static inline uint64_t benchTicks(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+/** Typical chat messages, some with an @ receiver tag */
+static const char *const chatCorpus[] = {
+	"Hi everyone, is anyone out there?",
+	"hello from the hill, signal is good here",
+	"@Bernd where are you now?",
+	"@Anna I'm at the parking lot, going to the lake soon",
+	"ok thanks",
+	"lol that was fast",
+	"Can you hear me? I have no cell coverage at all",
+	"We are going back home now, see you tomorrow",
+	"@Mike what time do we meet at the bridge?",
+	"At 10, bring water and something to eat",
+	"The battery of my node is at 40 %, need to charge it tonight",
+	"haha yes I know",
+	"Is the trail to the top still closed?",
+	"No, they opened it this morning",
+	"Thanks for the info!",
+	"@Kai I just sent you the location of the camp",
+	"Got it. We will be there in about an hour",
+	"Anyone need help with the tent?",
+	"I think it is going to rain in the afternoon",
+	"@Lisa did you find the keys?",
+	"Yes, they were in the car the whole time",
+	"Good night all",
+	"Morning! Coffee is ready at the fire",
+	"The mesh works great, I got your message over 3 hops",
+	"Where is the nearest water source?",
+	"There is a spring about 500 m north of the hut",
+	"@Tom can you check if the node on the roof is still running?",
+	"It is, I can see it in the map",
+	"Road is blocked after the village, take the forest track",
+	"Be careful, the bridge is very slippery",
+	"What channel are you on for the radio?",
+	"Let me know when you are back",
+	"Gruesse aus Muenchen, alles gut hier",
+	"Wir sind gleich da",
+	"Schöne Grüße, bis später!",
+	"SOS need help at the north trail, one person injured",
+	"Help is on the way, stay where you are",
+	"ETA 15 min",
+	"ok",
+	"Thanks, that was really helpful. I will tell the others about it when we get back to the camp this evening.",
+};
+
+/** Number of messages in the corpus */
+#define CORPUS_SIZE (sizeof(chatCorpus) / sizeof(chatCorpus[0]))
+/** Number of times each message is encoded and decoded for the timing */
+#define ROUNDS 2000
+
+int main(void)
+{
+	initTextCodec();
+
+	uint8_t packed[242];
+	char text[242];
+	uint32_t origBytes = 0;
+	uint32_t sentBytes = 0;
+	uint32_t smaller = 0;
+	uint32_t errors = 0;
+	double bestRatio = 1.0;
+	double worstRatio = 0.0;
+
+	for (unsigned idx = 0; idx < CORPUS_SIZE; idx++)
+	{
+		uint16_t len = strlen(chatCorpus[idx]);
+		uint16_t packedLen = compressText(chatCorpus[idx], len, packed, len - 1);
+		origBytes += len;
+		if (packedLen != 0)
+		{
+			smaller++;
+			sentBytes += packedLen;
+			uint16_t textLen = decompressText(packed, packedLen, text, sizeof(text));
+			if ((textLen != len) || (memcmp(text, chatCorpus[idx], len) != 0))
+			{
+				printf("Round trip failed: %s\n", chatCorpus[idx]);
+				errors++;
+			}
+			double ratio = (double)packedLen / len;
+			bestRatio = ratio < bestRatio ? ratio : bestRatio;
+			worstRatio = ratio > worstRatio ? ratio : worstRatio;
+		}
+		else
+		{
+			// Sent uncompressed
+			sentBytes += len;
+			worstRatio = 1.0;
+		}
+	}
+
+	// Timing over the whole corpus
+	uint64_t encTicks = 0;
+	uint64_t decTicks = 0;
+	uint64_t timedBytes = 0;
+	volatile uint16_t sink = 0;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		for (unsigned idx = 0; idx < CORPUS_SIZE; idx++)
+		{
+			uint16_t len = strlen(chatCorpus[idx]);
+			uint64_t start = benchTicks();
+			uint16_t packedLen = compressText(chatCorpus[idx], len, packed, sizeof(packed));
+			uint64_t mid = benchTicks();
+			sink += decompressText(packed, packedLen, text, sizeof(text));
+			uint64_t end = benchTicks();
+			encTicks += mid - start;
+			decTicks += end - mid;
+			timedBytes += len;
+		}
+	}
+
+	// Worst case for the encoder, the largest group of dictionary entries is checked without a match
+	char worst[242];
+	memset(worst, ' ', sizeof(worst));
+	uint64_t worstTicks = 0;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		uint64_t start = benchTicks();
+		sink += compressText(worst, sizeof(worst), packed, sizeof(packed));
+		worstTicks += benchTicks() - start;
+	}
+
+	printf("%-12s %8s %8s %8s %10s %10s\n", "messages", "bytes", "sent", "ratio", "enc " BENCH_UNIT "/B", "dec " BENCH_UNIT "/B");
+	printf("%-12u %8u %8u %8.3f %10.1f %10.1f\n", (unsigned)CORPUS_SIZE, origBytes, sentBytes, (double)sentBytes / origBytes,
+		   (double)encTicks / timedBytes, (double)decTicks / timedBytes);
+	printf("Smaller      : %u of %u messages, best ratio %.3f, worst ratio %.3f\n", smaller, (unsigned)CORPUS_SIZE, bestRatio, worstRatio);
+	printf("Worst case   : 242 spaces, enc %.1f " BENCH_UNIT "/B\n", (double)worstTicks / ROUNDS / sizeof(worst));
+	printf("Round trip   : %u errors\n", errors);
+	return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+/**
+ * Benchmark of the routing table in src/Mesh/router.cpp
+ *
+ * Runs the router functions on the host with 48, 256 and 1024 nodes:
+ * - build      fill an empty map with all nodes
+ * - map msg    handle a map message of a direct node that lists all nodes
+ * - getRoute   look up a random node
+ * - clearSubs  remove all subs of a direct node (and add them again)
+ * - cleanMap   check the map for timed out nodes, nothing times out
+ *
+ * The node names are part of the node table and are measured with it.
+ * The benchmark is built with MAX_NODES=1024, the node table is sized at compile time.
+ */
+#include <chrono>
+#include <vector>
+#include "main.h"
+
+/** Fake time in ms */
+static unsigned long benchTime = 1000;
+
+unsigned long millis(void)
+{
+	return benchTime;
+}
+
+extern "C" const char *pathToFileName(const char *path)
+{
+	return path;
+}
+
+extern "C" int log_printf(const char *, ...)
+{
+	return 0;
+}
+
+// Globals normally defined in mesh.cpp
+uint32_t broadcastID = 0;
+SemaphoreHandle_t accessNodeList = NULL;
+
+// The benchmark runs in one task, the node list needs no lock
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t)
+{
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t)
+{
+	return pdTRUE;
+}
+
+/** Node IDs, index 0 .. numDirects - 1 are direct nodes */
+static std::vector<uint32_t> ids;
+/** Number of direct nodes */
+static int numDirects;
+
+/**
+ * Create a map with the given number of nodes, every 8th node is a direct neighbour
+ * @param numNodes
+ * 		Number of nodes
+ */
+static void setupMap(int numNodes)
+{
+	initNodesMap(numNodes);
+	numDirects = numNodes / 8 > 0 ? numNodes / 8 : 1;
+	ids.clear();
+	// Node IDs are derived from the chip ID, use random looking IDs (xorshift32, no duplicates)
+	uint32_t id = 2463534242u;
+	for (int idx = 0; idx < numNodes; idx++)
+	{
+		id ^= id << 13;
+		id ^= id >> 17;
+		id ^= id << 5;
+		ids.push_back(id);
+	}
+}
+
+/**
+ * Add all nodes to the map
+ */
+static void fillMap(void)
+{
+	for (int idx = 0; idx < numDirects; idx++)
+	{
+		addNode(ids[idx], 0, 0, 0);
+	}
+	for (int idx = numDirects; idx < (int)ids.size(); idx++)
+	{
+		addNode(ids[idx], ids[idx % numDirects], 1 + (idx % 4), (1 + (idx % 4)) * ETX_UNIT);
+	}
+}
+
+/** Nanoseconds since an earlier time point */
+static double nsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Run all tests for one map size
+ * @param numNodes
+ * 		Number of nodes
+ */
+static void runBench(int numNodes)
+{
+	int rounds = 40000 / numNodes + 4;
+	std::chrono::steady_clock::time_point start;
+
+	// Build the map from scratch
+	double buildNs = 0;
+	for (int round = 0; round < rounds; round++)
+	{
+		setupMap(numNodes);
+		start = std::chrono::steady_clock::now();
+		fillMap();
+		buildNs += nsSince(start);
+	}
+	buildNs /= rounds;
+	if (numOfNodes() != numNodes)
+	{
+		printf("Map has %d nodes instead of %d\n", numOfNodes(), numNodes);
+	}
+
+	// Map message of a direct node that knows all other nodes
+	double mapNs = 0;
+	start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		uint32_t from = ids[round % numDirects];
+		addNode(from, 0, 0, 0);
+		for (int idx = 0; idx < numNodes; idx++)
+		{
+			if (ids[idx] != from)
+			{
+				addNode(ids[idx], from, 1 + (idx % 4) + 1, (1 + (idx % 4) + 1) * ETX_UNIT);
+			}
+		}
+	}
+	mapNs = nsSince(start) / rounds;
+
+	// Route lookups
+	int lookups = 200000;
+	uint32_t seed = 1;
+	int found = 0;
+	nodesList route;
+	start = std::chrono::steady_clock::now();
+	for (int idx = 0; idx < lookups; idx++)
+	{
+		seed = seed * 1103515245 + 12345;
+		found += getRoute(ids[(seed >> 8) % numNodes], &route) ? 1 : 0;
+	}
+	double lookupNs = nsSince(start) / lookups;
+	if (found != lookups)
+	{
+		printf("Only %d of %d routes found\n", found, lookups);
+	}
+
+	// Remove the subs of a direct node and add them back
+	double clearNs = 0;
+	for (int round = 0; round < rounds; round++)
+	{
+		int direct = round % numDirects;
+		start = std::chrono::steady_clock::now();
+		clearSubs(ids[direct]);
+		clearNs += nsSince(start);
+		for (int idx = numDirects + direct; idx < numNodes; idx += numDirects)
+		{
+			addNode(ids[idx], ids[direct], 1 + (idx % 4), (1 + (idx % 4)) * ETX_UNIT);
+		}
+	}
+	clearNs /= rounds;
+
+	// Clean the map, no node timed out
+	start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; round++)
+	{
+		cleanMap();
+	}
+	double cleanNs = nsSince(start) / rounds;
+
+	printf("%6d %12.1f %12.1f %12.1f %12.1f %12.1f\n", numNodes,
+		   buildNs / 1000.0, mapNs / 1000.0, lookupNs, clearNs / 1000.0, cleanNs / 1000.0);
+}
+
+int main(void)
+{
+	printf("%6s %12s %12s %12s %12s %12s\n", "nodes", "build us", "map msg us", "getRoute ns", "clearSubs us", "cleanMap us");
+	runBench(48);
+	runBench(256);
+	runBench(1024);
+	return 0;
+}
@@ -0,0 +1,399 @@
+/**
+ * Radio channel model of the mesh simulator
+ */
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "channel.h"
+#include "scheduler.h"
+#include "meshsim.h"
+
+/** Path loss at 1 m in dB */
+#define PATH_LOSS_1M 40.0
+/** Path loss exponent multiplied by 10 */
+#define PATH_LOSS_SLOPE 27.0
+/** Noise floor for 250 kHz bandwidth in dBm */
+#define NOISE_FLOOR -114.0
+/** Sensitivity of SF7 at 250 kHz in dBm, weaker frames are lost */
+#define RX_SENSITIVITY -121.0
+
+/**
+ * Radio modes
+ */
+typedef enum
+{
+	CHAN_STANDBY = 0, //!< Radio is not listening
+	CHAN_RX,		  //!< Radio is listening
+	CHAN_TX,		  //!< Radio is transmitting
+	CHAN_CAD		  //!< Radio is doing a channel activity detection
+} chanRadioState_t;
+
+/**
+ * A frame on the air
+ */
+struct chanTx
+{
+	/** Sending node */
+	uint32_t nodeNum;
+	/** Frame data */
+	uint8_t data[256];
+	/** Frame length */
+	uint8_t len;
+	/** TX power */
+	int8_t power;
+	/** True until the transmission ended or was aborted */
+	bool onAir;
+	/** True if the sender was switched off, nobody hears the frame */
+	bool silent;
+};
+
+/**
+ * Radio of a node
+ */
+struct chanNode
+{
+	/** Entry points of the virtual node */
+	const simNodeApi *api;
+	/** Position in meters */
+	double x, y;
+	/** Nodes in range */
+	std::vector<uint32_t> neighbours;
+	/** Radio mode */
+	chanRadioState_t state;
+	/** Number of neighbours transmitting right now */
+	int busyCount;
+	/** Transmission the node is locked on or -1 */
+	int64_t rxTx;
+	/** False if the locked transmission got corrupted */
+	bool rxOk;
+	/** Transmission of this node or -1 */
+	int64_t txTx;
+	/** Result of the running channel activity detection */
+	bool cadBusy;
+	/** Incremented on every CAD start, invalidates older CAD events */
+	uint32_t cadToken;
+	/** True if the radio is switched off to simulate a lost node */
+	bool failed;
+};
+
+/** All radios */
+static std::vector<chanNode> nodes;
+/** All transmissions, index is the transmission ID */
+static std::vector<chanTx> transmissions;
+/** Range in meters */
+static double chanRange = 150.0;
+/** Random loss of a reception in percent */
+static double chanLoss = 0.0;
+/** Loss of a reception at the edge of the range in percent, links shorter than half the range have none */
+static double chanEdgeLoss = 0.0;
+/** Statistics */
+static chanStats stats;
+
+uint32_t chanAddNode(const simNodeApi *api, double x, double y)
+{
+	chanNode node;
+	node.api = api;
+	node.x = x;
+	node.y = y;
+	node.state = CHAN_STANDBY;
+	node.busyCount = 0;
+	node.rxTx = -1;
+	node.rxOk = false;
+	node.txTx = -1;
+	node.cadBusy = false;
+	node.cadToken = 0;
+	node.failed = false;
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+
+/**
+ * Distance between two nodes
+ */
+static double distance(uint32_t a, uint32_t b)
+{
+	return hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y);
+}
+
+void chanSetup(double range, double lossPercent, double edgeLossPercent)
+{
+	chanRange = range;
+	chanLoss = lossPercent;
+	chanEdgeLoss = edgeLossPercent;
+	for (uint32_t a = 0; a < nodes.size(); a++)
+	{
+		nodes[a].neighbours.clear();
+		for (uint32_t b = 0; b < nodes.size(); b++)
+		{
+			if ((a != b) && (distance(a, b) <= chanRange))
+			{
+				nodes[a].neighbours.push_back(b);
+			}
+		}
+	}
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool chanConnected(void)
+{
+	std::vector<bool> seen(nodes.size(), false);
+	std::vector<uint32_t> todo;
+	size_t numAlive = 0;
+	for (uint32_t num = 0; num < nodes.size(); num++)
+	{
+		if (!nodes[num].failed)
+		{
+			numAlive++;
+			if (todo.empty())
+			{
+				todo.push_back(num);
+				seen[num] = true;
+			}
+		}
+	}
+	if (numAlive == 0)
+	{
+		return true;
+	}
+	size_t numSeen = 1;
+	while (!todo.empty())
+	{
+		uint32_t node = todo.back();
+		todo.pop_back();
+		for (uint32_t next : nodes[node].neighbours)
+		{
+			if (!seen[next] && !nodes[next].failed)
+			{
+				seen[next] = true;
+				numSeen++;
+				todo.push_back(next);
+			}
+		}
+	}
+	return numSeen == numAlive;
+}
+
+void chanSetFailed(uint32_t nodeNum, bool failed)
+{
+	nodes[nodeNum].failed = failed;
+}
+
+bool chanFailed(uint32_t nodeNum)
+{
+	return nodes[nodeNum].failed;
+}
+
+size_t chanNeighbours(uint32_t nodeNum)
+{
+	return nodes[nodeNum].neighbours.size();
+}
+
+const chanStats &chanGetStats(void)
+{
+	return stats;
+}
+
+uint8_t chanTypeIndex(uint8_t frameType)
+{
+	return frameType < CHAN_FRAME_TYPES ? frameType : 0;
+}
+
+/**
+ * End a transmission, deliver the frame to all receivers that got it intact
+ * @param txId
+ * 		Transmission ID
+ * @param deliver
+ * 		False if the transmission was aborted
+ */
+static void endTx(int64_t txId, bool deliver)
+{
+	chanTx &tx = transmissions[txId];
+	if (!tx.onAir)
+	{
+		return;
+	}
+	tx.onAir = false;
+
+	chanNode &sender = nodes[tx.nodeNum];
+	if (sender.txTx == txId)
+	{
+		sender.txTx = -1;
+		if (deliver)
+		{
+			sender.state = CHAN_STANDBY;
+			sender.api->radioTxDone();
+			schedSignal(tx.nodeNum);
+		}
+	}
+
+	for (uint32_t num : sender.neighbours)
+	{
+		if (tx.silent)
+		{
+			break;
+		}
+		chanNode &receiver = nodes[num];
+		receiver.busyCount--;
+		if (receiver.rxTx != txId)
+		{
+			continue;
+		}
+		receiver.rxTx = -1;
+		if (!receiver.rxOk || !deliver)
+		{
+			stats.collisions++;
+			continue;
+		}
+		if (receiver.failed)
+		{
+			continue;
+		}
+		if ((chanLoss > 0.0) && (hostRandom(10000) < (uint32_t)(chanLoss * 100.0)))
+		{
+			stats.linkLosses++;
+			continue;
+		}
+		if (chanEdgeLoss > 0.0)
+		{
+			// Fading hits long links harder, the loss grows with the square of the distance beyond half the range
+			double edge = fmin(fmax((distance(tx.nodeNum, num) - chanRange / 2) / (chanRange / 2), 0.0), 1.0);
+			if (hostRandom(10000) < (uint32_t)(chanEdgeLoss * edge * edge * 100.0))
+			{
+				stats.edgeLosses++;
+				continue;
+			}
+		}
+		double rssi = tx.power - (PATH_LOSS_1M + PATH_LOSS_SLOPE * log10(fmax(distance(tx.nodeNum, num), 1.0)));
+		double snr = fmin(fmax(rssi - NOISE_FLOOR, -20.0), 12.0);
+		if (rssi < RX_SENSITIVITY)
+		{
+			stats.weakSignal++;
+			continue;
+		}
+		stats.rxFrames++;
+		// The SX126x goes to standby after a reception in RX duty cycle mode,
+		// frames are missed until the node restarts the receiver
+		receiver.state = CHAN_STANDBY;
+		receiver.api->radioRxDone(tx.data, tx.len, (int16_t)rssi, (int8_t)snr);
+		schedSignal(num);
+	}
+}
+
+/**
+ * Stop whatever the radio of a node is doing
+ * @param nodeNum
+ * 		Node number
+ */
+static void stopRadio(uint32_t nodeNum)
+{
+	chanNode &node = nodes[nodeNum];
+	if (node.txTx != -1)
+	{
+		endTx(node.txTx, false);
+	}
+	if (node.rxTx != -1)
+	{
+		node.rxTx = -1;
+		stats.rxAborted++;
+	}
+	// Invalidate a running CAD
+	node.cadToken++;
+	node.state = CHAN_STANDBY;
+}
+
+void chanRadioTx(uint32_t nodeNum, const uint8_t *data, uint8_t len, simTime_t airTime, int8_t power)
+{
+	stopRadio(nodeNum);
+
+	int64_t txId = transmissions.size();
+	transmissions.push_back(chanTx());
+	chanTx &tx = transmissions.back();
+	tx.nodeNum = nodeNum;
+	memcpy(tx.data, data, len);
+	tx.len = len;
+	tx.power = power;
+	tx.onAir = true;
+
+	chanNode &sender = nodes[nodeNum];
+	sender.state = CHAN_TX;
+	sender.txTx = txId;
+	// A switched off node keeps running, but its frames do not go on air
+	tx.silent = sender.failed;
+	if (tx.silent)
+	{
+		schedAt(schedNow() + airTime, [txId]() { endTx(txId, true); });
+		return;
+	}
+
+	uint8_t type = chanTypeIndex(sender.api->frameType(data, len));
+	stats.txFrames[type]++;
+	stats.txBytes[type] += len;
+	stats.txAirTime[type] += airTime;
+
+	for (uint32_t num : sender.neighbours)
+	{
+		chanNode &receiver = nodes[num];
+		if (receiver.state == CHAN_RX)
+		{
+			if (receiver.rxTx == -1)
+			{
+				// Lock on the new frame, it is corrupted if another frame is already on the air
+				receiver.rxTx = txId;
+				receiver.rxOk = (receiver.busyCount == 0);
+			}
+			else
+			{
+				// Overlaps the frame the receiver is locked on
+				receiver.rxOk = false;
+			}
+		}
+		else if (receiver.state == CHAN_CAD)
+		{
+			receiver.cadBusy = true;
+		}
+		receiver.busyCount++;
+	}
+
+	schedAt(schedNow() + airTime, [txId]() { endTx(txId, true); });
+}
+
+void chanRadioCad(uint32_t nodeNum, simTime_t cadTime)
+{
+	stopRadio(nodeNum);
+	chanNode &node = nodes[nodeNum];
+	node.state = CHAN_CAD;
+	node.cadBusy = (node.busyCount > 0);
+	uint32_t token = node.cadToken;
+	stats.cadRuns++;
+	schedAt(schedNow() + cadTime, [nodeNum, token]() {
+		chanNode &node = nodes[nodeNum];
+		if ((node.state != CHAN_CAD) || (node.cadToken != token))
+		{
+			return;
+		}
+		node.state = CHAN_STANDBY;
+		if (node.cadBusy)
+		{
+			stats.cadBusy++;
+		}
+		node.api->radioCadDone(node.cadBusy);
+		schedSignal(nodeNum);
+	});
+}
+
+void chanRadioRx(uint32_t nodeNum)
+{
+	chanNode &node = nodes[nodeNum];
+	if (node.state == CHAN_RX)
+	{
+		return;
+	}
+	stopRadio(nodeNum);
+	// Frames already on the air are missed, their preamble is gone
+	node.state = CHAN_RX;
+}
+
+void chanRadioStandby(uint32_t nodeNum)
+{
+	stopRadio(nodeNum);
+}
@@ -0,0 +1,76 @@
+/**
+ * Radio channel model of the mesh simulator.
+ * Nodes within range of each other can hear each other. A frame is received
+ * if the receiver listened when the frame started and no other frame
+ * overlapped it at the receiver. Radios are half duplex.
+ */
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include <stdint.h>
+#include <vector>
+#include "../sim_host.h"
+
+/** Number of mesh package types tracked in the statistics */
+#define CHAN_FRAME_TYPES 9
+
+/**
+ * Channel statistics
+ */
+struct chanStats
+{
+	/** Transmitted frames per package type */
+	uint64_t txFrames[CHAN_FRAME_TYPES];
+	/** Transmitted bytes per package type */
+	uint64_t txBytes[CHAN_FRAME_TYPES];
+	/** Airtime per package type */
+	simTime_t txAirTime[CHAN_FRAME_TYPES];
+	/** Frames received by a node */
+	uint64_t rxFrames;
+	/** Receptions lost because frames overlapped */
+	uint64_t collisions;
+	/** Receptions lost by the random link loss */
+	uint64_t linkLosses;
+	/** Receptions lost by the distance dependent loss of long links */
+	uint64_t edgeLosses;
+	/** Receptions lost because the signal was below the sensitivity */
+	uint64_t weakSignal;
+	/** Receptions aborted because the receiver changed the radio mode */
+	uint64_t rxAborted;
+	/** Channel activity detections */
+	uint64_t cadRuns;
+	/** Channel activity detections that found the channel busy */
+	uint64_t cadBusy;
+};
+
+/** Add a node at a position, returns the node number */
+uint32_t chanAddNode(const simNodeApi *api, double x, double y);
+
+/** Set range in meters, random link loss in percent and loss at the edge of the range in percent */
+void chanSetup(double range, double lossPercent, double edgeLossPercent);
+
+/** Check if all nodes that are not switched off are connected through the mesh */
+bool chanConnected(void);
+
+/** Switch the radio of a node off or on again, a node that is off neither sends nor receives */
+void chanSetFailed(uint32_t nodeNum, bool failed);
+
+/** Check if the radio of a node is switched off */
+bool chanFailed(uint32_t nodeNum);
+
+/** Number of nodes a node can hear */
+size_t chanNeighbours(uint32_t nodeNum);
+
+/** Channel statistics */
+const chanStats &chanGetStats(void);
+
+/** Map a frame type to the statistics index */
+uint8_t chanTypeIndex(uint8_t frameType);
+
+// Radio functions called by the virtual nodes
+void chanRadioTx(uint32_t nodeNum, const uint8_t *data, uint8_t len, simTime_t airTime, int8_t power);
+void chanRadioCad(uint32_t nodeNum, simTime_t cadTime);
+void chanRadioRx(uint32_t nodeNum);
+void chanRadioStandby(uint32_t nodeNum);
+
+#endif // _CHANNEL_H
@@ -0,0 +1,853 @@
+/**
+ * Host-native mesh simulator.
+ * Runs many virtual Emy-Chat nodes in one process on virtual time and
+ * reports map convergence time, delivery ratio, latency and airtime.
+ *
+ * Every node is a private copy of meshnode.so, which contains the
+ * unmodified src/Mesh code. Loading one copy per node gives every node
+ * its own set of the mesh globals.
+ */
+#include <dlfcn.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "meshsim.h"
+#include "scheduler.h"
+#include "channel.h"
+
+/** Time the nodes need to boot, nodes start at a random time within it */
+#define BOOT_SPREAD 10000000ULL
+/** Interval to check the map convergence */
+#define SAMPLE_INTERVAL 1000000ULL
+/** Time after the node failure in which the delivery is measured separately */
+#define FAIL_WINDOW 120000000ULL
+
+/**
+ * Simulation settings
+ */
+struct simSettings
+{
+	uint32_t numNodes = 16;
+	uint32_t minutes = 30;
+	uint64_t seed = 1;
+	std::string topology = "grid";
+	double spacing = 100.0;
+	double range = 150.0;
+	double loss = 0.0;
+	double edgeLoss = 0.0;
+	uint32_t traffic = 60;
+	int maxNodes = 48;
+	bool verbose = false;
+	std::string nodeLib;
+	std::string altLib;
+	uint32_t altShare = 50;
+	uint32_t failNodes = 0;
+	uint32_t msgSize = 0;
+	bool compress = false;
+	double minDelivery = -1.0;
+	int64_t maxDuplicates = -1;
+};
+
+/**
+ * Record of a sent application message
+ */
+struct simMessage
+{
+	/** Virtual time the message was queued */
+	simTime_t sent;
+	/** Destination node number, -1 for a broadcast */
+	int32_t dest;
+	/** Receivers that got the message */
+	std::vector<bool> receivedBy;
+	/** True if the message was sent within FAIL_WINDOW after the node failure */
+	bool afterFailure;
+};
+
+/** Settings of this run */
+static simSettings settings;
+/** Random generator, seeded from the command line */
+static std::mt19937_64 rng;
+/** Entry points of the nodes */
+static std::vector<const simNodeApi *> nodeApis;
+/** Mesh node IDs of the nodes */
+static std::vector<uint32_t> nodeIds;
+/** Node number by mesh node ID */
+static std::map<uint32_t, uint32_t> nodeNums;
+/** True if the last log output of a node ended a line */
+static std::vector<bool> logLineStart;
+/** Sent application messages by originator node number and sequence number */
+static std::map<std::pair<uint32_t, uint32_t>, simMessage> messages;
+
+/** Application statistics */
+static uint64_t unicastSent = 0;
+static uint64_t unicastDelivered = 0;
+static uint64_t broadcastSent = 0;
+static uint64_t broadcastReceived = 0;
+static uint64_t duplicates = 0;
+static std::vector<double> unicastLatency;
+static std::vector<double> broadcastLatency;
+
+/** Node failure statistics */
+static simTime_t failAt = 0;
+static std::vector<uint32_t> failedNodes;
+static uint64_t failSent = 0;
+static uint64_t failDelivered = 0;
+static std::vector<double> failLatency;
+
+/** Map convergence statistics */
+static simTime_t convergedAt = 0;
+static uint64_t samples = 0;
+static uint64_t convergedSamples = 0;
+static double mapCompleteness = 0.0;
+
+uint32_t hostRandom(uint32_t max)
+{
+	if (max == 0)
+	{
+		return 0;
+	}
+	return (uint32_t)(rng() % max);
+}
+
+/**
+ * Log output of a node, only shown in verbose mode
+ */
+static void hostLog(uint32_t nodeNum, const char *text)
+{
+	if (!settings.verbose)
+	{
+		return;
+	}
+	for (const char *c = text; *c != 0; c++)
+	{
+		if (*c == '\r')
+		{
+			continue;
+		}
+		if (logLineStart[nodeNum])
+		{
+			printf("[%10.3f] %02u %08X: ", schedNow() / 1e6, nodeNum, nodeIds[nodeNum]);
+			logLineStart[nodeNum] = false;
+		}
+		putchar(*c);
+		if (*c == '\n')
+		{
+			logLineStart[nodeNum] = true;
+		}
+	}
+}
+
+/**
+ * Application of a node queued a message
+ */
+static void hostAppSent(uint32_t nodeNum, uint32_t destId, uint32_t seq)
+{
+	if (chanFailed(nodeNum))
+	{
+		// Switched off nodes do not count
+		return;
+	}
+	simMessage msg;
+	msg.sent = schedNow();
+	msg.afterFailure = false;
+	if (destId == 0)
+	{
+		msg.dest = -1;
+		broadcastSent++;
+	}
+	else
+	{
+		auto dest = nodeNums.find(destId);
+		msg.dest = (dest == nodeNums.end()) ? -2 : (int32_t)dest->second;
+		if ((msg.dest >= 0) && chanFailed(msg.dest))
+		{
+			return;
+		}
+		unicastSent++;
+		if ((failAt != 0) && (msg.sent < failAt + FAIL_WINDOW))
+		{
+			msg.afterFailure = true;
+			failSent++;
+		}
+	}
+	msg.receivedBy.assign(settings.numNodes, false);
+	messages[std::make_pair(nodeNum, seq)] = msg;
+}
+
+/**
+ * Application of a node received a message
+ */
+static void hostAppReceived(uint32_t nodeNum, uint32_t origId, uint32_t seq)
+{
+	auto orig = nodeNums.find(origId);
+	if (orig == nodeNums.end())
+	{
+		return;
+	}
+	auto found = messages.find(std::make_pair(orig->second, seq));
+	if (found == messages.end())
+	{
+		return;
+	}
+	simMessage &msg = found->second;
+	if (msg.receivedBy[nodeNum])
+	{
+		duplicates++;
+		return;
+	}
+	msg.receivedBy[nodeNum] = true;
+	double latency = (schedNow() - msg.sent) / 1000.0;
+	if (msg.dest == -1)
+	{
+		broadcastReceived++;
+		broadcastLatency.push_back(latency);
+	}
+	else if (msg.dest == (int32_t)nodeNum)
+	{
+		unicastDelivered++;
+		unicastLatency.push_back(latency);
+		if (msg.afterFailure)
+		{
+			failDelivered++;
+			failLatency.push_back(latency);
+		}
+	}
+}
+
+/** Services for the virtual nodes */
+static const simHostApi hostApi = {
+	schedNow,
+	schedSleepUntil,
+	schedWaitUntil,
+	schedSignal,
+	schedTaskCreate,
+	schedCurrentTask,
+	hostRandom,
+	chanRadioTx,
+	chanRadioCad,
+	chanRadioRx,
+	chanRadioStandby,
+	hostLog,
+	hostAppSent,
+	hostAppReceived};
+
+/**
+ * Check how many nodes know the complete mesh
+ */
+static void sampleMaps(void)
+{
+	uint32_t complete = 0;
+	double known = 0;
+	for (uint32_t idx = 0; idx < settings.numNodes; idx++)
+	{
+		uint16_t numNodes = nodeApis[idx]->numOfNodes();
+		known += numNodes;
+		if (numNodes >= settings.numNodes - 1)
+		{
+			complete++;
+		}
+	}
+	samples++;
+	mapCompleteness += settings.numNodes > 1 ? known / ((double)settings.numNodes * (settings.numNodes - 1)) : 1.0;
+	if (complete == settings.numNodes)
+	{
+		convergedSamples++;
+		if (convergedAt == 0)
+		{
+			convergedAt = schedNow();
+		}
+	}
+	schedAt(schedNow() + SAMPLE_INTERVAL, sampleMaps);
+}
+
+/**
+ * Place the nodes according to the selected topology
+ * @return bool
+ * 		False if the topology is unknown or not connected
+ */
+static bool placeNodes(void)
+{
+	std::vector<std::pair<double, double>> positions;
+	uint32_t num = settings.numNodes;
+	if (settings.topology == "grid")
+	{
+		uint32_t cols = (uint32_t)ceil(sqrt((double)num));
+		for (uint32_t idx = 0; idx < num; idx++)
+		{
+			positions.push_back(std::make_pair((idx % cols) * settings.spacing, (idx / cols) * settings.spacing));
+		}
+	}
+	else if (settings.topology == "line")
+	{
+		for (uint32_t idx = 0; idx < num; idx++)
+		{
+			positions.push_back(std::make_pair(idx * settings.spacing, 0.0));
+		}
+	}
+	else if (settings.topology == "random")
+	{
+		double side = settings.spacing * sqrt((double)num);
+		std::uniform_real_distribution<double> coord(0.0, side);
+		for (uint32_t idx = 0; idx < num; idx++)
+		{
+			positions.push_back(std::make_pair(coord(rng), coord(rng)));
+		}
+	}
+	else
+	{
+		fprintf(stderr, "meshsim: unknown topology '%s'\n", settings.topology.c_str());
+		return false;
+	}
+
+	for (uint32_t idx = 0; idx < num; idx++)
+	{
+		chanAddNode(nodeApis[idx], positions[idx].first, positions[idx].second);
+	}
+	chanSetup(settings.range, settings.loss, settings.edgeLoss);
+	if (!chanConnected())
+	{
+		fprintf(stderr, "meshsim: nodes are not connected, use a larger --range or smaller --spacing\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Select the nodes that fail, the remaining nodes must stay connected
+ * @return bool
+ * 		False if not enough nodes could be found
+ */
+static bool selectFailures(void)
+{
+	uint32_t tries = 0;
+	while ((failedNodes.size() < settings.failNodes) && (tries++ < 100 * settings.numNodes))
+	{
+		uint32_t num = hostRandom(settings.numNodes);
+		if (chanFailed(num))
+		{
+			continue;
+		}
+		chanSetFailed(num, true);
+		if (chanConnected())
+		{
+			failedNodes.push_back(num);
+		}
+		else
+		{
+			chanSetFailed(num, false);
+		}
+	}
+	// The nodes fail later, during the run
+	for (uint32_t num : failedNodes)
+	{
+		chanSetFailed(num, false);
+	}
+	if (failedNodes.size() < settings.failNodes)
+	{
+		fprintf(stderr, "meshsim: cannot switch off %u nodes without splitting the mesh\n", settings.failNodes);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Switch off the selected nodes
+ */
+static void failNodes(void)
+{
+	failAt = schedNow();
+	for (uint32_t num : failedNodes)
+	{
+		chanSetFailed(num, true);
+	}
+}
+
+/**
+ * Read a node library into memory
+ * @param path
+ * 		Path of the library
+ * @param image
+ * 		Buffer for the content of the library
+ * @return bool
+ * 		False if the library could not be read
+ */
+static bool readNodeLib(const std::string &path, std::vector<char> &image)
+{
+	FILE *src = fopen(path.c_str(), "rb");
+	if (src == NULL)
+	{
+		fprintf(stderr, "meshsim: cannot open %s\n", path.c_str());
+		return false;
+	}
+	char buf[65536];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof(buf), src)) > 0)
+	{
+		image.insert(image.end(), buf, buf + got);
+	}
+	fclose(src);
+	return true;
+}
+
+/**
+ * Load one private copy of meshnode.so per node
+ * With --alt-lib a part of the nodes gets a copy of the alternative library (mixed fleet)
+ * @return bool
+ * 		False if a node could not be loaded
+ */
+static bool loadNodes(void)
+{
+	char tmpDir[] = "/tmp/meshsim-XXXXXX";
+	if (mkdtemp(tmpDir) == NULL)
+	{
+		perror("meshsim: mkdtemp");
+		return false;
+	}
+
+	std::vector<char> mainImage;
+	std::vector<char> altImage;
+	if (!readNodeLib(settings.nodeLib, mainImage) || (!settings.altLib.empty() && !readNodeLib(settings.altLib, altImage)))
+	{
+		rmdir(tmpDir);
+		return false;
+	}
+
+	bool result = true;
+	for (uint32_t idx = 0; idx < settings.numNodes; idx++)
+	{
+		// Spread the nodes with the alternative library evenly
+		bool useAlt = !settings.altLib.empty() && (((idx * settings.altShare) % 100) < settings.altShare);
+		const std::vector<char> &image = useAlt ? altImage : mainImage;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/node%03u.so", tmpDir, idx);
+		FILE *dst = fopen(path, "wb");
+		if ((dst == NULL) || (fwrite(image.data(), 1, image.size(), dst) != image.size()))
+		{
+			fprintf(stderr, "meshsim: cannot write %s\n", path);
+			result = false;
+			break;
+		}
+		fclose(dst);
+
+		void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		unlink(path);
+		if (handle == NULL)
+		{
+			fprintf(stderr, "meshsim: %s\n", dlerror());
+			result = false;
+			break;
+		}
+		simNodeInit_t nodeInit = (simNodeInit_t)dlsym(handle, SIM_NODE_INIT);
+		if (nodeInit == NULL)
+		{
+			fprintf(stderr, "meshsim: %s\n", dlerror());
+			result = false;
+			break;
+		}
+
+		simNodeConfig config;
+		// Upper 24 bits must be unique, they are used for the broadcast IDs
+		config.deviceId = 0xE0000000 | ((idx + 1) << 8) | 0x42;
+		config.maxNodes = settings.maxNodes;
+		config.trafficInterval = settings.traffic * 1000;
+		config.msgSize = settings.msgSize;
+		config.compress = settings.compress;
+
+		nodeApis.push_back(nodeInit(&hostApi, idx, &config));
+		nodeIds.push_back(config.deviceId);
+		nodeNums[config.deviceId] = idx;
+		logLineStart.push_back(true);
+	}
+	rmdir(tmpDir);
+	return result;
+}
+
+/**
+ * Get a percentile of a list of values
+ */
+static double percentile(std::vector<double> &values, double pct)
+{
+	if (values.empty())
+	{
+		return 0.0;
+	}
+	std::sort(values.begin(), values.end());
+	size_t idx = (size_t)((values.size() - 1) * pct / 100.0 + 0.5);
+	return values[idx];
+}
+
+/**
+ * Get the average of a list of values
+ */
+static double average(const std::vector<double> &values)
+{
+	if (values.empty())
+	{
+		return 0.0;
+	}
+	double sum = 0;
+	for (double value : values)
+	{
+		sum += value;
+	}
+	return sum / values.size();
+}
+
+/**
+ * Print the results of the run
+ */
+static void report(void)
+{
+	static const char *typeNames[CHAN_FRAME_TYPES] = {"other", "direct", "forward", "broadcast", "map", "map delta", "map request", "aggregate", "ack"};
+	const chanStats &stats = chanGetStats();
+	double duration = settings.minutes * 60.0;
+
+	printf("Nodes              : %u (%s, spacing %.0f m, range %.0f m, loss %.1f %%, edge loss %.1f %%)\n",
+		   settings.numNodes, settings.topology.c_str(), settings.spacing, settings.range, settings.loss, settings.edgeLoss);
+	printf("Simulated time     : %.0f s, seed %llu, %llu task switches\n",
+		   duration, (unsigned long long)settings.seed, (unsigned long long)schedSwitches());
+	if (convergedAt != 0)
+	{
+		printf("Convergence        : %.1f s\n", convergedAt / 1e6);
+	}
+	else
+	{
+		printf("Convergence        : not reached\n");
+	}
+	printf("Map completeness   : %.1f %% average, complete in %.1f %% of the samples\n",
+		   samples ? 100.0 * mapCompleteness / samples : 0.0, samples ? 100.0 * convergedSamples / samples : 0.0);
+	printf("Unicast delivery   : %llu / %llu (%.1f %%), latency avg %.0f ms, p50 %.0f ms, p95 %.0f ms\n",
+		   (unsigned long long)unicastDelivered, (unsigned long long)unicastSent,
+		   unicastSent ? 100.0 * unicastDelivered / unicastSent : 0.0,
+		   average(unicastLatency), percentile(unicastLatency, 50), percentile(unicastLatency, 95));
+	uint64_t broadcastExpected = broadcastSent * (settings.numNodes - 1);
+	printf("Broadcast delivery : %llu / %llu (%.1f %%), latency avg %.0f ms, p50 %.0f ms, p95 %.0f ms\n",
+		   (unsigned long long)broadcastReceived, (unsigned long long)broadcastExpected,
+		   broadcastExpected ? 100.0 * broadcastReceived / broadcastExpected : 0.0,
+		   average(broadcastLatency), percentile(broadcastLatency, 50), percentile(broadcastLatency, 95));
+	printf("Duplicates         : %llu\n", (unsigned long long)duplicates);
+	if (failAt != 0)
+	{
+		printf("Node failure       : %u nodes off at %.0f s, unicast delivery in the next %.0f s %llu / %llu (%.1f %%), latency p50 %.0f ms, p95 %.0f ms\n",
+			   (unsigned)failedNodes.size(), failAt / 1e6, FAIL_WINDOW / 1e6,
+			   (unsigned long long)failDelivered, (unsigned long long)failSent,
+			   failSent ? 100.0 * failDelivered / failSent : 0.0, percentile(failLatency, 50), percentile(failLatency, 95));
+	}
+
+	simTime_t totalAir = 0;
+	uint64_t totalFrames = 0;
+	for (int type = 0; type < CHAN_FRAME_TYPES; type++)
+	{
+		totalAir += stats.txAirTime[type];
+		totalFrames += stats.txFrames[type];
+	}
+	printf("Airtime            : %.1f s total, %.2f %% of the time per node\n",
+		   totalAir / 1e6, settings.numNodes ? 100.0 * totalAir / 1e6 / duration / settings.numNodes : 0.0);
+	for (int type = 0; type < CHAN_FRAME_TYPES; type++)
+	{
+		if (stats.txFrames[type] == 0)
+		{
+			continue;
+		}
+		printf("  %-16s : %7llu frames, %9llu bytes, %8.1f s\n", typeNames[type],
+			   (unsigned long long)stats.txFrames[type], (unsigned long long)stats.txBytes[type],
+			   stats.txAirTime[type] / 1e6);
+	}
+	// Direct (1), forward (2) and ACK (8) frames carry the unicast messages
+	simTime_t unicastAir = stats.txAirTime[1] + stats.txAirTime[2] + stats.txAirTime[8];
+	uint64_t delivered = unicastDelivered + broadcastReceived;
+	printf("Airtime / delivery : %.1f ms per delivered message, %.1f ms unicast airtime per delivered unicast message\n",
+		   delivered ? totalAir / 1e3 / delivered : 0.0, unicastDelivered ? unicastAir / 1e3 / unicastDelivered : 0.0);
+	printf("Frames             : %llu sent, %llu received, %llu collided, %llu lost, %llu lost at the edge, %llu too weak, %llu aborted\n",
+		   (unsigned long long)totalFrames, (unsigned long long)stats.rxFrames,
+		   (unsigned long long)stats.collisions, (unsigned long long)stats.linkLosses, (unsigned long long)stats.edgeLosses,
+		   (unsigned long long)stats.weakSignal, (unsigned long long)stats.rxAborted);
+	printf("CAD                : %llu runs, %llu busy\n",
+		   (unsigned long long)stats.cadRuns, (unsigned long long)stats.cadBusy);
+
+	simQueueStats queueTotal = {};
+	uint64_t maxNodeAirTime = 0;
+	for (const simNodeApi *api : nodeApis)
+	{
+		// Libraries of older firmware fill only the fields they know
+		simQueueStats queue = {};
+		api->queueStats(&queue);
+		queueTotal.queued += queue.queued;
+		queueTotal.sent += queue.sent;
+		queueTotal.dropped += queue.dropped;
+		queueTotal.highWater = std::max(queueTotal.highWater, queue.highWater);
+		queueTotal.maxDelay = std::max(queueTotal.maxDelay, queue.maxDelay);
+		queueTotal.sumDelay += queue.sumDelay;
+		queueTotal.deferred += queue.deferred;
+		queueTotal.airTime += queue.airTime;
+		queueTotal.aggregates += queue.aggregates;
+		queueTotal.aggregatedItems += queue.aggregatedItems;
+		queueTotal.acked += queue.acked;
+		queueTotal.retries += queue.retries;
+		queueTotal.ackFailed += queue.ackFailed;
+		queueTotal.acksSent += queue.acksSent;
+		queueTotal.fullPower += queue.fullPower;
+		queueTotal.reducedPower += queue.reducedPower;
+		queueTotal.savedDb += queue.savedDb;
+		queueTotal.rerouted += queue.rerouted;
+		queueTotal.unsent += queue.unsent;
+		queueTotal.rxHandled += queue.rxHandled;
+		queueTotal.rxCopied += queue.rxCopied;
+		queueTotal.poolHighWater = std::max(queueTotal.poolHighWater, queue.poolHighWater);
+		queueTotal.poolFailed += queue.poolFailed;
+		maxNodeAirTime = std::max(maxNodeAirTime, queue.airTime);
+	}
+	printf("Send queue         : %u queued, %u dropped, high water %u, delay avg %.0f ms, max %u ms\n",
+		   queueTotal.queued, queueTotal.dropped, queueTotal.highWater,
+		   queueTotal.sent ? (double)queueTotal.sumDelay / queueTotal.sent : 0.0, queueTotal.maxDelay);
+	printf("TX budget          : %u packages deferred, busiest node %.2f %% airtime\n",
+		   queueTotal.deferred, 100.0 * maxNodeAirTime / 1000.0 / duration);
+	printf("Aggregation        : %u packages combined into %u frames\n",
+		   queueTotal.aggregatedItems, queueTotal.aggregates);
+	uint32_t ackDone = queueTotal.acked + queueTotal.ackFailed;
+	printf("Link ACK           : %u acked, %u failed (%.1f %% per hop), %u retries, %u rerouted, %u ACKs sent, %u not sent and queued again\n",
+		   queueTotal.acked, queueTotal.ackFailed, ackDone ? 100.0 * queueTotal.acked / ackDone : 0.0,
+		   queueTotal.retries, queueTotal.rerouted, queueTotal.acksSent, queueTotal.unsent);
+	printf("Link TX power      : %u of %u unicast packages reduced, by %.1f dB on average\n",
+		   queueTotal.reducedPower, queueTotal.reducedPower + queueTotal.fullPower,
+		   queueTotal.reducedPower ? (double)queueTotal.savedDb / queueTotal.reducedPower : 0.0);
+
+	printf("Package buffers    : %.1f bytes copied per received frame, high water %u, %u times none free\n",
+		   queueTotal.rxHandled ? (double)queueTotal.rxCopied / queueTotal.rxHandled : 0.0,
+		   queueTotal.poolHighWater, queueTotal.poolFailed);
+
+	simBroadcastStats bcTotal = {0, 0, 0};
+	for (const simNodeApi *api : nodeApis)
+	{
+		simBroadcastStats bc;
+		api->broadcastStats(&bc);
+		bcTotal.received += bc.received;
+		bcTotal.duplicates += bc.duplicates;
+		bcTotal.evicted += bc.evicted;
+	}
+	printf("Broadcast de-dup   : %u received, %u suppressed (%.1f %%), %u cache evictions\n",
+		   bcTotal.received, bcTotal.duplicates,
+		   bcTotal.received ? 100.0 * bcTotal.duplicates / bcTotal.received : 0.0, bcTotal.evicted);
+}
+
+/**
+ * Check the delivery ratio against --min-delivery
+ * @return bool
+ * 		True if the unicast and the broadcast delivery reached the minimum or no minimum is set
+ */
+static bool deliveryReached(void)
+{
+	if (settings.minDelivery < 0)
+	{
+		return true;
+	}
+	uint64_t broadcastExpected = broadcastSent * (settings.numNodes - 1);
+	double unicastRatio = unicastSent ? 100.0 * unicastDelivered / unicastSent : 0.0;
+	double broadcastRatio = broadcastExpected ? 100.0 * broadcastReceived / broadcastExpected : 0.0;
+	if ((unicastRatio < settings.minDelivery) || (broadcastRatio < settings.minDelivery))
+	{
+		printf("FAILED             : delivery below %.1f %%\n", settings.minDelivery);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Check the duplicates against --max-duplicates
+ * @return bool
+ * 		True if not more messages arrived twice than allowed or no maximum is set
+ */
+static bool duplicatesBelowMax(void)
+{
+	if ((settings.maxDuplicates < 0) || (duplicates <= (uint64_t)settings.maxDuplicates))
+	{
+		return true;
+	}
+	printf("FAILED             : %llu duplicates, more than %lld\n", (unsigned long long)duplicates, (long long)settings.maxDuplicates);
+	return false;
+}
+
+/**
+ * Print the command line help
+ */
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+		   "  -n, --nodes N       number of virtual nodes (default 16)\n"
+		   "  -t, --time MIN      simulated time in minutes (default 30)\n"
+		   "  -s, --seed N        random seed (default 1)\n"
+		   "  -T, --topology T    grid, line or random (default grid)\n"
+		   "  -d, --spacing M     distance between nodes in meters (default 100)\n"
+		   "  -r, --range M       radio range in meters (default 150)\n"
+		   "  -l, --loss PCT      random loss per reception in percent (default 0)\n"
+		   "  -E, --edge-loss PCT loss per reception at the edge of the range in percent (default 0)\n"
+		   "  -i, --traffic SEC   interval between chat messages per node, 0 = off (default 60)\n"
+		   "  -m, --max-nodes N   size of the nodes map (default 48)\n"
+		   "  -L, --lib PATH      node library (default meshnode.so next to meshsim)\n"
+		   "  -A, --alt-lib PATH  node library for a part of the nodes to simulate a mixed fleet\n"
+		   "  -a, --alt-share PCT share of the nodes that use --alt-lib (default 50)\n"
+		   "  -F, --fail N        switch off N nodes at half the simulated time (default 0)\n"
+		   "  -M, --msg-size N    size of the chat messages in bytes, 0 = short messages (default 0)\n"
+		   "  -C, --compress      compress the chat text with the text codec\n"
+		   "  -D, --min-delivery PCT  exit with 1 if the unicast or broadcast delivery is below PCT\n"
+		   "  -U, --max-duplicates N  exit with 1 if more than N messages arrived twice at the same node\n"
+		   "  -v, --verbose       show the log output of the nodes\n",
+		   name);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{"nodes", required_argument, NULL, 'n'},
+		{"time", required_argument, NULL, 't'},
+		{"seed", required_argument, NULL, 's'},
+		{"topology", required_argument, NULL, 'T'},
+		{"spacing", required_argument, NULL, 'd'},
+		{"range", required_argument, NULL, 'r'},
+		{"loss", required_argument, NULL, 'l'},
+		{"edge-loss", required_argument, NULL, 'E'},
+		{"traffic", required_argument, NULL, 'i'},
+		{"max-nodes", required_argument, NULL, 'm'},
+		{"lib", required_argument, NULL, 'L'},
+		{"alt-lib", required_argument, NULL, 'A'},
+		{"alt-share", required_argument, NULL, 'a'},
+		{"fail", required_argument, NULL, 'F'},
+		{"msg-size", required_argument, NULL, 'M'},
+		{"compress", no_argument, NULL, 'C'},
+		{"min-delivery", required_argument, NULL, 'D'},
+		{"max-duplicates", required_argument, NULL, 'U'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "n:t:s:T:d:r:l:E:i:m:L:A:a:F:M:CD:U:vh", options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			settings.numNodes = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			settings.minutes = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			settings.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			settings.topology = optarg;
+			break;
+		case 'd':
+			settings.spacing = atof(optarg);
+			break;
+		case 'r':
+			settings.range = atof(optarg);
+			break;
+		case 'l':
+			settings.loss = atof(optarg);
+			break;
+		case 'E':
+			settings.edgeLoss = atof(optarg);
+			break;
+		case 'i':
+			settings.traffic = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			settings.maxNodes = atoi(optarg);
+			break;
+		case 'L':
+			settings.nodeLib = optarg;
+			break;
+		case 'A':
+			settings.altLib = optarg;
+			break;
+		case 'a':
+			settings.altShare = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			settings.failNodes = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			settings.msgSize = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			settings.compress = true;
+			break;
+		case 'D':
+			settings.minDelivery = atof(optarg);
+			break;
+		case 'U':
+			settings.maxDuplicates = strtoll(optarg, NULL, 0);
+			break;
+		case 'v':
+			settings.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if ((settings.numNodes < 2) || (settings.numNodes > 1000))
+	{
+		fprintf(stderr, "meshsim: number of nodes must be between 2 and 1000\n");
+		return 1;
+	}
+
+	if (settings.altShare > 100)
+	{
+		fprintf(stderr, "meshsim: share of the alternative library must be between 0 and 100\n");
+		return 1;
+	}
+
+	if ((settings.msgSize != 0) && ((settings.msgSize < SIM_MIN_MSG_SIZE) || (settings.msgSize > SIM_MAX_MSG_SIZE)))
+	{
+		fprintf(stderr, "meshsim: message size must be 0 or between %u and %u\n", SIM_MIN_MSG_SIZE, SIM_MAX_MSG_SIZE);
+		return 1;
+	}
+
+	if (settings.nodeLib.empty())
+	{
+		std::string self = argv[0];
+		size_t slash = self.rfind('/');
+		settings.nodeLib = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/meshnode.so";
+	}
+
+	rng.seed(settings.seed);
+
+	if (!loadNodes() || !placeNodes() || !selectFailures())
+	{
+		return 1;
+	}
+
+	// Boot the nodes at random times
+	for (uint32_t idx = 0; idx < settings.numNodes; idx++)
+	{
+		const simNodeApi *api = nodeApis[idx];
+		schedAt(hostRandom(BOOT_SPREAD), [api]() { api->boot(); });
+	}
+	schedAt(SAMPLE_INTERVAL, sampleMaps);
+	if (!failedNodes.empty())
+	{
+		schedAt((simTime_t)settings.minutes * 30 * 1000000, failNodes);
+	}
+
+	schedRun((simTime_t)settings.minutes * 60 * 1000000);
+
+	report();
+	bool passed = deliveryReached();
+	passed = duplicatesBelowMax() && passed;
+	int result = passed ? 0 : 1;
+	fflush(stdout);
+	// The node tasks never end, leave without running destructors
+	_exit(result);
+}
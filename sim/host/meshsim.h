@@ -0,0 +1,12 @@
+/**
+ * Host-native mesh simulator
+ */
+#ifndef _MESHSIM_H
+#define _MESHSIM_H
+
+#include <stdint.h>
+
+/** Deterministic random number in the range 0 .. max - 1 */
+uint32_t hostRandom(uint32_t max);
+
+#endif // _MESHSIM_H
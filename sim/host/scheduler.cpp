@@ -0,0 +1,235 @@
+/**
+ * Virtual time scheduler of the mesh simulator
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <queue>
+#include <vector>
+#include "scheduler.h"
+
+/** Stack size of a task, much bigger than on the devices because of the host libc */
+#define TASK_STACK_SIZE (256 * 1024)
+
+/**
+ * A task of a virtual node
+ */
+struct simTask
+{
+	/** Node the task belongs to */
+	uint32_t nodeNum;
+	/** Task name */
+	const char *name;
+	/** Task function */
+	void (*taskFunc)(void *);
+	/** Task parameter */
+	void *param;
+	/** Context of the coroutine */
+	ucontext_t context;
+	/** Stack of the coroutine */
+	void *stack;
+	/** True while the task is suspended */
+	bool suspended;
+	/** True if a signal of the node wakes up the task */
+	bool waiting;
+	/** Incremented on every suspend, invalidates older wake up events */
+	uint32_t wakeToken;
+	/** True when the task function returned */
+	bool finished;
+};
+
+/**
+ * A scheduled event
+ */
+struct simEvent
+{
+	/** Virtual time of the event */
+	simTime_t time;
+	/** Sequence number, keeps events of the same time in order */
+	uint64_t seq;
+	/** Action to run */
+	std::function<void()> action;
+
+	bool operator>(const simEvent &other) const
+	{
+		return (time != other.time) ? (time > other.time) : (seq > other.seq);
+	}
+};
+
+/** Pending events, earliest first */
+static std::priority_queue<simEvent, std::vector<simEvent>, std::greater<simEvent>> events;
+/** Current virtual time */
+static simTime_t now = 0;
+/** Sequence number of the next event */
+static uint64_t eventSeq = 0;
+/** Tasks per node */
+static std::vector<std::vector<simTask *>> nodeTasks;
+/** The running task */
+static simTask *runningTask = NULL;
+/** Context of the scheduler */
+static ucontext_t schedContext;
+/** Number of task switches */
+static uint64_t switches = 0;
+
+simTime_t schedNow(void)
+{
+	return now;
+}
+
+void schedAt(simTime_t time, std::function<void()> action)
+{
+	if (time < now)
+	{
+		time = now;
+	}
+	events.push(simEvent{time, eventSeq++, action});
+}
+
+uint64_t schedSwitches(void)
+{
+	return switches;
+}
+
+void *schedCurrentTask(void)
+{
+	return runningTask;
+}
+
+/**
+ * Switch from the scheduler into a task
+ * @param task
+ * 		Task to resume
+ */
+static void resumeTask(simTask *task)
+{
+	task->suspended = false;
+	task->waiting = false;
+	runningTask = task;
+	switches++;
+	swapcontext(&schedContext, &task->context);
+	runningTask = NULL;
+}
+
+/**
+ * Schedule the wake up of a suspended task
+ * @param task
+ * 		Task to wake up
+ * @param time
+ * 		Virtual time of the wake up
+ */
+static void wakeAt(simTask *task, simTime_t time)
+{
+	uint32_t token = task->wakeToken;
+	schedAt(time, [task, token]() {
+		if (task->suspended && (task->wakeToken == token))
+		{
+			resumeTask(task);
+		}
+	});
+}
+
+/**
+ * Entry of every task coroutine
+ */
+static void taskEntry(void)
+{
+	simTask *task = runningTask;
+	task->taskFunc(task->param);
+	// FreeRTOS tasks must never return, treat it like vTaskDelete(NULL)
+	task->finished = true;
+	task->suspended = true;
+	swapcontext(&task->context, &schedContext);
+}
+
+void *schedTaskCreate(uint32_t nodeNum, void (*taskFunc)(void *), void *param, const char *name)
+{
+	simTask *task = new simTask();
+	task->nodeNum = nodeNum;
+	task->name = name;
+	task->taskFunc = taskFunc;
+	task->param = param;
+	task->stack = malloc(TASK_STACK_SIZE);
+	if (task->stack == NULL)
+	{
+		delete task;
+		return NULL;
+	}
+	getcontext(&task->context);
+	task->context.uc_stack.ss_sp = task->stack;
+	task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+	task->context.uc_link = NULL;
+	makecontext(&task->context, taskEntry, 0);
+
+	if (nodeTasks.size() <= nodeNum)
+	{
+		nodeTasks.resize(nodeNum + 1);
+	}
+	nodeTasks[nodeNum].push_back(task);
+
+	// New task becomes ready immediately
+	task->suspended = true;
+	wakeAt(task, now);
+	return task;
+}
+
+/**
+ * Suspend the running task and return to the scheduler
+ * @param wakeTime
+ * 		Virtual time to wake up again
+ * @param waiting
+ * 		True if a signal of the node wakes the task earlier
+ */
+static void suspend(simTime_t wakeTime, bool waiting)
+{
+	simTask *task = runningTask;
+	if (task == NULL)
+	{
+		fprintf(stderr, "meshsim: blocking call outside of a task\n");
+		abort();
+	}
+	task->wakeToken++;
+	task->suspended = true;
+	task->waiting = waiting;
+	if (wakeTime != SIM_FOREVER)
+	{
+		wakeAt(task, wakeTime);
+	}
+	swapcontext(&task->context, &schedContext);
+}
+
+void schedSleepUntil(simTime_t wakeTime)
+{
+	suspend(wakeTime, false);
+}
+
+void schedWaitUntil(simTime_t deadline)
+{
+	suspend(deadline, true);
+}
+
+void schedSignal(uint32_t nodeNum)
+{
+	if (nodeNum >= nodeTasks.size())
+	{
+		return;
+	}
+	for (simTask *task : nodeTasks[nodeNum])
+	{
+		if (task->suspended && task->waiting && !task->finished)
+		{
+			wakeAt(task, now);
+		}
+	}
+}
+
+void schedRun(simTime_t endTime)
+{
+	while (!events.empty() && (events.top().time <= endTime))
+	{
+		simEvent event = events.top();
+		events.pop();
+		now = event.time;
+		event.action();
+	}
+	now = endTime;
+}
@@ -0,0 +1,41 @@
+/**
+ * Virtual time scheduler of the mesh simulator.
+ * Tasks of the virtual nodes are cooperative coroutines. Only one task runs
+ * at a time, a task runs until it sleeps or waits, then the scheduler
+ * advances the virtual time to the next pending event.
+ */
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <stdint.h>
+#include <functional>
+#include "../sim_host.h"
+
+/** Current virtual time */
+simTime_t schedNow(void);
+
+/** Run a function at a given virtual time */
+void schedAt(simTime_t time, std::function<void()> action);
+
+/** Create a task for a node, returns the task handle */
+void *schedTaskCreate(uint32_t nodeNum, void (*taskFunc)(void *), void *param, const char *name);
+
+/** Handle of the running task or NULL if the scheduler itself is running */
+void *schedCurrentTask(void);
+
+/** Suspend the running task until wakeTime */
+void schedSleepUntil(simTime_t wakeTime);
+
+/** Suspend the running task until deadline or until its node is signaled */
+void schedWaitUntil(simTime_t deadline);
+
+/** Wake all waiting tasks of a node */
+void schedSignal(uint32_t nodeNum);
+
+/** Process events until the virtual time reaches endTime */
+void schedRun(simTime_t endTime);
+
+/** Number of task switches so far */
+uint64_t schedSwitches(void);
+
+#endif // _SCHEDULER_H
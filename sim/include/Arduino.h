@@ -0,0 +1,92 @@
+/**
+ * Arduino core replacement for the host-native mesh simulator.
+ * Only the parts used by src/Mesh are provided.
+ * Time is the virtual time of the simulator.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+
+#include "freertos_sim.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x01
+#define OUTPUT 0x02
+
+#define RISING 0x01
+#define FALLING 0x02
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+#define LED_BUILTIN 13
+
+#define IRAM_ATTR
+
+// Log macros of the Arduino cores, only used by the radio driver
+#ifdef ESP32
+#define log_e(format, ...)
+#endif
+#ifdef NRF52
+#define LOG_LV2(tag, format, ...)
+#endif
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield(void);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+/**
+ * Minimal String, only used in declarations of the display functions
+ */
+class String
+{
+public:
+	String(const char *str = "") : _str(str) {}
+	const char *c_str(void) const { return _str; }
+
+private:
+	const char *_str;
+};
+
+/**
+ * Serial port replacement, output goes to the node log of the simulator
+ */
+class HardwareSerial
+{
+public:
+	void begin(unsigned long) {}
+	int available(void) { return 0; }
+	size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+	size_t print(const char *text);
+	size_t println(const char *text = "");
+};
+
+extern HardwareSerial Serial;
+
+#endif // Arduino_h
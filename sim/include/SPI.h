@@ -0,0 +1,27 @@
+/**
+ * SPI replacement for the host-native mesh simulator.
+ * The simulated radio has no SPI bus, the class only lets the SX126x board
+ * driver compile in the driver syntax check.
+ */
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include <Arduino.h>
+
+class SPISettings
+{
+public:
+	SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass
+{
+public:
+	void begin(void) {}
+	void end(void) {}
+	void beginTransaction(SPISettings) {}
+	void endTransaction(void) {}
+	uint8_t transfer(uint8_t) { return 0; }
+};
+
+#endif // _SPI_H_INCLUDED
@@ -0,0 +1,16 @@
+/**
+ * Ticker replacement for the host-native mesh simulator.
+ * Not used by the mesh code, only needed to satisfy the includes.
+ */
+#ifndef TICKER_H
+#define TICKER_H
+
+class Ticker
+{
+public:
+	void once(float, void (*)(void)) {}
+	void attach(float, void (*)(void)) {}
+	void detach(void) {}
+};
+
+#endif // TICKER_H
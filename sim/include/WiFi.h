@@ -0,0 +1,6 @@
+/**
+ * Empty replacement for the host-native mesh simulator.
+ */
+#ifndef _SIM_WIFI_H
+#define _SIM_WIFI_H
+#endif // _SIM_WIFI_H
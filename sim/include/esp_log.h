@@ -0,0 +1,6 @@
+/**
+ * Empty replacement for the host-native mesh simulator.
+ */
+#ifndef _SIM_ESP_LOG_H
+#define _SIM_ESP_LOG_H
+#endif // _SIM_ESP_LOG_H
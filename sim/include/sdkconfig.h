@@ -0,0 +1,6 @@
+/**
+ * Empty replacement for the host-native mesh simulator.
+ */
+#ifndef _SIM_SDKCONFIG_H
+#define _SIM_SDKCONFIG_H
+#endif // _SIM_SDKCONFIG_H
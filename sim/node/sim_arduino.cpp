@@ -0,0 +1,330 @@
+/**
+ * Arduino and FreeRTOS functions of a virtual node.
+ * Everything runs in the virtual time of the simulator host.
+ */
+#include <map>
+#include <Arduino.h>
+#include "sim_node.h"
+
+/** Serial port of the node, output goes to the node log */
+HardwareSerial Serial;
+
+/**
+ * Queue (and semaphore) of the simulated FreeRTOS
+ */
+struct simQueue
+{
+	/** Storage for the items */
+	uint8_t *items;
+	/** Max number of items */
+	UBaseType_t length;
+	/** Size of one item, 0 for semaphores */
+	UBaseType_t itemSize;
+	/** Index of the oldest item */
+	UBaseType_t head;
+	/** Number of items in the queue */
+	UBaseType_t count;
+};
+
+unsigned long millis(void)
+{
+	return (unsigned long)(simHost->now() / 1000);
+}
+
+unsigned long micros(void)
+{
+	return (unsigned long)simHost->now();
+}
+
+void delay(uint32_t ms)
+{
+	simHost->sleepUntil(simHost->now() + (simTime_t)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+	simHost->sleepUntil(simHost->now() + us);
+}
+
+void yield(void)
+{
+	simHost->sleepUntil(simHost->now());
+}
+
+long random(long max)
+{
+	if (max <= 0)
+	{
+		return 0;
+	}
+	return (long)simHost->random((uint32_t)max);
+}
+
+long random(long min, long max)
+{
+	if (min >= max)
+	{
+		return min;
+	}
+	return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+	// The simulator host owns the random generator
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return LOW; }
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode) {}
+void detachInterrupt(uint8_t pin) {}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+	char text[512];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	simHost->log(simNodeNum, text);
+	return len < 0 ? 0 : (size_t)len;
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+	simHost->log(simNodeNum, text);
+	return strlen(text);
+}
+
+size_t HardwareSerial::println(const char *text)
+{
+	simHost->log(simNodeNum, text);
+	simHost->log(simNodeNum, "\n");
+	return strlen(text) + 1;
+}
+
+/**
+ * Used by the myLog_x macros of Log/my-log.h
+ */
+extern "C" const char *pathToFileName(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	return name == NULL ? path : name + 1;
+}
+
+extern "C" int log_printf(const char *format, ...)
+{
+	char text[512];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	simHost->log(simNodeNum, text);
+	return len;
+}
+
+/**
+ * Convert FreeRTOS ticks into a virtual time deadline
+ * @param ticks
+ * 		Ticks to wait
+ * @return simTime_t
+ * 		Deadline in virtual time
+ */
+static simTime_t deadlineFor(TickType_t ticks)
+{
+	if (ticks == portMAX_DELAY)
+	{
+		return SIM_FOREVER;
+	}
+	return simHost->now() + (simTime_t)ticks * 1000;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t taskCode, const char *name, uint32_t stackDepth,
+					   void *param, UBaseType_t priority, TaskHandle_t *createdTask)
+{
+	void *task = simHost->taskCreate(simNodeNum, taskCode, param, name);
+	if (createdTask != NULL)
+	{
+		*createdTask = task;
+	}
+	return task != NULL ? pdPASS : pdFAIL;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	delay(ticks);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)millis();
+}
+
+/**
+ * Get the notification value of a task
+ * @param task
+ * 		Task handle
+ * @return uint32_t&
+ * 		Notification value
+ */
+static uint32_t &notifyValue(TaskHandle_t task)
+{
+	static std::map<TaskHandle_t, uint32_t> values;
+	return values[task];
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	notifyValue(task)++;
+	simHost->signal(simNodeNum);
+	return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken)
+{
+	xTaskNotifyGive(task);
+	if (higherPriorityTaskWoken != NULL)
+	{
+		*higherPriorityTaskWoken = pdTRUE;
+	}
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+	simTime_t deadline = deadlineFor(ticksToWait);
+	uint32_t &value = notifyValue(simHost->currentTask());
+	while (value == 0)
+	{
+		if (simHost->now() >= deadline)
+		{
+			return 0;
+		}
+		simHost->waitUntil(deadline);
+	}
+	uint32_t count = value;
+	if (clearCountOnExit == pdTRUE)
+	{
+		value = 0;
+	}
+	else
+	{
+		value--;
+	}
+	return count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+	simQueue *queue = new simQueue;
+	queue->items = itemSize == 0 ? NULL : new uint8_t[length * itemSize];
+	queue->length = length;
+	queue->itemSize = itemSize;
+	queue->head = 0;
+	queue->count = 0;
+	return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticksToWait)
+{
+	simTime_t deadline = deadlineFor(ticksToWait);
+	while (queue->count == queue->length)
+	{
+		if (simHost->now() >= deadline)
+		{
+			return errQUEUE_FULL;
+		}
+		simHost->waitUntil(deadline);
+	}
+	if (queue->itemSize != 0)
+	{
+		UBaseType_t tail = (queue->head + queue->count) % queue->length;
+		memcpy(&queue->items[tail * queue->itemSize], item, queue->itemSize);
+	}
+	queue->count++;
+	simHost->signal(simNodeNum);
+	return pdTRUE;
+}
+
+/**
+ * Wait for an item in a queue
+ * @param queue
+ * 		Queue to wait on
+ * @param buffer
+ * 		Buffer for a copy of the item, can be NULL
+ * @param ticksToWait
+ * 		Max time to wait
+ * @param remove
+ * 		True to remove the item from the queue
+ * @return BaseType_t
+ * 		pdTRUE if an item was available
+ */
+static BaseType_t queueGet(QueueHandle_t queue, void *buffer, TickType_t ticksToWait, bool remove)
+{
+	simTime_t deadline = deadlineFor(ticksToWait);
+	while (queue->count == 0)
+	{
+		if (simHost->now() >= deadline)
+		{
+			return pdFALSE;
+		}
+		simHost->waitUntil(deadline);
+	}
+	if ((queue->itemSize != 0) && (buffer != NULL))
+	{
+		memcpy(buffer, &queue->items[queue->head * queue->itemSize], queue->itemSize);
+	}
+	if (remove)
+	{
+		queue->head = (queue->head + 1) % queue->length;
+		queue->count--;
+		simHost->signal(simNodeNum);
+	}
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticksToWait)
+{
+	return queueGet(queue, buffer, ticksToWait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *buffer, TickType_t ticksToWait)
+{
+	return queueGet(queue, buffer, ticksToWait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+	mutex->count = 1;
+	return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+	return queueGet(semaphore, NULL, ticksToWait, true);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+	return xQueueSend(semaphore, NULL, 0);
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *higherPriorityTaskWoken)
+{
+	if (higherPriorityTaskWoken != NULL)
+	{
+		*higherPriorityTaskWoken = pdTRUE;
+	}
+	return xSemaphoreGive(semaphore);
+}
@@ -0,0 +1,445 @@
+/**
+ * Application of a virtual node.
+ * Takes the place of main.cpp and EmyChat/lora.cpp: initializes the mesh
+ * and sends chat messages to random nodes the same way the
+ * "random sending" test code in loop() does. Long messages go through
+ * the fragmentation of EmyChat/fragment.cpp.
+ * Messages carry the originator and a sequence number, so the simulator
+ * host can count deliveries and measure the latency.
+ */
+#include "main.h"
+#include "sim_node.h"
+
+/** Services of the simulator host */
+const simHostApi *simHost = NULL;
+/** Number of this node in the simulation */
+uint32_t simNodeNum = 0;
+/** Configuration of this node */
+simNodeConfig simConfig;
+
+/** Structure with Mesh event callbacks */
+static MeshEvents_t MeshEvents;
+
+/** Sequence number of the last sent application message */
+static uint32_t appSeq = 0;
+
+/** Text that fills long application messages, common chat words so that the text codec has something to do */
+static const char simFiller[] = " Hello, are you going home now? I will be back in time for the meeting at the station.";
+
+/**
+ * Create the text of an application message
+ * Short messages are "sim <originator> <sequence>" with the terminating null,
+ * long messages are filled up to simConfig.msgSize with simFiller.
+ * @param text
+ * 			Buffer for the text, FRAG_MAX_MSG_SIZE bytes
+ * @param origId
+ * 			Node ID of the originator
+ * @param seq
+ * 			Sequence number of the message
+ * @return uint16_t
+ * 			Length of the text
+ */
+static uint16_t simChatText(char *text, uint32_t origId, uint32_t seq)
+{
+	uint16_t len = snprintf(text, FRAG_MAX_MSG_SIZE, "sim %08X %u", origId, seq) + 1;
+	if (simConfig.msgSize == 0)
+	{
+		return len;
+	}
+	// The message is the type byte and the text, the filler replaces the null
+	len--;
+	for (uint16_t idx = 0; len < simConfig.msgSize - 1; idx++, len++)
+	{
+		text[len] = simFiller[idx % (sizeof(simFiller) - 1)];
+	}
+	return len;
+}
+
+/**
+ * Handle one complete application message
+ * Only messages that arrive with the size and text they were sent with are counted.
+ * @param data
+ * 			The message, type byte and text
+ * @param size
+ * 			Size of the message
+ */
+static void simHandleMessage(uint8_t *data, uint16_t size)
+{
+	if (((data[0] & ~COMPRESSED_FLAG) != CHAT_TYPE) || (size < 2) || (size > FRAG_MAX_MSG_SIZE))
+	{
+		return;
+	}
+	char text[FRAG_MAX_MSG_SIZE + 1] = {0};
+	if (data[0] & COMPRESSED_FLAG)
+	{
+		// Expand the text the same way as handleLoraMessage()
+		uint16_t textLen = decompressText(&data[1], size - 1, text, FRAG_MAX_MSG_SIZE - 1);
+		if (textLen == 0)
+		{
+			myLog_e("Invalid compressed message");
+			return;
+		}
+		size = textLen + 1;
+	}
+	else
+	{
+		memcpy(text, &data[1], size - 1);
+	}
+	uint32_t origId;
+	uint32_t seq;
+	if (sscanf(text, "sim %08X %u", &origId, &seq) != 2)
+	{
+		return;
+	}
+	char expected[FRAG_MAX_MSG_SIZE];
+	if ((simChatText(expected, origId, seq) != (size - 1)) || (memcmp(expected, text, size - 1) != 0))
+	{
+		myLog_e("Message %u from %08X has %d bytes and does not match", seq, origId, size);
+		return;
+	}
+	simHost->appReceived(simNodeNum, origId, seq);
+}
+
+/** Reassembled message, null terminated */
+static uint8_t fullMsg[FRAG_MAX_MSG_SIZE + 1];
+
+/**
+ * Callback after a LoRa package was received
+ * Called from the mesh task, the virtual tasks do not preempt each other,
+ * so the fragments are handled here instead of going through a receive queue.
+ * @param fromID
+ * 			Node ID of the originator
+ * @param rxPayload
+ * 			Pointer to the received data
+ * @param rxSize
+ * 			Length of the received package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
+ */
+static void simOnLoraData(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
+{
+	(void)rxRssi;
+	(void)rxSnr;
+	uint16_t msgSize;
+	switch (rxPayload[0])
+	{
+	case FRAGMENT_TYPE:
+		msgSize = addFragment(fromID, rxPayload, rxSize, fullMsg);
+		if (msgSize != 0)
+		{
+			simHandleMessage(fullMsg, msgSize);
+		}
+		break;
+	case FRAGMENT_NACK_TYPE:
+		handleFragmentNack(fromID, rxPayload, rxSize);
+		break;
+	default:
+		simHandleMessage(rxPayload, rxSize);
+		break;
+	}
+}
+
+/**
+ * Callback after the nodes list changed
+ */
+static void simOnNodesListChange(void)
+{
+}
+
+/**
+ * Fill the header of a package for a receiver, same as setRoute() in EmyChat/lora.cpp
+ * @param receiver
+ * 			Node ID of the receiver, 0 for a broadcast
+ * @param outData
+ * 			Package to fill
+ * @return bool
+ * 			True if the package goes to the receiver,
+ * 			false if it is sent as broadcast because there is no route to the receiver
+ */
+bool setRoute(uint32_t receiver, dataMsg *outData)
+{
+	nodesList routeToNode;
+
+	outData->mark1 = 'L';
+	outData->mark2 = 'o';
+	outData->mark3 = 'R';
+
+	if ((receiver != 0) && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		bool hasRoute = getRoute(receiver, &routeToNode);
+		xSemaphoreGive(accessNodeList);
+		if (hasRoute && (routeToNode.firstHop != 0))
+		{
+			outData->dest = routeToNode.firstHop;
+			outData->from = routeToNode.nodeId;
+			outData->orig = deviceID;
+			outData->type = LORA_FORWARD;
+			return true;
+		}
+		if (hasRoute)
+		{
+			outData->dest = routeToNode.nodeId;
+			outData->from = outData->orig = deviceID;
+			outData->type = LORA_DIRECT;
+			return true;
+		}
+	}
+	outData->dest = getNextBroadcastID();
+	outData->from = outData->orig = deviceID;
+	outData->type = LORA_BROADCAST;
+	return receiver == 0;
+}
+
+/** Message that is sent, type and text */
+static uint8_t txMsg[FRAG_MAX_MSG_SIZE];
+/** Text of the message that is sent */
+static char txText[FRAG_MAX_MSG_SIZE];
+
+/**
+ * Check if the receivers of a chat message can expand compressed text, same as in EmyChat/lora.cpp
+ * @param receiver
+ * 			Node ID of the receiver, 0 for a broadcast
+ * @return bool
+ * 			True if all receivers understand COMPRESSED_FLAG
+ */
+static bool canExpandText(uint32_t receiver)
+{
+	bool result = false;
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+	{
+		result = ((receiver == 0) ? mapProtocol() : getNodeProtocol(receiver)) >= COMPRESSION_PROTOCOL;
+		xSemaphoreGive(accessNodeList);
+	}
+	return result;
+}
+
+/**
+ * Send a chat message over the mesh, same routing as sendLoRaData()
+ * @param receiver
+ * 			Node ID of the receiver, 0 for a broadcast
+ */
+static void simSendChat(uint32_t receiver)
+{
+	dataMsg outData;
+
+	if (!setRoute(receiver, &outData))
+	{
+		return;
+	}
+
+	appSeq++;
+	uint16_t len = simChatText(txText, deviceID, appSeq);
+	uint16_t packedLen = 0;
+	if (simConfig.compress && canExpandText(receiver))
+	{
+		packedLen = compressText(txText, len, &txMsg[1], len - 1);
+	}
+	uint16_t msgSize;
+	if (packedLen != 0)
+	{
+		txMsg[0] = CHAT_TYPE | COMPRESSED_FLAG;
+		msgSize = packedLen + 1;
+	}
+	else
+	{
+		txMsg[0] = CHAT_TYPE;
+		memcpy(&txMsg[1], txText, len);
+		msgSize = len + 1;
+	}
+	simHost->appSent(simNodeNum, receiver, appSeq);
+	if (msgSize > LORA_MAX_DATA_SIZE)
+	{
+		// Too large for one package
+		sendFragments(receiver, txMsg, msgSize);
+		return;
+	}
+	memcpy(outData.data, txMsg, msgSize);
+	if (!addSendRequest(&outData, DATA_HEADER_SIZE + msgSize))
+	{
+		myLog_e("Sending package failed");
+	}
+}
+
+/**
+ * Application task, does what setup() and loop() do on the real node
+ * @param pvParameters
+ * 		Unused task parameters
+ */
+static void simAppTask(void *pvParameters)
+{
+	(void)pvParameters;
+	MeshEvents.DataAvailable = simOnLoraData;
+	MeshEvents.NodesListChanged = simOnNodesListChange;
+
+	initMesh(&MeshEvents, simConfig.maxNodes);
+	initTextCodec();
+
+	time_t sendRandom = millis();
+
+	while (1)
+	{
+		delay(100);
+
+		checkFragments();
+
+		if ((simConfig.trafficInterval == 0) || ((millis() - sendRandom) < simConfig.trafficInterval))
+		{
+			continue;
+		}
+		sendRandom = millis();
+
+		if (random(0, 10) > 7)
+		{
+			// Send a broadcast
+			simSendChat(0);
+		}
+		else
+		{
+			// Send a direct package
+			uint32_t nodeId = 0;
+			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+			{
+				uint16_t numElements = numOfNodes();
+				uint32_t firstHop;
+				uint8_t numHops;
+				if (numElements >= 2)
+				{
+					getNode(random(0, numElements), nodeId, firstHop, numHops);
+				}
+				xSemaphoreGive(accessNodeList);
+			}
+			if (nodeId != 0)
+			{
+				simSendChat(nodeId);
+			}
+		}
+	}
+}
+
+/**
+ * Boot the node
+ */
+static void simBoot(void)
+{
+	simHost->taskCreate(simNodeNum, simAppTask, NULL, "loopTask");
+}
+
+/**
+ * Get the mesh package type of a frame
+ * @param data
+ * 		Frame data
+ * @param len
+ * 		Frame length
+ * @return uint8_t
+ * 		LORA_xxx package type or 0xFF if it is not a mesh frame
+ */
+static uint8_t simFrameType(const uint8_t *data, uint8_t len)
+{
+	if ((len >= 2) && (data[0] == MESH_WIRE_MAGIC))
+	{
+		// Compact wire format
+		return data[1] & 0x0F;
+	}
+	if ((len < 4) || (data[0] != 'L') || (data[1] != 'o') || (data[2] != 'R'))
+	{
+		return 0xFF;
+	}
+	return data[3];
+}
+
+/**
+ * Get the number of nodes in the map
+ * @return uint16_t
+ * 		Number of nodes
+ */
+static uint16_t simNumOfNodes(void)
+{
+	return numOfNodes();
+}
+
+/**
+ * Get the statistics of the send queue
+ * @param stats
+ * 		Struct for the statistics
+ */
+static void simGetQueueStats(simQueueStats *stats)
+{
+	sendQueueStats queueStats;
+	getSendQueueStats(&queueStats);
+	stats->queued = queueStats.queued;
+	stats->sent = queueStats.sent;
+	stats->dropped = queueStats.dropped;
+	stats->highWater = queueStats.highWater;
+	stats->maxDelay = queueStats.maxDelay;
+	stats->sumDelay = queueStats.sumDelay;
+	stats->deferred = queueStats.deferred;
+	stats->airTime = queueStats.airTime;
+	stats->aggregates = queueStats.aggregates;
+	stats->aggregatedItems = queueStats.aggregatedItems;
+	stats->acked = queueStats.acked;
+	stats->retries = queueStats.retries;
+	stats->ackFailed = queueStats.ackFailed;
+	stats->acksSent = queueStats.acksSent;
+	linkPowerStats powerStats;
+	getLinkPowerStats(&powerStats);
+	stats->fullPower = powerStats.fullPower;
+	stats->reducedPower = powerStats.reduced;
+	stats->savedDb = powerStats.savedDb;
+	stats->rerouted = queueStats.rerouted;
+	stats->unsent = queueStats.unsent;
+	meshStats mesh;
+	getMeshStats(&mesh);
+	stats->rxHandled = mesh.rxHandled;
+	stats->rxCopied = mesh.rxCopied;
+	packetPoolStats pool;
+	getPacketPoolStats(&pool);
+	stats->poolHighWater = pool.highWater;
+	stats->poolFailed = pool.failed;
+}
+
+/**
+ * Get the statistics of the broadcast duplicate detection
+ * @param stats
+ * 		Struct for the statistics
+ */
+static void simGetBroadcastStats(simBroadcastStats *stats)
+{
+	broadcastStats bcStats;
+	getBroadcastStats(&bcStats);
+	stats->received = bcStats.received;
+	stats->duplicates = bcStats.duplicates;
+	stats->evicted = bcStats.evicted;
+}
+
+/** Entry points for the simulator host */
+static const simNodeApi nodeApi = {
+	simBoot,
+	simRadioTxDone,
+	simRadioRxDone,
+	simRadioCadDone,
+	simNumOfNodes,
+	simFrameType,
+	simGetQueueStats,
+	simGetBroadcastStats};
+
+/**
+ * Initialize the virtual node, called by the simulator host after loading this copy of meshnode.so
+ * @param host
+ * 		Services of the simulator host
+ * @param nodeNum
+ * 		Number of this node in the simulation
+ * @param config
+ * 		Node configuration
+ * @return const simNodeApi*
+ * 		Entry points of the node
+ */
+extern "C" __attribute__((visibility("default"))) const simNodeApi *simNodeInit(const simHostApi *host, uint32_t nodeNum, const simNodeConfig *config)
+{
+	simHost = host;
+	simNodeNum = nodeNum;
+	simConfig = *config;
+	deviceID = config->deviceId;
+	return &nodeApi;
+}
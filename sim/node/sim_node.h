@@ -0,0 +1,21 @@
+/**
+ * Globals shared by the simulated layers of a virtual node
+ */
+#ifndef _SIM_NODE_H
+#define _SIM_NODE_H
+
+#include "../sim_host.h"
+
+/** Services of the simulator host */
+extern const simHostApi *simHost;
+/** Number of this node in the simulation */
+extern uint32_t simNodeNum;
+/** Configuration of this node */
+extern simNodeConfig simConfig;
+
+/** Radio events coming from the channel model of the host */
+void simRadioTxDone(void);
+void simRadioRxDone(const uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+void simRadioCadDone(bool channelBusy);
+
+#endif // _SIM_NODE_H
@@ -0,0 +1,346 @@
+/**
+ * Simulated SX126x radio of a virtual node.
+ * Implements the Radio_s driver interface of the SX126x-Arduino library.
+ * Transmissions, receptions and CAD are handled by the channel model of the
+ * simulator host, which reports the results back as radio interrupts.
+ * Like on the real chip, the interrupts are only dispatched to the
+ * RadioEvents_t callbacks when the application calls Radio.IrqProcess().
+ */
+#include <Arduino.h>
+#include <SX126x-Arduino.h>
+#include "sim_node.h"
+
+/** Interrupt flags, same meaning as the SX126x IRQ register */
+#define SIM_IRQ_TX_DONE 0x01
+#define SIM_IRQ_RX_DONE 0x02
+#define SIM_IRQ_CAD_DONE 0x04
+#define SIM_IRQ_CAD_DETECTED 0x08
+
+/** Radio event callbacks of the application */
+static RadioEvents_t *RadioEvents = NULL;
+
+/** LoRa spreading factor */
+static uint8_t loraSf = 7;
+/** LoRa bandwidth [0: 125 kHz, 1: 250 kHz, 2: 500 kHz] */
+static uint8_t loraBw = 1;
+/** LoRa coding rate [1: 4/5, 2: 4/6, 3: 4/7, 4: 4/8] */
+static uint8_t loraCr = 1;
+/** LoRa preamble length in symbols */
+static uint16_t loraPreamble = 8;
+/** Fixed length packets */
+static bool loraFixLen = false;
+/** CRC enabled */
+static bool loraCrcOn = true;
+/** TX power in dBm */
+static int8_t txPower = 22;
+/** Number of symbols used for CAD */
+static uint8_t cadSymbols = 8;
+
+/** Flag for a pending radio interrupt */
+static volatile bool IrqFired = false;
+/** Called when an interrupt is pending */
+static RadioIrqNotify_t IrqNotify = NULL;
+/** Pending interrupt flags */
+static uint8_t irqRegs = 0;
+/** Buffer for the received payload */
+static uint8_t RadioRxPayload[255];
+/** Size of the received payload */
+static uint8_t rxPayloadSize = 0;
+/** RSSI of the received payload */
+static int16_t rxRssi = 0;
+/** SNR of the received payload */
+static int8_t rxSnr = 0;
+
+/**
+ * Get the length of a LoRa symbol
+ * @return double
+ * 		Symbol time in ms
+ */
+static double symbolTime(void)
+{
+	double bwKHz = 125.0 * (1 << loraBw);
+	return (double)(1 << loraSf) / bwKHz;
+}
+
+/**
+ * Compute the time on air of a LoRa packet
+ * Same formula as used by RadioTimeOnAir() in the SX126x-Arduino library
+ * @param pktLen
+ * 		Payload length
+ * @return double
+ * 		Time on air in ms
+ */
+static double loraTimeOnAir(uint8_t pktLen)
+{
+	double ts = symbolTime();
+	bool lowDatarateOptimize = ts >= 16.38;
+	double tPreamble = (loraPreamble + 4.25) * ts;
+	double tmp = ceil((8 * pktLen - 4 * loraSf + 28 + 16 * (loraCrcOn ? 1 : 0) - (loraFixLen ? 20 : 0)) /
+					  (double)(4 * (loraSf - (lowDatarateOptimize ? 2 : 0)))) *
+				 (loraCr + 4);
+	double nPayload = 8 + ((tmp > 0) ? tmp : 0);
+	return tPreamble + nPayload * ts;
+}
+
+void RadioInit(RadioEvents_t *events)
+{
+	RadioEvents = events;
+	IrqFired = false;
+	irqRegs = 0;
+}
+
+RadioState_t RadioGetStatus(void)
+{
+	return RF_IDLE;
+}
+
+void RadioSetModem(RadioModems_t modem) {}
+
+void RadioSetChannel(uint32_t freq) {}
+
+bool RadioIsChannelFree(RadioModems_t modem, uint32_t freq, int16_t rssiThresh, uint32_t maxCarrierSenseTime)
+{
+	return true;
+}
+
+uint32_t RadioRandom(void)
+{
+	return simHost->random(UINT32_MAX);
+}
+
+void RadioSetRxConfig(RadioModems_t modem, uint32_t bandwidth,
+					  uint32_t datarate, uint8_t coderate,
+					  uint32_t bandwidthAfc, uint16_t preambleLen,
+					  uint16_t symbTimeout, bool fixLen,
+					  uint8_t payloadLen,
+					  bool crcOn, bool freqHopOn, uint8_t hopPeriod,
+					  bool iqInverted, bool rxContinuous)
+{
+	loraBw = bandwidth;
+	loraSf = datarate;
+	loraCr = coderate;
+	loraPreamble = preambleLen;
+	loraFixLen = fixLen;
+	loraCrcOn = crcOn;
+}
+
+void RadioSetTxConfig(RadioModems_t modem, int8_t power, uint32_t fdev,
+					  uint32_t bandwidth, uint32_t datarate,
+					  uint8_t coderate, uint16_t preambleLen,
+					  bool fixLen, bool crcOn, bool freqHopOn,
+					  uint8_t hopPeriod, bool iqInverted, uint32_t timeout)
+{
+	txPower = power;
+	loraBw = bandwidth;
+	loraSf = datarate;
+	loraCr = coderate;
+	loraPreamble = preambleLen;
+	loraFixLen = fixLen;
+	loraCrcOn = crcOn;
+}
+
+bool RadioCheckRfFrequency(uint32_t frequency)
+{
+	return true;
+}
+
+uint32_t RadioTimeOnAir(RadioModems_t modem, uint8_t pktLen)
+{
+	return (uint32_t)floor(loraTimeOnAir(pktLen) + 0.999);
+}
+
+void RadioSend(uint8_t *buffer, uint8_t size)
+{
+	simTime_t airTime = (simTime_t)(loraTimeOnAir(size) * 1000.0);
+	simHost->radioTx(simNodeNum, buffer, size, airTime, txPower);
+}
+
+void RadioSleep(void)
+{
+	simHost->radioStandby(simNodeNum);
+}
+
+void RadioStandby(void)
+{
+	simHost->radioStandby(simNodeNum);
+}
+
+void RadioRx(uint32_t timeout)
+{
+	simHost->radioRx(simNodeNum);
+}
+
+void RadioSetCadParams(uint8_t cadSymbolNum, uint8_t cadDetPeak, uint8_t cadDetMin, uint8_t cadExitMode, uint32_t cadTimeout)
+{
+	// LORA_CAD_01_SYMBOL .. LORA_CAD_16_SYMBOL
+	cadSymbols = 1 << cadSymbolNum;
+}
+
+void RadioStartCad(void)
+{
+	// CAD listens for cadSymbols symbols and needs about one symbol to process the result
+	simTime_t cadTime = (simTime_t)((cadSymbols + 1) * symbolTime() * 1000.0);
+	simHost->radioCad(simNodeNum, cadTime);
+}
+
+void RadioSetTxContinuousWave(uint32_t freq, int8_t power, uint16_t time) {}
+
+int16_t RadioRssi(RadioModems_t modem)
+{
+	return -120;
+}
+
+void RadioWrite(uint16_t addr, uint8_t data) {}
+
+uint8_t RadioRead(uint16_t addr)
+{
+	return 0;
+}
+
+void RadioWriteBuffer(uint16_t addr, uint8_t *buffer, uint8_t size) {}
+
+void RadioReadBuffer(uint16_t addr, uint8_t *buffer, uint8_t size) {}
+
+void RadioSetMaxPayloadLength(RadioModems_t modem, uint8_t max) {}
+
+void RadioSetPublicNetwork(bool enable) {}
+
+uint32_t RadioGetWakeupTime(void)
+{
+	return RADIO_TCXO_SETUP_TIME + RADIO_WAKEUP_TIME;
+}
+
+void RadioSetIrqNotify(RadioIrqNotify_t notify)
+{
+	IrqNotify = notify;
+}
+
+/**
+ * Flag an interrupt and call the notification like the DIO1 interrupt of the real radio
+ * @param irq
+ * 		SIM_IRQ_xxx flags
+ */
+static void fireIrq(uint8_t irq)
+{
+	irqRegs |= irq;
+	IrqFired = true;
+	if (IrqNotify != NULL)
+	{
+		IrqNotify();
+	}
+}
+
+void RadioIrqProcess(void)
+{
+	if (IrqFired == true)
+	{
+		IrqFired = false;
+		uint8_t irqs = irqRegs;
+		irqRegs = 0;
+
+		if ((irqs & SIM_IRQ_TX_DONE) == SIM_IRQ_TX_DONE)
+		{
+			if ((RadioEvents != NULL) && (RadioEvents->TxDone != NULL))
+			{
+				RadioEvents->TxDone();
+			}
+		}
+
+		if ((irqs & SIM_IRQ_RX_DONE) == SIM_IRQ_RX_DONE)
+		{
+			if ((RadioEvents != NULL) && (RadioEvents->RxDone != NULL))
+			{
+				RadioEvents->RxDone(RadioRxPayload, rxPayloadSize, rxRssi, rxSnr);
+			}
+		}
+
+		if ((irqs & SIM_IRQ_CAD_DONE) == SIM_IRQ_CAD_DONE)
+		{
+			if ((RadioEvents != NULL) && (RadioEvents->CadDone != NULL))
+			{
+				RadioEvents->CadDone((irqs & SIM_IRQ_CAD_DETECTED) == SIM_IRQ_CAD_DETECTED);
+			}
+		}
+	}
+}
+
+void RadioIrqProcessAfterDeepSleep(void)
+{
+	RadioIrqProcess();
+}
+
+void RadioRxBoosted(uint32_t timeout)
+{
+	simHost->radioRx(simNodeNum);
+}
+
+void RadioSetRxDutyCycle(uint32_t rxTime, uint32_t sleepTime)
+{
+	// The duty cycle is not modelled, the radio listens continuously
+	simHost->radioRx(simNodeNum);
+}
+
+/**
+ * Radio driver structure initialization
+ */
+const struct Radio_s Radio =
+	{
+		RadioInit,
+		RadioInit,
+		RadioGetStatus,
+		RadioSetModem,
+		RadioSetChannel,
+		RadioIsChannelFree,
+		RadioRandom,
+		RadioSetRxConfig,
+		RadioSetTxConfig,
+		RadioCheckRfFrequency,
+		RadioTimeOnAir,
+		RadioSend,
+		RadioSleep,
+		RadioStandby,
+		RadioRx,
+		RadioSetCadParams,
+		RadioStartCad,
+		RadioSetTxContinuousWave,
+		RadioRssi,
+		RadioWrite,
+		RadioRead,
+		RadioWriteBuffer,
+		RadioReadBuffer,
+		RadioSetMaxPayloadLength,
+		RadioSetPublicNetwork,
+		RadioGetWakeupTime,
+		RadioIrqProcess,
+		RadioIrqProcessAfterDeepSleep,
+		RadioRxBoosted,
+		RadioSetRxDutyCycle};
+
+/**
+ * Transmission finished, called by the simulator host
+ */
+void simRadioTxDone(void)
+{
+	fireIrq(SIM_IRQ_TX_DONE);
+}
+
+/**
+ * Frame received, called by the simulator host
+ * A frame that was not yet processed is overwritten like in the FIFO of the real chip
+ */
+void simRadioRxDone(const uint8_t *data, uint8_t len, int16_t rssi, int8_t snr)
+{
+	memcpy(RadioRxPayload, data, len);
+	rxPayloadSize = len;
+	rxRssi = rssi;
+	rxSnr = snr;
+	fireIrq(SIM_IRQ_RX_DONE);
+}
+
+/**
+ * Channel activity detection finished, called by the simulator host
+ */
+void simRadioCadDone(bool channelBusy)
+{
+	fireIrq(channelBusy ? SIM_IRQ_CAD_DONE | SIM_IRQ_CAD_DETECTED : SIM_IRQ_CAD_DONE);
+}
@@ -0,0 +1,175 @@
+/**
+ * Interface between the mesh simulator host and the virtual nodes.
+ *
+ * Every virtual node is a private copy of meshnode.so that contains the
+ * unmodified src/Mesh code together with the simulated Arduino, FreeRTOS
+ * and Radio layers. The host loads one copy per node, so all globals of
+ * the mesh code exist once per node.
+ */
+#ifndef _SIM_HOST_H
+#define _SIM_HOST_H
+
+#include <stdint.h>
+
+/** Virtual time is counted in microseconds */
+typedef uint64_t simTime_t;
+
+/** Wait forever, used for portMAX_DELAY */
+#define SIM_FOREVER UINT64_MAX
+
+/**
+ * Services the simulator host provides to the virtual nodes
+ */
+struct simHostApi
+{
+	/** Current virtual time */
+	simTime_t (*now)(void);
+	/** Suspend the running task until wakeTime, cannot be interrupted */
+	void (*sleepUntil)(simTime_t wakeTime);
+	/** Suspend the running task until deadline or until its node is signaled */
+	void (*waitUntil)(simTime_t deadline);
+	/** Wake up all waiting tasks of a node */
+	void (*signal)(uint32_t nodeNum);
+	/** Create a new task for a node, returns the task handle or NULL if it failed */
+	void *(*taskCreate)(uint32_t nodeNum, void (*taskFunc)(void *), void *param, const char *name);
+	/** Handle of the running task */
+	void *(*currentTask)(void);
+	/** Deterministic random number in the range 0 .. max - 1 */
+	uint32_t (*random)(uint32_t max);
+
+	/** Radio of a node starts to transmit a frame */
+	void (*radioTx)(uint32_t nodeNum, const uint8_t *data, uint8_t len, simTime_t airTime, int8_t power);
+	/** Radio of a node starts a channel activity detection */
+	void (*radioCad)(uint32_t nodeNum, simTime_t cadTime);
+	/** Radio of a node starts to listen */
+	void (*radioRx)(uint32_t nodeNum);
+	/** Radio of a node goes to standby or sleep */
+	void (*radioStandby)(uint32_t nodeNum);
+
+	/** Log output of a node */
+	void (*log)(uint32_t nodeNum, const char *text);
+
+	/** Application of a node sent a message, destId is 0 for a broadcast */
+	void (*appSent)(uint32_t nodeNum, uint32_t destId, uint32_t seq);
+	/** Application of a node received a message */
+	void (*appReceived)(uint32_t nodeNum, uint32_t origId, uint32_t seq);
+};
+
+/** Smallest application message size, the header with originator and sequence number must fit */
+#define SIM_MIN_MSG_SIZE 32
+/** Largest application message size, FRAG_MAX_MSG_SIZE of the node build */
+#define SIM_MAX_MSG_SIZE 500
+
+/**
+ * Configuration handed to every virtual node
+ */
+struct simNodeConfig
+{
+	/** Mesh node ID of the node */
+	uint32_t deviceId;
+	/** Max number of nodes in the map (MAX_NODES on the real devices) */
+	int maxNodes;
+	/** Interval between two application messages in ms, 0 to disable traffic */
+	uint32_t trafficInterval;
+	/** Size of the application messages, type byte included, 0 for short messages, larger than one package they are sent in fragments */
+	uint16_t msgSize;
+	/** Send the chat text compressed to receivers that can expand it */
+	bool compress;
+};
+
+/**
+ * Send queue statistics of a virtual node
+ */
+struct simQueueStats
+{
+	/** Packages added to the send queue */
+	uint32_t queued;
+	/** Packages taken from the send queue */
+	uint32_t sent;
+	/** Packages rejected because the send queue was full */
+	uint32_t dropped;
+	/** Max number of packages in the send queue */
+	uint32_t highWater;
+	/** Longest time a package waited in the send queue in ms */
+	uint32_t maxDelay;
+	/** Sum of the waiting times in ms */
+	uint64_t sumDelay;
+	/** Packages held back by the airtime budget */
+	uint32_t deferred;
+	/** Airtime of the sent packages in ms */
+	uint64_t airTime;
+	/** Aggregated packages sent */
+	uint32_t aggregates;
+	/** Packages sent inside aggregated packages */
+	uint32_t aggregatedItems;
+	/** Unicast packages acknowledged by the next hop */
+	uint32_t acked;
+	/** Unicast packages sent again because the ACK was missing */
+	uint32_t retries;
+	/** Unicast packages given up after all retransmissions */
+	uint32_t ackFailed;
+	/** ACKs sent for received packages */
+	uint32_t acksSent;
+	/** Unicast packages sent with full TX power */
+	uint32_t fullPower;
+	/** Unicast packages sent with reduced TX power */
+	uint32_t reducedPower;
+	/** Sum of the TX power reductions in dB */
+	uint32_t savedDb;
+	/** Given up unicast packages sent again through another first hop */
+	uint32_t rerouted;
+	/** Received frames handled by the mesh code */
+	uint32_t rxHandled;
+	/** Bytes copied from the radio into package buffers */
+	uint32_t rxCopied;
+	/** Max number of package buffers in use at the same time */
+	uint32_t poolHighWater;
+	/** Requests for a package buffer that failed */
+	uint32_t poolFailed;
+	/** Unicast packages queued again because they were not sent */
+	uint32_t unsent;
+};
+
+/**
+ * Broadcast duplicate detection statistics of a virtual node
+ */
+struct simBroadcastStats
+{
+	/** Broadcasts checked */
+	uint32_t received;
+	/** Broadcasts suppressed as duplicates */
+	uint32_t duplicates;
+	/** Valid cache entries replaced because the cache was full */
+	uint32_t evicted;
+};
+
+/**
+ * Entry points every virtual node exports to the simulator host
+ */
+struct simNodeApi
+{
+	/** Boot the node, creates the application task */
+	void (*boot)(void);
+	/** Radio finished a transmission */
+	void (*radioTxDone)(void);
+	/** Radio received a frame */
+	void (*radioRxDone)(const uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+	/** Radio finished a channel activity detection */
+	void (*radioCadDone)(bool channelBusy);
+	/** Number of nodes in the nodes map */
+	uint16_t (*numOfNodes)(void);
+	/** Mesh package type of a frame, used for the airtime statistics */
+	uint8_t (*frameType)(const uint8_t *data, uint8_t len);
+	/** Statistics of the send queue */
+	void (*queueStats)(simQueueStats *stats);
+	/** Statistics of the broadcast duplicate detection */
+	void (*broadcastStats)(simBroadcastStats *stats);
+};
+
+/** Name of the init function exported by meshnode.so */
+#define SIM_NODE_INIT "simNodeInit"
+
+/** Init function exported by meshnode.so */
+typedef const simNodeApi *(*simNodeInit_t)(const simHostApi *host, uint32_t nodeNum, const simNodeConfig *config);
+
+#endif // _SIM_HOST_H
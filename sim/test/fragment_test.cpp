@@ -0,0 +1,490 @@
+/**
+ * Test of the message fragmentation in src/EmyChat/fragment.cpp
+ *
+ * Runs sendFragments(), addFragment(), checkFragments() and handleFragmentNack() on the host,
+ * the queued packages are caught in addSendRequest() and handed to the receiver by the test:
+ * - round trip     messages of 1 .. FRAG_MAX_MSG_SIZE bytes, fragments in order and reversed
+ * - late fragment  a fragment that arrives after the message is complete is a duplicate
+ * - unicast NACK   a lost fragment is requested after FRAG_GAP_TIME and sent again
+ * - broadcast NACK a fragment requested by two receivers is sent again only once
+ * - retries        FRAG_NACK_RETRIES requests, the incomplete message is dropped after FRAG_TIMEOUT
+ * - invalid        fragments with a wrong header are rejected
+ * - slots          a completed message gives its slot to a new message before an incomplete one
+ * Exits with 1 if a check fails.
+ */
+#include <vector>
+#include "main.h"
+
+/** Fake time in ms */
+static unsigned long testTime = 1000;
+
+unsigned long millis(void)
+{
+	return testTime;
+}
+
+extern "C" const char *pathToFileName(const char *path)
+{
+	return path;
+}
+
+extern "C" int log_printf(const char *, ...)
+{
+	return 0;
+}
+
+/** Node ID of the node under test, it sends and receives */
+#define TEST_SENDER 0xA0000001
+/** Node ID of the receivers */
+#define TEST_RECEIVER 0xB0000001
+#define TEST_RECEIVER2 0xB0000002
+
+/**
+ * A package queued by the fragment code
+ */
+struct testPackage
+{
+	/** Receiver passed to setRoute(), 0 for a broadcast */
+	uint32_t receiver;
+	/** Data of the package, starts with the type byte */
+	std::vector<uint8_t> data;
+};
+
+/** Packages queued since the last clear */
+static std::vector<testPackage> queued;
+/** Receiver of the package that is being built */
+static uint32_t routeReceiver = 0;
+/** setRoute() finds a route */
+static bool routeFound = true;
+
+bool setRoute(uint32_t receiver, dataMsg *outData)
+{
+	(void)outData;
+	routeReceiver = receiver;
+	return routeFound;
+}
+
+bool addSendRequest(dataMsg *package, uint8_t msgSize)
+{
+	testPackage sent;
+	sent.receiver = routeReceiver;
+	sent.data.assign(package->data, package->data + msgSize - DATA_HEADER_SIZE);
+	queued.push_back(sent);
+	return true;
+}
+
+/** Number of failed checks */
+static int failures = 0;
+
+/**
+ * Count and print a failed check
+ * @param ok
+ * 		Result of the check
+ * @param test
+ * 		Name of the test
+ * @param what
+ * 		Description of the check
+ */
+static void expect(bool ok, const char *test, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAILED %s: %s\n", test, what);
+		failures++;
+	}
+}
+
+/**
+ * Fill a message with a pattern that differs for every message and position
+ * @param message
+ * 		Buffer for the message
+ * @param size
+ * 		Size of the message
+ * @param seed
+ * 		Start of the pattern
+ */
+static void fillMessage(uint8_t *message, uint16_t size, uint8_t seed)
+{
+	for (uint16_t idx = 0; idx < size; idx++)
+	{
+		message[idx] = (uint8_t)(seed + idx * 7 + (idx >> 8));
+	}
+}
+
+/**
+ * Hand a queued fragment to the receive path
+ * @param package
+ * 		The fragment
+ * @param message
+ * 		Buffer for the complete message
+ * @return uint16_t
+ * 		Size of the message if the fragment completed it, else 0
+ */
+static uint16_t receive(testPackage &package, uint8_t *message)
+{
+	return addFragment(TEST_SENDER, package.data.data(), package.data.size(), message);
+}
+
+/**
+ * Let the time pass and run the loop function
+ * @param ms
+ * 		Time in ms
+ */
+static void advance(unsigned long ms)
+{
+	testTime += ms;
+	checkFragments();
+}
+
+/**
+ * Drop all incomplete and completed messages and the sent messages
+ */
+static void expireAll(void)
+{
+	advance(FRAG_TIMEOUT);
+	queued.clear();
+}
+
+/**
+ * Send messages of all sizes and reassemble them with the fragments in order and reversed
+ */
+static void testRoundTrip(void)
+{
+	static const uint16_t sizes[] = {1, 2, FRAG_PAYLOAD_SIZE - 1, FRAG_PAYLOAD_SIZE, FRAG_PAYLOAD_SIZE + 1,
+									 2 * FRAG_PAYLOAD_SIZE, 2 * FRAG_PAYLOAD_SIZE + 1, FRAG_MAX_MSG_SIZE - 1, FRAG_MAX_MSG_SIZE};
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	uint8_t messages = 0;
+
+	for (uint16_t size : sizes)
+	{
+		for (int reversed = 0; reversed < 2; reversed++)
+		{
+			fillMessage(sent, size, messages++);
+			queued.clear();
+			sendFragments(TEST_RECEIVER, sent, size);
+
+			uint16_t count = (size + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+			expect(queued.size() == count, "round trip", "wrong number of fragments");
+			for (size_t idx = 0; idx < queued.size(); idx++)
+			{
+				uint16_t partSize = (idx < (size_t)count - 1) ? FRAG_PAYLOAD_SIZE : size - (count - 1) * FRAG_PAYLOAD_SIZE;
+				expect(queued[idx].receiver == TEST_RECEIVER, "round trip", "fragment not sent to the receiver");
+				expect(queued[idx].data.size() == (size_t)(FRAG_HEADER_SIZE + partSize), "round trip", "wrong fragment size");
+				expect((queued[idx].data[0] == FRAGMENT_TYPE) && ((size_t)queued[idx].data[2] == idx) && (queued[idx].data[3] == count),
+					   "round trip", "wrong fragment header");
+			}
+
+			uint16_t msgSize = 0;
+			for (size_t idx = 0; idx < queued.size(); idx++)
+			{
+				size_t next = reversed ? queued.size() - 1 - idx : idx;
+				msgSize = receive(queued[next], received);
+				expect((msgSize != 0) == (idx == queued.size() - 1), "round trip", "message completed with the wrong fragment");
+			}
+			expect(msgSize == size, "round trip", "wrong message size");
+			expect((msgSize == size) && (memcmp(sent, received, size) == 0) && (received[size] == 0), "round trip", "message changed");
+		}
+	}
+	expireAll();
+}
+
+/**
+ * A fragment that arrives after the message was completed is ignored and not requested
+ */
+static void testLateFragment(void)
+{
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	fillMessage(sent, FRAG_MAX_MSG_SIZE, 11);
+	sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+	std::vector<testPackage> fragments = queued;
+	queued.clear();
+
+	uint16_t msgSize = 0;
+	for (testPackage &fragment : fragments)
+	{
+		msgSize = receive(fragment, received);
+	}
+	expect(msgSize == FRAG_MAX_MSG_SIZE, "late fragment", "message not complete");
+
+	// Sent again after a lost link ACK
+	expect(receive(fragments[1], received) == 0, "late fragment", "message completed twice");
+	advance(FRAG_GAP_TIME);
+	expect(queued.empty(), "late fragment", "fragments of a complete message requested");
+	for (testPackage &fragment : fragments)
+	{
+		expect(receive(fragment, received) == 0, "late fragment", "message completed twice");
+	}
+	expireAll();
+}
+
+/**
+ * A lost fragment of a unicast message is requested from the sender and sent again
+ */
+static void testUnicastNack(void)
+{
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	fillMessage(sent, FRAG_MAX_MSG_SIZE, 23);
+	sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+	std::vector<testPackage> fragments = queued;
+	queued.clear();
+
+	// Fragment 1 is lost
+	for (size_t idx = 0; idx < fragments.size(); idx++)
+	{
+		if (idx != 1)
+		{
+			expect(receive(fragments[idx], received) == 0, "unicast NACK", "incomplete message completed");
+		}
+	}
+	advance(FRAG_GAP_TIME - 100);
+	expect(queued.empty(), "unicast NACK", "fragments requested before FRAG_GAP_TIME");
+	advance(100);
+	expect(queued.size() == 1, "unicast NACK", "missing fragment not requested");
+	if (queued.size() != 1)
+	{
+		expireAll();
+		return;
+	}
+	testPackage nack = queued[0];
+	queued.clear();
+	uint32_t missing;
+	memcpy(&missing, &nack.data[2], 4);
+	expect(nack.receiver == TEST_SENDER, "unicast NACK", "request not sent to the sender");
+	expect((nack.data.size() == 6) && (nack.data[0] == FRAGMENT_NACK_TYPE) && (nack.data[1] == fragments[0].data[1]),
+		   "unicast NACK", "wrong request header");
+	expect(missing == 0x02, "unicast NACK", "wrong mask of missing fragments");
+
+	// Another node cannot request the fragments of a unicast message
+	handleFragmentNack(TEST_RECEIVER2, nack.data.data(), nack.data.size());
+	expect(queued.empty(), "unicast NACK", "fragments sent again for the wrong node");
+
+	handleFragmentNack(TEST_RECEIVER, nack.data.data(), nack.data.size());
+	expect((queued.size() == 1) && (queued[0].receiver == TEST_RECEIVER) && (queued[0].data == fragments[1].data),
+		   "unicast NACK", "missing fragment not sent again");
+	if (queued.size() == 1)
+	{
+		uint16_t msgSize = receive(queued[0], received);
+		expect((msgSize == FRAG_MAX_MSG_SIZE) && (memcmp(sent, received, msgSize) == 0), "unicast NACK", "message not recovered");
+	}
+	queued.clear();
+
+	// Complete, nothing is requested anymore
+	advance(FRAG_GAP_TIME);
+	expect(queued.empty(), "unicast NACK", "complete message requested");
+	expireAll();
+}
+
+/**
+ * Fragments of a broadcast requested by several receivers are sent again once per FRAG_GAP_TIME
+ */
+static void testBroadcastNack(void)
+{
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	fillMessage(sent, FRAG_MAX_MSG_SIZE, 37);
+	sendFragments(0, sent, FRAG_MAX_MSG_SIZE);
+	uint8_t msgId = queued[0].data[1];
+	queued.clear();
+
+	uint8_t nack[6] = {FRAGMENT_NACK_TYPE, msgId};
+	uint32_t missing = 0x01;
+	memcpy(&nack[2], &missing, 4);
+	handleFragmentNack(TEST_RECEIVER, nack, sizeof(nack));
+	expect((queued.size() == 1) && (queued[0].receiver == 0) && (queued[0].data[2] == 0), "broadcast NACK", "missing fragment not sent again");
+	queued.clear();
+
+	// Second receiver misses fragments 0 and 2, 0 is already on the way
+	missing = 0x05;
+	memcpy(&nack[2], &missing, 4);
+	testTime += 1000;
+	handleFragmentNack(TEST_RECEIVER2, nack, sizeof(nack));
+	expect((queued.size() == 1) && (queued[0].data[2] == 2), "broadcast NACK", "fragment sent again twice");
+	queued.clear();
+
+	// Later requests are answered again
+	testTime += FRAG_GAP_TIME;
+	handleFragmentNack(TEST_RECEIVER, nack, sizeof(nack));
+	expect(queued.size() == 2, "broadcast NACK", "repeated request not answered");
+	queued.clear();
+
+	// Unknown message
+	nack[1] = msgId + 100;
+	handleFragmentNack(TEST_RECEIVER, nack, sizeof(nack));
+	expect(queued.empty(), "broadcast NACK", "unknown message answered");
+	expireAll();
+}
+
+/**
+ * An incomplete message is requested FRAG_NACK_RETRIES times and dropped after FRAG_TIMEOUT
+ */
+static void testRetries(void)
+{
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	fillMessage(sent, FRAG_MAX_MSG_SIZE, 41);
+	sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+	std::vector<testPackage> fragments = queued;
+	queued.clear();
+
+	receive(fragments[0], received);
+	unsigned long start = testTime;
+	while ((testTime - start) < FRAG_TIMEOUT - 100)
+	{
+		advance(100);
+	}
+	expect(queued.size() == FRAG_NACK_RETRIES, "retries", "wrong number of requests");
+	queued.clear();
+
+	// The message was dropped, the missing fragments start it again
+	advance(100);
+	expect(receive(fragments[1], received) == 0, "retries", "dropped message completed");
+	expect(receive(fragments[2], received) == 0, "retries", "dropped message completed");
+	expireAll();
+
+	// Without a route no request is queued
+	routeFound = false;
+	receive(fragments[0], received);
+	advance(FRAG_GAP_TIME);
+	expect(queued.empty(), "retries", "request queued without a route");
+	routeFound = true;
+	expireAll();
+}
+
+/**
+ * Fragments with a wrong header are rejected
+ */
+static void testInvalid(void)
+{
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	uint8_t fragment[FRAG_HEADER_SIZE + FRAG_PAYLOAD_SIZE];
+	memset(fragment, 0x55, sizeof(fragment));
+	fragment[0] = FRAGMENT_TYPE;
+	fragment[1] = 200;
+
+	// Header only
+	fragment[2] = 0;
+	fragment[3] = 1;
+	expect(addFragment(TEST_SENDER, fragment, FRAG_HEADER_SIZE, received) == 0, "invalid", "empty fragment accepted");
+	// No fragments
+	fragment[3] = 0;
+	expect(addFragment(TEST_SENDER, fragment, sizeof(fragment), received) == 0, "invalid", "count 0 accepted");
+	// Index behind the last fragment
+	fragment[2] = 2;
+	fragment[3] = 2;
+	expect(addFragment(TEST_SENDER, fragment, sizeof(fragment), received) == 0, "invalid", "index out of range accepted");
+	// Too many fragments
+	fragment[2] = 0;
+	fragment[3] = FRAG_MAX_COUNT + 1;
+	expect(addFragment(TEST_SENDER, fragment, sizeof(fragment), received) == 0, "invalid", "too many fragments accepted");
+	// Fragment before the last one is not full
+	fragment[2] = 0;
+	fragment[3] = 2;
+	expect(addFragment(TEST_SENDER, fragment, sizeof(fragment) - 1, received) == 0, "invalid", "short fragment accepted");
+	// Last fragment ends behind FRAG_MAX_MSG_SIZE
+	fragment[2] = FRAG_MAX_COUNT - 1;
+	fragment[3] = FRAG_MAX_COUNT;
+	expect(addFragment(TEST_SENDER, fragment, sizeof(fragment), received) == 0, "invalid", "too large message accepted");
+
+	// None of them took a slot
+	advance(FRAG_GAP_TIME);
+	expect(queued.empty(), "invalid", "rejected fragment requested");
+	expireAll();
+}
+
+/**
+ * Completed messages keep their slot for late fragments, but give it to a new message first
+ */
+static void testSlots(void)
+{
+	uint8_t sent[FRAG_MAX_MSG_SIZE];
+	uint8_t received[FRAG_MAX_MSG_SIZE + 1];
+	std::vector<std::vector<testPackage>> messages;
+
+	// One completed message, then FRAG_RX_SLOTS incomplete messages of other senders
+	fillMessage(sent, FRAG_MAX_MSG_SIZE, 53);
+	sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+	for (testPackage &fragment : queued)
+	{
+		receive(fragment, received);
+	}
+	queued.clear();
+	for (int idx = 0; idx < FRAG_RX_SLOTS; idx++)
+	{
+		testTime += 10;
+		sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+		messages.push_back(queued);
+		queued.clear();
+		addFragment(TEST_SENDER + 1 + idx, messages[idx][0].data.data(), messages[idx][0].data.size(), received);
+	}
+
+	// All incomplete messages are still there
+	int completed = 0;
+	for (int idx = 0; idx < FRAG_RX_SLOTS; idx++)
+	{
+		uint16_t msgSize = 0;
+		for (size_t part = 1; part < messages[idx].size(); part++)
+		{
+			msgSize = addFragment(TEST_SENDER + 1 + idx, messages[idx][part].data.data(), messages[idx][part].data.size(), received);
+		}
+		completed += (msgSize == FRAG_MAX_MSG_SIZE) && (memcmp(sent, received, msgSize) == 0) ? 1 : 0;
+	}
+	expect(completed == FRAG_RX_SLOTS, "slots", "incomplete message replaced instead of a complete one");
+
+	// With all slots incomplete, the message that waits longest is replaced
+	messages.clear();
+	for (int idx = 0; idx <= FRAG_RX_SLOTS; idx++)
+	{
+		testTime += 10;
+		sendFragments(TEST_RECEIVER, sent, FRAG_MAX_MSG_SIZE);
+		messages.push_back(queued);
+		queued.clear();
+		addFragment(TEST_SENDER + 10 + idx, messages[idx][0].data.data(), messages[idx][0].data.size(), received);
+	}
+	uint16_t msgSize = 0;
+	for (size_t part = 1; part < messages[0].size(); part++)
+	{
+		msgSize = addFragment(TEST_SENDER + 10, messages[0][part].data.data(), messages[0][part].data.size(), received);
+	}
+	expect(msgSize == 0, "slots", "replaced message completed");
+	for (size_t part = 1; part < messages[FRAG_RX_SLOTS].size(); part++)
+	{
+		msgSize = addFragment(TEST_SENDER + 10 + FRAG_RX_SLOTS, messages[FRAG_RX_SLOTS][part].data.data(),
+							  messages[FRAG_RX_SLOTS][part].data.size(), received);
+	}
+	expect(msgSize == FRAG_MAX_MSG_SIZE, "slots", "newest message lost");
+	expireAll();
+}
+
+/**
+ * Run one test and print its result
+ * @param name
+ * 		Name of the test
+ * @param test
+ * 		The test
+ */
+static void runTest(const char *name, void (*test)(void))
+{
+	int before = failures;
+	test();
+	printf("%-15s: %s\n", name, failures == before ? "ok" : "FAILED");
+}
+
+int main(void)
+{
+	runTest("round trip", testRoundTrip);
+	runTest("late fragment", testLateFragment);
+	runTest("unicast NACK", testUnicastNack);
+	runTest("broadcast NACK", testBroadcastNack);
+	runTest("retries", testRetries);
+	runTest("invalid", testInvalid);
+	runTest("slots", testSlots);
+	if (failures != 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -19,12 +19,20 @@ void handleBleData(void)
 		(type != LOCATION_TYPE) &&
 		(type != MAP_TYPE) &&
 		(type != NAME_TYPE) &&
-		(type != SET_NAME_TYPE))
+		(type != SET_NAME_TYPE) &&
+		(type != STATS_TYPE))
 	{
 		myLog_e("Invalid data type, discarding");
 		return;
 	}
 
+	if (type == STATS_TYPE)
+	{
+		// Request for the statistics, answered without sending anything over LoRa
+		sendBleData(0, STATS_TYPE, NULL, 0);
+		return;
+	}
+
 	if (type == SET_NAME_TYPE)
 	{
 		// Save the username on the device
@@ -40,12 +48,98 @@ void handleBleData(void)
 	sendLoRaData(0, type, &bleOutData[1], len - 1);
 }
 
+/**
+ * Put a counter into the statistics message, least significant byte first
+ * @param buffer
+ * 			Position in the message
+ * @param value
+ * 			Counter
+ * @return uint8_t *
+ * 			Position after the counter
+ */
+static uint8_t *putStat(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+	buffer[2] = value >> 16;
+	buffer[3] = value >> 24;
+	return buffer + 4;
+}
+
+/**
+ * Build the binary statistics message
+ * [STATS_TYPE] [STATS_VERSION] [number of package types n], then 32 bit counters, least significant byte first:
+ * uptime in s, n packages sent per LoRa package type, n packages received per LoRa package type,
+ * CAD runs, CAD busy, CAD given up,
+ * queued, sent, dropped because the queue was full, deferred by the airtime budget, queue high water,
+ * forwarded unicast packages, forwarded broadcasts, unicast packages without route,
+ * link ACKs received, retransmissions, given up, rerouted,
+ * duplicate broadcasts, nodes in the map, nodes added, nodes removed, first hop changes,
+ * received packages handled, average and max time of the RX callback in us, received packages dropped by the inbox,
+ * unicast packages not sent and queued again (since version 2)
+ * @param buffer
+ * 			Buffer for the message
+ * @return int
+ * 			Size of the message
+ */
+static int buildStatsMsg(uint8_t *buffer)
+{
+	meshStats mesh;
+	routeStats route;
+	sendQueueStats queue;
+	broadcastStats broadcast;
+	getMeshStats(&mesh);
+	getRouteStats(&route);
+	getSendQueueStats(&queue);
+	getBroadcastStats(&broadcast);
+
+	uint8_t *pos = buffer;
+	*pos++ = STATS_TYPE;
+	*pos++ = STATS_VERSION;
+	*pos++ = MESH_STATS_TYPES;
+	pos = putStat(pos, millis() / 1000);
+	for (int type = 0; type < MESH_STATS_TYPES; type++)
+	{
+		pos = putStat(pos, mesh.txFrames[type]);
+	}
+	for (int type = 0; type < MESH_STATS_TYPES; type++)
+	{
+		pos = putStat(pos, mesh.rxFrames[type]);
+	}
+	pos = putStat(pos, mesh.cadRuns);
+	pos = putStat(pos, mesh.cadBusy);
+	pos = putStat(pos, mesh.cadFailed);
+	pos = putStat(pos, queue.queued);
+	pos = putStat(pos, queue.sent);
+	pos = putStat(pos, queue.dropped);
+	pos = putStat(pos, queue.deferred);
+	pos = putStat(pos, queue.highWater);
+	pos = putStat(pos, mesh.forwarded);
+	pos = putStat(pos, mesh.broadcastsForwarded);
+	pos = putStat(pos, mesh.noRoute);
+	pos = putStat(pos, queue.acked);
+	pos = putStat(pos, queue.retries);
+	pos = putStat(pos, queue.ackFailed);
+	pos = putStat(pos, queue.rerouted);
+	pos = putStat(pos, broadcast.duplicates);
+	pos = putStat(pos, route.mapSize);
+	pos = putStat(pos, route.added);
+	pos = putStat(pos, route.removed);
+	pos = putStat(pos, route.changed);
+	pos = putStat(pos, mesh.rxHandled);
+	pos = putStat(pos, mesh.rxHandled != 0 ? (uint32_t)(mesh.rxTimeSum / mesh.rxHandled) : 0);
+	pos = putStat(pos, mesh.rxTimeMax);
+	pos = putStat(pos, getLoraRxOverflows());
+	pos = putStat(pos, queue.unsent);
+	return pos - buffer;
+}
+
 /**
  * Send data over BLE
  * @param receiver
  * 			Node ID the data was received from
  * @param type
- * 			Type of data (chat, location, name, node map)
+ * 			Type of data (chat, location, name, node map, statistics)
  * @param data
  * 			Data buffer
  * @param len
@@ -58,7 +152,8 @@ void sendBleData(uint32_t receiver, uint8_t type, char *data, size_t len)
 	{
 		int sendLen = 0;
 		uint8_t mapData[48][5];
-		uint8_t nodesInMap;
+		uint16_t nodesInMap;
+		char nodeName[NODE_NAME_SIZE];
 
 		switch (type)
 		{
@@ -68,15 +163,16 @@ void sendBleData(uint32_t receiver, uint8_t type, char *data, size_t len)
 			break;
 		case LOCATION_TYPE:
 			// Location data
-			if (getNodeName(receiver) != NULL)
+			if (getNodeName(receiver, nodeName))
 			{
-				sendLen = snprintf(bleOutData, 512, "%c<%s>%s\n", type, getNodeName(receiver), data);
+				sendLen = snprintf(bleOutData, 512, "%c<%s>%s\n", type, nodeName, data);
 			}
 			sendLen = snprintf(bleOutData, 512, "%s\n", data);
 			break;
 		case MAP_TYPE:
 			// Mesh map data
-			nodesInMap = nodeMap(mapData);
+			// The BLE message has room for the first 48 nodes
+			nodesInMap = nodeMap(mapData, sizeof(mapData) / sizeof(mapData[0]));
 			bleOutData[0] = 0x34;
 			myLog_d("Sending mesh map with %d entries and len %d", nodesInMap, (nodesInMap * 5)+1);
 			memcpy(&bleOutData[1], mapData, nodesInMap * 5);
@@ -86,6 +182,10 @@ void sendBleData(uint32_t receiver, uint8_t type, char *data, size_t len)
 			//Tell the app your saved username
 			sendLen = snprintf(bleOutData, 512, "%c%s\n", type, userName);
 			break;
+		case STATS_TYPE:
+			// Mesh statistics in binary format
+			sendLen = buildStatsMsg((uint8_t *)bleOutData);
+			break;
 		default:
 			myLog_e("Invalid type");
 			return;
@@ -6,6 +6,85 @@
 
 char consoleOut[512] = {0};
 
+/**
+ * Print the statistics of the mesh
+ */
+static void printStats(void)
+{
+	static const char *typeNames[MESH_STATS_TYPES] = {"invalid", "direct", "forward", "broadcast", "map", "map delta", "map request", "aggregate", "ack"};
+	meshStats mesh;
+	routeStats route;
+	sendQueueStats queue;
+	broadcastStats broadcast;
+	linkPowerStats power;
+	packetPoolStats pool;
+	getMeshStats(&mesh);
+	getRouteStats(&route);
+	getSendQueueStats(&queue);
+	getBroadcastStats(&broadcast);
+	getLinkPowerStats(&power);
+	getPacketPoolStats(&pool);
+
+	Serial.println("++++++++++++++++++++++++++++++++");
+	Serial.printf("Mesh statistics after %lu s:\n", millis() / 1000);
+	Serial.println("Package type       sent   received");
+	for (int type = 0; type < MESH_STATS_TYPES; type++)
+	{
+		Serial.printf("%-12s %10lu %10lu\n", typeNames[type], (unsigned long)mesh.txFrames[type], (unsigned long)mesh.rxFrames[type]);
+	}
+	Serial.printf("CAD: %lu runs, %lu busy, %lu packages given up\n",
+				  (unsigned long)mesh.cadRuns, (unsigned long)mesh.cadBusy, (unsigned long)mesh.cadFailed);
+	Serial.printf("Send queue: %lu queued, %lu sent, %lu dropped as full, %lu deferred, high water %d\n",
+				  (unsigned long)queue.queued, (unsigned long)queue.sent, (unsigned long)queue.dropped, (unsigned long)queue.deferred, queue.highWater);
+	Serial.printf("Forwarded: %lu unicast, %lu broadcast, %lu without route\n",
+				  (unsigned long)mesh.forwarded, (unsigned long)mesh.broadcastsForwarded, (unsigned long)mesh.noRoute);
+	Serial.printf("Link ACK: %lu acked, %lu retries, %lu failed, %lu rerouted, %lu not sent and queued again\n",
+				  (unsigned long)queue.acked, (unsigned long)queue.retries, (unsigned long)queue.ackFailed, (unsigned long)queue.rerouted, (unsigned long)queue.unsent);
+	Serial.printf("Broadcasts: %lu received, %lu duplicates\n", (unsigned long)broadcast.received, (unsigned long)broadcast.duplicates);
+	Serial.printf("TX power: %lu full, %lu reduced\n", (unsigned long)power.fullPower, (unsigned long)power.reduced);
+	Serial.printf("Map: %d nodes, %lu added, %lu removed, %lu first hop changes\n",
+				  route.mapSize, (unsigned long)route.added, (unsigned long)route.removed, (unsigned long)route.changed);
+	Serial.printf("RX: %lu packages, callback avg %lu us, max %lu us, %lu dropped by the inbox\n",
+				  (unsigned long)mesh.rxHandled, mesh.rxHandled != 0 ? (unsigned long)(mesh.rxTimeSum / mesh.rxHandled) : 0UL,
+				  (unsigned long)mesh.rxTimeMax, (unsigned long)getLoraRxOverflows());
+	Serial.printf("Package buffers: %lu bytes copied, %d in use, high water %d, %lu times none free\n",
+				  (unsigned long)mesh.rxCopied, pool.inUse, pool.highWater, (unsigned long)pool.failed);
+	Serial.println("++++++++++++++++++++++++++++++++");
+}
+
+#if MESH_TRACE
+/**
+ * Write the trace ring in binary format
+ * A traceHeader followed by the records from the oldest to the newest,
+ * trace_timeline.py turns it into a timeline
+ * @param clear
+ * 		True to empty the ring after the dump
+ */
+static void dumpTrace(bool clear)
+{
+	pauseTrace(true);
+	traceHeader header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(traceRecord);
+	header.count = getTraceCount();
+	header.clockHz = getTraceClock();
+	Serial.write((uint8_t *)&header, sizeof(traceHeader));
+	for (uint16_t idx = 0; idx < header.count; idx++)
+	{
+		traceRecord record;
+		getTraceRecord(idx, &record);
+		Serial.write((uint8_t *)&record, sizeof(traceRecord));
+	}
+	Serial.flush();
+	if (clear)
+	{
+		clearTrace();
+	}
+	pauseTrace(false);
+}
+#endif
+
 /**
  * Read incoming Console data and handle it
  */
@@ -34,7 +113,7 @@ void handleConsoleData(void)
 		String command = args[0].substring(1);
 		if (command.startsWith("help"))
 		{
-			Serial.print("Commands: /help /join /nick /nodes /names /restart\n");
+			Serial.print("Commands: /help /join /nick /nodes /names /stats /trace /restart\n");
 		}
 		else if ((command == "join" || command == "nick") && argIndex >= 1)
 		{
@@ -70,11 +149,12 @@ void handleConsoleData(void)
 			Serial.println("Mesh map:");
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
-				uint32_t nodeId[48];
-				uint32_t firstHop[48];
-				uint8_t numHops[48];
-				uint8_t numElements = numOfNodes();
-				for (uint8_t idx = 0; idx < numElements; idx++)
+				// Static, the map can be too large for the stack of the loop task
+				static uint32_t nodeId[MAX_NODES];
+				static uint32_t firstHop[MAX_NODES];
+				static uint8_t numHops[MAX_NODES];
+				uint16_t numElements = numOfNodes();
+				for (uint16_t idx = 0; idx < numElements; idx++)
 				{
 					getNode(idx, nodeId[idx], firstHop[idx], numHops[idx]);
 				}
@@ -105,13 +185,13 @@ void handleConsoleData(void)
 		{
 			Serial.println("++++++++++++++++++++++++++++++++");
 			Serial.println("Known nick names:");
-			namesList *nickName;
-			for (uint8_t idx = 0; idx < _numOfNodes; idx++)
+			uint32_t nickId;
+			char nickName[NODE_NAME_SIZE];
+			for (uint16_t idx = 0; idx < _numOfNodes; idx++)
 			{
-				nickName = getNodeNameByIndex(idx);
-				if (nickName != NULL)
+				if (getNodeNameByIndex(idx, nickId, nickName))
 				{
-					Serial.printf("'%08X' --> '%s'\n", nickName->nodeId, nickName->name);
+					Serial.printf("'%08X' --> '%s'\n", nickId, nickName);
 				}
 				else
 				{
@@ -120,6 +200,18 @@ void handleConsoleData(void)
 			}
 			Serial.println("++++++++++++++++++++++++++++++++");
 		}
+		else if (command == "stats")
+		{
+			printStats();
+		}
+		else if (command == "trace")
+		{
+#if MESH_TRACE
+			dumpTrace(args[1] == "clear");
+#else
+			Serial.println("Tracing is off, build with -DMESH_TRACE=1");
+#endif
+		}
 		else
 		{
 			Serial.println("Unknown command '" + command + "'");
@@ -145,12 +237,13 @@ void handleConsoleData(void)
  */
 void sendConsoleData(uint32_t receiver, uint8_t type, char *data, size_t len)
 {
+	char nodeName[NODE_NAME_SIZE];
 	switch (type)
 	{
 	case CHAT_TYPE:
-		if (getNodeName(receiver) != NULL)
+		if (getNodeName(receiver, nodeName))
 		{
-			snprintf(consoleOut, 512, "<%s>%s\n", getNodeName(receiver), data);
+			snprintf(consoleOut, 512, "<%s>%s\n", nodeName, data);
 		}
 		else
 		{
@@ -158,9 +251,9 @@ void sendConsoleData(uint32_t receiver, uint8_t type, char *data, size_t len)
 		}
 		break;
 	case LOCATION_TYPE:
-		if (getNodeName(receiver) != NULL)
+		if (getNodeName(receiver, nodeName))
 		{
-			snprintf(consoleOut, 512, "<%s> Loc: %s\n", getNodeName(receiver), data);
+			snprintf(consoleOut, 512, "<%s> Loc: %s\n", nodeName, data);
 		}
 		else
 		{
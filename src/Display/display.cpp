@@ -65,10 +65,12 @@ void dispWriteHeader(void)
 
 /**
  * Add a line to the display buffer
- * @param newLine
+ * @param prefix
+ * 		Text shown in front of the line, can be empty
+ * @param line
  * 		Pointer to char array with the new line
  */
-void dispAddLine(char * line)
+void dispAddLine(const char *prefix, const char *line)
 {
 	myLog_d("Adding line %d", currentLine);
 
@@ -82,7 +84,7 @@ void dispAddLine(char * line)
 		}
 		currentLine--;
 	}
-	snprintf(buffer[currentLine], 32, "%s", line);
+	snprintf(buffer[currentLine], 32, "%s%s", prefix, line);
 
 	if (currentLine != NUM_OF_LINES)
 	{
@@ -1,6 +1,6 @@
 void initDisplay(void);
 void dispWriteHeader(void);
-void dispAddLine(char *line);
+void dispAddLine(const char *prefix, const char *line);
 void dispShow(void);
 void dispWrite(String text, int x, int y);
 void dispUpdate(void);
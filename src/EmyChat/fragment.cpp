@@ -0,0 +1,371 @@
+#include "main.h"
+
+/**
+ * Fragmentation of messages that do not fit into one LoRa package
+ *
+ * The message (type byte and text) is split into parts of FRAG_PAYLOAD_SIZE bytes,
+ * each part is sent as its own package:
+ * 	[FRAGMENT_TYPE] [message ID] [fragment index] [number of fragments] [part of the message]
+ * All fragments are queued at once and the mesh task sends them back to back.
+ *
+ * The receiver collects the fragments in a reassembly slot. If no new fragment
+ * arrives for FRAG_GAP_TIME it asks the sender for the missing ones:
+ * 	[FRAGMENT_NACK_TYPE] [message ID] [bit mask of the missing fragments, 4 bytes]
+ * The sender keeps its last FRAG_TX_SLOTS messages to answer these requests.
+ * Incomplete messages are dropped after FRAG_TIMEOUT.
+ * A completed message keeps its slot until FRAG_TIMEOUT as well, fragments that arrive
+ * late (sent again for another receiver of a broadcast or after a lost link ACK) are
+ * then recognized as duplicates and do not start the message again.
+ */
+
+/**
+ * A message that is being reassembled
+ */
+struct fragRxSlot
+{
+	/** Node ID of the sender, 0 if the slot is free */
+	uint32_t fromID;
+	/** Message ID of the sender */
+	uint8_t msgId;
+	/** Number of fragments */
+	uint8_t count;
+	/** Bit mask of the received fragments, all bits set when the message is complete */
+	uint32_t received;
+	/** Size of the message, known after the last fragment arrived */
+	uint16_t size;
+	/** Time (millis) when the first fragment arrived */
+	time_t firstSeen;
+	/** Time (millis) when the last fragment arrived or missing fragments were requested */
+	time_t lastSeen;
+	/** Number of requests for missing fragments */
+	uint8_t nacks;
+	/** The message */
+	uint8_t data[FRAG_MAX_MSG_SIZE];
+};
+
+/**
+ * A sent message, kept to send missing fragments again
+ */
+struct fragTxSlot
+{
+	/** Node ID of the receiver, 0 for a broadcast */
+	uint32_t receiver;
+	/** Message ID */
+	uint8_t msgId;
+	/** Number of fragments */
+	uint8_t count;
+	/** Size of the message, 0 if the slot is free */
+	uint16_t size;
+	/** Time (millis) when the message was sent */
+	time_t sentAt;
+	/** Bit mask of the fragments sent again since resentAt, all receivers of a broadcast get them with one retransmission */
+	uint32_t resent;
+	/** Time (millis) of the first retransmission */
+	time_t resentAt;
+	/** The message */
+	uint8_t data[FRAG_MAX_MSG_SIZE];
+};
+
+/** Messages that are being reassembled */
+fragRxSlot fragRx[FRAG_RX_SLOTS];
+/** Sent messages */
+fragTxSlot fragTx[FRAG_TX_SLOTS];
+/** Next entry of fragTx to be replaced */
+uint8_t fragTxNext = 0;
+/** Message ID of the next fragmented message */
+uint8_t fragMsgId = 0;
+
+/**
+ * Get the bit mask of all fragments of a message
+ * @param count
+ * 		Number of fragments
+ * @return uint32_t
+ * 		Bit mask with one bit per fragment
+ */
+static inline uint32_t allFragments(uint8_t count)
+{
+	return count >= 32 ? 0xFFFFFFFF : (((uint32_t)1 << count) - 1);
+}
+
+/**
+ * Check if a reassembly slot holds a completed message
+ * @param slot
+ * 		The reassembly slot
+ * @return bool
+ * 		True if all fragments of the message arrived
+ */
+static inline bool fragComplete(fragRxSlot *slot)
+{
+	return slot->received == allFragments(slot->count);
+}
+
+/**
+ * Queue one fragment of a sent message
+ * The route is looked up for each fragment, a retransmission takes the current route.
+ * @param slot
+ * 		The sent message
+ * @param index
+ * 		Index of the fragment
+ * @return bool
+ * 		True if the fragment was queued
+ */
+static bool queueFragment(fragTxSlot *slot, uint8_t index)
+{
+	dataMsg outData;
+	setRoute(slot->receiver, &outData);
+
+	uint16_t offset = index * FRAG_PAYLOAD_SIZE;
+	uint16_t partSize = (slot->size - offset) < FRAG_PAYLOAD_SIZE ? (slot->size - offset) : FRAG_PAYLOAD_SIZE;
+	outData.data[0] = FRAGMENT_TYPE;
+	outData.data[1] = slot->msgId;
+	outData.data[2] = index;
+	outData.data[3] = slot->count;
+	memcpy(&outData.data[FRAG_HEADER_SIZE], &slot->data[offset], partSize);
+	if (!addSendRequest(&outData, DATA_HEADER_SIZE + FRAG_HEADER_SIZE + partSize))
+	{
+		myLog_e("Queuing fragment %d failed", index);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Send a message that is too large for one package in fragments
+ * @param receiver
+ * 		Node ID of the receiver, 0 for a broadcast
+ * @param message
+ * 		The message, type byte and text
+ * @param msgSize
+ * 		Size of the message, max FRAG_MAX_MSG_SIZE
+ */
+void sendFragments(uint32_t receiver, uint8_t *message, uint16_t msgSize)
+{
+	if (msgSize > FRAG_MAX_MSG_SIZE)
+	{
+		myLog_e("Message with %d bytes is too large", msgSize);
+		return;
+	}
+
+	// The oldest message cannot be requested again anymore
+	fragTxSlot *slot = &fragTx[fragTxNext];
+	fragTxNext = (fragTxNext + 1) % FRAG_TX_SLOTS;
+	slot->receiver = receiver;
+	slot->msgId = fragMsgId++;
+	slot->count = (msgSize + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+	slot->size = msgSize;
+	slot->sentAt = millis();
+	slot->resent = 0;
+	memcpy(slot->data, message, msgSize);
+
+	myLog_d("Sending %d bytes in %d fragments", msgSize, slot->count);
+	for (uint8_t index = 0; index < slot->count; index++)
+	{
+		queueFragment(slot, index);
+	}
+}
+
+/**
+ * Add a received fragment to its message
+ * @param fromID
+ * 		Node ID of the sender
+ * @param fragment
+ * 		The fragment, starting with FRAGMENT_TYPE
+ * @param size
+ * 		Size of the fragment
+ * @param message
+ * 		Buffer for the complete message, must hold FRAG_MAX_MSG_SIZE + 1 bytes
+ * @return uint16_t
+ * 		Size of the message if this fragment completed it, else 0
+ */
+uint16_t addFragment(uint32_t fromID, uint8_t *fragment, uint16_t size, uint8_t *message)
+{
+	if (size <= FRAG_HEADER_SIZE)
+	{
+		return 0;
+	}
+	uint8_t msgId = fragment[1];
+	uint8_t index = fragment[2];
+	uint8_t count = fragment[3];
+	uint16_t partSize = size - FRAG_HEADER_SIZE;
+	uint16_t offset = index * FRAG_PAYLOAD_SIZE;
+	// All fragments but the last are full
+	if ((count == 0) || (count > FRAG_MAX_COUNT) || (index >= count) ||
+		((index < count - 1) && (partSize != FRAG_PAYLOAD_SIZE)) ||
+		((offset + partSize) > FRAG_MAX_MSG_SIZE))
+	{
+		myLog_e("Invalid fragment from %08X", fromID);
+		return 0;
+	}
+
+	// Find the message, or take a free slot, or a completed message, or replace the slot that waits longest
+	fragRxSlot *slot = NULL;
+	fragRxSlot *oldest = &fragRx[0];
+	for (int idx = 0; idx < FRAG_RX_SLOTS; idx++)
+	{
+		fragRxSlot *check = &fragRx[idx];
+		if ((check->fromID == fromID) && (check->msgId == msgId) && (check->count == count))
+		{
+			slot = check;
+			break;
+		}
+		if ((oldest->fromID == 0) || (check->fromID == 0))
+		{
+			oldest = (oldest->fromID == 0) ? oldest : check;
+		}
+		else if (fragComplete(oldest) != fragComplete(check))
+		{
+			oldest = fragComplete(oldest) ? oldest : check;
+		}
+		else if (check->lastSeen < oldest->lastSeen)
+		{
+			oldest = check;
+		}
+	}
+	if (slot == NULL)
+	{
+		slot = oldest;
+		if ((slot->fromID != 0) && !fragComplete(slot))
+		{
+			myLog_e("Reassembly buffers full, dropping message from %08X", slot->fromID);
+		}
+		slot->fromID = fromID;
+		slot->msgId = msgId;
+		slot->count = count;
+		slot->received = 0;
+		slot->size = 0;
+		slot->firstSeen = millis();
+		slot->nacks = 0;
+	}
+
+	if ((slot->received & ((uint32_t)1 << index)) != 0)
+	{
+		// Duplicate, fragment was requested more than once or the message is already complete
+		return 0;
+	}
+	memcpy(&slot->data[offset], &fragment[FRAG_HEADER_SIZE], partSize);
+	slot->received |= (uint32_t)1 << index;
+	slot->lastSeen = millis();
+	if (index == count - 1)
+	{
+		slot->size = offset + partSize;
+	}
+
+	if (!fragComplete(slot))
+	{
+		return 0;
+	}
+	uint16_t msgSize = slot->size;
+	memcpy(message, slot->data, msgSize);
+	message[msgSize] = 0;
+	myLog_d("Message with %d bytes from %08X complete", msgSize, fromID);
+	return msgSize;
+}
+
+/**
+ * Send the fragments again that a receiver is missing
+ * @param fromID
+ * 		Node ID of the receiver that requests the fragments
+ * @param nack
+ * 		The request, starting with FRAGMENT_NACK_TYPE
+ * @param size
+ * 		Size of the request
+ */
+void handleFragmentNack(uint32_t fromID, uint8_t *nack, uint16_t size)
+{
+	if (size < 6)
+	{
+		return;
+	}
+	uint8_t msgId = nack[1];
+	uint32_t missing;
+	memcpy(&missing, &nack[2], 4);
+
+	for (int idx = 0; idx < FRAG_TX_SLOTS; idx++)
+	{
+		fragTxSlot *slot = &fragTx[idx];
+		if ((slot->size == 0) || (slot->msgId != msgId) || ((slot->receiver != fromID) && (slot->receiver != 0)))
+		{
+			continue;
+		}
+		if ((millis() - slot->resentAt) >= FRAG_GAP_TIME)
+		{
+			slot->resent = 0;
+			slot->resentAt = millis();
+		}
+		// Fragments that were sent again a moment ago for another receiver of the broadcast are not sent again
+		missing &= allFragments(slot->count) & ~slot->resent;
+		slot->resent |= missing;
+		myLog_d("%08X requests fragments %08X of message %d", fromID, missing, msgId);
+		for (uint8_t index = 0; index < slot->count; index++)
+		{
+			if (missing & ((uint32_t)1 << index))
+			{
+				queueFragment(slot, index);
+			}
+		}
+		return;
+	}
+	myLog_d("Message %d requested by %08X is gone", msgId, fromID);
+}
+
+/**
+ * Ask the sender of an incomplete message for the missing fragments
+ * @param slot
+ * 		The incomplete message
+ */
+static void sendFragmentNack(fragRxSlot *slot)
+{
+	dataMsg outData;
+	if (!setRoute(slot->fromID, &outData))
+	{
+		myLog_e("No route to %08X to request missing fragments", slot->fromID);
+		return;
+	}
+	uint32_t missing = allFragments(slot->count) & ~slot->received;
+	outData.data[0] = FRAGMENT_NACK_TYPE;
+	outData.data[1] = slot->msgId;
+	memcpy(&outData.data[2], &missing, 4);
+	if (!addSendRequest(&outData, DATA_HEADER_SIZE + 6))
+	{
+		myLog_e("Queuing request for missing fragments failed");
+	}
+}
+
+/**
+ * Request missing fragments and drop incomplete messages that timed out
+ * Called from the loop
+ */
+void checkFragments(void)
+{
+	for (int idx = 0; idx < FRAG_RX_SLOTS; idx++)
+	{
+		fragRxSlot *slot = &fragRx[idx];
+		if (slot->fromID == 0)
+		{
+			continue;
+		}
+		if ((millis() - slot->firstSeen) >= FRAG_TIMEOUT)
+		{
+			if (!fragComplete(slot))
+			{
+				myLog_e("Message from %08X incomplete, fragments %08X missing", slot->fromID, allFragments(slot->count) & ~slot->received);
+			}
+			slot->fromID = 0;
+		}
+		else if (!fragComplete(slot) && ((millis() - slot->lastSeen) >= FRAG_GAP_TIME) && (slot->nacks < FRAG_NACK_RETRIES))
+		{
+			sendFragmentNack(slot);
+			slot->nacks++;
+			slot->lastSeen = millis();
+		}
+	}
+
+	for (int idx = 0; idx < FRAG_TX_SLOTS; idx++)
+	{
+		// Receivers have given up on the message
+		if ((fragTx[idx].size != 0) && ((millis() - fragTx[idx].sentAt) >= FRAG_TIMEOUT))
+		{
+			fragTx[idx].size = 0;
+		}
+	}
+}
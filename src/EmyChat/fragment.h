@@ -0,0 +1,38 @@
+#include <Arduino.h>
+
+/** Max size of a message (type and text) that is sent in fragments, leaves room for the BLE and console output header, can be set in platformio.ini */
+#ifndef FRAG_MAX_MSG_SIZE
+#define FRAG_MAX_MSG_SIZE 500
+#endif
+/** Number of messages that can be reassembled at the same time, can be set in platformio.ini */
+#ifndef FRAG_RX_SLOTS
+#define FRAG_RX_SLOTS 4
+#endif
+/** Number of sent messages kept to answer requests for missing fragments, can be set in platformio.ini */
+#ifndef FRAG_TX_SLOTS
+#define FRAG_TX_SLOTS 2
+#endif
+/** Time in ms an incomplete message is kept */
+#define FRAG_TIMEOUT 60000
+/** Time in ms without a new fragment before missing fragments are requested */
+#define FRAG_GAP_TIME 8000
+/** Number of requests for missing fragments of one message */
+#define FRAG_NACK_RETRIES 2
+
+/** Size of the data of a single LoRa package, type byte included */
+#define LORA_MAX_DATA_SIZE (255 - DATA_HEADER_SIZE)
+/** Fragment header: [FRAGMENT_TYPE] [message ID] [fragment index] [number of fragments] */
+#define FRAG_HEADER_SIZE 4
+/** Size of the message part in one fragment */
+#define FRAG_PAYLOAD_SIZE (LORA_MAX_DATA_SIZE - FRAG_HEADER_SIZE)
+/** Max number of fragments of one message */
+#define FRAG_MAX_COUNT ((FRAG_MAX_MSG_SIZE + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE)
+
+#if FRAG_MAX_COUNT > 32
+#error "FRAG_MAX_MSG_SIZE is too large, a message can have at most 32 fragments"
+#endif
+
+void sendFragments(uint32_t receiver, uint8_t *message, uint16_t msgSize);
+uint16_t addFragment(uint32_t fromID, uint8_t *fragment, uint16_t size, uint8_t *message);
+void handleFragmentNack(uint32_t fromID, uint8_t *nack, uint16_t size);
+void checkFragments(void);
@@ -98,27 +98,48 @@ void onNodesListChange(void);
 /** Structure with Mesh event callbacks */
 static MeshEvents_t MeshEvents;
 
-/** Buffer for incoming LoRa data */
-char loraRX[256];
-/** NodeID of the LoRa sender */
-uint32_t loraSenderID;
-/** Size of received data */
-uint8_t loraDataSize;
+/**
+ * One received LoRa message waiting for the application
+ */
+struct loraRxFrame
+{
+	/** Package buffer of the mesh code that holds the message */
+	meshPacket *packet;
+	/** Received data inside the package buffer, null terminated */
+	char *data;
+	/** NodeID of the LoRa sender */
+	uint32_t fromID;
+	/** Size of received data */
+	uint16_t size;
+	/** Signal strength of the message */
+	int16_t rssi;
+	/** Signal to noise ratio of the message */
+	int8_t snr;
+};
+
+/** One slot stays empty to tell a full ring from an empty one */
+#define LORA_RX_RING_SLOTS (LORA_RX_QUEUE_SIZE + 1)
+
+/** Ring of received messages, filled by the mesh task, emptied by loop() */
+loraRxFrame loraRxRing[LORA_RX_RING_SLOTS];
+/** Index of the oldest message, only written by loop() */
+volatile uint16_t loraRxHead = 0;
+/** Index of the next free slot, only written by the mesh task */
+volatile uint16_t loraRxTail = 0;
+/** Number of messages dropped because the ring was full */
+volatile uint32_t loraRxOverflows = 0;
 
 /** Flag if the Mesh map has changed */
 boolean nodesListChanged = false;
 
-/** Flag if a new message arrived */
-boolean newLoRaData = false;
-
 /** Node ID of the selected receiver node */
-uint32_t nodeId[48];
+uint32_t nodeId[MAX_NODES];
 /** First hop ID of the selected receiver node */
-uint32_t firstHop[48];
+uint32_t firstHop[MAX_NODES];
 /** Number of hops to the selected receiver node */
-uint8_t numHops[48];
+uint8_t numHops[MAX_NODES];
 /** Number of nodes in the map */
-uint8_t numElements;
+uint16_t numElements;
 
 /**
  * Initialize the LoRa HW
@@ -129,8 +150,8 @@ bool initLoRa(void)
 {
 	bool initResult = true;
 
-	// Initialize the mesh node name list
-	initNodeNames(MAX_NODES);
+	// Prepare the chat text codec
+	initTextCodec();
 
 #ifdef USE_RFM95
 ////////////////////////////
@@ -183,63 +204,150 @@ bool initLoRa(void)
 	return initResult;
 }
 
+/** Reassembled message, null terminated */
+static char fullMsg[FRAG_MAX_MSG_SIZE + 1];
+/** Decompressed message, null terminated */
+static char expandedMsg[FRAG_MAX_MSG_SIZE + 1];
+
 /**
- * Handle LoRa data
+ * Handle one complete message
+ * @param fromID
+ * 		NodeID of the LoRa sender
+ * @param data
+ * 		The message, null terminated
+ * @param size
+ * 		Size of the message
  */
-void handleLoraData(void)
+static void handleLoraMessage(uint32_t fromID, char *data, uint16_t size)
 {
-	// char *dispNodeName = getNodeName(loraSenderID);
-	char tempName[17];
+	char tempName[NODE_NAME_SIZE];
 
-	myLog_v("Got type 0x%0X", loraRX[0]);
-	switch (loraRX[0])
+	myLog_v("Got type 0x%0X", data[0]);
+	if (data[0] & COMPRESSED_FLAG)
+	{
+		// Expand the text, it is never larger than the uncompressed message
+		uint16_t textLen = decompressText((uint8_t *)&data[1], size - 1, &expandedMsg[1], FRAG_MAX_MSG_SIZE - 1);
+		if (textLen == 0)
+		{
+			myLog_e("Invalid compressed message from %08X", fromID);
+			return;
+		}
+		expandedMsg[0] = data[0] & ~COMPRESSED_FLAG;
+		size = textLen + 1;
+		expandedMsg[size] = 0;
+		data = expandedMsg;
+	}
+	switch (data[0])
 	{
 	case CHAT_TYPE: // Chat message
 		// BLE output
-		sendBleData(loraSenderID, CHAT_TYPE, &loraRX[1], loraDataSize - 1);
+		sendBleData(fromID, CHAT_TYPE, &data[1], size - 1);
 
 		// Console output
-		sendConsoleData(loraSenderID, CHAT_TYPE, &loraRX[1], loraDataSize - 1);
+		sendConsoleData(fromID, CHAT_TYPE, &data[1], size - 1);
 
 #ifdef HAS_DISPLAY
 		// Update display
 		dispWriteHeader();
 		// // Display is very small, remove @ tags
-		if (loraRX[1] == '@')
+		// The message is not changed, the send queue can share its buffer
+		if (data[1] == '@')
 		{
-			// Remove the @ tag
+			// Replace the @ tag by a !
 			int txtStart;
-			for (txtStart = 1; txtStart < loraDataSize - 1; txtStart++)
+			for (txtStart = 1; txtStart < size - 1; txtStart++)
 			{
-				if (loraRX[txtStart] == 0x20)
+				if (data[txtStart] == 0x20)
 				{
 					break;
 				}
 			}
-			loraRX[1] = '!';
-			memcpy(&loraRX[2], &loraRX[txtStart + 1], loraDataSize - 1);
+			dispAddLine("!", &data[txtStart + 1]);
+		}
+		else
+		{
+			dispAddLine("", &data[1]);
 		}
-
-		dispAddLine(&loraRX[1]);
 		dispShow();
 #endif
 		break;
 	case LOCATION_TYPE: // Location message
 		// BLE output
-		sendBleData(loraSenderID, LOCATION_TYPE, &loraRX[1], loraDataSize - 1);
+		sendBleData(fromID, LOCATION_TYPE, &data[1], size - 1);
 
 		/// \todo Is the location message required to show on the console?
 		// Console output
-		// sendConsoleData(loraSenderID, LOCATION_TYPE, &loraRX[1], loraDataSize - 1);
+		// sendConsoleData(fromID, LOCATION_TYPE, &data[1], size - 1);
 		break;
 	case NAME_TYPE: // Nickname message
-		snprintf(tempName, 17, &loraRX[1]);
-		// Add name to local names list
-		addNodeName(loraSenderID, tempName);
+		snprintf(tempName, NODE_NAME_SIZE, &data[1]);
+		// Keep the name in the node table, the name of a node that is not yet in the map is cached until it is added
+		if (!setNodeName(fromID, tempName))
+		{
+			myLog_d("Node %08X is not in the map yet, name cached", fromID);
+		}
 		// Send name of node to the BLE app
-		sendBleData(loraSenderID, NAME_TYPE, &loraRX[1], loraDataSize - 1);
+		sendBleData(fromID, NAME_TYPE, &data[1], size - 1);
 		break;
+	case FRAGMENT_NACK_TYPE: // Request for missing fragments
+		handleFragmentNack(fromID, (uint8_t *)data, size);
+		break;
+	}
+}
+
+/**
+ * Handle one received LoRa package
+ * @param frame
+ * 		The package
+ */
+static void handleLoraFrame(loraRxFrame *frame)
+{
+	if (frame->data[0] == FRAGMENT_TYPE)
+	{
+		// Handle the message when its last missing fragment arrived
+		uint16_t msgSize = addFragment(frame->fromID, (uint8_t *)frame->data, frame->size, (uint8_t *)fullMsg);
+		if (msgSize != 0)
+		{
+			handleLoraMessage(frame->fromID, fullMsg, msgSize);
+		}
+		return;
 	}
+	handleLoraMessage(frame->fromID, frame->data, frame->size);
+}
+
+/**
+ * Handle all received LoRa messages
+ */
+void handleLoraData(void)
+{
+	while (loraRxHead != loraRxTail)
+	{
+		handleLoraFrame(&loraRxRing[loraRxHead]);
+		releasePacket(loraRxRing[loraRxHead].packet);
+		// Slot must not be released before the message is handled
+		__sync_synchronize();
+		loraRxHead = (loraRxHead + 1) % LORA_RX_RING_SLOTS;
+	}
+}
+
+/**
+ * Get the number of received messages waiting for the application
+ * @return uint16_t
+ * 		Number of messages
+ */
+uint16_t loraRxCount(void)
+{
+	return (loraRxTail + LORA_RX_RING_SLOTS - loraRxHead) % LORA_RX_RING_SLOTS;
+}
+
+/**
+ * Get the number of received messages that were dropped because the application was too slow
+ * @return uint32_t
+ * 		Number of dropped messages
+ */
+uint32_t getLoraRxOverflows(void)
+{
+	return loraRxOverflows;
 }
 
 /**
@@ -294,8 +402,86 @@ void handleNodesListChanges(void)
 	}
 }
 
+/**
+ * Fill the header of a package for a receiver
+ * @param receiver
+ * 			Node ID of the receiver, 0 for a broadcast
+ * @param outData
+ * 			Package to fill
+ * @return bool
+ * 			True if the package goes to the receiver,
+ * 			false if it is sent as broadcast because there is no route to the receiver
+ */
+bool setRoute(uint32_t receiver, dataMsg *outData)
+{
+	nodesList routeToNode;
+
+	// Prepare data
+	outData->mark1 = 'L';
+	outData->mark2 = 'o';
+	outData->mark3 = 'R';
+
+	if (receiver != 0)
+	{
+		if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+		{
+			bool hasRoute = getRoute(receiver, &routeToNode);
+			xSemaphoreGive(accessNodeList);
+			if (hasRoute && (routeToNode.firstHop != 0))
+			{
+				outData->dest = routeToNode.firstHop;
+				outData->from = routeToNode.nodeId;
+				outData->orig = deviceID;
+				outData->type = LORA_FORWARD;
+				myLog_d("Queuing msg to hop to %08X over %08X", outData->from, outData->dest);
+				return true;
+			}
+			if (hasRoute)
+			{
+				outData->dest = routeToNode.nodeId;
+				outData->from = outData->orig = deviceID;
+				outData->type = LORA_DIRECT;
+				myLog_d("Queuing msg direct to %08X", outData->dest);
+				return true;
+			}
+			myLog_e("%08X is not in the map, sending as broadcast", receiver);
+		}
+		else
+		{
+			myLog_e("Could not access the nodes list, sending as broadcast");
+		}
+	}
+	outData->dest = getNextBroadcastID();
+	outData->from = outData->orig = deviceID;
+	outData->type = LORA_BROADCAST;
+	return receiver == 0;
+}
+
+/** Message that is sent, type and text */
+static uint8_t txMsg[FRAG_MAX_MSG_SIZE];
+
+/**
+ * Check if the receivers of a chat message can expand compressed text
+ * Only direct nodes advertise their protocol version, text to nodes that were never direct is not compressed.
+ * @param receiver
+ * 			Node ID of the receiver, 0 for a broadcast
+ * @return bool
+ * 			True if all receivers understand COMPRESSED_FLAG
+ */
+static bool canExpandText(uint32_t receiver)
+{
+	bool result = false;
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+	{
+		result = ((receiver == 0) ? mapProtocol() : getNodeProtocol(receiver)) >= COMPRESSION_PROTOCOL;
+		xSemaphoreGive(accessNodeList);
+	}
+	return result;
+}
+
 /**
  * Send data over LoRa
+ * Data that does not fit into one package is sent in fragments.
  * @param receiver
  * 			Node ID the data was received from
  * @param type
@@ -311,15 +497,14 @@ void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len)
 	/** Structure for outgoing data */
 	dataMsg outData;
 
-	nodesList routeToNode;
-
 	// Release access to nodes list
 	xSemaphoreGive(accessNodeList);
 
-	// Prepare data
-	outData.mark1 = 'L';
-	outData.mark2 = 'o';
-	outData.mark3 = 'R';
+	if (len > (FRAG_MAX_MSG_SIZE - 1))
+	{
+		myLog_e("Data with %d bytes is too large, sending only %d bytes", len, FRAG_MAX_MSG_SIZE - 1);
+		len = FRAG_MAX_MSG_SIZE - 1;
+	}
 
 	uint32_t nodeIdFromName = 0;
 
@@ -328,9 +513,6 @@ void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len)
 	case LOCATION_TYPE:
 	case NAME_TYPE:
 		// Location or Name message, send as broadcast
-		outData.dest = getNextBroadcastID();
-		outData.from = outData.orig = deviceID;
-		outData.type = LORA_BROADCAST;
 		myLog_d("Sending message type 0x%0X with content %s", type, data);
 		break;
 	default:
@@ -339,22 +521,26 @@ void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len)
 		{
 			myLog_v("Found @, try to get nodeID");
 			// Try to get the node ID from the @ name
-			String tempString = String(data);
-			int endIdx = tempString.indexOf(" ");
-			tempString = tempString.substring(1, endIdx);
-			myLog_v("Found @ name '%s'", tempString.c_str());
-			nodeIdFromName = getNodeIdFromName((char *)tempString.c_str());
+			char atName[NODE_NAME_SIZE];
+			size_t nameLen = 0;
+			while (((nameLen + 1) < len) && (data[nameLen + 1] != ' ') && (data[nameLen + 1] != 0) && (nameLen < (NODE_NAME_SIZE - 1)))
+			{
+				atName[nameLen] = data[nameLen + 1];
+				nameLen++;
+			}
+			atName[nameLen] = 0;
+			myLog_v("Found @ name '%s'", atName);
+			nodeIdFromName = getNodeIdFromName(atName);
 			if (nodeIdFromName != 0)
 			{
 				// Found the name in the list, use the matching node ID
-				outData.dest = nodeIdFromName;
-				myLog_d("Found nodeID %08X from @ name %s", nodeIdFromName, tempString.c_str());
+				myLog_d("Found nodeID %08X from @ name %s", nodeIdFromName, atName);
 			}
 			else
 			{
 				// Assume the @ name is the node ID
 				// Not a registered name, try to get the number
-				sscanf(tempString.c_str(), "%08X", &nodeIdFromName);
+				sscanf(atName, "%08X", &nodeIdFromName);
 				if (nodeIdFromName != 0)
 				{
 					myLog_d("Got nodeID from sscanf '%08X'", nodeIdFromName);
@@ -368,48 +554,44 @@ void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len)
 		if (nodeIdFromName == 0)
 		{
 			// No nodeID found, send as broadcast
-			outData.dest = getNextBroadcastID();
-			outData.from = outData.orig = deviceID;
-			outData.type = LORA_BROADCAST;
 			myLog_d("Sending chat as broadcast");
 		}
-		else
-		{
-			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
-			{
-				getRoute(nodeIdFromName, &routeToNode);
-				xSemaphoreGive(accessNodeList);
-				if (routeToNode.firstHop != 0)
-				{
-					outData.dest = routeToNode.firstHop;
-					outData.from = routeToNode.nodeId;
-					outData.orig = deviceID;
-					outData.type = LORA_FORWARD;
-					myLog_d("Queuing msg to hop to %08X over %08X", outData.from, outData.dest);
-				}
-				else
-				{
-					outData.dest = routeToNode.nodeId;
-					outData.from = outData.orig = deviceID;
-					outData.type = LORA_DIRECT;
-					myLog_d("Queuing msg direct to %08X", outData.dest);
-				}
-			}
-			else
-			{
-				myLog_e("Could not access the nodes list, sending as broadcast");
-				outData.dest = getNextBroadcastID();
-				outData.from = outData.orig = deviceID;
-				outData.type = LORA_BROADCAST;
-			}
-		}
 		break;
 	}
-	outData.data[0] = type;
-	memcpy(&outData.data[1], data, len);
-	int dataLen = DATA_HEADER_SIZE + len + 1;
+
+	txMsg[0] = type;
+	uint16_t msgSize = len + 1;
+#if CHAT_COMPRESSION == 1
+	// Send the text compressed if it gets smaller and all receivers can expand it
+	uint16_t packedLen = 0;
+	if ((type == CHAT_TYPE) && canExpandText(nodeIdFromName))
+	{
+		packedLen = compressText(data, len, &txMsg[1], len - 1);
+	}
+	if (packedLen != 0)
+	{
+		txMsg[0] = type | COMPRESSED_FLAG;
+		msgSize = packedLen + 1;
+		myLog_d("Compressed chat from %d to %d bytes", len, packedLen);
+	}
+	else
+	{
+		memcpy(&txMsg[1], data, len);
+	}
+#else
+	memcpy(&txMsg[1], data, len);
+#endif
+
+	if (msgSize > LORA_MAX_DATA_SIZE)
+	{
+		// Too large for one package
+		sendFragments(nodeIdFromName, txMsg, msgSize);
+		return;
+	}
+	setRoute(nodeIdFromName, &outData);
+	memcpy(outData.data, txMsg, msgSize);
 	// Add package to send queue
-	if (!addSendRequest(&outData, dataLen))
+	if (!addSendRequest(&outData, DATA_HEADER_SIZE + msgSize))
 	{
 		myLog_e("Sending package failed");
 	}
@@ -428,17 +610,30 @@ void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len)
  */
 void OnLoraData(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 {
-	if (!newLoRaData)
+	uint16_t next = (loraRxTail + 1) % LORA_RX_RING_SLOTS;
+	/** Package buffer of the mesh code, kept instead of copying the message */
+	meshPacket *packet = NULL;
+	if (next == loraRxHead)
+	{
+		loraRxOverflows++;
+		myLog_e("LoRa RX queue is full, message dropped");
+	}
+	else if ((packet = holdPacket(rxPayload)) == NULL)
 	{
-		memcpy(loraRX, rxPayload, rxSize);
-		loraSenderID = fromID;
-		loraRX[rxSize] = 0;
-		loraDataSize = rxSize;
-		newLoRaData = true;
+		myLog_e("LoRa message is not in a package buffer, message dropped");
 	}
 	else
 	{
-		myLog_e("New data arrived before old data was processed");
+		loraRxFrame *frame = &loraRxRing[loraRxTail];
+		frame->packet = packet;
+		frame->data = (char *)rxPayload;
+		frame->fromID = fromID;
+		frame->size = rxSize;
+		frame->rssi = rxRssi;
+		frame->snr = rxSnr;
+		// Message must be complete before loop() can see it
+		__sync_synchronize();
+		loraRxTail = next;
 	}
 #if defined(IS_WROVER) || defined(RED_ESP)
 	digitalWrite(LED_BUILTIN, LOW);
@@ -0,0 +1,202 @@
+#include "main.h"
+
+/**
+ * Static dictionary text codec for chat messages
+ *
+ * Compressed format, one code per byte:
+ * 	0x00 .. 0x7F	ASCII character, copied as is
+ * 	0x80 .. 0xFE	dictionary entry (code - 0x80)
+ * 	0xFF			escape, the next byte is copied as is (UTF-8 and other non ASCII bytes)
+ *
+ * The dictionary holds common words and letter pairs of short English chat messages.
+ * Encoding is greedy, at each position the longest dictionary entry that matches is used.
+ * Encoding and decoding need no heap and run in linear time, the encoder checks at most
+ * the dictionary entries that start with the current character.
+ */
+
+/** First code of the dictionary entries */
+#define DICT_CODE 0x80
+/** Escape code for bytes that are not ASCII */
+#define ESCAPE_CODE 0xFF
+/** Number of dictionary entries */
+#define DICT_SIZE 127
+
+/** Dictionary, codes 0x80 .. 0xFE */
+static const char *const textDict[DICT_SIZE] = {
+	" the ", " you", " and ", " to ", " is ", " are ", " for ", " in ",
+	" of ", " it", " we ", " on ", " at ", " me", " my ", " be ",
+	" have", " what", " where", " when", " can ", " will ", " not ", " just ",
+	" with ", " this ", " that ", " there", " here", " now", " going", " ok",
+	" yes", " no ", " do ", " so ", " how", " all ", " good", " time",
+	" back", " out", " up", " home", " know", " want", " need", " from ",
+	" but ", " i ", " a ", "I'm ", "I ", "ok ", "thanks", "hello",
+	"hi ", "lol", "haha", "th", "he", "in", "er", "an",
+	"re", "on", "at", "en", "nd", "es", "or", "te",
+	"of", "ed", "is", "it", "al", "ar", "st", "to",
+	"nt", "ng", "se", "ha", "as", "ou", "le", "ve",
+	"co", "me", "de", "hi", "ro", "ne", "ea", "ra",
+	"ce", "ch", "ll", "be", "ur", "e ", "s ", "t ",
+	"d ", "y ", "n ", "o ", "r ", ", ", ". ", "? ",
+	"! ", "ing ", "ing", "ion", "ent", "ere", "ght", "ould",
+	"ll ", "'s ", "n't ", "ay", "ee", "oo", "ly "};
+
+/** Length of the dictionary entries */
+static uint8_t dictLen[DICT_SIZE];
+/** Dictionary entries sorted by first character, longest first */
+static uint8_t dictOrder[DICT_SIZE];
+/** Index into dictOrder of the first entry that starts with a character */
+static uint8_t dictStart[DICT_CODE + 1];
+/** Flag if the dictionary index is ready */
+static bool codecReady = false;
+
+/**
+ * Create the index of the dictionary
+ */
+void initTextCodec(void)
+{
+	uint8_t count[DICT_CODE] = {0};
+	for (int idx = 0; idx < DICT_SIZE; idx++)
+	{
+		dictLen[idx] = strlen(textDict[idx]);
+		count[(uint8_t)textDict[idx][0]]++;
+	}
+	dictStart[0] = 0;
+	for (int chr = 0; chr < DICT_CODE; chr++)
+	{
+		dictStart[chr + 1] = dictStart[chr] + count[chr];
+	}
+
+	// Insert the entries into their group, keep each group sorted by length
+	uint8_t fill[DICT_CODE];
+	memcpy(fill, dictStart, sizeof(fill));
+	for (int idx = 0; idx < DICT_SIZE; idx++)
+	{
+		uint8_t chr = textDict[idx][0];
+		int pos = fill[chr]++;
+		while ((pos > dictStart[chr]) && (dictLen[dictOrder[pos - 1]] < dictLen[idx]))
+		{
+			dictOrder[pos] = dictOrder[pos - 1];
+			pos--;
+		}
+		dictOrder[pos] = idx;
+	}
+	codecReady = true;
+}
+
+/**
+ * Compress a text
+ * @param text
+ * 		Text to compress
+ * @param textLen
+ * 		Length of the text
+ * @param out
+ * 		Buffer for the compressed text
+ * @param outMax
+ * 		Size of the buffer
+ * @return uint16_t
+ * 		Size of the compressed text, 0 if it does not fit into the buffer
+ */
+uint16_t compressText(const char *text, uint16_t textLen, uint8_t *out, uint16_t outMax)
+{
+	if (!codecReady)
+	{
+		initTextCodec();
+	}
+
+	uint16_t outLen = 0;
+	uint16_t pos = 0;
+	while (pos < textLen)
+	{
+		uint8_t chr = text[pos];
+		uint16_t left = textLen - pos;
+		if (chr >= DICT_CODE)
+		{
+			if ((outLen + 2) > outMax)
+			{
+				return 0;
+			}
+			out[outLen++] = ESCAPE_CODE;
+			out[outLen++] = chr;
+			pos++;
+			continue;
+		}
+
+		if (outLen >= outMax)
+		{
+			return 0;
+		}
+		// Entries of a group are sorted by length, the first match is the longest
+		int match = -1;
+		for (int idx = dictStart[chr]; idx < dictStart[chr + 1]; idx++)
+		{
+			uint8_t entry = dictOrder[idx];
+			// All entries have at least 2 characters, check the second one before comparing the whole entry
+			if ((dictLen[entry] <= left) && (textDict[entry][1] == text[pos + 1]) &&
+				(memcmp(&text[pos], textDict[entry], dictLen[entry]) == 0))
+			{
+				match = entry;
+				break;
+			}
+		}
+		if (match != -1)
+		{
+			out[outLen++] = DICT_CODE + match;
+			pos += dictLen[match];
+		}
+		else
+		{
+			out[outLen++] = chr;
+			pos++;
+		}
+	}
+	return outLen;
+}
+
+/**
+ * Decompress a text
+ * @param in
+ * 		Compressed text
+ * @param inLen
+ * 		Size of the compressed text
+ * @param text
+ * 		Buffer for the text, it is not null terminated
+ * @param textMax
+ * 		Size of the buffer
+ * @return uint16_t
+ * 		Length of the text, 0 if the compressed text is invalid or does not fit into the buffer
+ */
+uint16_t decompressText(const uint8_t *in, uint16_t inLen, char *text, uint16_t textMax)
+{
+	uint16_t textLen = 0;
+	for (uint16_t pos = 0; pos < inLen; pos++)
+	{
+		uint8_t code = in[pos];
+		if (code == ESCAPE_CODE)
+		{
+			if ((++pos >= inLen) || (textLen >= textMax))
+			{
+				return 0;
+			}
+			text[textLen++] = in[pos];
+		}
+		else if (code >= DICT_CODE)
+		{
+			uint8_t entryLen = strlen(textDict[code - DICT_CODE]);
+			if ((textLen + entryLen) > textMax)
+			{
+				return 0;
+			}
+			memcpy(&text[textLen], textDict[code - DICT_CODE], entryLen);
+			textLen += entryLen;
+		}
+		else
+		{
+			if (textLen >= textMax)
+			{
+				return 0;
+			}
+			text[textLen++] = code;
+		}
+	}
+	return textLen;
+}
@@ -0,0 +1,8 @@
+#include <Arduino.h>
+
+/** Max number of bytes a dictionary entry expands to */
+#define TEXT_DICT_MAX_LEN 6
+
+void initTextCodec(void);
+uint16_t compressText(const char *text, uint16_t textLen, uint8_t *out, uint16_t outMax);
+uint16_t decompressText(const uint8_t *in, uint16_t inLen, char *text, uint16_t textMax);
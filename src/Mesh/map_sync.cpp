@@ -0,0 +1,483 @@
+#include "main.h"
+
+/**
+ * One entry of an advertised map
+ */
+struct mapEntry
+{
+	/** Node ID */
+	uint32_t id;
+	/** Map version when the entry was changed the last time */
+	uint16_t changed;
+	/** Number of hops or path cost to the node, MAP_ENTRY_REMOVED if the node was removed */
+	uint8_t hops;
+};
+
+/** Entries of the advertised map including recently removed nodes, sorted by node ID */
+mapEntry *advEntries = NULL;
+/** Number of entries in advEntries */
+uint16_t advCount = 0;
+/** Buffer to merge the current map into the advertised map */
+mapEntry *mergeEntries = NULL;
+/** Entries of the current map, sorted by node ID */
+mapEntry *curEntries = NULL;
+/** Max number of entries in advEntries */
+uint16_t advSize = 0;
+/** Version of the advertised map, 0 is never used */
+uint16_t mapVersion = 0;
+/** Versions of the last MAP_DELTA_HISTORY sent maps, oldest first */
+uint16_t sentVersions[MAP_DELTA_HISTORY];
+/** Number of maps sent since the last full map */
+uint8_t mapsSinceFull = 0;
+/** Next map has to be a full map */
+bool sendFullMap = true;
+/** A neighbour requested the full map */
+bool fullMapRequested = false;
+/** Time (millis) of the first full map request */
+time_t fullMapRequestTime = 0;
+/** The advertised map has path costs instead of numbers of hops */
+bool advCostMap = MESH_PROTOCOL_VERSION >= 4;
+/** Sequence number of the next map */
+uint8_t mapSequence = 0;
+
+/** Number of hops of an advertised entry that has to be sent again with the next delta */
+#define MAP_ENTRY_READVERTISE 0xFE
+
+/**
+ * Initialize the map sync
+ * @param numOfNodes
+ * 		Max number of nodes in the map
+ * @return bool
+ * 		True if the memory could be allocated
+ */
+bool initMapSync(int numOfNodes)
+{
+	// Room for the removed nodes that are still part of the deltas
+	advSize = 2 * numOfNodes;
+	free(advEntries);
+	free(mergeEntries);
+	free(curEntries);
+	advEntries = (mapEntry *)malloc(advSize * sizeof(mapEntry));
+	mergeEntries = (mapEntry *)malloc(advSize * sizeof(mapEntry));
+	curEntries = (mapEntry *)malloc(numOfNodes * sizeof(mapEntry));
+	advCount = 0;
+	memset(sentVersions, 0, sizeof(sentVersions));
+	mapsSinceFull = 0;
+	sendFullMap = true;
+	fullMapRequested = false;
+
+	if ((advEntries == NULL) || (mergeEntries == NULL) || (curEntries == NULL))
+	{
+		myLog_e("Could not allocate memory for map sync");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Check if a map version is newer than another one, handles the wrap around
+ * @param version
+ * 		Version to check
+ * @param reference
+ * 		Version to compare with
+ * @return bool
+ * 		True if version is newer than reference
+ */
+static inline bool isNewer(uint16_t version, uint16_t reference)
+{
+	return (int16_t)(version - reference) > 0;
+}
+
+/**
+ * Compare two map entries by node ID, used by qsort()
+ */
+static int compareEntries(const void *a, const void *b)
+{
+	uint32_t idA = ((const mapEntry *)a)->id;
+	uint32_t idB = ((const mapEntry *)b)->id;
+	return (idA > idB) - (idA < idB);
+}
+
+/**
+ * Compare two map entries by number of hops, used by qsort()
+ */
+static int compareHops(const void *a, const void *b)
+{
+	return (int)((const mapEntry *)a)->hops - (int)((const mapEntry *)b)->hops;
+}
+
+/**
+ * Write a node into an entry of a map message
+ * @param entry
+ * 		Entry of the map message
+ * @param id
+ * 		Node ID
+ * @param hops
+ * 		Number of hops or MAP_ENTRY_REMOVED
+ */
+static void putEntry(uint8_t entry[5], uint32_t id, uint8_t hops)
+{
+	entry[0] = id & 0x000000FF;
+	entry[1] = (id >> 8) & 0x000000FF;
+	entry[2] = (id >> 16) & 0x000000FF;
+	entry[3] = (id >> 24) & 0x000000FF;
+	entry[4] = hops;
+}
+
+/**
+ * Merge the current map into the advertised map.
+ * Entries that were added, removed or got a different number of hops are marked with the new version.
+ * Path costs change a little with every lost package, they are sent again only if they changed by at least ETX_UNIT.
+ * A lower cost must also have dropped by 1 / MAP_COST_CHANGE, a higher cost is sent at once so loops count up fast.
+ * Removed nodes are kept until they are older than the oldest version a delta is based on.
+ * @param curCount
+ * 		Number of entries in curEntries
+ * @param newVersion
+ * 		Version of the map if something changed
+ * @param baseVersion
+ * 		Version the next delta is based on
+ * @param costMap
+ * 		True if the entries are path costs
+ * @return bool
+ * 		True if the map changed
+ */
+static bool mergeMap(uint16_t curCount, uint16_t newVersion, uint16_t baseVersion, bool costMap)
+{
+	bool mapChanged = false;
+	uint16_t mergeCount = 0;
+	int cur = 0;
+	int adv = 0;
+	while ((cur < curCount) || (adv < advCount))
+	{
+		if (mergeCount == advSize)
+		{
+			// Too many removed nodes, forget them and send a full map
+			myLog_e("Too many map changes, sending full map");
+			mergeCount = 0;
+			for (cur = 0; cur < curCount; cur++)
+			{
+				mergeEntries[mergeCount] = curEntries[cur];
+				mergeEntries[mergeCount++].changed = newVersion;
+			}
+			sendFullMap = true;
+			mapChanged = true;
+			break;
+		}
+		if ((adv == advCount) || ((cur < curCount) && (curEntries[cur].id < advEntries[adv].id)))
+		{
+			// Node was added
+			mergeEntries[mergeCount] = curEntries[cur++];
+			mergeEntries[mergeCount++].changed = newVersion;
+			mapChanged = true;
+		}
+		else if ((cur == curCount) || (advEntries[adv].id < curEntries[cur].id))
+		{
+			if (advEntries[adv].hops != MAP_ENTRY_REMOVED)
+			{
+				// Node was removed
+				mergeEntries[mergeCount] = advEntries[adv];
+				mergeEntries[mergeCount].hops = MAP_ENTRY_REMOVED;
+				mergeEntries[mergeCount++].changed = newVersion;
+				mapChanged = true;
+			}
+			else if (isNewer(advEntries[adv].changed, baseVersion))
+			{
+				// Removed node is still part of the deltas
+				mergeEntries[mergeCount++] = advEntries[adv];
+			}
+			adv++;
+		}
+		else
+		{
+			mergeEntries[mergeCount] = advEntries[adv];
+			int change = (int)curEntries[cur].hops - (int)advEntries[adv].hops;
+			if ((change != 0) && (!costMap || (change >= ETX_UNIT) ||
+								  ((-change >= ETX_UNIT) && (-change >= (advEntries[adv].hops / MAP_COST_CHANGE)))))
+			{
+				// Number of hops changed or node is back
+				mergeEntries[mergeCount].hops = curEntries[cur].hops;
+				mergeEntries[mergeCount].changed = newVersion;
+				mapChanged = true;
+			}
+			mergeCount++;
+			cur++;
+			adv++;
+		}
+	}
+
+	mapEntry *swap = advEntries;
+	advEntries = mergeEntries;
+	mergeEntries = swap;
+	advCount = mergeCount;
+	return mapChanged;
+}
+
+/**
+ * Create the next map message.
+ * Sends only the nodes that were added, removed or changed within the last MAP_DELTA_HISTORY maps (delta map),
+ * so a neighbour that missed some maps can still apply the delta.
+ * A full map is sent if it is not larger than the delta, if a neighbour requested it,
+ * after MAP_FULL_SYNC_INTERVAL delta maps or if a direct node does not understand delta maps.
+ * Must be called with the node list locked.
+ * @param msg
+ * 		Buffer for the map message
+ * @return uint8_t
+ * 		Size of the map message
+ */
+uint8_t buildMapMsg(mapMsg *msg)
+{
+#if MESH_PROTOCOL_VERSION >= 4
+	// Path costs only if all neighbours understand them
+	bool costMap = neighbourProtocol() >= 4;
+#else
+	bool costMap = false;
+#endif
+	// Delta maps only if all neighbours understand them, older nodes ignore them and time out our nodes
+	bool deltaMap = neighbourProtocol() >= 2;
+	if (costMap != advCostMap)
+	{
+		// All entries change, start over with a full map
+		myLog_d("Map switches to %s", costMap ? "path costs" : "number of hops");
+		advCostMap = costMap;
+		advCount = 0;
+		memset(sentVersions, 0, sizeof(sentVersions));
+		sendFullMap = true;
+	}
+
+	// Get the current map, it can have more nodes than the map message
+	uint16_t curCount = numOfNodes();
+	for (uint16_t idx = 0; idx < curCount; idx++)
+	{
+		uint32_t firstHop;
+		uint8_t numHops;
+		getNode(idx, curEntries[idx].id, firstHop, numHops);
+		curEntries[idx].hops = costMap ? getNodeCost(idx) : numHops;
+	}
+	if (curCount > MAP_MAX_ENTRIES)
+	{
+		// Map message is too small for all nodes, leave out the nodes that are farthest away
+		qsort(curEntries, curCount, sizeof(mapEntry), compareHops);
+		curCount = MAP_MAX_ENTRIES;
+	}
+	qsort(curEntries, curCount, sizeof(mapEntry), compareEntries);
+
+	// The delta is based on the oldest of the last sent maps
+	uint16_t baseVersion = sentVersions[0];
+	uint16_t newVersion = mapVersion + 1;
+	if (newVersion == 0)
+	{
+		newVersion = 1;
+	}
+	if (mergeMap(curCount, newVersion, baseVersion, costMap))
+	{
+		mapVersion = newVersion;
+	}
+	memmove(&sentVersions[0], &sentVersions[1], (MAP_DELTA_HISTORY - 1) * sizeof(uint16_t));
+	sentVersions[MAP_DELTA_HISTORY - 1] = mapVersion;
+
+	// Collect the changes since the base version
+	uint8_t numChanges = 0;
+	bool deltaFits = true;
+	for (int idx = 0; idx < advCount; idx++)
+	{
+		if (isNewer(advEntries[idx].changed, baseVersion))
+		{
+			if (numChanges >= curCount)
+			{
+				// Delta is not smaller than the full map
+				deltaFits = false;
+				break;
+			}
+			putEntry(msg->nodes[numChanges++], advEntries[idx].id, advEntries[idx].hops);
+		}
+	}
+
+	mapsSinceFull++;
+	msg->from = deviceID;
+	msg->version = mapVersion;
+	uint8_t numEntries;
+	if (!deltaMap || sendFullMap || fullMapRequested || !deltaFits || (baseVersion == 0) || (mapsSinceFull >= MAP_FULL_SYNC_INTERVAL))
+	{
+		msg->type = LORA_NODEMAP;
+		msg->baseVersion = mapVersion;
+		for (int idx = 0; idx < curCount; idx++)
+		{
+			putEntry(msg->nodes[idx], curEntries[idx].id, curEntries[idx].hops);
+		}
+		numEntries = curCount;
+		sendFullMap = false;
+		fullMapRequested = false;
+		mapsSinceFull = 0;
+		myLog_d("Full map version %d with %d nodes", mapVersion, numEntries);
+	}
+	else
+	{
+		msg->type = LORA_NODEMAP_DELTA;
+		msg->baseVersion = baseVersion;
+		numEntries = numChanges;
+		myLog_d("Delta map version %d -> %d with %d changes", baseVersion, mapVersion, numEntries);
+	}
+
+	// End marker AA 55 00 FF AA
+	putEntry(msg->nodes[numEntries], 0xFF0055AA, 0xAA);
+	uint8_t mapSize = MAP_HEADER_SIZE + ((numEntries + 1) * 5);
+#if MESH_PROTOCOL_VERSION >= 4
+	// Neighbours count the lost maps for the link cost
+	((uint8_t *)msg)[mapSize++] = (mapSequence++ & MAP_SEQ_MASK) | (costMap ? MAP_FLAG_COST : 0);
+#endif
+#if MESH_PROTOCOL_VERSION >= 2
+	// Neighbours calculate the path loss from the TX power of the map
+	((uint8_t *)msg)[mapSize++] = (uint8_t)LINK_FULL_POWER;
+	((uint8_t *)msg)[mapSize++] = MESH_PROTOCOL_VERSION;
+#endif
+	return mapSize;
+}
+
+/**
+ * Send a node again with the next delta map
+ * @param id
+ * 		Node ID
+ */
+static void readvertiseNode(uint32_t id)
+{
+	mapEntry key;
+	key.id = id;
+	mapEntry *entry = (mapEntry *)bsearch(&key, advEntries, advCount, sizeof(mapEntry), compareEntries);
+	if ((entry != NULL) && (entry->hops != MAP_ENTRY_REMOVED))
+	{
+		// Forces the merge to mark the entry as changed
+		entry->hops = MAP_ENTRY_READVERTISE;
+	}
+}
+
+/**
+ * Ask a direct node to send its full map
+ * @param nodeId
+ * 		Node ID of the direct node
+ */
+static void sendMapRequest(uint32_t nodeId)
+{
+	dataMsg request;
+	request.type = LORA_MAP_REQUEST;
+	request.dest = nodeId;
+	request.from = deviceID;
+	request.orig = deviceID;
+	if (!addSendRequest(&request, DATA_HEADER_SIZE))
+	{
+		myLog_e("Cannot request map because send queue is full");
+	}
+}
+
+/**
+ * Apply a delta map of a direct node.
+ * If the last map we know from the node is older than the base of the delta, the full map is requested.
+ * Must be called with the node list locked.
+ * @param msg
+ * 		The received map message
+ * @param numEntries
+ * 		Number of entries in the map message without the end marker
+ * @param costMap
+ * 		True if the entries carry path costs instead of numbers of hops
+ * @return bool
+ * 		True if the nodes list changed
+ */
+bool handleMapDelta(mapMsg *msg, uint8_t numEntries, bool costMap)
+{
+	// The delta can be applied to every version from the base version up to the new version
+	uint16_t knownVersion = getMapVersion(msg->from);
+	if ((knownVersion == 0) || isNewer(msg->baseVersion, knownVersion) || isNewer(knownVersion, msg->version))
+	{
+		myLog_d("Map of %08X has version %d, we know %d, requesting full map", msg->from, msg->baseVersion, knownVersion);
+		setMapVersion(msg->from, 0);
+		sendMapRequest(msg->from);
+		return false;
+	}
+
+	// Nodes not listed in the delta did not change
+	refreshSubs(msg->from);
+
+	bool listChanged = false;
+	for (int idx = 0; idx < numEntries; idx++)
+	{
+		uint32_t subId = (uint32_t)msg->nodes[idx][0];
+		subId += (uint32_t)msg->nodes[idx][1] << 8;
+		subId += (uint32_t)msg->nodes[idx][2] << 16;
+		subId += (uint32_t)msg->nodes[idx][3] << 24;
+		uint8_t hops = msg->nodes[idx][4];
+		if (subId == deviceID)
+		{
+			continue;
+		}
+		if (hops == MAP_ENTRY_REMOVED)
+		{
+			if (removeSub(subId, msg->from))
+			{
+				listChanged = true;
+			}
+			else
+			{
+				// We still know a route, tell the neighbour about it with our next delta
+				readvertiseNode(subId);
+			}
+		}
+		else
+		{
+			listChanged |= addMapNode(subId, msg->from, hops, costMap);
+		}
+	}
+	setMapVersion(msg->from, msg->version);
+	return listChanged;
+}
+
+/**
+ * Add a node from the map of a direct node
+ * Maps of older nodes carry the number of hops, it is taken as path over perfect links.
+ * Maps with path costs have no number of hops, a hop costs at least ETX_UNIT and ETX_HOP_PENALTY,
+ * so the cost gives the highest possible number of hops.
+ * Must be called with the node list locked.
+ * @param id
+ * 		Node ID from the map entry
+ * @param hop
+ * 		Node ID of the direct node that sent the map
+ * @param value
+ * 		Number of hops or path cost from the map entry
+ * @param costMap
+ * 		True if the map carries path costs
+ * @return bool
+ * 		True if the nodes list changed
+ */
+bool addMapNode(uint32_t id, uint32_t hop, uint8_t value, bool costMap)
+{
+	if (!costMap)
+	{
+		uint16_t cost = (value + 1) * ETX_UNIT + value * ETX_HOP_PENALTY;
+		return addNode(id, hop, value + 1, cost > ETX_MAX_COST ? ETX_UNREACHABLE : cost);
+	}
+	uint8_t hops = (value + ETX_HOP_PENALTY) / (ETX_UNIT + ETX_HOP_PENALTY);
+	return addNode(id, hop, hops != 0 ? hops : 1, value);
+}
+
+/**
+ * A direct node requested our full map
+ */
+void requestFullMap(void)
+{
+	if (!fullMapRequested)
+	{
+		fullMapRequested = true;
+		fullMapRequestTime = millis();
+	}
+}
+
+/**
+ * Check if a neighbour requested the full map
+ * @param requestTime
+ * 		Time (millis) of the first request
+ * @return bool
+ * 		True if the full map was requested
+ */
+bool getMapResync(time_t &requestTime)
+{
+	requestTime = fullMapRequestTime;
+	return fullMapRequested;
+}
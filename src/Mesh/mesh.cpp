@@ -11,6 +11,12 @@ volatile xQueueHandle meshMsgQueue;
 
 /** Counter for CAD retry */
 uint8_t channelFreeRetryNum = 0;
+/** Flag if the package in txPckg waits for a CAD retry */
+bool cadBackoff = false;
+/** Time when the CAD retry wait started */
+time_t cadBackoffStart = 0;
+/** Random wait time before the CAD retry */
+time_t cadBackoffTime = 0;
 
 /** The Mesh node ID, created from ID of the nRF52 */
 uint32_t deviceID;
@@ -20,18 +26,6 @@ uint32_t broadcastID;
 /** Map message buffer */
 mapMsg syncMsg;
 
-/** Max number of messages in the queue */
-#define SEND_QUEUE_SIZE 2
-/** Send buffer for SEND_QUEUE_SIZE messages */
-dataMsg sendMsg[SEND_QUEUE_SIZE];
-/** Message size buffer for SEND_QUEUE_SIZE messages */
-uint8_t sendMsgSize[SEND_QUEUE_SIZE];
-/** Queue to handle send requests */
-volatile xQueueHandle sendQueue;
-#ifdef ESP32
-/** Mux used to enter critical code part (clear up queue content) */
-portMUX_TYPE accessMsgQueue = portMUX_INITIALIZER_UNLOCKED;
-#endif
 /** Mux used to enter critical code part (access to node list) */
 SemaphoreHandle_t accessNodeList;
 
@@ -39,8 +33,17 @@ SemaphoreHandle_t accessNodeList;
 uint8_t txPckg[256];
 /** Size of data package */
 uint16_t txLen = 0;
-/** LoRa RX buffer */
-uint8_t rxBuffer[256];
+/** Link token of the package in txPckg, -1 if it needs no ACK */
+int32_t txLinkToken = -1;
+/** TX power of the package in txPckg */
+int8_t txPower = LINK_FULL_POWER;
+/** TX power the radio is set to */
+int8_t radioTxPower = LINK_FULL_POWER;
+/** LoRa package type of the package in txPckg */
+uint8_t txType = LORA_INVALID;
+
+/** Statistics of the radio and the package handling */
+meshStats meshCounters;
 
 /** Sync time for routing at start */
 #define INIT_SYNCTIME 30000
@@ -52,20 +55,10 @@ uint8_t rxBuffer[256];
 time_t syncTime = INIT_SYNCTIME;
 
 /**
- * Sleep and Listen time definitions 
- * Calculated with Semtech SX1261 Calculater
- * SF 7, BW 250, CR 4/5 PreambleLen 8 PayloadLen 253 Hdr enabled CRC enabled
- * 2 -> number of preambles required to detect package 
- * 512 -> length of a symbol im ms
- * 1000 -> wake time is in us
- * 15.625 -> SX126x counts in increments of 15.625 us
- * 
- * 10 -> max length we can sleep in symbols 
- * 512 -> length of a symbol im ms
- * 1000 -> sleep time is in us
- * 15.625 -> SX126x counts in increments of 15.625 us
+ * Listen and sleep time of the RX duty cycle in steps of 15.625 us
+ * Calculated from the radio profile, see MeshRadio
  */
-#define RX_SLEEP_TIMES 2 * 512 * 1000 * 15.625, 10 * 512 * 1000 * 15.625
+#define RX_SLEEP_TIMES MeshRadio::rxDutyTime, MeshRadio::rxSleepTime
 
 typedef enum
 {
@@ -93,6 +86,19 @@ time_t preambTimeout;
 /** Flag if the nodes map has changed */
 boolean nodesChanged = false;
 
+/**
+ * Get the time on air of a package
+ * Taken from the table of the radio profile, Radio.TimeOnAir() needs floating point math
+ * @param msgSize
+ * 		Size of the package
+ * @return uint32_t
+ * 		Time on air in milliseconds
+ */
+static uint32_t loraAirTime(uint8_t msgSize)
+{
+	return MeshRadio::airTime(msgSize);
+}
+
 /**
  * Initialize the Mesh network
  * @param events
@@ -104,6 +110,10 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 {
 	_MeshEvents = events;
 
+#if MESH_TRACE
+	initTrace();
+#endif
+
 	// Initialize the callbacks
 	RadioEvents.TxDone = OnTxDone;
 	RadioEvents.RxDone = OnRxDone;
@@ -113,38 +123,27 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 	RadioEvents.CadDone = OnCadDone;
 	// RadioEvents.PreAmpDetect = OnPreAmbDetect;
 	Radio.Init(&RadioEvents);
+	RadioSetIrqNotify(meshIrqNotify);
 
 	_numOfNodes = numOfNodes;
 
 	// Prepare empty nodes map
-	nodesMap = (nodesList *)malloc(_numOfNodes * sizeof(nodesList));
+	initNodesMap(_numOfNodes);
+	initMapSync(_numOfNodes);
 
-	if (nodesMap == NULL)
-	{
-		myLog_e("Could not allocate memory for nodes map");
-	}
-	else
-	{
-		myLog_d("Memory for nodes map is allocated");
-	}
-	memset(nodesMap, 0, _numOfNodes * sizeof(nodesList));
-
-	// Create queue
-	sendQueue = xQueueCreate(SEND_QUEUE_SIZE, sizeof(uint8_t));
-	if (sendQueue == NULL)
-	{
-		myLog_e("Could not create send queue!");
-	}
-	else
-	{
-		myLog_d("Send queue created!");
-	}
+	// Create package buffers and queue
+	initPacketPool();
+	initSendQueue(loraAirTime);
 	// Create blocking semaphore for nodes list access
 	accessNodeList = xSemaphoreCreateBinary();
 	xSemaphoreGive(accessNodeList);
 
-	// Create broadcast ID
-	broadcastID = deviceID & 0xFFFFFF00;
+	// Create broadcast ID, start random because after a restart the neighbours might still remember the old IDs
+#if MESH_PROTOCOL_VERSION >= 2
+	broadcastID = (uint32_t)random(0x10000);
+#else
+	broadcastID = ((uint32_t)random(0x10000) << 16) | (uint32_t)random(0x10000);
+#endif
 	myLog_d("Broadcast ID is %08X", broadcastID);
 
 	// Put LoRa into standby
@@ -154,15 +153,15 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 	Radio.SetChannel(RF_FREQUENCY);
 
 	// Set transmit configuration
-	Radio.SetTxConfig(MODEM_LORA, TX_OUTPUT_POWER, 0, LORA_BANDWIDTH,
-					  LORA_SPREADING_FACTOR, LORA_CODINGRATE,
-					  LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON,
-					  true, 0, 0, LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE);
+	Radio.SetTxConfig(MODEM_LORA, LINK_FULL_POWER, 0, MeshRadio::bandwidth,
+					  MeshRadio::spreadingFactor, MeshRadio::codingRate,
+					  MeshRadio::preambleLength, LORA_FIX_LENGTH_PAYLOAD_ON,
+					  MeshRadio::crcOn, 0, 0, LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE);
 	// Set receive configuration
-	Radio.SetRxConfig(MODEM_LORA, LORA_BANDWIDTH, LORA_SPREADING_FACTOR,
-					  LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
+	Radio.SetRxConfig(MODEM_LORA, MeshRadio::bandwidth, MeshRadio::spreadingFactor,
+					  MeshRadio::codingRate, 0, MeshRadio::preambleLength,
 					  LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON,
-					  0, true, 0, 0, LORA_IQ_INVERSION_ON, true);
+					  0, MeshRadio::crcOn, 0, 0, LORA_IQ_INVERSION_ON, true);
 
 	// Create message queue for LoRa
 	meshMsgQueue = xQueueCreate(10, sizeof(uint8_t));
@@ -185,6 +184,57 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 	}
 }
 
+/**
+ * Get the time until a timer expires
+ * @param start
+ * 		Time when the timer was started
+ * @param period
+ * 		Timer period in milliseconds
+ * @return time_t
+ * 		Milliseconds until the timer expires, 0 if it is already expired
+ */
+static time_t timeUntil(time_t start, time_t period)
+{
+	uint32_t passed = millis() - start;
+	return passed >= (uint32_t)period ? 0 : period - passed;
+}
+
+/**
+ * Count a package in the per type statistics
+ * @param counters
+ * 		Counters of the sent or received packages
+ * @param type
+ * 		LoRa package type
+ */
+static inline void countFrame(uint32_t *counters, uint8_t type)
+{
+	counters[type < MESH_STATS_TYPES ? type : LORA_INVALID]++;
+}
+
+/**
+ * Get the statistics of the radio and the package handling
+ * @param stats
+ * 		Pointer to a structure for the statistics
+ */
+void getMeshStats(meshStats *stats)
+{
+	memcpy(stats, &meshCounters, sizeof(meshStats));
+}
+
+/**
+ * Put the radio into standby and start a channel activity detection
+ */
+static void startCad(void)
+{
+	Radio.Standby();
+	Radio.SetCadParams(MeshRadio::cadSymbolNum, MeshRadio::cadDetPeak, MeshRadio::cadDetMin, LORA_CAD_ONLY, 0);
+	// SX126xSetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10, LORA_CAD_ONLY, 0);
+	// SX126xSetDioIrqParams(IRQ_RADIO_ALL,
+	// 					  IRQ_RADIO_ALL,
+	// 					  IRQ_RADIO_NONE, IRQ_RADIO_NONE);
+	Radio.StartCad();
+}
+
 /**
  * Task to handle the mesh
  * @param pvParameters
@@ -192,9 +242,7 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
  */
 void meshTask(void *pvParameters)
 {
-	// Queue variable to be sent to the task
-	uint8_t queueIndex;
-
+	(void)pvParameters;
 	time_t notifyTimer = millis() + syncTime;
 	// time_t cleanTimer = millis();
 	time_t checkSwitchSyncTime = millis();
@@ -219,8 +267,10 @@ void meshTask(void *pvParameters)
 				_MeshEvents->NodesListChanged();
 			}
 		}
-		// Time to sync the Mesh ???
-		if ((millis() - notifyTimer) >= syncTime)
+		// Time to sync the Mesh or did a neighbour request our full map ???
+		time_t resyncRequest;
+		bool resyncDue = getMapResync(resyncRequest) && ((millis() - resyncRequest) >= MAP_RESYNC_DELAY);
+		if (((millis() - notifyTimer) >= (unsigned long)syncTime) || resyncDue)
 		{
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
@@ -235,35 +285,13 @@ void meshTask(void *pvParameters)
 					}
 				}
 				myLog_d("Sending mesh map");
-				syncMsg.from = deviceID;
-				syncMsg.type = LORA_NODEMAP;
-				memset(syncMsg.nodes, 0, _numOfNodes * 5);
-
-				// Get sub nodes
-				uint8_t subsLen = nodeMap(syncMsg.nodes);
+				// Get full or delta map
+				uint8_t mapSize = buildMapMsg(&syncMsg);
 
 				xSemaphoreGive(accessNodeList);
 
-				if (subsLen != 0)
-				{
-					for (int idx = 0; idx < subsLen; idx++)
-					{
-						uint32_t checkNode = syncMsg.nodes[idx][0];
-						checkNode |= syncMsg.nodes[idx][1] << 8;
-						checkNode |= syncMsg.nodes[idx][2] << 16;
-						checkNode |= syncMsg.nodes[idx][3] << 24;
-					}
-				}
-				syncMsg.nodes[subsLen][0] = 0xAA;
-				syncMsg.nodes[subsLen][1] = 0x55;
-				syncMsg.nodes[subsLen][2] = 0x00;
-				syncMsg.nodes[subsLen][3] = 0xFF;
-				syncMsg.nodes[subsLen][4] = 0xAA;
-				subsLen++;
 
-				subsLen = MAP_HEADER_SIZE + (subsLen * 5);
-
-				if (!addSendRequest((dataMsg *)&syncMsg, subsLen))
+				if (!addSendRequest((dataMsg *)&syncMsg, mapSize))
 				{
 					myLog_e("Cannot send map because send queue is full");
 				}
@@ -291,62 +319,274 @@ void meshTask(void *pvParameters)
 			Radio.SetRxDutyCycle(RX_SLEEP_TIMES);
 
 			loraState = MESH_IDLE;
+			sendDone(false);
 			myLog_e("loraState stuck in TX for 2 seconds");
 		}
 
+		// Time to retry the CAD for the waiting package ???
+		if (cadBackoff && (loraState != MESH_TX) && (timeUntil(cadBackoffStart, cadBackoffTime) == 0))
+		{
+			myLog_d("Retrying CAD, attempt %d", channelFreeRetryNum + 1);
+			cadBackoff = false;
+			loraState = MESH_TX;
+			startCad();
+			txTimeout = millis();
+		}
+
+		// Queue packages again whose ACK is missing
+		time_t ackWait = checkAckTimeouts();
+
 		// Check if we have something in the queue
-		if (xQueuePeek(sendQueue, &queueIndex, (TickType_t)10) == pdTRUE)
+		if (sendQueueCount() != 0)
 		{
-			if (loraState != MESH_TX)
+			if ((loraState != MESH_TX) && !cadBackoff)
 			{
-#ifdef ESP32
-				portENTER_CRITICAL(&accessMsgQueue);
-#else
-				taskENTER_CRITICAL();
-#endif
-				txLen = sendMsgSize[queueIndex];
-				memset(txPckg, 0, 256);
-				memcpy(txPckg, &sendMsg[queueIndex].mark1, txLen);
-				if (xQueueReceive(sendQueue, &queueIndex, portMAX_DELAY) == pdTRUE)
+				if (getSendRequest(txPckg, &txLen, &txLinkToken))
 				{
-					sendMsg[queueIndex].type = 0;
+					txType = txPckg[3];
+					bool relayedBroadcast = (txType == LORA_BROADCAST) && (((dataMsg *)txPckg)->orig != deviceID);
+					txPower = getFrameTxPower(txPckg, sendRetries() != 0);
+					txLen = wireFrame(txPckg, txLen, txLinkToken);
+					myLog_d("Sending msg with len %d, %d more in queue", txLen, sendQueueCount());
+
+					if (relayedBroadcast)
+					{
+						// All neighbours received the broadcast at the same time, spread their forwards
+						cadBackoffTime = random(0, BROADCAST_JITTER * MeshRadio::airTime(txLen) + 1);
+						cadBackoffStart = millis();
+						cadBackoff = true;
+					}
+					else
+					{
+						loraState = MESH_TX;
+
+						startCad();
+						txTimeout = millis();
+					}
+				}
+			}
+		}
+
+		// Sleep until the radio has an event, a package is queued or the next timer expires
+		time_t waitTime = timeUntil(notifyTimer, syncTime);
+		if ((syncTime != DEFAULT_SYNCTIME) && (timeUntil(checkSwitchSyncTime, SWITCH_SYNCTIME) < waitTime))
+		{
+			waitTime = timeUntil(checkSwitchSyncTime, SWITCH_SYNCTIME);
+		}
+		if (getMapResync(resyncRequest) && (timeUntil(resyncRequest, MAP_RESYNC_DELAY) < waitTime))
+		{
+			waitTime = timeUntil(resyncRequest, MAP_RESYNC_DELAY);
+		}
+		if ((sendQueueCount() != 0) && (loraState != MESH_TX) && !cadBackoff && (sendBudgetWait() < waitTime))
+		{
+			// Packages are held back by the airtime budget
+			waitTime = sendBudgetWait() + 1;
+		}
+		if (ackWait < waitTime)
+		{
+			waitTime = ackWait;
+		}
+		if (cadBackoff && (timeUntil(cadBackoffStart, cadBackoffTime) < waitTime))
+		{
+			waitTime = timeUntil(cadBackoffStart, cadBackoffTime);
+		}
+		if ((loraState == MESH_TX) && (timeUntil(txTimeout, 7500) < waitTime))
+		{
+			// Stuck check needs more than 7500 ms
+			waitTime = timeUntil(txTimeout, 7500) + 1;
+		}
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitTime));
+	}
+}
+
+/**
+ * Wake up the mesh task, called from the LoRa interrupt
+ */
+void meshIrqNotify(void)
+{
+	if (meshTaskHandle != NULL)
+	{
+		BaseType_t higherPriorityTaskWoken = pdFALSE;
+		vTaskNotifyGiveFromISR(meshTaskHandle, &higherPriorityTaskWoken);
 #ifdef ESP32
-					portEXIT_CRITICAL(&accessMsgQueue);
+		if (higherPriorityTaskWoken == pdTRUE)
+		{
+			portYIELD_FROM_ISR();
+		}
 #else
-					taskEXIT_CRITICAL();
+		portYIELD_FROM_ISR(higherPriorityTaskWoken);
 #endif
+	}
+}
 
-					myLog_d("Sending msg #%d with len %d", queueIndex, txLen);
-
-					loraState = MESH_TX;
+/**
+ * Handle a received direct, forward or broadcast package
+ * @param thisDataMsg
+ * 			The package, null terminated
+ * @param tempSize
+ * 			Length of the package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
+ */
+static void handleDataMsg(dataMsg *thisDataMsg, uint16_t tempSize, int16_t rxRssi, int8_t rxSnr)
+{
+	if (thisDataMsg->type == LORA_DIRECT)
+	{
+		if (thisDataMsg->dest == deviceID)
+		{
+			// Message is for us, call user callback to handle the data
+			myLog_d("Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
+			if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
+			{
+				_MeshEvents->DataAvailable(thisDataMsg->orig, thisDataMsg->data, tempSize - DATA_HEADER_SIZE, rxRssi, rxSnr);
+			}
+		}
+		else
+		{
+			// Message is not for us
+		}
+	}
+	else if (thisDataMsg->type == LORA_FORWARD)
+	{
+		if (thisDataMsg->dest == deviceID)
+		{
+			// Message is for sub node, forward the message
+			nodesList route;
+			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+			{
+				if (getRoute(thisDataMsg->from, &route))
+				{
+					// We found a route, send package to next hop
+					if (route.firstHop == 0)
+					{
+						myLog_i("Route for %lX is direct", route.nodeId);
+						// Destination is a direct
+						thisDataMsg->dest = thisDataMsg->from;
+						thisDataMsg->from = thisDataMsg->orig;
+						thisDataMsg->type = LORA_DIRECT;
+					}
+					else
+					{
+						myLog_i("Route for %lX is to %lX", route.nodeId, route.firstHop);
+						// Destination is a sub
+						thisDataMsg->dest = route.firstHop;
+						thisDataMsg->type = LORA_FORWARD;
+					}
 
-					Radio.Standby();
-					Radio.SetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10, LORA_CAD_ONLY, 0);
-					// SX126xSetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10, LORA_CAD_ONLY, 0);
-					// SX126xSetDioIrqParams(IRQ_RADIO_ALL,
-					// 					  IRQ_RADIO_ALL,
-					// 					  IRQ_RADIO_NONE, IRQ_RADIO_NONE);
-					Radio.StartCad();
-					txTimeout = millis();
+					// Put message into send queue, the queue keeps the received package
+					if (addSendPacket(holdPacket(thisDataMsg), tempSize))
+					{
+						meshCounters.forwarded++;
+					}
+					else
+					{
+						myLog_e("Cannot forward message because send queue is full");
+					}
 				}
 				else
 				{
-#ifdef ESP32
-					portEXIT_CRITICAL(&accessMsgQueue);
-#else
-					taskEXIT_CRITICAL();
-#endif
+					myLog_e("No route found for %lX", thisDataMsg->from);
+					meshCounters.noRoute++;
 				}
+				xSemaphoreGive(accessNodeList);
 			}
+			else
+			{
+				myLog_e("Could not access map to forward package");
+			}
+		}
+		else
+		{
+			// Message is not for us
+		}
+	}
+	else if (thisDataMsg->type == LORA_BROADCAST)
+	{
+		// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
+		myLog_d("Handling broadcast with ID %08X from %08X", thisDataMsg->dest, thisDataMsg->from);
+		// Check if this broadcast is coming from ourself
+		if (thisDataMsg->orig == deviceID)
+		{
+			myLog_w("We received our own broadcast, dismissing it");
+			return;
+		}
+		// Check if we handled this broadcast already
+		if (isOldBroadcast(thisDataMsg->orig, thisDataMsg->dest))
+		{
+			myLog_w("Got an old broadcast, dismissing it");
+			return;
+		}
+
+		// Put broadcast into send queue, the queue and the application share the received package
+		if (addSendPacket(holdPacket(thisDataMsg), tempSize))
+		{
+			meshCounters.broadcastsForwarded++;
+		}
+		else
+		{
+			myLog_e("Cannot forward broadcast because send queue is full");
+		}
+
+		// This is a broadcast, call user callback to handle the data
+		myLog_d("Got data broadcast %s", (char *)thisDataMsg->data);
+		if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
+		{
+			_MeshEvents->DataAvailable(thisDataMsg->from, thisDataMsg->data, tempSize - DATA_HEADER_SIZE, rxRssi, rxSnr);
 		}
+	}
+}
 
-		// Enable a task switch
-		delay(100);
+/**
+ * Split an aggregated package into the single packages and handle them
+ * @param aggBuffer
+ * 			The aggregated package
+ * @param aggSize
+ * 			Length of the aggregated package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
+ */
+static void handleAggregate(uint8_t *aggBuffer, uint16_t aggSize, int16_t rxRssi, int8_t rxSnr)
+{
+	uint16_t pos = AGGREGATE_HEADER_SIZE;
+
+	myLog_d("Got aggregated package from %08X", ((aggregateMsg *)aggBuffer)->from);
+	while (pos < aggSize)
+	{
+		// Each package is stored with its length and without the 'LoR' marks
+		uint8_t itemSize = aggBuffer[pos];
+		if ((itemSize < DATA_HEADER_SIZE - 3) || ((pos + 1 + itemSize) > aggSize))
+		{
+			myLog_e("Invalid aggregated package");
+			return;
+		}
+		// Each package gets its own buffer, the send queue and the application can keep it
+		meshPacket *item = allocPacket();
+		if (item == NULL)
+		{
+			myLog_e("No free package buffer for an aggregated package");
+			return;
+		}
+		item->data[0] = 'L';
+		item->data[1] = 'o';
+		item->data[2] = 'R';
+		memcpy(&item->data[3], &aggBuffer[pos + 1], itemSize);
+		meshCounters.rxCopied += itemSize;
+		// Make sure the data is null terminated
+		item->data[itemSize + 3] = 0;
+		handleDataMsg((dataMsg *)item->data, itemSize + 3, rxRssi, rxSnr);
+		releasePacket(item);
+		pos += itemSize + 1;
 	}
 }
 
 /**
- * Callback after a LoRa package was received
+ * Handle a received LoRa package
+ * @param packet
+ * 			Package buffer for the received data
  * @param rxPayload
  * 			Pointer to the received data
  * @param rxSize
@@ -356,21 +596,28 @@ void meshTask(void *pvParameters)
  * @param rxSnr
  * 			Signal to noise ratio while the package was received
  */
-void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
+static void receiveFrame(meshPacket *packet, uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 {
-	// Secure buffer before restart listening
-	if (rxSize < 256)
+	uint8_t *rxBuffer = packet->data;
+	uint16_t tempSize = rxSize;
+	/** Link token if the sender expects an ACK */
+	int32_t linkToken = -1;
+
+	// Secure buffer before restart listening, a compact package is converted into the format used inside the mesh code on the way
+#if MESH_PROTOCOL_VERSION >= 2
+	if ((rxSize != 0) && (rxPayload[0] == MESH_WIRE_MAGIC))
 	{
-		memcpy(rxBuffer, rxPayload, rxSize + 1);
-		// Make sure the data is null terminated
-		rxBuffer[rxSize] = 0;
+		tempSize = decodeFrame(rxPayload, rxSize, rxBuffer, &linkToken);
 	}
 	else
+#endif
 	{
-		memcpy(rxBuffer, rxPayload, rxSize);
+		tempSize = rxSize < 256 ? rxSize : 255;
+		memcpy(rxBuffer, rxPayload, tempSize);
+		// Make sure the data is null terminated
+		rxBuffer[tempSize] = 0;
 	}
-
-	uint16_t tempSize = rxSize;
+	meshCounters.rxCopied += tempSize;
 
 	delay(1);
 
@@ -381,7 +628,7 @@ void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 #if MYLOG_LOG_LEVEL == MYLOG_LOG_LEVEL_VERBOSE
 	for (int idx = 0; idx < rxSize; idx++)
 	{
-		Serial.printf(" %02X", rxBuffer[idx]);
+		Serial.printf(" %02X", rxPayload[idx]);
 	}
 	Serial.println("");
 #endif
@@ -391,14 +638,22 @@ void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 	// Radio.Rx(0);
 	Radio.SetRxDutyCycle(RX_SLEEP_TIMES);
 
+	if (tempSize == 0)
+	{
+		myLog_e("Invalid compact package");
+		meshCounters.rxFrames[LORA_INVALID]++;
+		return;
+	}
+
 	// Check the received data
 	if ((rxBuffer[0] == 'L') && (rxBuffer[1] == 'o') && (rxBuffer[2] == 'R'))
 	{
 		// Valid Mesh data received
 		mapMsg *thisMsg = (mapMsg *)rxBuffer;
 		dataMsg *thisDataMsg = (dataMsg *)rxBuffer;
+		countFrame(meshCounters.rxFrames, thisDataMsg->type);
 
-		if (thisMsg->type == LORA_NODEMAP)
+		if ((thisMsg->type == LORA_NODEMAP) || (thisMsg->type == LORA_NODEMAP_DELTA))
 		{
 			/// \todo for debug make some nodes unreachable
 #ifdef BROKEN_NET
@@ -484,47 +739,70 @@ void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 			}
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
-				nodesChanged = addNode(thisMsg->from, 0, 0);
-
-				// Remove nodes that use sending node as hop
-				clearSubs(thisMsg->from);
+				nodesChanged = addNode(thisMsg->from, 0, 0, 0);
+				// Nodes that understand the compact wire format append their protocol version to the map
+				setNodeProtocol(thisMsg->from, (subsSize % 5) != 0 ? rxBuffer[tempSize - 1] : 1);
+				// The TX power of the map is in front of the protocol version
+				if ((subsSize % 5) >= 2)
+				{
+					setLinkQuality(thisMsg->from, (int8_t)rxBuffer[tempSize - 2], rxRssi, rxSnr);
+				}
+				// Map flags and sequence are in front of the TX power
+				bool costMap = false;
+				if ((subsSize % 5) >= 3)
+				{
+					costMap = (rxBuffer[tempSize - 3] & MAP_FLAG_COST) != 0;
+					setMapSequence(thisMsg->from, rxBuffer[tempSize - 3] & MAP_SEQ_MASK);
+				}
 
 				myLog_v("From %08X", thisMsg->from);
-				myLog_v("Dest %08X", thisMsg->dest);
+				myLog_v("Version %d", thisMsg->version);
 
-				if (subsSize != 0)
+				if (thisMsg->type == LORA_NODEMAP_DELTA)
+				{
+					// Map contains only the changes since the last map
+					nodesChanged |= handleMapDelta(thisMsg, numSubs - 1, costMap);
+				}
+				else
 				{
-					// Mapping contains subs
-
-					myLog_v("Msg size %d", tempSize);
-					myLog_v("#subs %d", numSubs);
-
-					// Serial.println("++++++++++++++++++++++++++++");
-					// Serial.printf("From %08X Dest %08X #Subs %d\n", thisMsg->from, thisMsg->dest, numSubs);
-					// for (int idx = 0; idx < numSubs; idx++)
-					// {
-					// 	uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-					// 	subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-					// 	subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-					// 	subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-					// 	uint8_t hops = thisMsg->nodes[idx][4];
-					// 	Serial.printf("ID: %08X numHops: %d\n", subId, hops);
-					// }
-					// Serial.println("++++++++++++++++++++++++++++");
-
-					for (int idx = 0; idx < numSubs - 1; idx++)
+					// Remove nodes that use sending node as hop
+					clearSubs(thisMsg->from);
+
+					if (subsSize != 0)
 					{
-						uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-						subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-						subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-						subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-						uint8_t hops = thisMsg->nodes[idx][4];
-						if (subId != deviceID)
+						// Mapping contains subs
+
+						myLog_v("Msg size %d", tempSize);
+						myLog_v("#subs %d", numSubs);
+
+						// Serial.println("++++++++++++++++++++++++++++");
+						// Serial.printf("From %08X Version %d #Subs %d\n", thisMsg->from, thisMsg->version, numSubs);
+						// for (int idx = 0; idx < numSubs; idx++)
+						// {
+						// 	uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
+						// 	subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
+						// 	subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
+						// 	subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
+						// 	uint8_t hops = thisMsg->nodes[idx][4];
+						// 	Serial.printf("ID: %08X numHops: %d\n", subId, hops);
+						// }
+						// Serial.println("++++++++++++++++++++++++++++");
+
+						for (int idx = 0; idx < numSubs - 1; idx++)
 						{
-							nodesChanged |= addNode(subId, thisMsg->from, hops + 1);
-							myLog_v("Subs %08X", subId);
+							uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
+							subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
+							subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
+							subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
+							uint8_t hops = thisMsg->nodes[idx][4];
+							if (subId != deviceID)
+							{
+								nodesChanged |= addMapNode(subId, thisMsg->from, hops, costMap);
+								myLog_v("Subs %08X", subId);
+							}
 						}
 					}
+					setMapVersion(thisMsg->from, thisMsg->version);
 				}
 				xSemaphoreGive(accessNodeList);
 			}
@@ -533,105 +811,44 @@ void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 				myLog_e("Could not access map to add node");
 			}
 		}
-		else if (thisDataMsg->type == LORA_DIRECT)
+		else if (thisDataMsg->type == LORA_MAP_REQUEST)
 		{
 			if (thisDataMsg->dest == deviceID)
 			{
-				// Message is for us, call user callback to handle the data
-				myLog_d("Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
-				if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
-				{
-					_MeshEvents->DataAvailable(thisDataMsg->orig, thisDataMsg->data, tempSize - 12, rxRssi, rxSnr);
-				}
-			}
-			else
-			{
-				// Message is not for us
+				// Neighbour lost track of our map versions, send the full map soon
+				myLog_d("Full map requested by %08X", thisDataMsg->from);
+				requestFullMap();
 			}
 		}
-		else if (thisDataMsg->type == LORA_FORWARD)
+		else if (thisDataMsg->type == LORA_ACK)
 		{
-			if (thisDataMsg->dest == deviceID)
+			ackReceived(thisDataMsg->from, thisDataMsg->dest);
+		}
+		else if ((thisDataMsg->type == LORA_DIRECT) || (thisDataMsg->type == LORA_FORWARD) || (thisDataMsg->type == LORA_BROADCAST))
+		{
+#if MESH_PROTOCOL_VERSION >= 3
+			if ((linkToken >= 0) && (thisDataMsg->dest == deviceID))
 			{
-				// Message is for sub node, forward the message
-				nodesList route;
-				if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+				// Previous hop waits for an ACK, send it again if the package is a retransmission
+				addLinkAck(linkToken);
+				if (isRetransmission(thisDataMsg->orig, linkToken))
 				{
-					if (getRoute(thisDataMsg->from, &route))
-					{
-						// We found a route, send package to next hop
-						if (route.firstHop == 0)
-						{
-							myLog_i("Route for %lX is direct", route.nodeId);
-							// Destination is a direct
-							thisDataMsg->dest = thisDataMsg->from;
-							thisDataMsg->from = thisDataMsg->orig;
-							thisDataMsg->type = LORA_DIRECT;
-						}
-						else
-						{
-							myLog_i("Route for %lX is to %lX", route.nodeId, route.firstHop);
-							// Destination is a sub
-							thisDataMsg->dest = route.firstHop;
-							thisDataMsg->type = LORA_FORWARD;
-						}
-
-						// Put message into send queue
-						if (!addSendRequest(thisDataMsg, tempSize))
-						{
-							myLog_e("Cannot forward message because send queue is full");
-						}
-					}
-					else
-					{
-						myLog_e("No route found for %lX", thisMsg->from);
-					}
-					xSemaphoreGive(accessNodeList);
-				}
-				else
-				{
-					myLog_e("Could not access map to forward package");
+					myLog_d("Got a retransmission from %08X, dismissing it", thisDataMsg->orig);
+					return;
 				}
 			}
-			else
-			{
-				// Message is not for us
-			}
+#endif
+			handleDataMsg(thisDataMsg, tempSize, rxRssi, rxSnr);
 		}
-		else if (thisDataMsg->type == LORA_BROADCAST)
+		else if (thisDataMsg->type == LORA_AGGREGATE)
 		{
-			// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
-			myLog_d("Handling broadcast with ID %08X from %08X", thisDataMsg->dest, thisDataMsg->from);
-			// Check if this broadcast is coming from ourself
-			if ((thisDataMsg->dest & 0xFFFFFF00) == (deviceID & 0xFFFFFF00))
-			{
-				myLog_w("We received our own broadcast, dismissing it");
-				return;
-			}
-			// Check if we handled this broadcast already
-			if (isOldBroadcast(thisDataMsg->dest))
-			{
-				myLog_w("Got an old broadcast, dismissing it");
-				return;
-			}
-
-			// Put broadcast into send queue
-			if (!addSendRequest(thisDataMsg, tempSize))
-			{
-				myLog_e("Cannot forward broadcast because send queue is full");
-			}
-
-			// This is a broadcast, call user callback to handle the data
-			myLog_d("Got data broadcast %s", (char *)thisDataMsg->data);
-			if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
-			{
-				_MeshEvents->DataAvailable(thisDataMsg->from, thisDataMsg->data, tempSize - 12, rxRssi, rxSnr);
-			}
+			handleAggregate(rxBuffer, tempSize, rxRssi, rxSnr);
 		}
 	}
 	else
 	{
 		myLog_e("Invalid package");
+		meshCounters.rxFrames[LORA_INVALID]++;
 		for (int idx = 0; idx < tempSize; idx++)
 		{
 			Serial.printf("%02X ", rxBuffer[idx]);
@@ -640,6 +857,47 @@ void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
 	}
 }
 
+/**
+ * Callback after a LoRa package was received
+ * Counts the time the handling of the package takes
+ * @param rxPayload
+ * 			Pointer to the received data
+ * @param rxSize
+ * 			Length of the received package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
+ */
+void OnRxDone(uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr)
+{
+	TRACE_ENTER(TRACE_RX_DONE, rxSize);
+	uint32_t start = micros();
+	// The package is written once into a package buffer, forwarding and the application keep references to it
+	meshPacket *packet = allocPacket();
+	if (packet != NULL)
+	{
+		receiveFrame(packet, rxPayload, rxSize, rxRssi, rxSnr);
+		releasePacket(packet);
+	}
+	else
+	{
+		// All buffers are held by the send queue and the application
+		myLog_e("No free package buffer, package dropped");
+		loraState = MESH_IDLE;
+		Radio.Standby();
+		Radio.SetRxDutyCycle(RX_SLEEP_TIMES);
+	}
+	uint32_t rxTime = micros() - start;
+	meshCounters.rxHandled++;
+	meshCounters.rxTimeSum += rxTime;
+	if (rxTime > meshCounters.rxTimeMax)
+	{
+		meshCounters.rxTimeMax = rxTime;
+	}
+	TRACE_EXIT(TRACE_RX_DONE, rxSize);
+}
+
 /**
  * Callback after a package was successfully sent
  */
@@ -647,6 +905,8 @@ void OnTxDone(void)
 {
 	myLog_w("LoRa send finished");
 	loraState = MESH_IDLE;
+	// Start waiting for the ACK
+	sendDone(true);
 
 	// Restart listening
 	Radio.Standby();
@@ -662,6 +922,7 @@ void OnTxTimeout(void)
 {
 	myLog_w("LoRa TX timeout");
 	loraState = MESH_IDLE;
+	sendDone(false);
 
 	// Restart listening
 	Radio.Standby();
@@ -751,9 +1012,9 @@ void OnPreAmbDetect(void)
 
 /**
  * Callback if the Channel Activity Detection has finished
- * Starts sending the ACK package if the channel is available
- * Retries 5 times if the channel was busy.
- * Returns to listen mode if the channel was occupied 5 times
+ * Starts sending the package if the channel is available
+ * If the channel was busy, returns to listen mode and lets meshTask
+ * repeat the CAD after a random wait, up to CAD_RETRY times.
  * 
  * @param cadResult
  * 		True if channel activity was detected
@@ -761,16 +1022,21 @@ void OnPreAmbDetect(void)
  */
 void OnCadDone(bool cadResult)
 {
+	TRACE_ENTER(TRACE_CAD_DONE, cadResult);
+	meshCounters.cadRuns++;
 	// Not used
 	if (cadResult)
 	{
 		myLog_d("CAD returned channel busy");
+		meshCounters.cadBusy++;
 		channelFreeRetryNum++;
 		if (channelFreeRetryNum >= CAD_RETRY)
 		{
 			myLog_e("CAD returned channel busy %d times, giving up", CAD_RETRY);
+			meshCounters.cadFailed++;
 			loraState = MESH_IDLE;
 			channelFreeRetryNum = 0;
+			sendDone(false);
 			// Restart listening
 			Radio.Standby();
 			// Radio.Rx(0);
@@ -778,11 +1044,14 @@ void OnCadDone(bool cadResult)
 		}
 		else
 		{
-			// Wait a little bit before retrying
-			delay(250);
+			// Listen while waiting a random time before retrying, meshTask restarts the CAD
+			cadBackoffTime = random(CAD_BACKOFF_MIN, CAD_BACKOFF_MAX + 1);
+			cadBackoffStart = millis();
+			cadBackoff = true;
+			loraState = MESH_IDLE;
 			Radio.Standby();
-			Radio.SetCadParams(LORA_CAD_08_SYMBOL, LORA_SPREADING_FACTOR + 13, 10, LORA_CAD_ONLY, 0);
-			Radio.StartCad();
+			// Radio.Rx(0);
+			Radio.SetRxDutyCycle(RX_SLEEP_TIMES);
 		}
 	}
 	else
@@ -792,87 +1061,22 @@ void OnCadDone(bool cadResult)
 		channelFreeRetryNum = 0;
 
 		// Send the data package
+		chargeAirTime(txLen);
+		countFrame(meshCounters.txFrames, txType);
 		Radio.Standby();
-		Radio.Send((uint8_t *)&txPckg, txLen);
-	}
-}
-
-/**
- * Add a data package to the queue
- * @param package
- * 			dataPckg * to the package data
- * @param msgSize
- * 			Size of the data package
- * @return result
- * 			TRUE if task could be added to queue
- * 			FALSE if queue is full or not initialized 
- */
-bool addSendRequest(dataMsg *package, uint8_t msgSize)
-{
-	if (sendQueue != NULL)
-	{
-#ifdef ESP32
-		portENTER_CRITICAL(&accessMsgQueue);
-#else
-		taskENTER_CRITICAL();
-#endif
-		// Find unused entry in queue list
-		int next = SEND_QUEUE_SIZE;
-		for (int idx = 0; idx < SEND_QUEUE_SIZE; idx++)
+		if (txPower != radioTxPower)
 		{
-			if (sendMsg[idx].type == LORA_INVALID)
-			{
-				next = idx;
-				break;
-			}
+			// Next hop needs a different TX power
+			Radio.SetTxConfig(MODEM_LORA, txPower, 0, MeshRadio::bandwidth,
+							  MeshRadio::spreadingFactor, MeshRadio::codingRate,
+							  MeshRadio::preambleLength, LORA_FIX_LENGTH_PAYLOAD_ON,
+							  MeshRadio::crcOn, 0, 0, LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE);
+			radioTxPower = txPower;
 		}
-
-		if (next != SEND_QUEUE_SIZE)
-		{
-			// Found an empty entry!
-			memcpy(&sendMsg[next], package, msgSize);
-			sendMsgSize[next] = msgSize;
-
-			myLog_d("Queued msg #%d with len %d", next, msgSize);
-
-			// Try to add to cloudTaskQueue
-			if (xQueueSend(sendQueue, &next, (TickType_t)1000) != pdTRUE)
-			{
-				myLog_e("Send queue is busy");
-#ifdef ESP32
-				portEXIT_CRITICAL(&accessMsgQueue);
-#else
-				taskEXIT_CRITICAL();
-#endif
-				return false;
-			}
-			else
-			{
-				myLog_v("Send request queued:");
-#ifdef ESP32
-				portEXIT_CRITICAL(&accessMsgQueue);
-#else
-				taskEXIT_CRITICAL();
-#endif
-				return true;
-			}
-		}
-		else
-		{
-			myLog_e("Send queue is full");
-			// Queue is already full!
-#ifdef ESP32
-			portEXIT_CRITICAL(&accessMsgQueue);
-#else
-			taskEXIT_CRITICAL();
-#endif
-			return false;
-		}
-	}
-	else
-	{
-		myLog_e("Send queue not yet initialized");
-		return false;
+		TRACE_ENTER(TRACE_RADIO_SEND, txLen);
+		Radio.Send((uint8_t *)&txPckg, txLen);
+		TRACE_EXIT(TRACE_RADIO_SEND, txLen);
 	}
+	TRACE_EXIT(TRACE_CAD_DONE, cadResult);
 }
 #endif
@@ -1,4 +1,6 @@
 #include "Arduino.h"
+#include "trace.h"
+#include "radio_profile.h"
 
 struct mapMsg
 {
@@ -6,9 +8,14 @@ struct mapMsg
 	uint8_t mark2 = 'o';
 	uint8_t mark3 = 'R';
 	uint8_t type = 5;
-	uint32_t dest = 0;
+	/** Version of the senders map */
+	uint16_t version = 0;
+	/** Delta map: version the changes are based on, full map: same as version */
+	uint16_t baseVersion = 0;
 	uint32_t from = 0;
 	uint8_t nodes[48][5];
+	/** Room for the map flags and sequence, the TX power and the protocol version that are appended after the end marker */
+	uint8_t trailer[3];
 };
 
 struct dataMsg
@@ -23,6 +30,17 @@ struct dataMsg
 	uint8_t data[243];
 };
 
+struct aggregateMsg
+{
+	uint8_t mark1 = 'L';
+	uint8_t mark2 = 'o';
+	uint8_t mark3 = 'R';
+	uint8_t type = 7;
+	uint32_t from = 0;
+	/** Packages as [size][package without 'LoR' marks], size counts without the marks */
+	uint8_t items[247];
+};
+
 /**
  * Mesh callback functions
  */
@@ -61,51 +79,462 @@ void OnRxTimeout(void);
 void OnRxError(void);
 void OnPreAmbDetect(void);
 void OnCadDone(bool cadResult);
+void meshIrqNotify(void);
 bool addSendRequest(dataMsg *package, uint8_t msgSize);
 extern TaskHandle_t meshTaskHandle;
 extern volatile xQueueHandle meshMsgQueue;
 
+/** Max number of messages in the send queue, can be set in platformio.ini */
+#ifndef SEND_QUEUE_SIZE
+#define SEND_QUEUE_SIZE 16
+#endif
+
+/** Number of package buffers, can be set in platformio.ini
+ *  Room for a full send queue, a full application inbox (LORA_RX_QUEUE_SIZE), the package that is received
+ *  and one package out of a received aggregated package */
+#ifndef PACKET_POOL_SIZE
+#define PACKET_POOL_SIZE (SEND_QUEUE_SIZE + 10)
+#endif
+
+/**
+ * Reference counted package buffer
+ * A received package is written once into a buffer, the send queue
+ * and the application keep references to it instead of copies.
+ */
+struct meshPacket
+{
+	/** The package in the v1 layout, null terminated, aligned for the dataMsg and mapMsg access */
+	uint8_t data[sizeof(dataMsg) + 1] __attribute__((aligned(4)));
+	/** Number of references, the buffer is unused at 0 */
+	uint8_t refs;
+};
+
+/**
+ * Statistics of the package buffers
+ */
+struct packetPoolStats
+{
+	/** Buffers in use */
+	uint16_t inUse;
+	/** Max number of buffers that were in use at the same time */
+	uint16_t highWater;
+	/** Buffers taken */
+	uint32_t allocated;
+	/** Requests for a buffer that failed because all buffers were in use */
+	uint32_t failed;
+};
+
+void initPacketPool(void);
+meshPacket *allocPacket(void);
+meshPacket *holdPacket(const void *data);
+void releasePacket(meshPacket *packet);
+void getPacketPoolStats(packetPoolStats *stats);
+bool addSendPacket(meshPacket *packet, uint8_t msgSize);
+
+/** Allowed airtime in permille of TX_BUDGET_WINDOW, can be set in platformio.ini */
+#ifndef TX_DUTY_CYCLE
+#define TX_DUTY_CYCLE 100
+#endif
+/** Length of the rolling airtime budget window in ms, can be set in platformio.ini */
+#ifndef TX_BUDGET_WINDOW
+#define TX_BUDGET_WINDOW 60000
+#endif
+/** Number of slices the budget window is divided into */
+#define TX_BUDGET_SLICES 12
+
+/** Size of the aggregated package header */
+#define AGGREGATE_HEADER_SIZE 8
+/** Max size of packages that are combined into an aggregated package, can be set in platformio.ini */
+#ifndef AGGREGATE_MAX_ITEM
+#define AGGREGATE_MAX_ITEM 80
+#endif
+
+/** Number of retransmissions of a unicast package before it is given up, can be set in platformio.ini */
+#ifndef ACK_RETRIES
+#define ACK_RETRIES 3
+#endif
+/** Time in ms added to the airtime of package and ACK before a missing ACK triggers a retransmission, can be set in platformio.ini */
+#ifndef ACK_TIMEOUT_MARGIN
+#define ACK_TIMEOUT_MARGIN 500
+#endif
+/** Returned by checkAckTimeouts() if no package waits for an ACK */
+#define ACK_NO_TIMEOUT 0x7FFFFFFF
+
+/** Traffic classes of the send queue, in sending order */
+#define SEND_CONTROL 0
+#define SEND_UNICAST 1
+#define SEND_BULK 2
+#define SEND_CLASSES 3
+
+/**
+ * Statistics of the send queue
+ */
+struct sendQueueStats
+{
+	/** Packages added to the queue */
+	uint32_t queued;
+	/** Packages taken from the queue for sending */
+	uint32_t sent;
+	/** Packages rejected because the queue was full */
+	uint32_t dropped;
+	/** Max number of packages that were in the queue at the same time */
+	uint16_t highWater;
+	/** Longest time a package waited in the queue in ms */
+	time_t maxDelay;
+	/** Sum of the time all sent packages waited in the queue in ms */
+	uint64_t sumDelay;
+	/** Packages held back because the airtime budget was used up */
+	uint32_t deferred;
+	/** Airtime of all sent packages in ms */
+	uint64_t airTime;
+	/** Aggregated packages sent */
+	uint32_t aggregates;
+	/** Packages sent inside aggregated packages */
+	uint32_t aggregatedItems;
+	/** Unicast packages acknowledged by the next hop */
+	uint32_t acked;
+	/** Unicast packages sent again because the ACK was missing */
+	uint32_t retries;
+	/** Unicast packages given up after ACK_RETRIES retransmissions */
+	uint32_t ackFailed;
+	/** Given up unicast packages sent again through another first hop */
+	uint32_t rerouted;
+	/** ACKs sent for received packages */
+	uint32_t acksSent;
+	/** Unicast packages put back into the queue because they were not sent (channel busy, TX timeout) */
+	uint32_t unsent;
+};
+
+void initSendQueue(uint32_t (*airTime)(uint8_t msgSize));
+bool getSendRequest(uint8_t *buffer, uint16_t *msgSize, int32_t *linkToken);
+void sendDone(bool sent);
+uint8_t sendRetries(void);
+time_t checkAckTimeouts(void);
+void ackReceived(uint32_t from, uint16_t linkToken);
+void addLinkAck(uint16_t linkToken);
+void chargeAirTime(uint16_t msgSize);
+time_t sendBudgetWait(void);
+uint16_t sendQueueCount(void);
+void getSendQueueStats(sendQueueStats *stats);
+
+bool initMapSync(int numOfNodes);
+uint8_t buildMapMsg(mapMsg *msg);
+bool handleMapDelta(mapMsg *msg, uint8_t numEntries, bool costMap);
+bool addMapNode(uint32_t id, uint32_t hop, uint8_t value, bool costMap);
+void requestFullMap(void);
+bool getMapResync(time_t &requestTime);
+
 /** Size of map message buffer without subnode */
 #define MAP_HEADER_SIZE 12
+/** Max number of nodes in a map message, plus the end marker it fills the 48 entries of mapMsg */
+#define MAP_MAX_ENTRIES 47
+/** Number of hops in a delta map entry for a node that was removed */
+#define MAP_ENTRY_REMOVED 0xFF
+/** A delta map contains the changes of the last n maps, a neighbour can miss n - 1 maps, can be set in platformio.ini */
+#ifndef MAP_DELTA_HISTORY
+#define MAP_DELTA_HISTORY 3
+#endif
+/** Every n-th map is sent as full map, even if a delta would be enough, can be set in platformio.ini */
+#ifndef MAP_FULL_SYNC_INTERVAL
+#define MAP_FULL_SYNC_INTERVAL 5
+#endif
+/** Map flag: the entries carry the path cost instead of the number of hops, shares the byte with the map sequence */
+#define MAP_FLAG_COST 0x80
+/** Bits of the map sequence number, it counts every sent map so that neighbours see the lost ones */
+#define MAP_SEQ_MASK 0x7F
+/** Time to collect full map requests of neighbours before sending the full map */
+#define MAP_RESYNC_DELAY 1000
 /** Size of data message buffer without subnode */
 #define DATA_HEADER_SIZE 16
 
+/**
+ * Wire protocol version of this node, can be set in platformio.ini
+ * 1 original format only
+ * 2 compact header, delta maps and aggregated packages
+ * 3 compact header and link ACKs for unicast packages
+ * 4 maps with path cost (ETX) instead of number of hops
+ * 5 chat text compressed with the text codec of the application
+ */
+#ifndef MESH_PROTOCOL_VERSION
+#define MESH_PROTOCOL_VERSION 5
+#endif
+/** First byte of a compact (v2) package, upper nibble marks it, lower nibble is the version */
+#define MESH_WIRE_MAGIC 0xA2
+
+uint16_t encodeFrame(uint8_t *frame, uint16_t size, int32_t linkToken);
+uint16_t decodeFrame(const uint8_t *wire, uint16_t size, uint8_t *frame, int32_t *linkToken);
+uint16_t wireFrame(uint8_t *frame, uint16_t size, int32_t linkToken);
+
 /** Number of retries if CAD shows busy */
 #define CAD_RETRY 20
+/** Shortest random wait in ms before repeating a CAD that showed busy, can be set in platformio.ini */
+#ifndef CAD_BACKOFF_MIN
+#define CAD_BACKOFF_MIN 50
+#endif
+/** Longest random wait in ms before repeating a CAD that showed busy, can be set in platformio.ini */
+#ifndef CAD_BACKOFF_MAX
+#define CAD_BACKOFF_MAX 500
+#endif
+/** Longest random wait before a received broadcast is forwarded, in airtimes of the frame, can be set in platformio.ini */
+#ifndef BROADCAST_JITTER
+#define BROADCAST_JITTER 3
+#endif
 
 // LoRa definitions
 #define RF_FREQUENCY 910000000  // Hz
 #define TX_OUTPUT_POWER 22		// dBm
-#define LORA_BANDWIDTH 1		// [0: 125 kHz, 1: 250 kHz, 2: 500 kHz, 3: Reserved]
+/** Modulation of the mesh, all nodes must use the same, can be set in platformio.ini */
+#ifndef LORA_BANDWIDTH
+#define LORA_BANDWIDTH 1		// [0: 125 kHz, 1: 250 kHz, 2: 500 kHz]
+#endif
+#ifndef LORA_SPREADING_FACTOR
 #define LORA_SPREADING_FACTOR 7 // [SF7..SF12]
+#endif
+#ifndef LORA_CODINGRATE
 #define LORA_CODINGRATE 1		// [1: 4/5, 2: 4/6, 3: 4/7, 4: 4/8]
+#endif
+#ifndef LORA_PREAMBLE_LENGTH
 #define LORA_PREAMBLE_LENGTH 8  // Same for Tx and Rx
+#endif
 #define LORA_SYMBOL_TIMEOUT 0   // Symbols
 #define LORA_FIX_LENGTH_PAYLOAD_ON false
 #define LORA_IQ_INVERSION_ON false
 #define RX_TIMEOUT_VALUE 5000
 #define TX_TIMEOUT_VALUE 5000
 
+/** Radio settings, time on air table, CAD parameters and RX duty cycle of the mesh, calculated at compile time */
+#ifdef USE_RFM95
+// The RFM95 sends without CRC
+typedef RadioProfile<LORA_SPREADING_FACTOR, LORA_BANDWIDTH, LORA_CODINGRATE, LORA_PREAMBLE_LENGTH, false> MeshRadio;
+#else
+typedef RadioProfile<LORA_SPREADING_FACTOR, LORA_BANDWIDTH, LORA_CODINGRATE, LORA_PREAMBLE_LENGTH> MeshRadio;
+#endif
+
+/** TX power in dBm of maps, broadcasts and ACKs, announced in the map so that neighbours can calculate the path loss */
+#ifdef USE_RFM95
+#define LINK_FULL_POWER 17
+#else
+#define LINK_FULL_POWER TX_OUTPUT_POWER
+#endif
+/** Send unicast packages with the TX power the next hop needs, 0 sends all packages with full power, can be set in platformio.ini */
+#ifndef LINK_ADAPT_POWER
+#define LINK_ADAPT_POWER 1
+#endif
+/** Lowest TX power in dBm of a unicast package, can be set in platformio.ini */
+#ifndef LINK_MIN_POWER
+#define LINK_MIN_POWER 2
+#endif
+/** RSSI in dBm a unicast package should arrive with, about 20 dB above the sensitivity of SF7 at 250 kHz, can be set in platformio.ini */
+#ifndef LINK_RSSI_TARGET
+#define LINK_RSSI_TARGET -100
+#endif
+/** Links with a lower SNR in dB are always sent with full power */
+#define LINK_SNR_MIN 5
+
+/** Unit of the path cost, the cost of one transmission over a perfect link */
+#define ETX_UNIT 4
+/** Highest path cost of a reachable node, 0xFE and 0xFF are markers in delta maps */
+#define ETX_MAX_COST 0xFD
+/** Path cost of an unreachable node */
+#define ETX_UNREACHABLE 0xFF
+/** Highest cost of a single link, a worse link is still better than no link */
+#define ETX_LINK_MAX (8 * ETX_UNIT)
+/** A route through another first hop is taken only if it is cheaper by this cost, avoids flapping routes, can be set in platformio.ini */
+#ifndef ETX_SWITCH_MARGIN
+#define ETX_SWITCH_MARGIN 2
+#endif
+/** Extra cost of every hop, each forward adds CAD, ACK and collision risk the link estimate does not see, can be set in platformio.ini */
+#ifndef ETX_HOP_PENALTY
+#define ETX_HOP_PENALTY (3 * ETX_UNIT)
+#endif
+/** Links with a lower averaged SNR in dB are close to the sensitivity and get a higher cost */
+#define ETX_SNR_WEAK -5
+/** Change of the estimated link cost in 1/n of the cost that is taken over, smaller changes are ignored */
+#define ETX_LINK_CHANGE 4
+/** Change of a path cost in 1/n of the cost that is sent with the next delta map, smaller changes wait */
+#define MAP_COST_CHANGE 4
+/** Number of alternative first hops kept per node beside the one in use, can be set in platformio.ini */
+#ifndef ROUTE_ALTERNATES
+#define ROUTE_ALTERNATES 2
+#endif
+
+/** Max number of nodes in the map, the node table is allocated for this number at compile time, can be set in platformio.ini */
+#ifndef MAX_NODES
+#define MAX_NODES 48
+#endif
+/** Size of a node name, terminating 0 included */
+#define NODE_NAME_SIZE 17
+/** Number of names kept for nodes that are not in the map, can be set in platformio.ini */
+#ifndef NAME_CACHE_SIZE
+#define NAME_CACHE_SIZE 16
+#endif
+
+/**
+ * Entry of the node table, route and name of one node
+ * Ordered by size to avoid padding, the fields used by the routing come first, the name is last
+ */
 struct nodesList
 {
 	uint32_t nodeId;
 	uint32_t firstHop;
-	time_t timeStamp;
+	/** Time of the last refresh in ms (millis()) */
+	uint32_t timeStamp;
+	/** Other direct nodes that reach the node cheaper than we ever did, used if firstHop fails, 0 marks an unused entry */
+	uint32_t altHop[ROUTE_ALTERNATES];
+	/** Hash of the name, compared before the name itself */
+	uint32_t nameHash;
+	uint16_t mapVersion;
 	uint8_t numHops;
+	/** Highest wire protocol version the node understands */
+	uint8_t protoVersion;
+	/** Averaged path loss in dB to a direct node, 0 if unknown */
+	uint8_t linkLoss;
+	/** Averaged SNR in dB of the maps of a direct node */
+	int8_t linkSnr;
+	/** Path cost in ETX_UNIT, of the link for a direct node, as advertised by the first hop for other nodes */
+	uint8_t cost;
+	/** Averaged share of the packages to a direct node that were acknowledged (255 = all), 0 if none was sent */
+	uint8_t ackRate;
+	/** Averaged share of the maps of a direct node that were received (255 = all), 0 if no map sequence is known */
+	uint8_t mapRate;
+	/** Sequence number of the last map received from a direct node */
+	uint8_t mapSeq;
+	/** Lowest path cost in ETX_UNIT of the route to a node that is not direct since its entry was added */
+	uint8_t feasibleCost;
+	/** Path cost the alternative first hops advertised for the node */
+	uint8_t altCost[ROUTE_ALTERNATES];
+	/** Number of hops through the alternative first hops */
+	uint8_t altHops[ROUTE_ALTERNATES];
+	/** Nick name of the node, the node ID in hex until the node sent its name */
+	char name[NODE_NAME_SIZE];
 };
 
+bool initNodesMap(int numOfNodes);
 bool getRoute(uint32_t id, nodesList *route);
-boolean addNode(uint32_t id, uint32_t hop, uint8_t numHops);
+boolean addNode(uint32_t id, uint32_t hop, uint8_t numHops, uint8_t cost);
 void removeNode(uint32_t id);
 void clearSubs(uint32_t id);
+void refreshSubs(uint32_t id);
+bool removeSub(uint32_t id, uint32_t hop);
+bool getAlternateRoute(uint32_t id, uint32_t failedHop, nodesList *route);
+uint16_t getMapVersion(uint32_t id);
+void setMapVersion(uint32_t id, uint16_t version);
+uint8_t getNodeProtocol(uint32_t id);
+void setNodeProtocol(uint32_t id, uint8_t version);
+uint8_t neighbourProtocol(void);
+uint8_t mapProtocol(void);
+void setLinkQuality(uint32_t id, int8_t txPower, int16_t rssi, int8_t snr);
+int8_t getFrameTxPower(uint8_t *frame, bool retry);
+void setMapSequence(uint32_t id, uint8_t sequence);
+void setLinkDelivery(uint32_t id, bool acked);
 bool cleanMap(void);
-uint8_t nodeMap(uint32_t subs[], uint8_t hops[]);
-uint8_t nodeMap(uint8_t nodes[][5]);
-uint8_t numOfNodes();
-bool getNode(uint8_t nodeNum, uint32_t &nodeId, uint32_t &firstHop, uint8_t &numHops);
+uint16_t nodeMap(uint32_t subs[], uint8_t hops[]);
+uint16_t nodeMap(uint8_t nodes[][5], uint16_t maxNodes);
+uint8_t getNodeCost(uint16_t nodeNum);
+uint16_t numOfNodes();
+bool getNode(uint16_t nodeNum, uint32_t &nodeId, uint32_t &firstHop, uint8_t &numHops);
+bool setNodeName(uint32_t id, char *nodeName);
+bool getNodeName(uint32_t id, char *nodeName);
+uint32_t getNodeIdFromName(char *nodeName);
+bool getNodeNameByIndex(uint16_t index, uint32_t &nodeId, char *nodeName);
 uint32_t getNextBroadcastID(void);
-bool isOldBroadcast(uint32_t broadcastID);
+bool isOldBroadcast(uint32_t origin, uint32_t broadcastID);
+bool isRetransmission(uint32_t origin, uint16_t linkToken);
+
+/** Number of broadcasts remembered to detect duplicates, multiple of 4, can be set in platformio.ini */
+#ifndef BROADCAST_CACHE_SIZE
+#define BROADCAST_CACHE_SIZE 128
+#endif
+/** Time in ms a broadcast is remembered */
+#define BROADCAST_CACHE_TIME 60000
+/** Number of received link tokens remembered to detect retransmissions */
+#define LINK_CACHE_SIZE 32
+/** Time in ms a link token is remembered, longer than all retransmissions of a package take */
+#define LINK_CACHE_TIME 30000
+
+/**
+ * Statistics of the broadcast duplicate detection
+ */
+struct broadcastStats
+{
+	/** Broadcasts checked */
+	uint32_t received;
+	/** Broadcasts suppressed because they were seen before */
+	uint32_t duplicates;
+	/** Valid entries replaced because the cache was full */
+	uint32_t evicted;
+};
+
+void getBroadcastStats(broadcastStats *stats);
+
+/**
+ * Statistics of the per link TX power
+ */
+struct linkPowerStats
+{
+	/** Unicast packages sent with full power */
+	uint32_t fullPower;
+	/** Unicast packages sent with reduced power */
+	uint32_t reduced;
+	/** Sum of the power reductions in dB */
+	uint32_t savedDb;
+};
+
+void getLinkPowerStats(linkPowerStats *stats);
+
+/** Number of LoRa package types in the statistics, LORA_INVALID counts the unknown and invalid packages */
+#define MESH_STATS_TYPES (LORA_ACK + 1)
+
+/**
+ * Statistics of the radio and the package handling
+ */
+struct meshStats
+{
+	/** Packages sent per LoRa package type */
+	uint32_t txFrames[MESH_STATS_TYPES];
+	/** Packages received per LoRa package type */
+	uint32_t rxFrames[MESH_STATS_TYPES];
+	/** Channel activity detections before sending */
+	uint32_t cadRuns;
+	/** Channel activity detections that found the channel busy */
+	uint32_t cadBusy;
+	/** Packages given up because the channel stayed busy */
+	uint32_t cadFailed;
+	/** Unicast packages forwarded to the next hop */
+	uint32_t forwarded;
+	/** Broadcasts forwarded */
+	uint32_t broadcastsForwarded;
+	/** Unicast packages that could not be forwarded because there is no route */
+	uint32_t noRoute;
+	/** Received packages handled by the RX callback */
+	uint32_t rxHandled;
+	/** Sum of the time the RX callback took in us */
+	uint64_t rxTimeSum;
+	/** Longest time the RX callback took in us */
+	uint32_t rxTimeMax;
+	/** Bytes copied from the radio into package buffers, compact packages and aggregated packages included */
+	uint32_t rxCopied;
+};
+
+void getMeshStats(meshStats *stats);
+
+/**
+ * Statistics of the routing table
+ */
+struct routeStats
+{
+	/** Nodes in the map */
+	uint16_t mapSize;
+	/** Nodes added to the map */
+	uint32_t added;
+	/** Nodes removed from the map */
+	uint32_t removed;
+	/** Nodes that switched to another first hop */
+	uint32_t changed;
+};
+
+void getRouteStats(routeStats *stats);
 
 extern SemaphoreHandle_t accessNodeList;
-extern nodesList *nodesMap;
+extern nodesList nodesMap[MAX_NODES];
 extern int _numOfNodes;
@@ -23,6 +23,10 @@ volatile xQueueHandle meshMsgQueue;
 
 /** Counter for CAD retry */
 uint8_t channelFreeRetryNum = 0;
+/** Time when the CAD retry wait started */
+time_t cadBackoffStart = 0;
+/** Random wait time before the CAD retry */
+time_t cadBackoffTime = 0;
 
 /** The Mesh node ID, created from ID of the nRF52 */
 uint32_t deviceID;
@@ -32,18 +36,6 @@ uint32_t broadcastID;
 /** Map message buffer */
 mapMsg syncMsg;
 
-/** Max number of messages in the queue */
-#define SEND_QUEUE_SIZE 2
-/** Send buffer for SEND_QUEUE_SIZE messages */
-dataMsg sendMsg[SEND_QUEUE_SIZE];
-/** Message size buffer for SEND_QUEUE_SIZE messages */
-uint8_t sendMsgSize[SEND_QUEUE_SIZE];
-/** Queue to handle send requests */
-volatile xQueueHandle sendQueue;
-#ifdef ESP32
-/** Mux used to enter critical code part (clear up queue content) */
-portMUX_TYPE accessMsgQueue = portMUX_INITIALIZER_UNLOCKED;
-#endif
 /** Mux used to enter critical code part (access to node list) */
 SemaphoreHandle_t accessNodeList;
 
@@ -51,13 +43,22 @@ SemaphoreHandle_t accessNodeList;
 uint8_t txPckg[256];
 /** Size of data package */
 uint16_t txLen = 0;
-/** LoRa RX buffer */
-uint8_t rxBuffer[256];
+/** Link token of the package in txPckg, -1 if it needs no ACK */
+int32_t txLinkToken = -1;
+/** TX power of the package in txPckg */
+int8_t txPower = LINK_FULL_POWER;
+/** TX power the radio is set to */
+int8_t radioTxPower = LINK_FULL_POWER;
+/** LoRa RX buffer, the package is read into it from the radio */
+uint8_t radioBuffer[256];
 /** Size of data package */
 uint16_t rxSize = 0;
 /** Result of read package */
 int state = ERR_NONE;
 
+/** Statistics of the radio and the package handling */
+meshStats meshCounters;
+
 /** Sync time for routing at start */
 #define INIT_SYNCTIME 30000
 /** Sync time for routing after mesh has settled */
@@ -98,6 +99,41 @@ boolean hasData = false;
 /** Flag if RFM95 module has finished transmission */
 boolean txFinished = false;
 
+/**
+ * Get the time on air of a package
+ * Taken from the table of the radio profile, lora.getTimeOnAir() needs floating point math
+ * @param msgSize
+ * 		Size of the package
+ * @return uint32_t
+ * 		Time on air in milliseconds
+ */
+static uint32_t loraAirTime(uint8_t msgSize)
+{
+	return MeshRadio::airTime(msgSize);
+}
+
+/**
+ * Count a package in the per type statistics
+ * @param counters
+ * 		Counters of the sent or received packages
+ * @param type
+ * 		LoRa package type
+ */
+static inline void countFrame(uint32_t *counters, uint8_t type)
+{
+	counters[type < MESH_STATS_TYPES ? type : LORA_INVALID]++;
+}
+
+/**
+ * Get the statistics of the radio and the package handling
+ * @param stats
+ * 		Pointer to a structure for the statistics
+ */
+void getMeshStats(meshStats *stats)
+{
+	memcpy(stats, &meshCounters, sizeof(meshStats));
+}
+
 /**
  * Initialize the Mesh network
  * @param events
@@ -109,37 +145,29 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 {
 	_MeshEvents = events;
 
+#if MESH_TRACE
+	initTrace();
+#endif
+
 	_numOfNodes = numOfNodes;
 
 	// Prepare empty nodes map
-	nodesMap = (nodesList *)malloc(_numOfNodes * sizeof(nodesList));
-
-	if (nodesMap == NULL)
-	{
-		myLog_e("Could not allocate memory for nodes map");
-	}
-	else
-	{
-		myLog_d("Memory for nodes map is allocated");
-	}
-	memset(nodesMap, 0, _numOfNodes * sizeof(nodesList));
+	initNodesMap(_numOfNodes);
+	initMapSync(_numOfNodes);
 
-	// Create queue
-	sendQueue = xQueueCreate(SEND_QUEUE_SIZE, sizeof(uint8_t));
-	if (sendQueue == NULL)
-	{
-		myLog_e("Could not create send queue!");
-	}
-	else
-	{
-		myLog_d("Send queue created!");
-	}
+	// Create package buffers and queue
+	initPacketPool();
+	initSendQueue(loraAirTime);
 	// Create blocking semaphore for nodes list access
 	accessNodeList = xSemaphoreCreateBinary();
 	xSemaphoreGive(accessNodeList);
 
-	// Create broadcast ID
-	broadcastID = deviceID & 0xFFFFFF00;
+	// Create broadcast ID, start random because after a restart the neighbours might still remember the old IDs
+#if MESH_PROTOCOL_VERSION >= 2
+	broadcastID = (uint32_t)random(0x10000);
+#else
+	broadcastID = ((uint32_t)random(0x10000) << 16) | (uint32_t)random(0x10000);
+#endif
 	myLog_d("Broadcast ID is %08X", broadcastID);
 
 	state = lora.begin();
@@ -153,18 +181,13 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
 	}
 
 	lora.standby();
-	lora.setOutputPower(17);
+	lora.setOutputPower(LINK_FULL_POWER);
 	lora.setFrequency(RF_FREQUENCY / 1000000.0F);
-	float bw = 125.0F;
-	if (LORA_BANDWIDTH != 0)
-	{
-		bw = LORA_BANDWIDTH * 250.0F;
-	}
-	lora.setBandwidth(bw); // How to calculate from LORA_BANDWIDTH [0: 125 kHz, 1: 250 kHz, 2: 500 kHz, 3: Reserved]
-	lora.setCodingRate(LORA_CODINGRATE + 4);
-	lora.setPreambleLength(LORA_PREAMBLE_LENGTH);
-	lora.setSpreadingFactor(LORA_SPREADING_FACTOR);
-	lora.setCRC(false);
+	lora.setBandwidth(MeshRadio::bandwidthKHz);
+	lora.setCodingRate(MeshRadio::codingRate + 4);
+	lora.setPreambleLength(MeshRadio::preambleLength);
+	lora.setSpreadingFactor(MeshRadio::spreadingFactor);
+	lora.setCRC(MeshRadio::crcOn);
 
 	lora.setDio0Action(OnLoRaIRQ);
 
@@ -196,9 +219,7 @@ void initMesh(MeshEvents_t *events, int numOfNodes)
  */
 void meshTask(void *pvParameters)
 {
-	// Queue variable to be sent to the task
-	uint8_t queueIndex;
-
+	(void)pvParameters;
 	time_t notifyTimer = millis() + syncTime;
 	time_t checkSwitchSyncTime = millis();
 
@@ -216,6 +237,8 @@ void meshTask(void *pvParameters)
 		{
 			myLog_d("TX finished");
 			txFinished = false;
+			// Start waiting for the ACK
+			sendDone(true);
 			lora.standby();
 			lora.startReceive();
 			loraState = MESH_RX;
@@ -234,8 +257,10 @@ void meshTask(void *pvParameters)
 				_MeshEvents->NodesListChanged();
 			}
 		}
-		// Time to sync the Mesh ???
-		if (((millis() - notifyTimer) >= syncTime) && (loraState == MESH_RX))
+		// Time to sync the Mesh or did a neighbour request our full map ???
+		time_t resyncRequest;
+		bool resyncDue = getMapResync(resyncRequest) && ((millis() - resyncRequest) >= MAP_RESYNC_DELAY);
+		if ((((millis() - notifyTimer) >= (unsigned long)syncTime) || resyncDue) && (loraState == MESH_RX))
 		{
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
@@ -250,35 +275,13 @@ void meshTask(void *pvParameters)
 					}
 				}
 				myLog_d("Sending mesh map");
-				syncMsg.from = deviceID;
-				syncMsg.type = LORA_NODEMAP;
-				memset(syncMsg.nodes, 0, 48 * 5);
-
-				// Get sub nodes
-				uint8_t subsLen = nodeMap(syncMsg.nodes);
+				// Get full or delta map
+				uint8_t mapSize = buildMapMsg(&syncMsg);
 
 				xSemaphoreGive(accessNodeList);
 
-				if (subsLen != 0)
-				{
-					for (int idx = 0; idx < subsLen; idx++)
-					{
-						uint32_t checkNode = syncMsg.nodes[idx][0];
-						checkNode |= syncMsg.nodes[idx][1] << 8;
-						checkNode |= syncMsg.nodes[idx][2] << 16;
-						checkNode |= syncMsg.nodes[idx][3] << 24;
-					}
-				}
-				syncMsg.nodes[subsLen][0] = 0xAA;
-				syncMsg.nodes[subsLen][1] = 0x55;
-				syncMsg.nodes[subsLen][2] = 0x00;
-				syncMsg.nodes[subsLen][3] = 0xFF;
-				syncMsg.nodes[subsLen][4] = 0xAA;
-				subsLen++;
 
-				subsLen = MAP_HEADER_SIZE + (subsLen * 5);
-
-				if (!addSendRequest((dataMsg *)&syncMsg, subsLen))
+				if (!addSendRequest((dataMsg *)&syncMsg, mapSize))
 				{
 					myLog_e("Cannot send map because send queue is full");
 				}
@@ -305,49 +308,71 @@ void meshTask(void *pvParameters)
 			lora.startReceive();
 			loraState = MESH_RX;
 			txFinished = false;
+			sendDone(false);
 			myLog_e("loraState stuck in TX for 2 seconds");
 		}
 
+		// Queue packages again whose ACK is missing
+		checkAckTimeouts();
+
 		// Check if we have something in the queue
-		if (xQueuePeek(sendQueue, &queueIndex, (TickType_t)10) == pdTRUE)
+		if (sendQueueCount() != 0)
 		{
 			if (loraState != MESH_TX)
 			{
-				// Check if the channel is free
-				boolean channelAvailable = true;
-				time_t cadTimeout = millis();
-				while (lora.scanChannel() != CHANNEL_FREE)
+				// Check if the channel is free, retry after a random wait if it is busy
+				boolean channelAvailable = false;
+				if ((millis() - cadBackoffStart) >= cadBackoffTime)
 				{
-					if ((millis() - cadTimeout) > 5000)
+					meshCounters.cadRuns++;
+					TRACE_ENTER(TRACE_CAD_DONE, 0);
+					if (lora.scanChannel() == CHANNEL_FREE)
 					{
-						myLog_e("CAD failed after 5 seconds");
-						channelAvailable = false;
+						channelAvailable = true;
+						channelFreeRetryNum = 0;
 					}
+					else
+					{
+						meshCounters.cadBusy++;
+						if (++channelFreeRetryNum >= CAD_RETRY)
+						{
+							myLog_e("CAD returned channel busy %d times, giving up", CAD_RETRY);
+							meshCounters.cadFailed++;
+							channelFreeRetryNum = 0;
+							// Drop the package, a package that needs an ACK gets another try
+							if (getSendRequest(txPckg, &txLen, &txLinkToken))
+							{
+								sendDone(false);
+							}
+						}
+						else
+						{
+							cadBackoffTime = random(CAD_BACKOFF_MIN, CAD_BACKOFF_MAX + 1);
+							cadBackoffStart = millis();
+						}
+					}
+					TRACE_EXIT(TRACE_CAD_DONE, !channelAvailable);
 				}
 
-				if (channelAvailable && (xQueueReceive(sendQueue, &queueIndex, portMAX_DELAY) == pdTRUE))
+				if (channelAvailable && getSendRequest(txPckg, &txLen, &txLinkToken))
 				{
-#ifdef ESP32
-					portENTER_CRITICAL(&accessMsgQueue);
-#else
-					taskENTER_CRITICAL();
-#endif
-					txLen = sendMsgSize[queueIndex];
-					memset(txPckg, 0, 256);
-					memcpy(txPckg, &sendMsg[queueIndex].mark1, txLen);
-
-					sendMsg[queueIndex].type = 0;
-#ifdef ESP32
-					portEXIT_CRITICAL(&accessMsgQueue);
-#else
-					taskEXIT_CRITICAL();
-#endif
-
-					myLog_d("Sending msg #%d with len %d", queueIndex, txLen);
+					myLog_d("Sending msg with len %d, %d more in queue", txLen, sendQueueCount());
 
 					loraState = MESH_TX;
 					txFinished = false;
+					countFrame(meshCounters.txFrames, txPckg[3]);
+					txPower = getFrameTxPower(txPckg, sendRetries() != 0);
+					txLen = wireFrame(txPckg, txLen, txLinkToken);
+					if (txPower != radioTxPower)
+					{
+						// Next hop needs a different TX power
+						lora.setOutputPower(txPower);
+						radioTxPower = txPower;
+					}
+					chargeAirTime(txLen);
+					TRACE_ENTER(TRACE_RADIO_SEND, txLen);
 					lora.startTransmit(txPckg, txLen);
+					TRACE_EXIT(TRACE_RADIO_SEND, txLen);
 				}
 			}
 		}
@@ -378,11 +403,175 @@ void OnLoRaIRQ(void)
 }
 
 /**
- * Callback after a LoRa package was received
- * @param packetSize
- * 			Length of received data
+ * Handle a received direct, forward or broadcast package
+ * @param thisDataMsg
+ * 			The package, null terminated
+ * @param tempSize
+ * 			Length of the package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
  */
-void receiveData(void)
+static void handleDataMsg(dataMsg *thisDataMsg, uint16_t tempSize, int16_t rxRssi, int8_t rxSnr)
+{
+	if (thisDataMsg->type == LORA_DIRECT)
+	{
+		if (thisDataMsg->dest == deviceID)
+		{
+			// Message is for us, call user callback to handle the data
+			myLog_d("Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
+			if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
+			{
+				_MeshEvents->DataAvailable(thisDataMsg->orig, thisDataMsg->data, tempSize - DATA_HEADER_SIZE, rxRssi, rxSnr);
+			}
+		}
+		else
+		{
+			// Message is not for us
+		}
+	}
+	else if (thisDataMsg->type == LORA_FORWARD)
+	{
+		if (thisDataMsg->dest == deviceID)
+		{
+			// Message is for sub node, forward the message
+			nodesList route;
+			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+			{
+				if (getRoute(thisDataMsg->from, &route))
+				{
+					// We found a route, send package to next hop
+					if (route.firstHop == 0)
+					{
+						myLog_i("Route for %lX is direct", route.nodeId);
+						// Destination is a direct
+						thisDataMsg->dest = thisDataMsg->from;
+						thisDataMsg->from = deviceID;
+						thisDataMsg->type = LORA_DIRECT;
+					}
+					else
+					{
+						myLog_i("Route for %lX is to %lX", route.nodeId, route.firstHop);
+						// Destination is a sub
+						thisDataMsg->dest = route.firstHop;
+						thisDataMsg->type = LORA_FORWARD;
+					}
+
+					// Put message into send queue, the queue keeps the received package
+					if (addSendPacket(holdPacket(thisDataMsg), tempSize))
+					{
+						meshCounters.forwarded++;
+					}
+					else
+					{
+						myLog_e("Cannot forward message because send queue is full");
+					}
+				}
+				else
+				{
+					myLog_e("No route found for %lX", thisDataMsg->from);
+					meshCounters.noRoute++;
+				}
+				xSemaphoreGive(accessNodeList);
+			}
+			else
+			{
+				myLog_e("Could not access map to forward package");
+			}
+		}
+		else
+		{
+			// Message is not for us
+		}
+	}
+	else if (thisDataMsg->type == LORA_BROADCAST)
+	{
+		// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
+		myLog_d("Handling broadcast with ID %08X from %08X", thisDataMsg->dest, thisDataMsg->from);
+		// Check if this broadcast is coming from ourself
+		if (thisDataMsg->orig == deviceID)
+		{
+			myLog_w("We received our own broadcast, dismissing it");
+			return;
+		}
+		// Check if we handled this broadcast already
+		if (isOldBroadcast(thisDataMsg->orig, thisDataMsg->dest))
+		{
+			myLog_w("Got an old broadcast, dismissing it");
+			return;
+		}
+
+		// Put broadcast into send queue, the queue and the application share the received package
+		if (addSendPacket(holdPacket(thisDataMsg), tempSize))
+		{
+			meshCounters.broadcastsForwarded++;
+		}
+		else
+		{
+			myLog_e("Cannot forward broadcast because send queue is full");
+		}
+
+		// This is a broadcast, call user callback to handle the data
+		myLog_d("Got data broadcast %s", (char *)thisDataMsg->data);
+		if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
+		{
+			_MeshEvents->DataAvailable(thisDataMsg->from, thisDataMsg->data, tempSize - DATA_HEADER_SIZE, rxRssi, rxSnr);
+		}
+	}
+}
+
+/**
+ * Split an aggregated package into the single packages and handle them
+ * @param aggBuffer
+ * 			The aggregated package
+ * @param aggSize
+ * 			Length of the aggregated package
+ * @param rxRssi
+ * 			Signal strength while the package was received
+ * @param rxSnr
+ * 			Signal to noise ratio while the package was received
+ */
+static void handleAggregate(uint8_t *aggBuffer, uint16_t aggSize, int16_t rxRssi, int8_t rxSnr)
+{
+	uint16_t pos = AGGREGATE_HEADER_SIZE;
+
+	myLog_d("Got aggregated package from %08X", ((aggregateMsg *)aggBuffer)->from);
+	while (pos < aggSize)
+	{
+		// Each package is stored with its length and without the 'LoR' marks
+		uint8_t itemSize = aggBuffer[pos];
+		if ((itemSize < DATA_HEADER_SIZE - 3) || ((pos + 1 + itemSize) > aggSize))
+		{
+			myLog_e("Invalid aggregated package");
+			return;
+		}
+		// Each package gets its own buffer, the send queue and the application can keep it
+		meshPacket *item = allocPacket();
+		if (item == NULL)
+		{
+			myLog_e("No free package buffer for an aggregated package");
+			return;
+		}
+		item->data[0] = 'L';
+		item->data[1] = 'o';
+		item->data[2] = 'R';
+		memcpy(&item->data[3], &aggBuffer[pos + 1], itemSize);
+		meshCounters.rxCopied += itemSize;
+		// Make sure the data is null terminated
+		item->data[itemSize + 3] = 0;
+		handleDataMsg((dataMsg *)item->data, itemSize + 3, rxRssi, rxSnr);
+		releasePacket(item);
+		pos += itemSize + 1;
+	}
+}
+
+/**
+ * Read and handle a received LoRa package
+ * @param packet
+ * 			Package buffer for the received data
+ */
+static void receiveFrame(meshPacket *packet)
 {
 	lora.standby();
 
@@ -392,7 +581,7 @@ void receiveData(void)
 	// Read received data as byte array
 	rxSize = lora.getPacketLength(true);
 
-	state = lora.readData(rxBuffer, rxSize);
+	state = lora.readData(radioBuffer, rxSize);
 	if (state != ERR_NONE)
 	{
 		myLog_e("Read data error %d", state);
@@ -403,13 +592,26 @@ void receiveData(void)
 		return;
 	}
 
-	if (rxSize < 256)
+	uint8_t *rxBuffer = packet->data;
+	uint16_t tempSize = rxSize;
+	/** Link token if the sender expects an ACK */
+	int32_t linkToken = -1;
+
+	// A compact package is converted into the format used inside the mesh code on the way into the package buffer
+#if MESH_PROTOCOL_VERSION >= 2
+	if ((rxSize != 0) && (radioBuffer[0] == MESH_WIRE_MAGIC))
+	{
+		tempSize = decodeFrame(radioBuffer, rxSize, rxBuffer, &linkToken);
+	}
+	else
+#endif
 	{
+		tempSize = rxSize < 256 ? rxSize : 255;
+		memcpy(rxBuffer, radioBuffer, tempSize);
 		// Make sure the data is null terminated
-		rxBuffer[rxSize] = 0;
+		rxBuffer[tempSize] = 0;
 	}
-
-	uint16_t tempSize = rxSize;
+	meshCounters.rxCopied += tempSize;
 
 	delay(1);
 
@@ -424,7 +626,7 @@ void receiveData(void)
 #if MYLOG_LOG_LEVEL == MYLOG_LOG_LEVEL_VERBOSE
 	for (int idx = 0; idx < rxSize; idx++)
 	{
-		Serial.printf(" %02X", rxBuffer[idx]);
+		Serial.printf(" %02X", radioBuffer[idx]);
 	}
 	Serial.println("");
 #endif
@@ -435,14 +637,22 @@ void receiveData(void)
 	lora.startReceive();
 	loraState = MESH_RX;
 
+	if (tempSize == 0)
+	{
+		myLog_e("Invalid compact package");
+		meshCounters.rxFrames[LORA_INVALID]++;
+		return;
+	}
+
 	// Check the received data
 	if ((rxBuffer[0] == 'L') && (rxBuffer[1] == 'o') && (rxBuffer[2] == 'R'))
 	{
 		// Valid Mesh data received
 		mapMsg *thisMsg = (mapMsg *)rxBuffer;
 		dataMsg *thisDataMsg = (dataMsg *)rxBuffer;
+		countFrame(meshCounters.rxFrames, thisDataMsg->type);
 
-		if (thisMsg->type == LORA_NODEMAP)
+		if ((thisMsg->type == LORA_NODEMAP) || (thisMsg->type == LORA_NODEMAP_DELTA))
 		{
 			/// \todo for debug make some nodes unreachable
 #ifdef BROKEN_NET
@@ -528,47 +738,70 @@ void receiveData(void)
 			}
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
-				nodesChanged = addNode(thisMsg->from, 0, 0);
-
-				// Remove nodes that use sending node as hop
-				clearSubs(thisMsg->from);
+				nodesChanged = addNode(thisMsg->from, 0, 0, 0);
+				// Nodes that understand the compact wire format append their protocol version to the map
+				setNodeProtocol(thisMsg->from, (subsSize % 5) != 0 ? rxBuffer[tempSize - 1] : 1);
+				// The TX power of the map is in front of the protocol version
+				if ((subsSize % 5) >= 2)
+				{
+					setLinkQuality(thisMsg->from, (int8_t)rxBuffer[tempSize - 2], rxRssi, rxSnr);
+				}
+				// Map flags and sequence are in front of the TX power
+				bool costMap = false;
+				if ((subsSize % 5) >= 3)
+				{
+					costMap = (rxBuffer[tempSize - 3] & MAP_FLAG_COST) != 0;
+					setMapSequence(thisMsg->from, rxBuffer[tempSize - 3] & MAP_SEQ_MASK);
+				}
 
 				myLog_v("From %08X", thisMsg->from);
-				myLog_v("Dest %08X", thisMsg->dest);
+				myLog_v("Version %d", thisMsg->version);
 
-				if (subsSize != 0)
+				if (thisMsg->type == LORA_NODEMAP_DELTA)
 				{
-					// Mapping contains subs
-
-					myLog_v("Msg size %d", tempSize);
-					myLog_v("#subs %d", numSubs);
-
-					// Serial.println("++++++++++++++++++++++++++++");
-					// Serial.printf("From %08X Dest %08X #Subs %d\n", thisMsg->from, thisMsg->dest, numSubs);
-					// for (int idx = 0; idx < numSubs; idx++)
-					// {
-					// 	uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-					// 	subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-					// 	subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-					// 	subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-					// 	uint8_t hops = thisMsg->nodes[idx][4];
-					// 	Serial.printf("ID: %08X numHops: %d\n", subId, hops);
-					// }
-					// Serial.println("++++++++++++++++++++++++++++");
-
-					for (int idx = 0; idx < numSubs - 1; idx++)
+					// Map contains only the changes since the last map
+					nodesChanged |= handleMapDelta(thisMsg, numSubs - 1, costMap);
+				}
+				else
+				{
+					// Remove nodes that use sending node as hop
+					clearSubs(thisMsg->from);
+
+					if (subsSize != 0)
 					{
-						uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-						subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-						subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-						subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-						uint8_t hops = thisMsg->nodes[idx][4];
-						if (subId != deviceID)
+						// Mapping contains subs
+
+						myLog_v("Msg size %d", tempSize);
+						myLog_v("#subs %d", numSubs);
+
+						// Serial.println("++++++++++++++++++++++++++++");
+						// Serial.printf("From %08X Version %d #Subs %d\n", thisMsg->from, thisMsg->version, numSubs);
+						// for (int idx = 0; idx < numSubs; idx++)
+						// {
+						// 	uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
+						// 	subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
+						// 	subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
+						// 	subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
+						// 	uint8_t hops = thisMsg->nodes[idx][4];
+						// 	Serial.printf("ID: %08X numHops: %d\n", subId, hops);
+						// }
+						// Serial.println("++++++++++++++++++++++++++++");
+
+						for (int idx = 0; idx < numSubs - 1; idx++)
 						{
-							nodesChanged |= addNode(subId, thisMsg->from, hops + 1);
-							myLog_v("Subs %08X", subId);
+							uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
+							subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
+							subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
+							subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
+							uint8_t hops = thisMsg->nodes[idx][4];
+							if (subId != deviceID)
+							{
+								nodesChanged |= addMapNode(subId, thisMsg->from, hops, costMap);
+								myLog_v("Subs %08X", subId);
+							}
 						}
 					}
+					setMapVersion(thisMsg->from, thisMsg->version);
 				}
 				xSemaphoreGive(accessNodeList);
 			}
@@ -577,105 +810,44 @@ void receiveData(void)
 				myLog_e("Could not access map to add node");
 			}
 		}
-		else if (thisDataMsg->type == LORA_DIRECT)
+		else if (thisDataMsg->type == LORA_MAP_REQUEST)
 		{
 			if (thisDataMsg->dest == deviceID)
 			{
-				// Message is for us, call user callback to handle the data
-				myLog_d("Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
-				if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
-				{
-					_MeshEvents->DataAvailable(thisDataMsg->orig, thisDataMsg->data, tempSize - 12, rxRssi, rxSnr);
-				}
-			}
-			else
-			{
-				// Message is not for us
+				// Neighbour lost track of our map versions, send the full map soon
+				myLog_d("Full map requested by %08X", thisDataMsg->from);
+				requestFullMap();
 			}
 		}
-		else if (thisDataMsg->type == LORA_FORWARD)
+		else if (thisDataMsg->type == LORA_ACK)
 		{
-			if (thisDataMsg->dest == deviceID)
+			ackReceived(thisDataMsg->from, thisDataMsg->dest);
+		}
+		else if ((thisDataMsg->type == LORA_DIRECT) || (thisDataMsg->type == LORA_FORWARD) || (thisDataMsg->type == LORA_BROADCAST))
+		{
+#if MESH_PROTOCOL_VERSION >= 3
+			if ((linkToken >= 0) && (thisDataMsg->dest == deviceID))
 			{
-				// Message is for sub node, forward the message
-				nodesList route;
-				if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+				// Previous hop waits for an ACK, send it again if the package is a retransmission
+				addLinkAck(linkToken);
+				if (isRetransmission(thisDataMsg->orig, linkToken))
 				{
-					if (getRoute(thisDataMsg->from, &route))
-					{
-						// We found a route, send package to next hop
-						if (route.firstHop == 0)
-						{
-							myLog_i("Route for %lX is direct", route.nodeId);
-							// Destination is a direct
-							thisDataMsg->dest = thisDataMsg->from;
-							thisDataMsg->from = deviceID;
-							thisDataMsg->type = LORA_DIRECT;
-						}
-						else
-						{
-							myLog_i("Route for %lX is to %lX", route.nodeId, route.firstHop);
-							// Destination is a sub
-							thisDataMsg->dest = route.firstHop;
-							thisDataMsg->type = LORA_FORWARD;
-						}
-
-						// Put message into send queue
-						if (!addSendRequest(thisDataMsg, tempSize))
-						{
-							myLog_e("Cannot forward message because send queue is full");
-						}
-					}
-					else
-					{
-						myLog_e("No route found for %lX", thisMsg->from);
-					}
-					xSemaphoreGive(accessNodeList);
-				}
-				else
-				{
-					myLog_e("Could not access map to forward package");
+					myLog_d("Got a retransmission from %08X, dismissing it", thisDataMsg->orig);
+					return;
 				}
 			}
-			else
-			{
-				// Message is not for us
-			}
+#endif
+			handleDataMsg(thisDataMsg, tempSize, rxRssi, rxSnr);
 		}
-		else if (thisDataMsg->type == LORA_BROADCAST)
+		else if (thisDataMsg->type == LORA_AGGREGATE)
 		{
-			// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
-			myLog_d("Handling broadcast with ID %08X from %08X", thisDataMsg->dest, thisDataMsg->from);
-			// Check if this broadcast is coming from ourself
-			if ((thisDataMsg->dest & 0xFFFFFF00) == (deviceID & 0xFFFFFF00))
-			{
-				myLog_w("We received our own broadcast, dismissing it");
-				return;
-			}
-			// Check if we handled this broadcast already
-			if (isOldBroadcast(thisDataMsg->dest))
-			{
-				myLog_w("Got an old broadcast, dismissing it");
-				return;
-			}
-
-			// Put broadcast into send queue
-			if (!addSendRequest(thisDataMsg, tempSize))
-			{
-				myLog_e("Cannot forward broadcast because send queue is full");
-			}
-
-			// This is a broadcast, call user callback to handle the data
-			myLog_d("Got data broadcast %s", (char *)thisDataMsg->data);
-			if ((_MeshEvents != NULL) && (_MeshEvents->DataAvailable != NULL))
-			{
-				_MeshEvents->DataAvailable(thisDataMsg->from, thisDataMsg->data, tempSize - 12, rxRssi, rxSnr);
-			}
+			handleAggregate(rxBuffer, tempSize, rxRssi, rxSnr);
 		}
 	}
 	else
 	{
 		myLog_e("Invalid package");
+		meshCounters.rxFrames[LORA_INVALID]++;
 		for (int idx = 0; idx < tempSize; idx++)
 		{
 			Serial.printf("%02X ", rxBuffer[idx]);
@@ -685,81 +857,35 @@ void receiveData(void)
 }
 
 /**
- * Add a data package to the queue
- * @param package
- * 			dataPckg * to the package data
- * @param msgSize
- * 			Size of the data package
- * @return result
- * 			TRUE if task could be added to queue
- * 			FALSE if queue is full or not initialized 
+ * Callback after a LoRa package was received
+ * Counts the time the handling of the package takes
  */
-bool addSendRequest(dataMsg *package, uint8_t msgSize)
+void receiveData(void)
 {
-	if (sendQueue != NULL)
+	TRACE_ENTER(TRACE_RX_DONE, 0);
+	uint32_t start = micros();
+	// The package is written once into a package buffer, forwarding and the application keep references to it
+	meshPacket *packet = allocPacket();
+	if (packet != NULL)
 	{
-#ifdef ESP32
-		portENTER_CRITICAL(&accessMsgQueue);
-#else
-		taskENTER_CRITICAL();
-#endif
-		// Find unused entry in queue list
-		int next = SEND_QUEUE_SIZE;
-		for (int idx = 0; idx < SEND_QUEUE_SIZE; idx++)
-		{
-			if (sendMsg[idx].type == LORA_INVALID)
-			{
-				next = idx;
-				break;
-			}
-		}
-
-		if (next != SEND_QUEUE_SIZE)
-		{
-			// Found an empty entry!
-			memcpy(&sendMsg[next], package, msgSize);
-			sendMsgSize[next] = msgSize;
-
-			myLog_d("Queued msg #%d with len %d", next, msgSize);
-
-			// Try to add to cloudTaskQueue
-			if (xQueueSend(sendQueue, &next, (TickType_t)1000) != pdTRUE)
-			{
-				myLog_e("Send queue is busy");
-#ifdef ESP32
-				portEXIT_CRITICAL(&accessMsgQueue);
-#else
-				taskEXIT_CRITICAL();
-#endif
-				return false;
-			}
-			else
-			{
-				myLog_v("Send request queued:");
-#ifdef ESP32
-				portEXIT_CRITICAL(&accessMsgQueue);
-#else
-				taskEXIT_CRITICAL();
-#endif
-				return true;
-			}
-		}
-		else
-		{
-			myLog_e("Send queue is full");
-			// Queue is already full!
-#ifdef ESP32
-			portEXIT_CRITICAL(&accessMsgQueue);
-#else
-			taskEXIT_CRITICAL();
-#endif
-			return false;
-		}
+		receiveFrame(packet);
+		releasePacket(packet);
 	}
 	else
 	{
-		myLog_e("Send queue not yet initialized");
-		return false;
+		// All buffers are held by the send queue and the application
+		myLog_e("No free package buffer, package dropped");
+		lora.standby();
+		lora.startReceive();
+		loraState = MESH_RX;
+	}
+	uint32_t rxTime = micros() - start;
+	meshCounters.rxHandled++;
+	meshCounters.rxTimeSum += rxTime;
+	if (rxTime > meshCounters.rxTimeMax)
+	{
+		meshCounters.rxTimeMax = rxTime;
 	}
+	TRACE_EXIT(TRACE_RX_DONE, 0);
 }
 #endif
@@ -0,0 +1,143 @@
+#include "main.h"
+
+/** Package buffers */
+meshPacket packetPool[PACKET_POOL_SIZE];
+/** Stack of unused package buffers */
+uint16_t freePackets[PACKET_POOL_SIZE];
+/** Number of unused package buffers */
+uint16_t freePacketCount = 0;
+/** Statistics of the package buffers */
+packetPoolStats poolStats;
+
+#ifdef ESP32
+/** Mux used to enter critical code part (access to the free package buffers) */
+portMUX_TYPE accessPacketPool = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+/**
+ * Initialize the package buffers, all buffers become unused
+ */
+void initPacketPool(void)
+{
+#ifdef ESP32
+	portENTER_CRITICAL(&accessPacketPool);
+#else
+	taskENTER_CRITICAL();
+#endif
+	for (uint16_t idx = 0; idx < PACKET_POOL_SIZE; idx++)
+	{
+		packetPool[idx].refs = 0;
+		freePackets[idx] = PACKET_POOL_SIZE - 1 - idx;
+	}
+	freePacketCount = PACKET_POOL_SIZE;
+	memset(&poolStats, 0, sizeof(packetPoolStats));
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessPacketPool);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
+
+/**
+ * Take an unused package buffer
+ * The caller holds the only reference and releases it with releasePacket()
+ * @return meshPacket *
+ * 		The package buffer, NULL if all buffers are in use
+ */
+meshPacket *allocPacket(void)
+{
+	meshPacket *packet = NULL;
+#ifdef ESP32
+	portENTER_CRITICAL(&accessPacketPool);
+#else
+	taskENTER_CRITICAL();
+#endif
+	if (freePacketCount != 0)
+	{
+		packet = &packetPool[freePackets[--freePacketCount]];
+		packet->refs = 1;
+		poolStats.allocated++;
+		if ((PACKET_POOL_SIZE - freePacketCount) > poolStats.highWater)
+		{
+			poolStats.highWater = PACKET_POOL_SIZE - freePacketCount;
+		}
+	}
+	else
+	{
+		poolStats.failed++;
+	}
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessPacketPool);
+#else
+	taskEXIT_CRITICAL();
+#endif
+	return packet;
+}
+
+/**
+ * Keep the package buffer that holds the given data
+ * Used to keep a received package beyond the callback that got it
+ * @param data
+ * 		Pointer into the data of a package buffer
+ * @return meshPacket *
+ * 		The package buffer with one more reference, NULL if data is not inside a package buffer
+ */
+meshPacket *holdPacket(const void *data)
+{
+	const uint8_t *pos = (const uint8_t *)data;
+	const uint8_t *start = (const uint8_t *)packetPool;
+	if ((pos < start) || (pos >= start + sizeof(packetPool)))
+	{
+		return NULL;
+	}
+	meshPacket *packet = &packetPool[(pos - start) / sizeof(meshPacket)];
+	__atomic_add_fetch(&packet->refs, 1, __ATOMIC_RELAXED);
+	return packet;
+}
+
+/**
+ * Drop a reference to a package buffer
+ * The buffer is unused when the last reference is dropped.
+ * Can be called inside the accessMsgQueue critical section.
+ * @param packet
+ * 		The package buffer, NULL is ignored
+ */
+void releasePacket(meshPacket *packet)
+{
+	if ((packet == NULL) || (__atomic_sub_fetch(&packet->refs, 1, __ATOMIC_ACQ_REL) != 0))
+	{
+		return;
+	}
+#ifdef ESP32
+	portENTER_CRITICAL(&accessPacketPool);
+#else
+	taskENTER_CRITICAL();
+#endif
+	freePackets[freePacketCount++] = packet - packetPool;
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessPacketPool);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
+
+/**
+ * Get the statistics of the package buffers
+ * @param stats
+ * 		Pointer to a structure for the statistics
+ */
+void getPacketPoolStats(packetPoolStats *stats)
+{
+#ifdef ESP32
+	portENTER_CRITICAL(&accessPacketPool);
+#else
+	taskENTER_CRITICAL();
+#endif
+	memcpy(stats, &poolStats, sizeof(packetPoolStats));
+	stats->inUse = PACKET_POOL_SIZE - freePacketCount;
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessPacketPool);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
@@ -0,0 +1,134 @@
+#include <stdint.h>
+
+/** Number of payload sizes in the time on air table, a LoRa package has 0 to 255 bytes */
+#define AIR_TIME_SIZES 256
+
+/** List of table indexes, expanded into the initializer of the time on air table */
+template <uint16_t... N>
+struct airTimeIndexes
+{
+};
+
+/** Builds airTimeIndexes<0, 1, ... , N - 1> */
+template <uint16_t N, uint16_t... Rest>
+struct makeAirTimeIndexes : makeAirTimeIndexes<N - 1, N - 1, Rest...>
+{
+};
+
+template <uint16_t... Rest>
+struct makeAirTimeIndexes<0, Rest...>
+{
+	typedef airTimeIndexes<Rest...> type;
+};
+
+template <class Profile, class Indexes>
+struct airTimeTable;
+
+/**
+ * Time on air of all payload sizes of a radio profile, calculated by the compiler
+ */
+template <class Profile, uint16_t... N>
+struct airTimeTable<Profile, airTimeIndexes<N...>>
+{
+	static constexpr uint16_t ms[sizeof...(N)] = {Profile::airTimeMs(N)...};
+};
+
+template <class Profile, uint16_t... N>
+constexpr uint16_t airTimeTable<Profile, airTimeIndexes<N...>>::ms[sizeof...(N)];
+
+/**
+ * LoRa modulation settings and the timings that follow from them
+ * All values are calculated at compile time, the mesh code needs no floating point math for them.
+ * The packages are sent with explicit header.
+ * @param SF
+ * 		Spreading factor [7..12]
+ * @param BW
+ * 		Bandwidth [0: 125 kHz, 1: 250 kHz, 2: 500 kHz]
+ * @param CR
+ * 		Coding rate [1: 4/5, 2: 4/6, 3: 4/7, 4: 4/8]
+ * @param PREAMBLE
+ * 		Preamble length in symbols, same for TX and RX
+ * @param CRC_ON
+ * 		True if the packages have a CRC
+ */
+template <uint8_t SF, uint8_t BW, uint8_t CR, uint16_t PREAMBLE, bool CRC_ON = true>
+struct RadioProfile
+{
+	static_assert((SF >= 7) && (SF <= 12), "Spreading factor must be 7 to 12");
+	static_assert(BW <= 2, "Bandwidth must be 0 (125 kHz), 1 (250 kHz) or 2 (500 kHz)");
+	static_assert((CR >= 1) && (CR <= 4), "Coding rate must be 1 (4/5) to 4 (4/8)");
+
+	/** Arguments of SetTxConfig() and SetRxConfig() */
+	static constexpr uint32_t bandwidth = BW;
+	static constexpr uint32_t spreadingFactor = SF;
+	static constexpr uint8_t codingRate = CR;
+	static constexpr uint16_t preambleLength = PREAMBLE;
+	static constexpr bool crcOn = CRC_ON;
+	/** Bandwidth in kHz, for radio drivers that take the bandwidth as frequency */
+	static constexpr uint16_t bandwidthKHz = 125 << BW;
+
+	/** Length of a symbol in us, 2^SF / bandwidth */
+	static constexpr uint32_t symbolTimeUs = 1UL << (SF + 3 - BW);
+	/** Symbols of 16 ms and longer need the low data rate optimization, it takes 2 bits less per symbol */
+	static constexpr bool lowDataRate = symbolTimeUs >= 16384;
+
+	/**
+	 * Get the number of symbols of the payload, header and CRC included
+	 * @param size
+	 * 		Payload size in bytes
+	 * @return uint32_t
+	 * 		Number of symbols
+	 */
+	static constexpr uint32_t payloadSymbols(uint16_t size)
+	{
+		// 8 + ceil((8 * size - 4 * SF + 28 + 16 * CRC) / (4 * (SF - 2 * lowDataRate))) * (CR + 4), the ceil part is never negative
+		return 8 + ((8 * size + 28 + 16 * CRC_ON > 4 * SF) ? ((8 * size + 28 + 16 * CRC_ON - 4 * SF + 4 * (SF - 2 * lowDataRate) - 1) / (4 * (SF - 2 * lowDataRate))) * (CR + 4) : 0);
+	}
+
+	/**
+	 * Get the time on air of a package, same formula as the SX126x driver
+	 * @param size
+	 * 		Payload size in bytes
+	 * @return uint16_t
+	 * 		Time on air in ms, rounded up
+	 */
+	static constexpr uint16_t airTimeMs(uint16_t size)
+	{
+		// Preamble + 4.25 symbols sync word, counted in quarter symbols
+		return (((4 * PREAMBLE + 17) * symbolTimeUs / 4 + payloadSymbols(size) * symbolTimeUs) + 999) / 1000;
+	}
+
+	/**
+	 * Get the time on air of a package from the table
+	 * @param size
+	 * 		Payload size in bytes
+	 * @return uint32_t
+	 * 		Time on air in ms
+	 */
+	static inline uint32_t airTime(uint8_t size)
+	{
+		return airTimeTable<RadioProfile, typename makeAirTimeIndexes<AIR_TIME_SIZES>::type>::ms[size];
+	}
+
+	/** CAD over 8 symbols, as RadioLoRaCadSymbols_t (2^3 symbols) */
+	static constexpr uint8_t cadSymbolNum = 3;
+	/** CAD detection peak, the detector finds a preamble above this level */
+	static constexpr uint8_t cadDetPeak = SF + 13;
+	/** CAD detection minimum */
+	static constexpr uint8_t cadDetMin = 10;
+
+	/** Symbols the radio listens for a preamble in the RX duty cycle */
+	static constexpr uint16_t rxDutySymbols = 2;
+	static_assert(PREAMBLE > 2 * rxDutySymbols, "Preamble is too short for the RX duty cycle");
+	/**
+	 * Symbols the radio sleeps in the RX duty cycle
+	 * A preamble that starts just after the radio went to sleep must still be on air
+	 * for a complete listen window when it wakes up, one more window is the margin.
+	 */
+	static constexpr uint16_t rxSleepSymbols = PREAMBLE - 2 * rxDutySymbols;
+	/** Listen time of the RX duty cycle in steps of 15.625 us, rounded up */
+	static constexpr uint32_t rxDutyTime = (rxDutySymbols * symbolTimeUs * 64 + 999) / 1000;
+	/** Sleep time of the RX duty cycle in steps of 15.625 us, rounded down */
+	static constexpr uint32_t rxSleepTime = rxSleepSymbols * symbolTimeUs * 64 / 1000;
+	static_assert(rxSleepTime < (1UL << 24), "RX duty cycle times have 24 bits");
+};
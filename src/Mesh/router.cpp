@@ -1,9 +1,11 @@
 #include "main.h"
 
-/** The list with all known nodes */
-nodesList *nodesMap;
+/** The node table, route and name of all known nodes */
+nodesList nodesMap[MAX_NODES];
 /** Index to the first free node entry */
 int nodesMapIndex = 0;
+/** Max number of nodes in the map, at most MAX_NODES */
+int nodesMapSize = 0;
 
 /** Timeout to remove unresponsive nodes */
 time_t inActiveTimeout = 120000;
@@ -11,147 +13,1290 @@ time_t inActiveTimeout = 120000;
 /** ID of received broadcast */
 extern uint32_t broadcastID;
 
+/** Statistics of the routing table */
+routeStats routeCounters = {0, 0, 0, 0};
+
+/** Marks an empty slot in the hash indexes and the end of a first hop chain */
+#define NO_ENTRY 0xFFFF
+
+/** Keys of the hash indexes */
+#define KEY_NODE_ID 0
+#define KEY_FIRST_HOP 1
+#define KEY_NAME 2
+
+/**
+ * Get the number of slots the hash indexes need for a number of nodes
+ * @param minSlots
+ * 		Twice the number of nodes, keeps the probe sequences short
+ * @param slots
+ * 		Number of slots to start with
+ * @return int
+ * 		Power of 2 that is at least minSlots
+ */
+static constexpr int indexSlots(int minSlots, int slots = 16)
+{
+	return slots >= minSlots ? slots : indexSlots(minSlots, 2 * slots);
+}
+
+/** Number of slots of the hash indexes for MAX_NODES */
+#define INDEX_SLOTS indexSlots(2 * MAX_NODES)
+
+/**
+ * Links between the nodesMap entries that have the same first hop
+ */
+struct hopLinks
+{
+	uint16_t next;
+	uint16_t prev;
+};
+
+/** Hash index node ID -> nodesMap entry */
+uint16_t nodeIndex[INDEX_SLOTS];
+/** Hash index first hop ID -> first nodesMap entry with this first hop */
+uint16_t hopIndex[INDEX_SLOTS];
+/** Hash index name -> nodesMap entry, nodes can have the same name */
+uint16_t nameIndex[INDEX_SLOTS];
+/** Chains of the nodesMap entries with the same first hop */
+hopLinks hopChain[MAX_NODES];
+/** Number of bits of the hash, the indexes use 1 << indexBits of their slots */
+uint8_t indexBits = 0;
+
+/**
+ * Name of a node that is not in the map
+ */
+struct nameCacheEntry
+{
+	/** Node ID, 0 if the entry is free */
+	uint32_t nodeId;
+	char name[NODE_NAME_SIZE];
+};
+
+/** Names of nodes that sent their name before they were in the map or that left the map, a node gets its name back when it is added */
+nameCacheEntry nameCache[NAME_CACHE_SIZE];
+/** Next entry of nameCache to be replaced */
+uint8_t nameCacheNext = 0;
+
+/**
+ * Get the hash of a node name (FNV-1a)
+ * @param nodeName
+ * 		Node name, only the first NODE_NAME_SIZE - 1 characters count
+ * @return uint32_t
+ * 		Hash of the name
+ */
+static uint32_t hashName(const char *nodeName)
+{
+	uint32_t hash = 2166136261UL;
+	for (int idx = 0; (idx < NODE_NAME_SIZE - 1) && (nodeName[idx] != 0); idx++)
+	{
+		hash = (hash ^ (uint8_t)nodeName[idx]) * 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Get the home slot of an ID in the hash indexes
+ * @param id
+ * 		Node ID, first hop ID or name hash
+ * @return int
+ * 		Slot number
+ */
+static inline int hashSlot(uint32_t id)
+{
+	// Fibonacci hashing, spreads the node IDs that differ only in some bytes
+	return (int)((uint32_t)(id * 2654435761UL) >> (32 - indexBits));
+}
+
+/**
+ * Get the key of an nodesMap entry in a hash index
+ * @param entry
+ * 		Index of the entry in nodesMap
+ * @param key
+ * 		KEY_NODE_ID, KEY_FIRST_HOP or KEY_NAME
+ * @return uint32_t
+ * 		Node ID, first hop ID or name hash of the entry
+ */
+static inline uint32_t entryKey(int entry, uint8_t key)
+{
+	switch (key)
+	{
+	case KEY_FIRST_HOP:
+		return nodesMap[entry].firstHop;
+	case KEY_NAME:
+		return nodesMap[entry].nameHash;
+	default:
+		return nodesMap[entry].nodeId;
+	}
+}
+
+/**
+ * Find an ID in a hash index (linear probing)
+ * @param index
+ * 		Hash index to search
+ * @param id
+ * 		Node ID or first hop ID
+ * @param key
+ * 		KEY_NODE_ID or KEY_FIRST_HOP
+ * @return int
+ * 		Slot with the ID or the empty slot where the ID belongs to
+ */
+static int findSlot(uint16_t *index, uint32_t id, uint8_t key)
+{
+	int mask = (1 << indexBits) - 1;
+	int slot = hashSlot(id);
+	while ((index[slot] != NO_ENTRY) && (entryKey(index[slot], key) != id))
+	{
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/**
+ * Find the slot that points to a nodesMap entry in the name index
+ * The name index can have the same key more than once
+ * @param entry
+ * 		Index of the entry in nodesMap, must be in the name index
+ * @return int
+ * 		Slot of the entry
+ */
+static int nameSlot(int entry)
+{
+	int mask = (1 << indexBits) - 1;
+	int slot = hashSlot(nodesMap[entry].nameHash);
+	while (nameIndex[slot] != entry)
+	{
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/**
+ * Add a nodesMap entry to the name index
+ * @param entry
+ * 		Index of the entry in nodesMap
+ */
+static void linkName(int entry)
+{
+	int mask = (1 << indexBits) - 1;
+	int slot = hashSlot(nodesMap[entry].nameHash);
+	while (nameIndex[slot] != NO_ENTRY)
+	{
+		slot = (slot + 1) & mask;
+	}
+	nameIndex[slot] = entry;
+}
+
+/**
+ * Empty a slot of a hash index and move following entries
+ * back, so that no search stops early at the empty slot
+ * @param index
+ * 		Hash index
+ * @param slot
+ * 		Slot to be emptied
+ * @param key
+ * 		KEY_NODE_ID, KEY_FIRST_HOP or KEY_NAME
+ */
+static void clearSlot(uint16_t *index, int slot, uint8_t key)
+{
+	int mask = (1 << indexBits) - 1;
+	int next = (slot + 1) & mask;
+	index[slot] = NO_ENTRY;
+	while (index[next] != NO_ENTRY)
+	{
+		int home = hashSlot(entryKey(index[next], key));
+		// Move the entry if the empty slot is between its home slot and its current slot
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			index[slot] = index[next];
+			index[next] = NO_ENTRY;
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+}
+
+/**
+ * Add a nodesMap entry to the hash indexes
+ * @param entry
+ * 		Index of the entry in nodesMap
+ */
+static void linkEntry(int entry)
+{
+	nodeIndex[findSlot(nodeIndex, nodesMap[entry].nodeId, KEY_NODE_ID)] = entry;
+
+	// Put the entry at the start of the chain of its first hop
+	int slot = findSlot(hopIndex, nodesMap[entry].firstHop, KEY_FIRST_HOP);
+	hopChain[entry].prev = NO_ENTRY;
+	hopChain[entry].next = hopIndex[slot];
+	if (hopIndex[slot] != NO_ENTRY)
+	{
+		hopChain[hopIndex[slot]].prev = entry;
+	}
+	hopIndex[slot] = entry;
+}
+
+/**
+ * Remove a nodesMap entry from the hash indexes
+ * @param entry
+ * 		Index of the entry in nodesMap
+ */
+static void unlinkEntry(int entry)
+{
+	clearSlot(nodeIndex, findSlot(nodeIndex, nodesMap[entry].nodeId, KEY_NODE_ID), KEY_NODE_ID);
+
+	uint16_t prev = hopChain[entry].prev;
+	uint16_t next = hopChain[entry].next;
+	if (next != NO_ENTRY)
+	{
+		hopChain[next].prev = prev;
+	}
+	if (prev != NO_ENTRY)
+	{
+		hopChain[prev].next = next;
+	}
+	else
+	{
+		// Entry is the start of the chain
+		int slot = findSlot(hopIndex, nodesMap[entry].firstHop, KEY_FIRST_HOP);
+		if (next != NO_ENTRY)
+		{
+			hopIndex[slot] = next;
+		}
+		else
+		{
+			clearSlot(hopIndex, slot, KEY_FIRST_HOP);
+		}
+	}
+}
+
+/**
+ * Move a nodesMap entry to another (unused) position and update the hash indexes
+ * @param from
+ * 		Current index of the entry in nodesMap
+ * @param to
+ * 		New index of the entry in nodesMap
+ */
+static void moveEntry(int from, int to)
+{
+	nodeIndex[findSlot(nodeIndex, nodesMap[from].nodeId, KEY_NODE_ID)] = to;
+	nameIndex[nameSlot(from)] = to;
+
+	uint16_t prev = hopChain[from].prev;
+	uint16_t next = hopChain[from].next;
+	if (next != NO_ENTRY)
+	{
+		hopChain[next].prev = to;
+	}
+	if (prev != NO_ENTRY)
+	{
+		hopChain[prev].next = to;
+	}
+	else
+	{
+		hopIndex[findSlot(hopIndex, nodesMap[from].firstHop, KEY_FIRST_HOP)] = to;
+	}
+
+	hopChain[to] = hopChain[from];
+	memcpy(&nodesMap[to], &nodesMap[from], sizeof(nodesList));
+}
+
+/**
+ * Find a node in the map
+ * @param id
+ * 		Node ID
+ * @return int
+ * 		Index of the node in nodesMap or -1 if the node is not in the map
+ */
+static int findNode(uint32_t id)
+{
+	uint16_t entry = nodeIndex[findSlot(nodeIndex, id, KEY_NODE_ID)];
+	return entry == NO_ENTRY ? -1 : entry;
+}
+
+/**
+ * Initialize the nodes map and its hash indexes
+ * @param numOfNodes
+ * 		Max number of nodes in the map, limited to MAX_NODES
+ * @return bool
+ * 		True if the map has room for numOfNodes nodes
+ */
+bool initNodesMap(int numOfNodes)
+{
+	nodesMapSize = numOfNodes;
+	if (nodesMapSize > MAX_NODES)
+	{
+		myLog_e("Nodes map has only room for %d nodes", MAX_NODES);
+		nodesMapSize = MAX_NODES;
+	}
+	// Hash indexes are at least twice as large as the map to keep the probe sequences short
+	indexBits = 4;
+	while ((1 << indexBits) < (2 * nodesMapSize))
+	{
+		indexBits++;
+	}
+
+	nodesMapIndex = 0;
+	memset(nodesMap, 0, sizeof(nodesMap));
+	memset(nodeIndex, 0xFF, sizeof(nodeIndex));
+	memset(hopIndex, 0xFF, sizeof(hopIndex));
+	memset(nameIndex, 0xFF, sizeof(nameIndex));
+	memset(nameCache, 0, sizeof(nameCache));
+	nameCacheNext = 0;
+	return nodesMapSize == numOfNodes;
+}
+
+/**
+ * Write the name a node has until it sends its own, the node ID as hex number
+ * @param id
+ * 		Node ID
+ * @param nodeName
+ * 		Buffer for the name, NODE_NAME_SIZE bytes
+ */
+static void defaultName(uint32_t id, char *nodeName)
+{
+	static const char hexDigits[] = "0123456789ABCDEF";
+	for (int digit = 0; digit < 8; digit++)
+	{
+		nodeName[digit] = hexDigits[(id >> (28 - 4 * digit)) & 0x0F];
+	}
+	nodeName[8] = 0;
+}
+
+/**
+ * Find the cached name of a node that is not in the map
+ * @param id
+ * 		Node ID
+ * @return int
+ * 		Index in nameCache or -1 if the name is not cached
+ */
+static int findCachedName(uint32_t id)
+{
+	for (int idx = 0; idx < NAME_CACHE_SIZE; idx++)
+	{
+		if (nameCache[idx].nodeId == id)
+		{
+			return idx;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Keep the name of a node that is not in the map, the oldest cached name is replaced
+ * @param id
+ * 		Node ID
+ * @param nodeName
+ * 		Node name
+ */
+static void cacheName(uint32_t id, const char *nodeName)
+{
+	int idx = findCachedName(id);
+	if (idx == -1)
+	{
+		idx = nameCacheNext;
+		nameCacheNext = (nameCacheNext + 1) % NAME_CACHE_SIZE;
+	}
+	nameCache[idx].nodeId = id;
+	snprintf(nameCache[idx].name, NODE_NAME_SIZE, "%s", nodeName);
+}
+
+/**
+ * Delete a node route by moving the last route on top of it.
+ * A name the node sent is kept in the name cache, the node gets it back when its route returns.
+ * @param index
+ * 		The node to be deleted
+ */
+void deleteRoute(int index)
+{
+	char hexName[NODE_NAME_SIZE];
+	defaultName(nodesMap[index].nodeId, hexName);
+	if (strcmp(nodesMap[index].name, hexName) != 0)
+	{
+		cacheName(nodesMap[index].nodeId, nodesMap[index].name);
+	}
+	unlinkEntry(index);
+	clearSlot(nameIndex, nameSlot(index), KEY_NAME);
+	nodesMapIndex--;
+	if (index != nodesMapIndex)
+	{
+		moveEntry(nodesMapIndex, index);
+	}
+	memset(&nodesMap[nodesMapIndex], 0, sizeof(nodesList));
+	routeCounters.removed++;
+}
+
+/**
+ * Get the path cost to a node through a direct node
+ * @param hop
+ * 		Node ID of the direct node
+ * @param cost
+ * 		Path cost the direct node advertised
+ * @return uint8_t
+ * 		Path cost in ETX_UNIT, ETX_UNREACHABLE if the direct node is unknown or the cost is too high
+ */
+static uint8_t hopPathCost(uint32_t hop, uint8_t cost)
+{
+	int idx = findNode(hop);
+	if ((idx == -1) || (nodesMap[idx].firstHop != 0))
+	{
+		return ETX_UNREACHABLE;
+	}
+	uint16_t total = nodesMap[idx].cost + cost + ETX_HOP_PENALTY;
+	return total > ETX_MAX_COST ? ETX_UNREACHABLE : total;
+}
+
+/**
+ * Get the path cost of the route in use to a node
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @return uint8_t
+ * 		Path cost in ETX_UNIT, the cost of the link for a direct node
+ */
+static uint8_t entryCost(int idx)
+{
+	if (nodesMap[idx].firstHop == 0)
+	{
+		return nodesMap[idx].cost;
+	}
+	return hopPathCost(nodesMap[idx].firstHop, nodesMap[idx].cost);
+}
+
+/**
+ * Get the path cost an alternative first hop has to advertise less than
+ * For a direct node this is the cost of the link. For other nodes it is the lowest cost
+ * the route ever had, a neighbour that advertises less cannot route through us.
+ * Else the alternatives would follow a route to a lost node while its cost counts up.
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @return uint8_t
+ * 		Path cost in ETX_UNIT
+ */
+static uint8_t feasibleCost(int idx)
+{
+	uint8_t cost = entryCost(idx);
+	if (nodesMap[idx].firstHop == 0)
+	{
+		return cost;
+	}
+	if (cost < nodesMap[idx].feasibleCost)
+	{
+		nodesMap[idx].feasibleCost = cost;
+	}
+	return nodesMap[idx].feasibleCost;
+}
+
+/**
+ * Remove a first hop from the alternatives of a node
+ * @param node
+ * 		The node entry
+ * @param hop
+ * 		Node ID of the first hop
+ */
+static void removeAlternate(nodesList *node, uint32_t hop)
+{
+	if (hop == 0)
+	{
+		return;
+	}
+	for (int alt = 0; alt < ROUTE_ALTERNATES; alt++)
+	{
+		if (node->altHop[alt] != hop)
+		{
+			continue;
+		}
+		for (; alt < ROUTE_ALTERNATES - 1; alt++)
+		{
+			node->altHop[alt] = node->altHop[alt + 1];
+			node->altCost[alt] = node->altCost[alt + 1];
+			node->altHops[alt] = node->altHops[alt + 1];
+		}
+		node->altHop[ROUTE_ALTERNATES - 1] = 0;
+		return;
+	}
+}
+
+/**
+ * Add or update an alternative first hop of a node
+ * The alternatives are ranked by path cost, the most expensive one drops out if the list is full.
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @param hop
+ * 		Node ID of the direct node that advertised the node
+ * @param hopNum
+ * 		Number of hops through the direct node
+ * @param cost
+ * 		Path cost the direct node advertised
+ */
+static void addAlternate(int idx, uint32_t hop, uint8_t hopNum, uint8_t cost)
+{
+	nodesList *node = &nodesMap[idx];
+	removeAlternate(node, hop);
+	uint8_t pathCost = hopPathCost(hop, cost);
+	// The alternative must reach the node cheaper than we do, else its route might go through us
+	if ((pathCost == ETX_UNREACHABLE) || (cost >= feasibleCost(idx)))
+	{
+		return;
+	}
+	int pos = 0;
+	while ((pos < ROUTE_ALTERNATES) && (node->altHop[pos] != 0) && (hopPathCost(node->altHop[pos], node->altCost[pos]) <= pathCost))
+	{
+		pos++;
+	}
+	if (pos == ROUTE_ALTERNATES)
+	{
+		return;
+	}
+	for (int alt = ROUTE_ALTERNATES - 1; alt > pos; alt--)
+	{
+		node->altHop[alt] = node->altHop[alt - 1];
+		node->altCost[alt] = node->altCost[alt - 1];
+		node->altHops[alt] = node->altHops[alt - 1];
+	}
+	node->altHop[pos] = hop;
+	node->altCost[pos] = cost;
+	node->altHops[pos] = hopNum;
+}
+
+/**
+ * Remove the alternatives of a node that are not feasible anymore
+ * @param idx
+ * 		Index of the node in nodesMap
+ */
+static void pruneAlternates(int idx)
+{
+	nodesList *node = &nodesMap[idx];
+	uint8_t cost = feasibleCost(idx);
+	int alt = 0;
+	while ((alt < ROUTE_ALTERNATES) && (node->altHop[alt] != 0))
+	{
+		if ((node->altCost[alt] >= cost) || (hopPathCost(node->altHop[alt], node->altCost[alt]) == ETX_UNREACHABLE))
+		{
+			removeAlternate(node, node->altHop[alt]);
+		}
+		else
+		{
+			alt++;
+		}
+	}
+}
+
+/**
+ * Find the cheapest alternative first hop of a node
+ * Link costs change, so the ranking is checked again.
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @param exclude
+ * 		Node ID of a first hop that must not be used, 0 if none
+ * @return int
+ * 		Index into the alternatives, -1 if there is none
+ */
+static int bestAlternate(int idx, uint32_t exclude)
+{
+	int best = -1;
+	uint8_t bestCost = ETX_UNREACHABLE;
+	for (int alt = 0; (alt < ROUTE_ALTERNATES) && (nodesMap[idx].altHop[alt] != 0); alt++)
+	{
+		uint8_t cost = hopPathCost(nodesMap[idx].altHop[alt], nodesMap[idx].altCost[alt]);
+		if ((nodesMap[idx].altHop[alt] != exclude) && (cost < bestCost))
+		{
+			best = alt;
+			bestCost = cost;
+		}
+	}
+	return best;
+}
+
+/**
+ * Change the first hop of a node in place, the node keeps its name and alternatives
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @param hop
+ * 		Node ID of the new first hop
+ * @param hopNum
+ * 		Number of hops through the new first hop
+ * @param cost
+ * 		Path cost the new first hop advertised
+ * @param keepOld
+ * 		True to keep the old first hop as alternative, false if it failed
+ */
+static void switchRoute(int idx, uint32_t hop, uint8_t hopNum, uint8_t cost, bool keepOld)
+{
+	nodesList *node = &nodesMap[idx];
+	uint32_t oldHop = node->firstHop;
+	uint8_t oldHops = node->numHops;
+	uint8_t oldCost = node->cost;
+	myLog_d("Node %08X switches from hop %08X to %08X", node->nodeId, oldHop, hop);
+
+	removeAlternate(node, hop);
+	unlinkEntry(idx);
+	node->firstHop = hop;
+	node->numHops = hopNum;
+	node->cost = cost;
+	node->timeStamp = millis();
+	linkEntry(idx);
+	routeCounters.changed++;
+
+	if (keepOld)
+	{
+		addAlternate(idx, oldHop, oldHops, oldCost);
+	}
+	pruneAlternates(idx);
+}
+
+/**
+ * Switch a node to its cheapest alternative first hop after the first hop failed
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @return bool
+ * 		True if the node has a new first hop, false if there is no alternative
+ */
+static bool promoteAlternate(int idx)
+{
+	int alt = bestAlternate(idx, 0);
+	if (alt == -1)
+	{
+		return false;
+	}
+	switchRoute(idx, nodesMap[idx].altHop[alt], nodesMap[idx].altHops[alt], nodesMap[idx].altCost[alt], false);
+	return true;
+}
+
+/**
+ * Get the cheapest route to a node
+ * A direct node is reached through another direct node if its own link costs more.
+ * @param idx
+ * 		Index of the node in nodesMap
+ * @param firstHop
+ * 		Pointer to a variable for the first hop, 0 if the node is sent to directly
+ * @return uint8_t
+ * 		Path cost in ETX_UNIT
+ */
+static uint8_t bestRoute(int idx, uint32_t *firstHop)
+{
+	*firstHop = nodesMap[idx].firstHop;
+	uint8_t cost = entryCost(idx);
+	if (nodesMap[idx].firstHop != 0)
+	{
+		return cost;
+	}
+	int alt = bestAlternate(idx, 0);
+	if (alt != -1)
+	{
+		uint8_t relayCost = hopPathCost(nodesMap[idx].altHop[alt], nodesMap[idx].altCost[alt]);
+		if ((relayCost + ETX_SWITCH_MARGIN) <= cost)
+		{
+			*firstHop = nodesMap[idx].altHop[alt];
+			cost = relayCost;
+		}
+	}
+	return cost;
+}
+
+/**
+ * Find a route to a node
+ * @param id
+ * 		Node ID we need a route to
+ * @param route
+ * 		nodesList struct that will be filled with the route
+ * @return bool
+ * 		True if a route was found, false if not
+ */
+bool getRoute(uint32_t id, nodesList *route)
+{
+	int idx = findNode(id);
+	if (idx == -1)
+	{
+		// Node not in map
+		return false;
+	}
+	bestRoute(idx, &route->firstHop);
+	route->nodeId = nodesMap[idx].nodeId;
+	// Node found in map
+	return true;
+}
+
+/**
+ * Find the cheapest route to a node that does not start with a given next hop
+ * Used for a package that the next hop did not acknowledge.
+ * @param id
+ * 		Node ID we need a route to
+ * @param failedHop
+ * 		Node ID of the next hop that failed, the node itself if the direct link failed
+ * @param route
+ * 		nodesList struct that will be filled with the route
+ * @return bool
+ * 		True if another route was found, false if not
+ */
+bool getAlternateRoute(uint32_t id, uint32_t failedHop, nodesList *route)
+{
+	int idx = findNode(id);
+	if (idx == -1)
+	{
+		return false;
+	}
+	uint8_t bestCost = ETX_UNREACHABLE;
+	uint32_t nextHop = nodesMap[idx].firstHop == 0 ? id : nodesMap[idx].firstHop;
+	if (nextHop != failedHop)
+	{
+		route->firstHop = nodesMap[idx].firstHop;
+		bestCost = entryCost(idx);
+	}
+	int alt = bestAlternate(idx, failedHop);
+	if ((alt != -1) && (hopPathCost(nodesMap[idx].altHop[alt], nodesMap[idx].altCost[alt]) < bestCost))
+	{
+		route->firstHop = nodesMap[idx].altHop[alt];
+		bestCost = hopPathCost(nodesMap[idx].altHop[alt], nodesMap[idx].altCost[alt]);
+	}
+	route->nodeId = id;
+	return bestCost != ETX_UNREACHABLE;
+}
+
+/** 
+ * Add a node into the list.
+ * Checks if the node already exists and
+ * switches to the new route if it has a lower path cost.
+ * Other routes that reach the node cheaper than we ever did are kept as alternatives,
+ * for a direct node they are used if the direct link costs more.
+ * @param id
+ * 		Node ID
+ * @param hop
+ * 		Node ID of the first hop, 0 for a direct node
+ * @param hopNum
+ * 		Number of hops
+ * @param cost
+ * 		Path cost in ETX_UNIT the first hop advertised for the node, ignored for a direct node
+ * @return boolean
+ * 		True if the list changed
+ */
+boolean addNode(uint32_t id, uint32_t hop, uint8_t hopNum, uint8_t cost)
+{
+	boolean listChanged = false;
+	nodesList _newNode;
+	memset(&_newNode, 0, sizeof(nodesList));
+	_newNode.nodeId = id;
+	_newNode.firstHop = hop;
+	_newNode.timeStamp = millis();
+	_newNode.numHops = hopNum;
+	_newNode.mapVersion = 0;
+	_newNode.protoVersion = 1;
+	// A new link is expected to be good until the first losses show up
+	_newNode.cost = hop == 0 ? ETX_UNIT : cost;
+
+	uint8_t pathCost = hop == 0 ? ETX_UNIT : hopPathCost(hop, cost);
+	_newNode.feasibleCost = pathCost;
+	int idx = findNode(id);
+	if (idx != -1)
+	{
+		if (nodesMap[idx].firstHop == 0)
+		{
+			if (hop == 0)
+			{ // Node entry exist already as direct, update timestamp
+				nodesMap[idx].timeStamp = millis();
+			}
+			else
+			{
+				// Keep the route through another node in case the direct link is bad
+				addAlternate(idx, hop, hopNum, cost);
+			}
+			myLog_d("Node %08X already exists as direct", _newNode.nodeId);
+			return listChanged;
+		}
+		else
+		{
+			if (hop == 0)
+			{
+				// Found the node, but not as direct neighbor
+				myLog_d("Node %08X removed because it was a sub", _newNode.nodeId);
+				deleteRoute(idx);
+			}
+			else
+			{
+				// Node entry exists, check the path cost
+				if (nodesMap[idx].firstHop == hop)
+				{
+					if (pathCost == ETX_UNREACHABLE)
+					{
+						// Cost grows with every round through a loop
+						myLog_d("Node %08X is not reachable anymore", _newNode.nodeId);
+						deleteRoute(idx);
+						return true;
+					}
+					// Same route, take over the number of hops and the cost of the first hop
+					nodesMap[idx].timeStamp = millis();
+					nodesMap[idx].cost = cost;
+					if (nodesMap[idx].numHops != hopNum)
+					{
+						nodesMap[idx].numHops = hopNum;
+						listChanged = true;
+					}
+					pruneAlternates(idx);
+					// The route got more expensive than an alternative
+					int alt = bestAlternate(idx, 0);
+					if ((alt != -1) && ((hopPathCost(nodesMap[idx].altHop[alt], nodesMap[idx].altCost[alt]) + ETX_SWITCH_MARGIN) <= pathCost))
+					{
+						switchRoute(idx, nodesMap[idx].altHop[alt], nodesMap[idx].altHops[alt], nodesMap[idx].altCost[alt], true);
+						listChanged = true;
+					}
+					return listChanged;
+				}
+				if (((pathCost + ETX_SWITCH_MARGIN) > entryCost(idx)) || (cost >= feasibleCost(idx)))
+				{
+					// Node entry exist with a lower or about the same path cost, or the other route might go through us
+					myLog_d("Node %08X exist with a lower path cost", _newNode.nodeId);
+					addAlternate(idx, hop, hopNum, cost);
+					return listChanged;
+				}
+				else
+				{
+					// Found the node, but with a higher path cost
+					myLog_d("Node %08X exist with a higher path cost", _newNode.nodeId);
+					switchRoute(idx, hop, hopNum, cost, true);
+					return true;
+				}
+			}
+		}
+	}
+	if (pathCost == ETX_UNREACHABLE)
+	{
+		return listChanged;
+	}
+
+	if (nodesMapIndex == nodesMapSize)
+	{
+		// Map is full, remove the oldest entry
+		int oldest = 0;
+		for (idx = 1; idx < nodesMapIndex; idx++)
+		{
+			if (nodesMap[idx].timeStamp < nodesMap[oldest].timeStamp)
+			{
+				oldest = idx;
+			}
+		}
+		deleteRoute(oldest);
+		listChanged = true;
+	}
+
+	// New node entry, named by its ID until the node sends its name, unless its name is cached
+	int cached = findCachedName(id);
+	if (cached != -1)
+	{
+		memcpy(_newNode.name, nameCache[cached].name, NODE_NAME_SIZE);
+		nameCache[cached].nodeId = 0;
+	}
+	else
+	{
+		defaultName(id, _newNode.name);
+	}
+	_newNode.nameHash = hashName(_newNode.name);
+	memcpy(&nodesMap[nodesMapIndex], &_newNode, sizeof(nodesList));
+	linkEntry(nodesMapIndex);
+	linkName(nodesMapIndex);
+	nodesMapIndex++;
+	routeCounters.added++;
+
+	listChanged = true;
+	myLog_d("Added node %lX with hop %lX, num hops %d and cost %d", id, hop, hopNum, pathCost);
+	return listChanged;
+}
+
+/**
+ * Remove all nodes that are a non direct and have a given node as first hop.
+ * This is to clean up the nodes list from left overs of an unresponsive node
+ * @param id
+ * 		The node which is listed as first hop
+ */
+void clearSubs(uint32_t id)
+{
+	uint16_t entry;
+	while ((entry = hopIndex[findSlot(hopIndex, id, KEY_FIRST_HOP)]) != NO_ENTRY)
+	{
+		myLog_d("Removed node %lX with hop %lX", nodesMap[entry].nodeId, nodesMap[entry].firstHop);
+		deleteRoute(entry);
+	}
+	for (int idx = 0; idx < nodesMapIndex; idx++)
+	{
+		removeAlternate(&nodesMap[idx], id);
+	}
+}
+
+/**
+ * Move all nodes that have a lost direct node as first hop to their next alternative
+ * Nodes without an alternative are removed.
+ * Only the first hop is lost, so the alternatives still lead to the nodes.
+ * If a node itself is lost its route is withdrawn and removed instead,
+ * switching to the alternatives would only chase it through the mesh.
+ * @param id
+ * 		The lost direct node
+ */
+static void failoverSubs(uint32_t id)
+{
+	for (int idx = 0; idx < nodesMapIndex; idx++)
+	{
+		removeAlternate(&nodesMap[idx], id);
+	}
+	uint16_t entry;
+	while ((entry = hopIndex[findSlot(hopIndex, id, KEY_FIRST_HOP)]) != NO_ENTRY)
+	{
+		// Switching moves the entry into the chain of the new first hop
+		if (!promoteAlternate(entry))
+		{
+			myLog_d("Removed node %lX with hop %lX", nodesMap[entry].nodeId, nodesMap[entry].firstHop);
+			deleteRoute(entry);
+		}
+	}
+}
+
+/**
+ * Refresh the timestamp of all nodes that use a node as first hop
+ * @param id
+ * 		Node ID of the first hop
+ */
+void refreshSubs(uint32_t id)
+{
+	uint32_t now = millis();
+	for (uint16_t entry = hopIndex[findSlot(hopIndex, id, KEY_FIRST_HOP)]; entry != NO_ENTRY; entry = hopChain[entry].next)
+	{
+		nodesMap[entry].timeStamp = now;
+	}
+}
+
+/**
+ * Remove a node if it is reached through a given first hop
+ * @param id
+ * 		Node ID
+ * @param hop
+ * 		Node ID of the first hop
+ * @return bool
+ * 		True if the node was removed
+ */
+bool removeSub(uint32_t id, uint32_t hop)
+{
+	int idx = findNode(id);
+	if (idx != -1)
+	{
+		removeAlternate(&nodesMap[idx], hop);
+	}
+	if ((idx == -1) || (nodesMap[idx].firstHop != hop) || (hop == 0))
+	{
+		// Unknown or reached through another node
+		return false;
+	}
+	myLog_d("Removed node %lX with hop %lX", id, hop);
+	deleteRoute(idx);
+	return true;
+}
+
 /**
- * Delete a node route by copying following routes on top of it.
- * @param index
- * 		The node to be deleted
+ * Get the version of the last map received from a direct node
+ * @param id
+ * 		Node ID
+ * @return uint16_t
+ * 		Map version, 0 if no valid map was received
  */
-void deleteRoute(uint8_t index)
+uint16_t getMapVersion(uint32_t id)
 {
-	// Delete a route by copying following routes on top of it
-	uint32_t nodeToDelete = nodesMap[index].nodeId;
-	memcpy(&nodesMap[index], &nodesMap[index + 1],
-		   sizeof(nodesList) * (_numOfNodes - index - 1));
-	nodesMapIndex--;
-	nodesMap[nodesMapIndex].nodeId = 0;
-	// Delete the name as well
-	deleteNodeName(nodeToDelete);
+	int idx = findNode(id);
+	if ((idx == -1) || (nodesMap[idx].firstHop != 0))
+	{
+		return 0;
+	}
+	return nodesMap[idx].mapVersion;
 }
 
 /**
- * Find a route to a node
+ * Store the version of the last map received from a direct node
  * @param id
- * 		Node ID we need a route to
- * @param route
- * 		nodesList struct that will be filled with the route
- * @return bool
- * 		True if a route was found, false if not
+ * 		Node ID
+ * @param version
+ * 		Map version, 0 to request the full map with the next delta
  */
-bool getRoute(uint32_t id, nodesList *route)
+void setMapVersion(uint32_t id, uint16_t version)
 {
-	for (int idx = 0; idx < _numOfNodes; idx++)
+	int idx = findNode(id);
+	if ((idx != -1) && (nodesMap[idx].firstHop == 0))
 	{
-		if (nodesMap[idx].nodeId == id)
-		{
-			route->firstHop = nodesMap[idx].firstHop;
-			route->nodeId = nodesMap[idx].nodeId;
-			// Node found in map
-			return true;
-		}
+		nodesMap[idx].mapVersion = version;
 	}
-	// Node not in map
-	return false;
 }
 
-/** 
- * Add a node into the list.
- * Checks if the node already exists and
- * removes node if the existing entry has more hops
+/**
+ * Get the wire protocol version a node understands
+ * @param id
+ * 		Node ID
+ * @return uint8_t
+ * 		Protocol version, 1 if the node is unknown
  */
-boolean addNode(uint32_t id, uint32_t hop, uint8_t hopNum)
+uint8_t getNodeProtocol(uint32_t id)
 {
-	boolean listChanged = false;
-	nodesList _newNode;
-	_newNode.nodeId = id;
-	_newNode.firstHop = hop;
-	_newNode.timeStamp = millis();
-	_newNode.numHops = hopNum;
+	int idx = findNode(id);
+	if (idx == -1)
+	{
+		return 1;
+	}
+	return nodesMap[idx].protoVersion;
+}
+
+/**
+ * Store the wire protocol version a direct node advertised in its map
+ * @param id
+ * 		Node ID
+ * @param version
+ * 		Protocol version
+ */
+void setNodeProtocol(uint32_t id, uint8_t version)
+{
+	int idx = findNode(id);
+	if ((idx != -1) && (nodesMap[idx].firstHop == 0))
+	{
+		nodesMap[idx].protoVersion = version;
+	}
+}
 
-	for (int idx = 0; idx < _numOfNodes; idx++)
+/**
+ * Get the wire protocol version all direct nodes understand
+ * @return uint8_t
+ * 		Lowest protocol version of the direct nodes, MESH_PROTOCOL_VERSION if there are none
+ */
+uint8_t neighbourProtocol(void)
+{
+	uint8_t version = MESH_PROTOCOL_VERSION;
+	for (int idx = 0; idx < nodesMapIndex; idx++)
 	{
-		if (nodesMap[idx].nodeId == id)
+		if ((nodesMap[idx].firstHop == 0) && (nodesMap[idx].protoVersion < version))
 		{
-			if (nodesMap[idx].firstHop == 0)
-			{
-				if (hop == 0)
-				{ // Node entry exist already as direct, update timestamp
-					nodesMap[idx].timeStamp = millis();
-				}
-				myLog_d("Node %08X already exists as direct", _newNode.nodeId);
-				return listChanged;
-			}
-			else
-			{
-				if (hop == 0)
-				{
-					// Found the node, but not as direct neighbor
-					myLog_d("Node %08X removed because it was a sub", _newNode.nodeId);
-					deleteRoute(idx);
-					idx--;
-					break;
-				}
-				else
-				{
-					// Node entry exists, check number of hops
-					if (nodesMap[idx].numHops < hopNum)
-					{
-						// Node entry exist with smaller # of hops
-						myLog_d("Node %08X exist with a lower number of hops", _newNode.nodeId);
-						return listChanged;
-					}
-					else
-					{
-						// Found the node, but with higher # of hops
-						myLog_d("Node %08X exist with a higher number of hops", _newNode.nodeId);
-						deleteRoute(idx);
-						idx--;
-						break;
-					}
-				}
-			}
+			version = nodesMap[idx].protoVersion;
 		}
 	}
+	return version;
+}
 
-	if (nodesMapIndex == _numOfNodes)
+/**
+ * Get the wire protocol version all nodes in the map understand
+ * Only direct nodes advertise their version, a node that was never direct counts as version 1.
+ * @return uint8_t
+ * 		Lowest protocol version of all nodes, MESH_PROTOCOL_VERSION if there are none
+ */
+uint8_t mapProtocol(void)
+{
+	uint8_t version = MESH_PROTOCOL_VERSION;
+	for (int idx = 0; idx < nodesMapIndex; idx++)
 	{
-		// Map is full, remove the oldest entry
-		deleteRoute(0);
-		listChanged = true;
+		if (nodesMap[idx].protoVersion < version)
+		{
+			version = nodesMap[idx].protoVersion;
+		}
 	}
+	return version;
+}
 
-	// New node entry
-	memcpy(&nodesMap[nodesMapIndex], &_newNode, sizeof(nodesList));
-	nodesMapIndex++;
+/**
+ * Calculate the cost of the link to a direct node from its delivery estimates
+ * ACKs show the delivery in both directions, ETX = 1 / ackRate.
+ * Without ACKs only the delivery of the maps from the node is known,
+ * the link is expected to be symmetric, ETX = 1 / mapRate².
+ * @param idx
+ * 		Index of the direct node in nodesMap
+ */
+static void updateLinkCost(int idx)
+{
+	nodesList *node = &nodesMap[idx];
+	uint32_t cost = ETX_UNIT;
+	if (node->ackRate != 0)
+	{
+		cost = (ETX_UNIT * 255 + node->ackRate / 2) / node->ackRate;
+	}
+	else if (node->mapRate != 0)
+	{
+		uint32_t rate = node->mapRate * node->mapRate;
+		cost = (ETX_UNIT * 255 * 255 + rate / 2) / rate;
+	}
+	if ((node->linkLoss != 0) && (node->linkSnr < ETX_SNR_WEAK))
+	{
+		// Close to the sensitivity a little fading loses the package
+		cost += ETX_UNIT / 2;
+	}
+	if (cost > ETX_LINK_MAX)
+	{
+		cost = ETX_LINK_MAX;
+	}
+	// Small changes are noise, every change shifts the cost of all nodes behind the link
+	int change = abs((int)cost - (int)node->cost);
+	if ((change >= ETX_UNIT / 2) && (change >= (node->cost / ETX_LINK_CHANGE)))
+	{
+		node->cost = cost;
+	}
+}
 
-	listChanged = true;
-	myLog_d("Added node %lX with hop %lX and num hops %d", id, hop, hopNum);
+/**
+ * Count a received map of a direct node for its link cost
+ * Maps that are missing in the sequence were lost.
+ * @param id
+ * 		Node ID
+ * @param sequence
+ * 		Sequence number of the map
+ */
+void setMapSequence(uint32_t id, uint8_t sequence)
+{
+	int idx = findNode(id);
+	if ((idx == -1) || (nodesMap[idx].firstHop != 0))
+	{
+		return;
+	}
+	nodesList *node = &nodesMap[idx];
+	if (node->mapRate == 0)
+	{
+		node->mapRate = 255;
+	}
+	else
+	{
+		uint8_t lost = (sequence - node->mapSeq - 1) & MAP_SEQ_MASK;
+		if (lost > 8)
+		{
+			// Node restarted or was out of reach for long
+			lost = 8;
+		}
+		for (int loss = 0; loss < lost; loss++)
+		{
+			node->mapRate = (7 * node->mapRate) / 8;
+		}
+		node->mapRate = (7 * node->mapRate + 255 + 4) / 8;
+		if (node->mapRate == 0)
+		{
+			node->mapRate = 1;
+		}
+	}
+	node->mapSeq = sequence;
+	updateLinkCost(idx);
+}
 
-	if (getNodeName(_newNode.nodeId) == NULL)
+/**
+ * Count a unicast package sent to a direct node for its link cost
+ * Every transmission is counted, a retransmission after a missing ACK as well.
+ * @param id
+ * 		Node ID of the next hop
+ * @param acked
+ * 		True if the next hop acknowledged the package, false if the ACK was missing
+ */
+void setLinkDelivery(uint32_t id, bool acked)
+{
+	int idx = findNode(id);
+	if ((idx == -1) || (nodesMap[idx].firstHop != 0))
 	{
-		char nodeName[17] = {0};
-		snprintf(nodeName, 17, "%08X", _newNode.nodeId);
-		addNodeName(_newNode.nodeId, nodeName);
+		return;
 	}
-	return listChanged;
+	nodesList *node = &nodesMap[idx];
+	if (node->ackRate == 0)
+	{
+		// Start with the estimate of the maps
+		node->ackRate = node->mapRate != 0 ? (node->mapRate * node->mapRate) / 255 : 255;
+	}
+	node->ackRate = (15 * node->ackRate + (acked ? 255 : 0) + 8) / 16;
+	if (node->ackRate == 0)
+	{
+		node->ackRate = 1;
+	}
+	updateLinkCost(idx);
 }
 
+/** Statistics of the per link TX power */
+linkPowerStats powerStats = {0, 0, 0};
+
 /**
- * Remove all nodes that are a non direct and have a given node as first hop.
- * This is to clean up the nodes list from left overs of an unresponsive node
+ * Store the link quality of a direct node, measured on a received map
+ * Maps are always sent with full power, the path loss is the announced power minus the RSSI.
  * @param id
- * 		The node which is listed as first hop
+ * 		Node ID
+ * @param txPower
+ * 		TX power in dBm the node announced in the map
+ * @param rssi
+ * 		RSSI of the map
+ * @param snr
+ * 		SNR of the map
  */
-void clearSubs(uint32_t id)
+void setLinkQuality(uint32_t id, int8_t txPower, int16_t rssi, int8_t snr)
 {
-	for (int idx = 0; idx < _numOfNodes; idx++)
+	int idx = findNode(id);
+	if ((idx == -1) || (nodesMap[idx].firstHop != 0))
 	{
-		if (nodesMap[idx].firstHop == id)
+		return;
+	}
+	int16_t loss = constrain(txPower - rssi, 1, 255);
+	if (nodesMap[idx].linkLoss == 0)
+	{
+		nodesMap[idx].linkLoss = loss;
+		nodesMap[idx].linkSnr = snr;
+	}
+	else
+	{
+		// Average over the last maps, a single faded map should not change the power much
+		nodesMap[idx].linkLoss = (3 * nodesMap[idx].linkLoss + loss + 2) / 4;
+		nodesMap[idx].linkSnr = (3 * nodesMap[idx].linkSnr + snr) / 4;
+	}
+	updateLinkCost(idx);
+}
+
+/**
+ * Get the TX power for a package
+ * Unicast packages are sent with the power that reaches the next hop with LINK_RSSI_TARGET,
+ * all other packages and retransmissions with full power.
+ * Takes accessNodeList.
+ * @param frame
+ * 		The package, not yet converted to the wire format
+ * @param retry
+ * 		True if the package is sent again because its ACK was missing
+ * @return int8_t
+ * 		TX power in dBm
+ */
+int8_t getFrameTxPower(uint8_t *frame, bool retry)
+{
+	dataMsg *thisMsg = (dataMsg *)frame;
+	if ((thisMsg->type != LORA_DIRECT) && (thisMsg->type != LORA_FORWARD))
+	{
+		return LINK_FULL_POWER;
+	}
+
+	int16_t power = LINK_FULL_POWER;
+#if LINK_ADAPT_POWER == 1
+	if (!retry && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		int idx = findNode(thisMsg->dest);
+		if ((idx != -1) && (nodesMap[idx].firstHop == 0) && (nodesMap[idx].linkLoss != 0) && (nodesMap[idx].linkSnr >= LINK_SNR_MIN))
 		{
-			myLog_d("Removed node %lX with hop %lX", nodesMap[idx].nodeId, nodesMap[idx].firstHop);
-			deleteRoute(idx);
-			idx--;
+			power = constrain(LINK_RSSI_TARGET + nodesMap[idx].linkLoss, LINK_MIN_POWER, LINK_FULL_POWER);
 		}
+		xSemaphoreGive(accessNodeList);
+	}
+#endif
+	if (power < LINK_FULL_POWER)
+	{
+		powerStats.reduced++;
+		powerStats.savedDb += LINK_FULL_POWER - power;
+	}
+	else
+	{
+		powerStats.fullPower++;
 	}
+	return power;
+}
+
+/**
+ * Get the statistics of the per link TX power
+ * @param stats
+ * 		Pointer to a structure for the statistics
+ */
+void getLinkPowerStats(linkPowerStats *stats)
+{
+	memcpy(stats, &powerStats, sizeof(linkPowerStats));
+}
+
+/**
+ * Get the statistics of the routing table
+ * @param stats
+ * 		Pointer to a structure for the statistics
+ */
+void getRouteStats(routeStats *stats)
+{
+	memcpy(stats, &routeCounters, sizeof(routeStats));
+	stats->mapSize = nodesMapIndex;
 }
 
 /**
@@ -164,23 +1309,25 @@ bool cleanMap(void)
 {
 	// Check active nodes list
 	bool mapUpToDate = true;
-	for (int idx = 0; idx < _numOfNodes; idx++)
+	// Go backwards, deleteRoute() moves only already checked entries into the free place
+	for (int idx = nodesMapIndex - 1; idx >= 0; idx--)
 	{
-		if (nodesMap[idx].nodeId == 0)
+		if (idx >= nodesMapIndex)
 		{
-			// Last entry found
-			break;
+			// clearSubs() removed entries at the end of the list
+			continue;
 		}
-		if (((millis() > (nodesMap[idx].timeStamp + inActiveTimeout))) || (nodesMap[idx].numHops > 48))
+		if (((millis() - nodesMap[idx].timeStamp) > (uint32_t)inActiveTimeout) || (nodesMap[idx].numHops > 48))
 		{
 			// Node was not refreshed for inActiveTimeout milli seconds
 			myLog_e("Node %lX with hop %lX timed out or has too many hops", nodesMap[idx].nodeId, nodesMap[idx].firstHop);
-			if (nodesMap[idx].firstHop == 0)
+			uint32_t nodeToDelete = nodesMap[idx].nodeId;
+			bool wasDirect = (nodesMap[idx].firstHop == 0);
+			deleteRoute(idx);
+			if (wasDirect)
 			{
-				clearSubs(nodesMap[idx].nodeId);
+				failoverSubs(nodeToDelete);
 			}
-			deleteRoute(idx);
-			idx--;
 			mapUpToDate = false;
 		}
 	}
@@ -193,14 +1340,14 @@ bool cleanMap(void)
  * 		Pointer to an array to hold the node IDs
  * @param hops[]
  * 		Pointer to an array to hold the hops for the node IDs
- * @return uint8_t
+ * @return uint16_t
  * 		Number of nodes in the list
  */
-uint8_t nodeMap(uint32_t subs[], uint8_t hops[])
+uint16_t nodeMap(uint32_t subs[], uint8_t hops[])
 {
-	uint8_t subsNameIndex = 0;
+	uint16_t subsNameIndex = 0;
 
-	for (int idx = 0; idx < _numOfNodes; idx++)
+	for (int idx = 0; idx < nodesMapSize; idx++)
 	{
 		if (nodesMap[idx].nodeId == 0)
 		{
@@ -220,14 +1367,16 @@ uint8_t nodeMap(uint32_t subs[], uint8_t hops[])
  * Create a list of nodes and hops to be broadcasted as this nodes map
  * @param nodes[]
  * 		Pointer to an two dimensional array to hold the node IDs and hops
- * @return uint8_t
+ * @param maxNodes
+ * 		Number of entries of nodes[], the list ends after them
+ * @return uint16_t
  * 		Number of nodes in the list
  */
-uint8_t nodeMap(uint8_t nodes[][5])
+uint16_t nodeMap(uint8_t nodes[][5], uint16_t maxNodes)
 {
-	uint8_t subsNameIndex = 0;
+	uint16_t subsNameIndex = 0;
 
-	for (int idx = 0; idx < _numOfNodes; idx++)
+	for (int idx = 0; (idx < nodesMapSize) && (subsNameIndex < maxNodes); idx++)
 	{
 		if (nodesMap[idx].nodeId == 0)
 		{
@@ -247,11 +1396,25 @@ uint8_t nodeMap(uint8_t nodes[][5])
 }
 
 /**
- * Get number of nodes in the map
+ * Get the path cost of a specific node to be broadcasted in this nodes map
+ * @param nodeNum
+ * 		Index of the node we want to query
  * @return uint8_t
+ * 		Path cost in ETX_UNIT, at most ETX_MAX_COST
+ */
+uint8_t getNodeCost(uint16_t nodeNum)
+{
+	uint32_t firstHop;
+	uint8_t cost = bestRoute(nodeNum, &firstHop);
+	return cost > ETX_MAX_COST ? ETX_MAX_COST : cost;
+}
+
+/**
+ * Get number of nodes in the map
+ * @return uint16_t
  * 		Number of nodes
  */
-uint8_t numOfNodes(void)
+uint16_t numOfNodes(void)
 {
 	return nodesMapIndex;
 }
@@ -269,7 +1432,7 @@ uint8_t numOfNodes(void)
  * @return bool
  * 		True if the data could be found, false if the requested index is out of range
  */
-bool getNode(uint8_t nodeNum, uint32_t &nodeId, uint32_t &firstHop, uint8_t &numHops)
+bool getNode(uint16_t nodeNum, uint32_t &nodeId, uint32_t &firstHop, uint8_t &numHops)
 {
 	if (nodeNum >= numOfNodes())
 	{
@@ -282,50 +1445,262 @@ bool getNode(uint8_t nodeNum, uint32_t &nodeId, uint32_t &firstHop, uint8_t &num
 	return true;
 }
 
+/**
+ * Set the name of a node
+ * Takes accessNodeList.
+ * @param id
+ * 		Node ID
+ * @param nodeName
+ * 		Node name, longer names are cut to NODE_NAME_SIZE - 1 characters
+ * @return bool
+ * 		True if the name was set, false if the node is not in the map yet, the name is cached until the node is added
+ */
+bool setNodeName(uint32_t id, char *nodeName)
+{
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) != pdTRUE)
+	{
+		return false;
+	}
+	int idx = findNode(id);
+	if (idx == -1)
+	{
+		cacheName(id, nodeName);
+	}
+	else if (strncmp(nodesMap[idx].name, nodeName, NODE_NAME_SIZE - 1) != 0)
+	{
+		clearSlot(nameIndex, nameSlot(idx), KEY_NAME);
+		snprintf(nodesMap[idx].name, NODE_NAME_SIZE, "%s", nodeName);
+		nodesMap[idx].nameHash = hashName(nodesMap[idx].name);
+		linkName(idx);
+	}
+	xSemaphoreGive(accessNodeList);
+	return idx != -1;
+}
+
+/**
+ * Get the name of a node
+ * Takes accessNodeList.
+ * @param id
+ * 		Node ID
+ * @param nodeName
+ * 		Buffer for the name, NODE_NAME_SIZE bytes
+ * @return bool
+ * 		True if the name was found in the map or in the name cache
+ */
+bool getNodeName(uint32_t id, char *nodeName)
+{
+	bool found = false;
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+	{
+		int idx = findNode(id);
+		int cached = idx == -1 ? findCachedName(id) : -1;
+		if (idx != -1)
+		{
+			memcpy(nodeName, nodesMap[idx].name, NODE_NAME_SIZE);
+			found = true;
+		}
+		else if (cached != -1)
+		{
+			memcpy(nodeName, nameCache[cached].name, NODE_NAME_SIZE);
+			found = true;
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+	if (!found)
+	{
+		myLog_w("Didn't find the name in the list");
+	}
+	return found;
+}
+
+/**
+ * Get the id of a node by its name
+ * Takes accessNodeList.
+ * @param nodeName
+ * 		Node name
+ * @return uint32_t
+ * 		Node ID of the first node with this name or 0 if no node has the name
+ */
+uint32_t getNodeIdFromName(char *nodeName)
+{
+	uint32_t id = 0;
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+	{
+		uint32_t hash = hashName(nodeName);
+		int mask = (1 << indexBits) - 1;
+		for (int slot = hashSlot(hash); nameIndex[slot] != NO_ENTRY; slot = (slot + 1) & mask)
+		{
+			nodesList *entry = &nodesMap[nameIndex[slot]];
+			if ((entry->nameHash == hash) && (strncmp(entry->name, nodeName, NODE_NAME_SIZE - 1) == 0))
+			{
+				id = entry->nodeId;
+				break;
+			}
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+	if (id == 0)
+	{
+		myLog_w("Didn't find the nodeID in the list");
+	}
+	return id;
+}
+
+/**
+ * Get a node with its name by index
+ * Takes accessNodeList.
+ * @param index
+ * 		Index of request
+ * @param nodeId
+ * 		Variable for the node ID
+ * @param nodeName
+ * 		Buffer for the name, NODE_NAME_SIZE bytes
+ * @return bool
+ * 		True if the node was copied, false if the index is at the end of the list
+ */
+bool getNodeNameByIndex(uint16_t index, uint32_t &nodeId, char *nodeName)
+{
+	bool found = false;
+	if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
+	{
+		if (index < nodesMapIndex)
+		{
+			nodeId = nodesMap[index].nodeId;
+			memcpy(nodeName, nodesMap[index].name, NODE_NAME_SIZE);
+			found = true;
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+	return found;
+}
+
 /**
  * Get next broadcast ID
+ * The broadcast ID is a sequence number, together with the origin it identifies a broadcast
+ * With the compact wire format it is limited to 16 bit to fit into the short destination field
  * @return
  * 		next broadcast ID
  */
 uint32_t getNextBroadcastID(void)
 {
-	uint32_t broadcastNum = broadcastID & 0x000000FF;
 	// Create new one by just counting up
-	broadcastNum++;
-	broadcastNum &= 0x000000FF;
-	broadcastID = (broadcastID & 0xFFFFFF00) | broadcastNum;
+	broadcastID++;
+#if MESH_PROTOCOL_VERSION >= 2
+	broadcastID &= 0xFFFF;
+#endif
 	return broadcastID;
 }
 
-byte broadcastIndex = 0;
-#define NUM_OF_LAST_BROADCASTS 10
-uint32_t broadcastList[NUM_OF_LAST_BROADCASTS] = {0L};
+/**
+ * One remembered broadcast
+ */
+struct broadcastEntry
+{
+	/** Node ID of the node that created the broadcast */
+	uint32_t origin;
+	/** Broadcast ID (sequence number) */
+	uint32_t id;
+	/** Time (millis) when the broadcast was seen first */
+	time_t seen;
+};
+
+/** Number of entries in one bucket of the broadcast cache */
+#define BROADCAST_CACHE_WAYS 4
+/** Number of buckets of the broadcast cache */
+#define BROADCAST_CACHE_BUCKETS (BROADCAST_CACHE_SIZE / BROADCAST_CACHE_WAYS)
+
+/** Recently seen broadcasts, BROADCAST_CACHE_BUCKETS buckets with BROADCAST_CACHE_WAYS entries each */
+broadcastEntry broadcastCache[BROADCAST_CACHE_BUCKETS * BROADCAST_CACHE_WAYS];
+/** Statistics of the broadcast cache */
+broadcastStats bcStats;
+
 /**
  * Handle broadcast message ID's
- * to avoid circulating same broadcast over and over
+ * to avoid circulating same broadcast over and over.
+ * Broadcasts are remembered for BROADCAST_CACHE_TIME, if a bucket is full the oldest entry is replaced.
  * 
+ * @param origin
+ * 			Node ID of the node that created the broadcast
  * @param broadcastID
  * 			The broadcast ID to be checked
  * @return bool
  * 			True if the broadcast is an old broadcast, else false
  */
-bool isOldBroadcast(uint32_t broadcastID)
+bool isOldBroadcast(uint32_t origin, uint32_t broadcastID)
 {
-	for (int idx = 0; idx < NUM_OF_LAST_BROADCASTS; idx++)
+	time_t now = millis();
+	bcStats.received++;
+
+	// Fibonacci hashing of origin and ID, sequential IDs of one origin go into different buckets
+	uint32_t hash = (uint32_t)((origin ^ (broadcastID * 2654435761UL)) * 2654435761UL);
+	broadcastEntry *bucket = &broadcastCache[((hash >> 16) % BROADCAST_CACHE_BUCKETS) * BROADCAST_CACHE_WAYS];
+
+	broadcastEntry *oldest = &bucket[0];
+	for (int way = 0; way < BROADCAST_CACHE_WAYS; way++)
 	{
-		if (broadcastID == broadcastList[idx])
+		broadcastEntry *entry = &bucket[way];
+		if ((entry->origin == origin) && (entry->id == broadcastID) && ((now - entry->seen) < BROADCAST_CACHE_TIME))
 		{
-			// Broadcast ID is already in the list
+			// Broadcast ID is already in the cache
+			bcStats.duplicates++;
 			return true;
 		}
+		if ((now - entry->seen) > (now - oldest->seen))
+		{
+			oldest = entry;
+		}
 	}
-	// This is a new broadcast ID
-	broadcastList[broadcastIndex] = broadcastID;
-	broadcastIndex++;
-	if (broadcastIndex == NUM_OF_LAST_BROADCASTS)
+
+	// This is a new broadcast ID, replace the oldest entry of the bucket
+	if ((oldest->origin != 0) && ((now - oldest->seen) < BROADCAST_CACHE_TIME))
+	{
+		// Entry was still valid, cache is too small for the broadcast traffic
+		bcStats.evicted++;
+	}
+	oldest->origin = origin;
+	oldest->id = broadcastID;
+	oldest->seen = now;
+	return false;
+}
+
+/**
+ * Get the statistics of the broadcast cache
+ * @param stats
+ * 			Pointer to a struct for a copy of the statistics
+ */
+void getBroadcastStats(broadcastStats *stats)
+{
+	memcpy(stats, &bcStats, sizeof(broadcastStats));
+}
+
+/** Recently received packages that asked for a link ACK, origin and link token */
+broadcastEntry linkCache[LINK_CACHE_SIZE];
+/** Next entry of linkCache to be replaced */
+uint16_t linkCacheNext = 0;
+
+/**
+ * Check if a package that asked for a link ACK was received before
+ * The ACK got lost and the previous hop sent the package again.
+ * @param origin
+ * 			Node ID of the node that created the package
+ * @param linkToken
+ * 			Link token of the package
+ * @return bool
+ * 			True if the package was already handled, else false
+ */
+bool isRetransmission(uint32_t origin, uint16_t linkToken)
+{
+	time_t now = millis();
+	for (int idx = 0; idx < LINK_CACHE_SIZE; idx++)
 	{
-		// Index overflow, reset to 0
-		broadcastIndex = 0;
+		if ((linkCache[idx].origin == origin) && (linkCache[idx].id == linkToken) && ((now - linkCache[idx].seen) < LINK_CACHE_TIME))
+		{
+			return true;
+		}
 	}
+	linkCache[linkCacheNext].origin = origin;
+	linkCache[linkCacheNext].id = linkToken;
+	linkCache[linkCacheNext].seen = now;
+	linkCacheNext = (linkCacheNext + 1) % LINK_CACHE_SIZE;
 	return false;
-}
\ No newline at end of file
+}
@@ -0,0 +1,914 @@
+#include "main.h"
+
+/**
+ * One pre-allocated entry of the send queue
+ */
+struct sendSlot
+{
+	/** Package buffer of the frame, the entry holds a reference to it */
+	meshPacket *packet;
+	/** The frame inside the package buffer */
+	dataMsg *msg;
+	/** Size of the frame */
+	uint8_t size;
+	/** Flag if the frame was already held back by the airtime budget */
+	bool deferred;
+	/** Time (millis) when the frame was queued */
+	time_t queuedAt;
+	/** Flag if it was checked whether the next hop acknowledges the frame and reads aggregated packages */
+	bool hopChecked;
+	/** Flag if the next hop acknowledges the frame, it is kept until the ACK arrives */
+	bool wantsAck;
+	/** Flag if the receivers read aggregated packages, the frame can be sent inside one */
+	bool aggregate;
+	/** Link token of the frame, sender tag in the upper byte, sequence number in the lower byte */
+	uint16_t linkToken;
+	/** Number of retransmissions */
+	uint8_t retries;
+	/** Flag if the frame was already sent again through another first hop */
+	bool rerouted;
+	/** Time (millis) when the frame was sent */
+	time_t ackStart;
+	/** Time in ms to wait for the ACK */
+	time_t ackTimeout;
+};
+
+/** Frame buffers */
+sendSlot sendSlots[SEND_QUEUE_SIZE];
+/** Stack of unused frame buffers */
+uint16_t freeSlots[SEND_QUEUE_SIZE];
+/** Number of unused frame buffers */
+uint16_t freeCount = 0;
+/** Frame buffers in sending order, one ring per traffic class */
+uint16_t classRing[SEND_CLASSES][SEND_QUEUE_SIZE];
+/** Index of the oldest frame in each class ring */
+uint16_t classHead[SEND_CLASSES];
+/** Number of frames in each class ring */
+uint16_t classCount[SEND_CLASSES];
+/** Number of frames in the queue */
+uint16_t sendRingCount = 0;
+/** Statistics of the send queue */
+sendQueueStats queueStats;
+/** Frame buffers of sent unicast frames that wait for their ACK */
+uint16_t ackSlots[SEND_QUEUE_SIZE];
+/** Number of frames waiting for their ACK */
+uint16_t ackCount = 0;
+/** Frame buffer of the unicast frame that is being sent, NO_SLOT if none */
+uint16_t txSlot;
+/** Sequence number of the next unicast frame */
+uint8_t linkSeq = 0;
+
+/** Marks an unused txSlot */
+#define NO_SLOT 0xFFFF
+
+/** Part of the airtime budget (in %) a traffic class may fill, the rest is left for the classes before it */
+static const uint8_t classShare[SEND_CLASSES] = {100, 90, 75};
+
+/** Length of one slice of the rolling budget window in ms */
+#define TX_BUDGET_SLICE (TX_BUDGET_WINDOW / TX_BUDGET_SLICES)
+/** Airtime in ms a node may use within TX_BUDGET_WINDOW */
+#define TX_BUDGET ((uint32_t)((uint64_t)TX_BUDGET_WINDOW * TX_DUTY_CYCLE / 1000))
+
+/** Airtime in ms used in each slice of the budget window */
+uint32_t budgetSlices[TX_BUDGET_SLICES];
+/** Slice the airtime is currently counted in */
+uint16_t budgetSlice = 0;
+/** Time (millis) when the current slice started */
+time_t budgetSliceStart = 0;
+/** Airtime in ms used within the budget window */
+uint32_t budgetUsed = 0;
+
+/** Function to calculate the airtime of a frame */
+static uint32_t (*frameAirTime)(uint8_t msgSize) = NULL;
+
+#ifdef ESP32
+/** Mux used to enter critical code part (access to the send queue) */
+portMUX_TYPE accessMsgQueue = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+/**
+ * Initialize the send queue
+ * @param airTime
+ * 			Function that returns the time on air of a frame in ms
+ */
+void initSendQueue(uint32_t (*airTime)(uint8_t msgSize))
+{
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	for (uint16_t idx = 0; idx < SEND_QUEUE_SIZE; idx++)
+	{
+		sendSlots[idx].packet = NULL;
+		freeSlots[idx] = SEND_QUEUE_SIZE - 1 - idx;
+	}
+	freeCount = SEND_QUEUE_SIZE;
+	memset(classHead, 0, sizeof(classHead));
+	memset(classCount, 0, sizeof(classCount));
+	sendRingCount = 0;
+	memset(budgetSlices, 0, sizeof(budgetSlices));
+	budgetSlice = 0;
+	budgetSliceStart = millis();
+	budgetUsed = 0;
+	frameAirTime = airTime;
+	memset(&queueStats, 0, sizeof(sendQueueStats));
+	ackCount = 0;
+	txSlot = NO_SLOT;
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+	myLog_d("Send queue with %d entries created!", SEND_QUEUE_SIZE);
+}
+
+/**
+ * Get the traffic class of a package
+ * @param package
+ * 			The package
+ * @return uint8_t
+ * 			SEND_CONTROL for map sync packages and ACKs
+ * 			SEND_UNICAST for direct and forwarded packages
+ * 			SEND_BULK for broadcasts
+ */
+static uint8_t sendClass(dataMsg *package)
+{
+	switch (package->type)
+	{
+	case LORA_NODEMAP:
+	case LORA_NODEMAP_DELTA:
+	case LORA_MAP_REQUEST:
+	case LORA_ACK:
+		return SEND_CONTROL;
+	case LORA_DIRECT:
+	case LORA_FORWARD:
+		return SEND_UNICAST;
+	default:
+		return SEND_BULK;
+	}
+}
+
+/**
+ * Drop the slices that fell out of the budget window
+ * Must be called inside the accessMsgQueue critical section
+ */
+static void updateBudget(void)
+{
+	for (uint16_t idx = 0; idx < TX_BUDGET_SLICES; idx++)
+	{
+		if ((millis() - budgetSliceStart) < TX_BUDGET_SLICE)
+		{
+			return;
+		}
+		budgetSlice = (budgetSlice + 1) % TX_BUDGET_SLICES;
+		budgetUsed -= budgetSlices[budgetSlice];
+		budgetSlices[budgetSlice] = 0;
+		budgetSliceStart += TX_BUDGET_SLICE;
+	}
+	// Nothing was sent for a full window
+	budgetSliceStart = millis();
+}
+
+/**
+ * Put a frame buffer back on the stack of unused buffers and release its package
+ * Must be called inside the accessMsgQueue critical section
+ * @param slotIdx
+ * 			Frame buffer
+ */
+static void freeSlot(uint16_t slotIdx)
+{
+	releasePacket(sendSlots[slotIdx].packet);
+	sendSlots[slotIdx].packet = NULL;
+	freeSlots[freeCount++] = slotIdx;
+}
+
+/**
+ * Add a data package to the queue
+ * The package is copied into a package buffer
+ * @param package
+ * 			dataPckg * to the package data
+ * @param msgSize
+ * 			Size of the data package
+ * If the queue is full, the oldest package of a lower traffic class is dropped
+ * @return result
+ * 			TRUE if task could be added to queue
+ * 			FALSE if queue is full
+ */
+bool addSendRequest(dataMsg *package, uint8_t msgSize)
+{
+	meshPacket *packet = allocPacket();
+	if (packet == NULL)
+	{
+		myLog_e("No free package buffer for the send queue");
+		return false;
+	}
+	memcpy(packet->data, package, msgSize);
+	return addSendPacket(packet, msgSize);
+}
+
+/**
+ * Add a package buffer to the queue without copying it
+ * Used to forward received packages. The queue takes over the
+ * reference of the caller, also if the package is not added.
+ * @param packet
+ * 			Package buffer with the package, NULL is ignored
+ * @param msgSize
+ * 			Size of the data package
+ * If the queue is full, the oldest package of a lower traffic class is dropped
+ * @return result
+ * 			TRUE if task could be added to queue
+ * 			FALSE if queue is full
+ */
+bool addSendPacket(meshPacket *packet, uint8_t msgSize)
+{
+	if (packet == NULL)
+	{
+		return false;
+	}
+	TRACE_ENTER(TRACE_SEND_REQUEST, msgSize);
+	dataMsg *package = (dataMsg *)packet->data;
+	uint8_t msgClass = sendClass(package);
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	if (freeCount == 0)
+	{
+		// Make room by dropping the oldest package of a lower class
+		for (uint8_t lowerClass = SEND_CLASSES - 1; lowerClass > msgClass; lowerClass--)
+		{
+			if (classCount[lowerClass] != 0)
+			{
+				freeSlot(classRing[lowerClass][classHead[lowerClass]]);
+				classHead[lowerClass] = (classHead[lowerClass] + 1) % SEND_QUEUE_SIZE;
+				classCount[lowerClass]--;
+				sendRingCount--;
+				queueStats.dropped++;
+				break;
+			}
+		}
+	}
+	if (freeCount == 0)
+	{
+		queueStats.dropped++;
+#ifdef ESP32
+		portEXIT_CRITICAL(&accessMsgQueue);
+#else
+		taskEXIT_CRITICAL();
+#endif
+		// Queue is already full!
+		myLog_e("Send queue is full");
+		releasePacket(packet);
+		TRACE_EXIT(TRACE_SEND_REQUEST, msgSize);
+		return false;
+	}
+
+	uint16_t slot = freeSlots[--freeCount];
+	sendSlots[slot].packet = packet;
+	sendSlots[slot].msg = package;
+	sendSlots[slot].size = msgSize;
+	sendSlots[slot].deferred = false;
+	sendSlots[slot].queuedAt = millis();
+	// Only unicast packages have a next hop to check
+	sendSlots[slot].hopChecked = (msgClass != SEND_UNICAST);
+	sendSlots[slot].wantsAck = false;
+	sendSlots[slot].aggregate = false;
+	sendSlots[slot].retries = 0;
+	sendSlots[slot].rerouted = false;
+	if (msgClass == SEND_UNICAST)
+	{
+		// The tag tells apart the tokens of the neighbours of the next hop
+		uint8_t tag = deviceID ^ (deviceID >> 8) ^ (deviceID >> 16) ^ (deviceID >> 24);
+		sendSlots[slot].linkToken = (tag << 8) | linkSeq++;
+	}
+	classRing[msgClass][(classHead[msgClass] + classCount[msgClass]) % SEND_QUEUE_SIZE] = slot;
+	classCount[msgClass]++;
+	sendRingCount++;
+
+	queueStats.queued++;
+	if (sendRingCount > queueStats.highWater)
+	{
+		queueStats.highWater = sendRingCount;
+	}
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+
+	myLog_d("Queued msg #%d class %d with len %d", slot, msgClass, msgSize);
+
+	// Wake up the mesh task to send the package
+	if (meshTaskHandle != NULL)
+	{
+		xTaskNotifyGive(meshTaskHandle);
+	}
+	TRACE_EXIT(TRACE_SEND_REQUEST, msgSize);
+	return true;
+}
+
+/**
+ * Remove the oldest package of a class from the queue and update the statistics
+ * Must be called inside the accessMsgQueue critical section
+ * @param msgClass
+ * 			Traffic class of the package
+ * @param release
+ * 			True to free the frame buffer, false to keep it for a retransmission
+ */
+static void takeSlot(uint8_t msgClass, bool release)
+{
+	uint16_t slotIdx = classRing[msgClass][classHead[msgClass]];
+	if (release)
+	{
+		freeSlot(slotIdx);
+	}
+	else
+	{
+		txSlot = slotIdx;
+	}
+	classHead[msgClass] = (classHead[msgClass] + 1) % SEND_QUEUE_SIZE;
+	classCount[msgClass]--;
+	sendRingCount--;
+
+	time_t queueDelay = millis() - sendSlots[slotIdx].queuedAt;
+	queueStats.sent++;
+	queueStats.sumDelay += queueDelay;
+	if (queueDelay > queueStats.maxDelay)
+	{
+		queueStats.maxDelay = queueDelay;
+	}
+}
+
+/**
+ * Check if a class may send a package with the given airtime
+ * Must be called inside the accessMsgQueue critical section
+ * @param msgClass
+ * 			Traffic class of the package
+ * @param airTime
+ * 			Time on air of the package in ms
+ * @return result
+ * 			TRUE if the package fits into the share of the budget of the class
+ */
+static bool fitsBudget(uint8_t msgClass, uint32_t airTime)
+{
+	return (uint64_t)(budgetUsed + airTime) * 100 <= (uint64_t)TX_BUDGET * classShare[msgClass];
+}
+
+/**
+ * Take the next data package from the queue
+ * Control packages go first, then unicast, then broadcasts.
+ * A package is only taken if its airtime fits into the share
+ * of the airtime budget its class may use.
+ * Small unicast and broadcast packages that wait behind it are
+ * combined with it into one aggregated package.
+ * Unicast packages to a next hop that sends link ACKs are sent alone
+ * and stay in the queue until sendDone() and the ACK or the last retry.
+ * @param buffer
+ * 			Buffer for the package, must hold 256 bytes
+ * @param msgSize
+ * 			Pointer to a variable for the size of the package
+ * @param linkToken
+ * 			Pointer to a variable for the link token, -1 if the package needs no ACK
+ * @return result
+ * 			TRUE if a package was copied into the buffer
+ * 			FALSE if the queue is empty or the budget is used up
+ */
+bool getSendRequest(uint8_t *buffer, uint16_t *msgSize, int32_t *linkToken)
+{
+	*linkToken = -1;
+	if (txSlot != NO_SLOT)
+	{
+		// Sending the last package did not finish, handle it as not sent
+		sendDone(false);
+	}
+
+	// Airtime of the oldest package of each class, calculated outside of the critical section
+	// Only the mesh task takes packages, so the oldest packages cannot change meanwhile
+	uint32_t classAirTime[SEND_CLASSES];
+	for (uint8_t msgClass = 0; msgClass < SEND_CLASSES; msgClass++)
+	{
+		classAirTime[msgClass] = 0;
+		if ((classCount[msgClass] != 0) && (frameAirTime != NULL))
+		{
+			classAirTime[msgClass] = frameAirTime(sendSlots[classRing[msgClass][classHead[msgClass]]].size);
+		}
+	}
+
+	// Check once per unicast package if its next hop sends link ACKs and reads aggregated packages
+	// Broadcasts are aggregated only if all direct nodes read aggregated packages, older nodes drop them
+	// Packages added after this are checked with the next call
+	uint16_t unicastCount = classCount[SEND_UNICAST];
+	uint16_t bulkCount = classCount[SEND_BULK];
+	if (((unicastCount != 0) || (bulkCount != 0)) && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		for (uint16_t idx = 0; idx < unicastCount; idx++)
+		{
+			sendSlot *slot = &sendSlots[classRing[SEND_UNICAST][(classHead[SEND_UNICAST] + idx) % SEND_QUEUE_SIZE]];
+			if (!slot->hopChecked)
+			{
+				uint8_t hopProtocol = getNodeProtocol(slot->msg->dest);
+#if MESH_PROTOCOL_VERSION >= 3
+				slot->wantsAck = hopProtocol >= 3;
+#endif
+				slot->aggregate = (MESH_PROTOCOL_VERSION >= 2) && (hopProtocol >= 2);
+				slot->hopChecked = true;
+			}
+		}
+		bool neighboursAggregate = (MESH_PROTOCOL_VERSION >= 2) && (neighbourProtocol() >= 2);
+		for (uint16_t idx = 0; idx < bulkCount; idx++)
+		{
+			sendSlots[classRing[SEND_BULK][(classHead[SEND_BULK] + idx) % SEND_QUEUE_SIZE]].aggregate = neighboursAggregate;
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	updateBudget();
+
+	int firstClass = -1;
+	for (uint8_t msgClass = 0; msgClass < SEND_CLASSES; msgClass++)
+	{
+		if ((classCount[msgClass] == 0) || ((classAirTime[msgClass] == 0) && (frameAirTime != NULL)))
+		{
+			// Empty, or the package was added after the airtimes were calculated
+			continue;
+		}
+		if (!sendSlots[classRing[msgClass][classHead[msgClass]]].hopChecked)
+		{
+			// Not known yet if the next hop sends an ACK
+			continue;
+		}
+		if (!fitsBudget(msgClass, classAirTime[msgClass]))
+		{
+			// Over budget, keep it for later
+			uint16_t slotIdx = classRing[msgClass][classHead[msgClass]];
+			if (!sendSlots[slotIdx].deferred)
+			{
+				sendSlots[slotIdx].deferred = true;
+				queueStats.deferred++;
+			}
+			continue;
+		}
+		firstClass = msgClass;
+		break;
+	}
+
+	if (firstClass < 0)
+	{
+#ifdef ESP32
+		portEXIT_CRITICAL(&accessMsgQueue);
+#else
+		taskEXIT_CRITICAL();
+#endif
+		return false;
+	}
+
+	sendSlot *slot = &sendSlots[classRing[firstClass][classHead[firstClass]]];
+	memset(buffer, 0, 256);
+	if ((firstClass == SEND_CONTROL) || (slot->size > AGGREGATE_MAX_ITEM) || slot->wantsAck || !slot->aggregate)
+	{
+		*msgSize = slot->size;
+		memcpy(buffer, &slot->msg->mark1, slot->size);
+		if (slot->wantsAck)
+		{
+			*linkToken = slot->linkToken;
+		}
+		takeSlot(firstClass, !slot->wantsAck);
+	}
+	else
+	{
+		// Collect the small packages, each one as [size][package without the 'LoR' marks]
+		aggregateMsg *aggMsg = (aggregateMsg *)buffer;
+		uint16_t aggSize = AGGREGATE_HEADER_SIZE;
+		uint8_t numItems = 0;
+		for (uint8_t msgClass = firstClass; msgClass < SEND_CLASSES; msgClass++)
+		{
+			if ((msgClass != firstClass) && !fitsBudget(msgClass, classAirTime[msgClass]))
+			{
+				continue;
+			}
+			while (classCount[msgClass] != 0)
+			{
+				slot = &sendSlots[classRing[msgClass][classHead[msgClass]]];
+				if ((slot->size > AGGREGATE_MAX_ITEM) || ((aggSize + slot->size - 2) > 255))
+				{
+					break;
+				}
+				if (slot->wantsAck || !slot->hopChecked || !slot->aggregate)
+				{
+					// Package needs an ACK, is not checked yet or a receiver cannot read aggregated packages, it is sent alone
+					break;
+				}
+				buffer[aggSize] = slot->size - 3;
+				memcpy(&buffer[aggSize + 1], &slot->msg->type, slot->size - 3);
+				aggSize += slot->size - 2;
+				numItems++;
+				takeSlot(msgClass, true);
+			}
+		}
+
+		if (numItems == 1)
+		{
+			// Nothing to combine, send the package as it is
+			*msgSize = buffer[AGGREGATE_HEADER_SIZE] + 3;
+			memmove(&buffer[3], &buffer[AGGREGATE_HEADER_SIZE + 1], *msgSize - 3);
+			memset(&buffer[*msgSize], 0, 256 - *msgSize);
+			buffer[0] = 'L';
+			buffer[1] = 'o';
+			buffer[2] = 'R';
+		}
+		else
+		{
+			aggMsg->mark1 = 'L';
+			aggMsg->mark2 = 'o';
+			aggMsg->mark3 = 'R';
+			aggMsg->type = LORA_AGGREGATE;
+			aggMsg->from = deviceID;
+			*msgSize = aggSize;
+			queueStats.aggregates++;
+			queueStats.aggregatedItems += numItems;
+		}
+	}
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+	return true;
+}
+
+/**
+ * Put a package back at the start of the unicast packages
+ * Must be called inside the accessMsgQueue critical section
+ * @param slotIdx
+ * 			Frame buffer of the package
+ */
+static void requeueSlot(uint16_t slotIdx)
+{
+	classHead[SEND_UNICAST] = (classHead[SEND_UNICAST] + SEND_QUEUE_SIZE - 1) % SEND_QUEUE_SIZE;
+	classRing[SEND_UNICAST][classHead[SEND_UNICAST]] = slotIdx;
+	classCount[SEND_UNICAST]++;
+	sendRingCount++;
+}
+
+/**
+ * Tell the queue that the package taken last with getSendRequest() was sent or given up
+ * A package that waits for an ACK starts its ACK timer.
+ * A package that was not sent goes back to the start of the unicast packages,
+ * it spends no retry and does not count against the link to the next hop.
+ * Must be called from the mesh task
+ * @param sent
+ * 			True if the package was sent, false if it was given up (channel busy, TX timeout)
+ */
+void sendDone(bool sent)
+{
+	// Only the mesh task changes txSlot
+	uint16_t slotIdx = txSlot;
+	if (slotIdx == NO_SLOT)
+	{
+		return;
+	}
+
+	time_t timeout = 0;
+	if (sent && (frameAirTime != NULL))
+	{
+		// The next hop might send a frame of its own before the ACK, wait longer with every retry
+		sendSlot *slot = &sendSlots[slotIdx];
+		timeout = (frameAirTime(slot->size) + frameAirTime(DATA_HEADER_SIZE) + ACK_TIMEOUT_MARGIN) << slot->retries;
+		timeout += random(0, CAD_BACKOFF_MAX);
+	}
+
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	if (sent)
+	{
+		sendSlots[slotIdx].ackStart = millis();
+		sendSlots[slotIdx].ackTimeout = timeout;
+		ackSlots[ackCount++] = slotIdx;
+	}
+	else
+	{
+		queueStats.unsent++;
+		requeueSlot(slotIdx);
+	}
+	txSlot = NO_SLOT;
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
+
+/**
+ * Get the number of retransmissions of the package taken last with getSendRequest()
+ * Must be called from the mesh task
+ * @return uint8_t
+ * 		Number of retransmissions, 0 if the package waits for no ACK
+ */
+uint8_t sendRetries(void)
+{
+	return txSlot != NO_SLOT ? sendSlots[txSlot].retries : 0;
+}
+
+/**
+ * Change the next hop of a given up package to another route to its destination
+ * Must be called with the node list locked.
+ * @param slot
+ * 			Frame buffer of the package
+ * @return bool
+ * 			True if the package has a new next hop
+ */
+static bool rerouteFrame(sendSlot *slot)
+{
+	dataMsg *msg = slot->msg;
+	if ((msg->type != LORA_DIRECT) && (msg->type != LORA_FORWARD))
+	{
+		return false;
+	}
+	// A forwarded package carries the destination in from, the origin is always in orig
+	uint32_t target = msg->type == LORA_FORWARD ? msg->from : msg->dest;
+	if (target == msg->dest)
+	{
+		// The destination itself does not answer, another route ends at the same node
+		return false;
+	}
+	nodesList route;
+	if (!getAlternateRoute(target, msg->dest, &route))
+	{
+		return false;
+	}
+	if (route.firstHop == 0)
+	{
+		msg->type = LORA_DIRECT;
+		msg->dest = target;
+		msg->from = msg->orig;
+	}
+	else
+	{
+		msg->type = LORA_FORWARD;
+		msg->dest = route.firstHop;
+		msg->from = target;
+	}
+	myLog_d("Package for %08X sent again through %08X", target, msg->dest);
+	slot->retries = 0;
+	slot->rerouted = true;
+	// The new next hop might not send ACKs
+	slot->hopChecked = false;
+	slot->wantsAck = false;
+	return true;
+}
+
+/**
+ * Send packages again if their ACK did not arrive in time
+ * A package is given up after ACK_RETRIES retransmissions,
+ * then it is sent once more through another first hop if there is one.
+ * Every missing ACK is counted for the cost of the link to the next hop.
+ * Retransmissions go before all other unicast packages.
+ * @return time_t
+ * 			Milliseconds until the next ACK timeout, ACK_NO_TIMEOUT if no package waits for an ACK
+ */
+time_t checkAckTimeouts(void)
+{
+	time_t nextTimeout = ACK_NO_TIMEOUT;
+	// Next hops of the packages with a missing ACK, counted for the link cost after leaving the critical section
+	uint32_t missedAcks[SEND_QUEUE_SIZE];
+	uint16_t numMissed = 0;
+	// Given up packages, they get a new route after leaving the critical section
+	uint16_t givenUp[SEND_QUEUE_SIZE];
+	bool rerouted[SEND_QUEUE_SIZE];
+	uint16_t numGivenUp = 0;
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	for (int idx = 0; idx < ackCount; idx++)
+	{
+		uint16_t slotIdx = ackSlots[idx];
+		sendSlot *slot = &sendSlots[slotIdx];
+		uint32_t passed = millis() - slot->ackStart;
+		if (passed < (uint32_t)slot->ackTimeout)
+		{
+			if ((time_t)(slot->ackTimeout - passed) < nextTimeout)
+			{
+				nextTimeout = slot->ackTimeout - passed;
+			}
+			continue;
+		}
+
+		// ACK is missing
+		ackSlots[idx--] = ackSlots[--ackCount];
+		missedAcks[numMissed++] = slot->msg->dest;
+		if (slot->retries < ACK_RETRIES)
+		{
+			slot->retries++;
+			queueStats.retries++;
+			requeueSlot(slotIdx);
+		}
+		else
+		{
+			queueStats.ackFailed++;
+			if (slot->rerouted)
+			{
+				freeSlot(slotIdx);
+			}
+			else
+			{
+				rerouted[numGivenUp] = false;
+				givenUp[numGivenUp++] = slotIdx;
+			}
+		}
+	}
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+
+	if (((numMissed != 0) || (numGivenUp != 0)) && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		for (uint16_t idx = 0; idx < numMissed; idx++)
+		{
+			setLinkDelivery(missedAcks[idx], false);
+		}
+		// Routes are looked up after the link costs are updated
+		for (uint16_t idx = 0; idx < numGivenUp; idx++)
+		{
+			rerouted[idx] = rerouteFrame(&sendSlots[givenUp[idx]]);
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+
+	if (numGivenUp != 0)
+	{
+#ifdef ESP32
+		portENTER_CRITICAL(&accessMsgQueue);
+#else
+		taskENTER_CRITICAL();
+#endif
+		for (uint16_t idx = 0; idx < numGivenUp; idx++)
+		{
+			if (rerouted[idx])
+			{
+				queueStats.rerouted++;
+				requeueSlot(givenUp[idx]);
+			}
+			else
+			{
+				freeSlot(givenUp[idx]);
+			}
+		}
+#ifdef ESP32
+		portEXIT_CRITICAL(&accessMsgQueue);
+#else
+		taskEXIT_CRITICAL();
+#endif
+	}
+	return nextTimeout;
+}
+
+/**
+ * Remove a package from the queue after its ACK arrived
+ * The ACK is counted for the cost of the link to the next hop.
+ * @param from
+ * 			Node ID of the node that sent the ACK
+ * @param linkToken
+ * 			Link token of the acknowledged package
+ */
+void ackReceived(uint32_t from, uint16_t linkToken)
+{
+	bool acked = false;
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	for (int idx = 0; idx < ackCount; idx++)
+	{
+		uint16_t slotIdx = ackSlots[idx];
+		if ((sendSlots[slotIdx].msg->dest == from) && (sendSlots[slotIdx].linkToken == linkToken))
+		{
+			ackSlots[idx] = ackSlots[--ackCount];
+			freeSlot(slotIdx);
+			queueStats.acked++;
+			acked = true;
+			break;
+		}
+	}
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+
+	if (acked && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		setLinkDelivery(from, true);
+		xSemaphoreGive(accessNodeList);
+	}
+}
+
+/**
+ * Queue an ACK for a received package
+ * @param linkToken
+ * 			Link token of the received package
+ */
+void addLinkAck(uint16_t linkToken)
+{
+	dataMsg ackMsg;
+	ackMsg.type = LORA_ACK;
+	ackMsg.dest = linkToken;
+	ackMsg.from = ackMsg.orig = deviceID;
+	if (addSendRequest(&ackMsg, DATA_HEADER_SIZE))
+	{
+#ifdef ESP32
+		portENTER_CRITICAL(&accessMsgQueue);
+#else
+		taskENTER_CRITICAL();
+#endif
+		queueStats.acksSent++;
+#ifdef ESP32
+		portEXIT_CRITICAL(&accessMsgQueue);
+#else
+		taskEXIT_CRITICAL();
+#endif
+	}
+}
+
+/**
+ * Count the airtime of a package that is sent now against the budget
+ * @param msgSize
+ * 			Size of the package
+ */
+void chargeAirTime(uint16_t msgSize)
+{
+	if (frameAirTime == NULL)
+	{
+		return;
+	}
+	uint32_t airTime = frameAirTime(msgSize);
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	updateBudget();
+	budgetSlices[budgetSlice] += airTime;
+	budgetUsed += airTime;
+	queueStats.airTime += airTime;
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
+
+/**
+ * Get the time until a package held back by the airtime budget should be checked again
+ * @return time_t
+ * 			Milliseconds until the next slice of the budget window starts
+ */
+time_t sendBudgetWait(void)
+{
+	uint32_t passed = millis() - budgetSliceStart;
+	return passed >= TX_BUDGET_SLICE ? 0 : TX_BUDGET_SLICE - passed;
+}
+
+/**
+ * Get the number of packages waiting in the queue
+ * @return uint16_t
+ * 			Number of packages
+ */
+uint16_t sendQueueCount(void)
+{
+	return sendRingCount;
+}
+
+/**
+ * Get the statistics of the send queue
+ * @param stats
+ * 			Pointer to a struct for a copy of the statistics
+ */
+void getSendQueueStats(sendQueueStats *stats)
+{
+#ifdef ESP32
+	portENTER_CRITICAL(&accessMsgQueue);
+#else
+	taskENTER_CRITICAL();
+#endif
+	memcpy(stats, &queueStats, sizeof(sendQueueStats));
+#ifdef ESP32
+	portEXIT_CRITICAL(&accessMsgQueue);
+#else
+	taskEXIT_CRITICAL();
+#endif
+}
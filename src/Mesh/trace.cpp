@@ -0,0 +1,101 @@
+#include "main.h"
+
+#if MESH_TRACE
+/** Ring with the last MESH_TRACE_SIZE events */
+traceRecord traceRing[MESH_TRACE_SIZE];
+/** Number of events recorded since the last clear, the next record goes to traceHead % MESH_TRACE_SIZE */
+volatile uint32_t traceHead = 0;
+/** Set while the ring is read */
+volatile bool tracePaused = false;
+
+/**
+ * Start the cycle counter and clear the ring
+ */
+void initTrace(void)
+{
+#ifdef NRF52
+	// The DWT cycle counter is off after reset
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	clearTrace();
+}
+
+/**
+ * Stop or restart the recording
+ * @param pause
+ * 		True to stop recording while the ring is read
+ */
+void pauseTrace(bool pause)
+{
+	tracePaused = pause;
+}
+
+/**
+ * Remove all records from the ring
+ */
+void clearTrace(void)
+{
+	traceHead = 0;
+	memset(traceRing, 0, sizeof(traceRing));
+}
+
+/**
+ * Get the number of records in the ring
+ * @return uint16_t
+ * 		Number of records, at most MESH_TRACE_SIZE
+ */
+uint16_t getTraceCount(void)
+{
+	uint32_t head = traceHead;
+	return head < MESH_TRACE_SIZE ? head : MESH_TRACE_SIZE;
+}
+
+/**
+ * Get a record from the ring, the ring should be paused
+ * @param index
+ * 		Number of the record, 0 is the oldest
+ * @param record
+ * 		Copy of the record
+ */
+void getTraceRecord(uint16_t index, traceRecord *record)
+{
+	uint32_t head = traceHead;
+	uint32_t oldest = head < MESH_TRACE_SIZE ? 0 : head;
+	memcpy(record, &traceRing[(oldest + index) & (MESH_TRACE_SIZE - 1)], sizeof(traceRecord));
+}
+
+/**
+ * Get the frequency of the cycle counter
+ * @return uint32_t
+ * 		Frequency in Hz
+ */
+uint32_t getTraceClock(void)
+{
+#if defined(__XTENSA__)
+	return getCpuFrequencyMhz() * 1000000UL;
+#elif defined(NRF52)
+	return SystemCoreClock;
+#else
+	return 1000000UL;
+#endif
+}
+
+/**
+ * Record the events of the SX126x driver
+ * Replaces the empty default of the driver
+ * @param event
+ * 		SX126X_TRACE_xxx
+ * @param exit
+ * 		False at the entry, true at the exit of the function
+ * @param arg
+ * 		Number of bytes for buffer writes, 0 else
+ */
+#ifndef USE_RFM95
+extern "C" void SX126xTraceHook(uint8_t event, bool exit, uint16_t arg)
+{
+	traceEvent((TRACE_WRITE_BUFFER + event) | (exit ? TRACE_EXIT_FLAG : 0), arg);
+}
+#endif
+#endif
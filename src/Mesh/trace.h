@@ -0,0 +1,119 @@
+#include "Arduino.h"
+#ifdef NRF52
+#include <nrf.h>
+#endif
+
+/** Record entry and exit of the hot path functions in a RAM ring, can be set in platformio.ini */
+#ifndef MESH_TRACE
+#define MESH_TRACE 0
+#endif
+
+/** Number of records in the trace ring, must be a power of 2, can be set in platformio.ini */
+#ifndef MESH_TRACE_SIZE
+#define MESH_TRACE_SIZE 512
+#endif
+
+/** Traced functions */
+#define TRACE_RX_DONE 1
+#define TRACE_SEND_REQUEST 2
+#define TRACE_CAD_DONE 3
+#define TRACE_RADIO_SEND 4
+/** SX126xWriteBuffer, the SX126x driver reports its events with this offset */
+#define TRACE_WRITE_BUFFER 5
+#define TRACE_WAIT_ON_BUSY 6
+/** Flag in the event, set at the exit of the function */
+#define TRACE_EXIT_FLAG 0x80
+
+/** Marks and version of the binary trace dump */
+#define TRACE_MAGIC "EMTR"
+#define TRACE_VERSION 1
+
+struct traceRecord
+{
+	/** Cycle counter of the CPU, wraps around */
+	uint32_t cycles;
+	/** TRACE_xxx, with TRACE_EXIT_FLAG at the exit */
+	uint8_t event;
+	/** CPU core that recorded the event */
+	uint8_t core;
+	/** Size of the package or buffer, 0 if the function has none */
+	uint16_t arg;
+};
+
+/** Header of the binary trace dump, followed by the records from the oldest to the newest */
+struct traceHeader
+{
+	char magic[4];
+	uint8_t version;
+	/** Size of one traceRecord */
+	uint8_t recordSize;
+	/** Number of records that follow */
+	uint16_t count;
+	/** Frequency of the cycle counter in Hz */
+	uint32_t clockHz;
+};
+
+#if MESH_TRACE
+extern traceRecord traceRing[MESH_TRACE_SIZE];
+extern volatile uint32_t traceHead;
+extern volatile bool tracePaused;
+
+/**
+ * Read the cycle counter of the CPU
+ * The host simulator has none and uses micros()
+ * @return uint32_t
+ * 		Cycles since the start
+ */
+static inline uint32_t traceCycles(void)
+{
+#if defined(__XTENSA__)
+	uint32_t ccount;
+	__asm__ __volatile__("rsr %0, ccount"
+						 : "=a"(ccount));
+	return ccount;
+#elif defined(NRF52)
+	return DWT->CYCCNT;
+#else
+	return micros();
+#endif
+}
+
+/**
+ * Add an event to the trace ring, overwrites the oldest record if the ring is full
+ * Safe to be called from tasks on both cores and from interrupts
+ * @param event
+ * 		TRACE_xxx, with TRACE_EXIT_FLAG at the exit
+ * @param arg
+ * 		Size of the package or buffer, 0 if the function has none
+ */
+static inline void traceEvent(uint8_t event, uint16_t arg)
+{
+	if (tracePaused)
+	{
+		return;
+	}
+	uint32_t cycles = traceCycles();
+	traceRecord *record = &traceRing[__atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED) & (MESH_TRACE_SIZE - 1)];
+	record->cycles = cycles;
+	record->event = event;
+#if defined(__XTENSA__)
+	record->core = xPortGetCoreID();
+#else
+	record->core = 0;
+#endif
+	record->arg = arg;
+}
+
+#define TRACE_ENTER(event, arg) traceEvent(event, arg)
+#define TRACE_EXIT(event, arg) traceEvent((event) | TRACE_EXIT_FLAG, arg)
+
+void initTrace(void);
+void pauseTrace(bool pause);
+void clearTrace(void);
+uint16_t getTraceCount(void);
+void getTraceRecord(uint16_t index, traceRecord *record);
+uint32_t getTraceClock(void);
+#else
+#define TRACE_ENTER(event, arg)
+#define TRACE_EXIT(event, arg)
+#endif
@@ -0,0 +1,348 @@
+#include "main.h"
+
+/**
+ * Compact wire format (protocol version 2)
+ *
+ * Inside the mesh code all packages use the v1 layout of dataMsg,
+ * mapMsg and aggregateMsg. They are converted to the compact layout
+ * just before sending and back to the v1 layout right after receiving.
+ *
+ * v2 header:
+ * 	[magic/version] [flags << 4 | type] ...
+ * 	direct, forward, broadcast, map request, ack:
+ * 		dest (2 or 4 bytes), from (4 bytes), orig (4 bytes, only if it differs from from),
+ * 		link token (2 bytes, only if the next hop should send an ACK), data
+ * 	map, map delta:
+ * 		version, baseVersion, from, entries as in v1
+ * 	aggregate:
+ * 		from (4 bytes), packages as [size][v2 header without magic][data]
+ */
+
+/** Flag: orig is sent, otherwise it is the same as from */
+#define WIRE_FLAG_ORIG 0x10
+/** Flag: dest is sent with 2 bytes */
+#define WIRE_FLAG_SHORT_DEST 0x20
+/** Flag: link token is sent, the next hop acknowledges the package */
+#define WIRE_FLAG_ACK 0x40
+
+/** Size of a v1 package header without the 'LoR' marks */
+#define V1_ITEM_HEADER (DATA_HEADER_SIZE - 3)
+
+/**
+ * Write a 32 bit value in little endian order
+ * @param buffer
+ * 		Destination
+ * @param value
+ * 		Value to write
+ */
+static inline void putId(uint8_t *buffer, uint32_t value)
+{
+	memcpy(buffer, &value, 4);
+}
+
+/**
+ * Read a 32 bit value in little endian order
+ * @param buffer
+ * 		Source
+ * @return uint32_t
+ * 		The value
+ */
+static inline uint32_t getId(const uint8_t *buffer)
+{
+	uint32_t value;
+	memcpy(&value, buffer, 4);
+	return value;
+}
+
+/**
+ * Convert a v1 package without the 'LoR' marks into a v2 package without the magic byte
+ * @param in
+ * 		Package starting with the type byte
+ * @param inSize
+ * 		Size of the package without the marks
+ * @param out
+ * 		Buffer for the compact package
+ * @param linkToken
+ * 		Link token if the next hop should acknowledge the package, -1 if not
+ * @return uint16_t
+ * 		Size of the compact package
+ */
+static uint16_t encodeItem(const uint8_t *in, uint16_t inSize, uint8_t *out, int32_t linkToken)
+{
+	uint32_t dest = getId(&in[1]);
+	uint32_t from = getId(&in[5]);
+	uint32_t orig = getId(&in[9]);
+	uint8_t flags = 0;
+	uint16_t pos = 1;
+
+	if (dest <= 0xFFFF)
+	{
+		flags |= WIRE_FLAG_SHORT_DEST;
+		out[pos++] = dest & 0xFF;
+		out[pos++] = dest >> 8;
+	}
+	else
+	{
+		putId(&out[pos], dest);
+		pos += 4;
+	}
+	putId(&out[pos], from);
+	pos += 4;
+	if (orig != from)
+	{
+		flags |= WIRE_FLAG_ORIG;
+		putId(&out[pos], orig);
+		pos += 4;
+	}
+	if (linkToken >= 0)
+	{
+		flags |= WIRE_FLAG_ACK;
+		out[pos++] = linkToken & 0xFF;
+		out[pos++] = linkToken >> 8;
+	}
+	out[0] = flags | (in[0] & 0x0F);
+	memcpy(&out[pos], &in[V1_ITEM_HEADER], inSize - V1_ITEM_HEADER);
+	return pos + inSize - V1_ITEM_HEADER;
+}
+
+/**
+ * Convert a v2 package without the magic byte into a v1 package without the 'LoR' marks
+ * @param in
+ * 		Package starting with the flags/type byte
+ * @param inSize
+ * 		Size of the compact package
+ * @param out
+ * 		Buffer for the v1 package
+ * @param outMax
+ * 		Size of the buffer
+ * @param linkToken
+ * 		Pointer to a variable for the link token, set to -1 if the package has none, can be NULL
+ * @return uint16_t
+ * 		Size of the v1 package, 0 if the package is invalid
+ */
+static uint16_t decodeItem(const uint8_t *in, uint16_t inSize, uint8_t *out, uint16_t outMax, int32_t *linkToken)
+{
+	uint8_t flags = in[0] & 0xF0;
+	uint16_t headerSize = 1 + ((flags & WIRE_FLAG_SHORT_DEST) ? 2 : 4) + 4 + ((flags & WIRE_FLAG_ORIG) ? 4 : 0) + ((flags & WIRE_FLAG_ACK) ? 2 : 0);
+	if ((inSize < headerSize) || ((inSize - headerSize + V1_ITEM_HEADER) > outMax))
+	{
+		return 0;
+	}
+
+	uint16_t pos = 1;
+	uint32_t dest;
+	if (flags & WIRE_FLAG_SHORT_DEST)
+	{
+		dest = in[pos] | (in[pos + 1] << 8);
+		pos += 2;
+	}
+	else
+	{
+		dest = getId(&in[pos]);
+		pos += 4;
+	}
+	uint32_t from = getId(&in[pos]);
+	pos += 4;
+	uint32_t orig = from;
+	if (flags & WIRE_FLAG_ORIG)
+	{
+		orig = getId(&in[pos]);
+		pos += 4;
+	}
+	if (linkToken != NULL)
+	{
+		*linkToken = -1;
+	}
+	if (flags & WIRE_FLAG_ACK)
+	{
+		if (linkToken != NULL)
+		{
+			*linkToken = in[pos] | (in[pos + 1] << 8);
+		}
+		pos += 2;
+	}
+
+	out[0] = in[0] & 0x0F;
+	putId(&out[1], dest);
+	putId(&out[5], from);
+	putId(&out[9], orig);
+	memcpy(&out[V1_ITEM_HEADER], &in[pos], inSize - pos);
+	return V1_ITEM_HEADER + inSize - pos;
+}
+
+/**
+ * Convert a package from the v1 layout into the compact v2 wire format
+ * The v2 package is never larger than the v1 package, so it is converted in place
+ * @param frame
+ * 		Buffer with the package, must hold 256 bytes
+ * @param size
+ * 		Size of the v1 package
+ * @param linkToken
+ * 		Link token if the next hop should acknowledge the package, -1 if not
+ * @return uint16_t
+ * 		Size of the v2 package
+ */
+uint16_t encodeFrame(uint8_t *frame, uint16_t size, int32_t linkToken)
+{
+	uint8_t wire[256];
+	uint8_t type = frame[3];
+	uint16_t wireSize = 2;
+
+	wire[0] = MESH_WIRE_MAGIC;
+	wire[1] = type;
+	switch (type)
+	{
+	case LORA_NODEMAP:
+	case LORA_NODEMAP_DELTA:
+		// Version, baseVersion, from and the entries are kept as they are
+		memcpy(&wire[2], &frame[4], size - 4);
+		wireSize = size - 2;
+		break;
+	case LORA_AGGREGATE:
+	{
+		memcpy(&wire[2], &frame[4], 4);
+		wireSize = 6;
+		uint16_t pos = AGGREGATE_HEADER_SIZE;
+		while (pos < size)
+		{
+			uint8_t itemSize = frame[pos];
+			uint16_t wireItemSize = encodeItem(&frame[pos + 1], itemSize, &wire[wireSize + 1], -1);
+			wire[wireSize] = wireItemSize;
+			wireSize += wireItemSize + 1;
+			pos += itemSize + 1;
+		}
+		break;
+	}
+	default:
+		wireSize = 1 + encodeItem(&frame[3], size - 3, &wire[1], linkToken);
+		break;
+	}
+
+	memcpy(frame, wire, wireSize);
+	memset(&frame[wireSize], 0, 256 - wireSize);
+	return wireSize;
+}
+
+/**
+ * Convert a received package from the compact v2 wire format into the v1 layout
+ * @param wire
+ * 		The received package
+ * @param size
+ * 		Size of the received package
+ * @param frame
+ * 		Buffer for the v1 package, must hold 256 bytes and must not overlap wire
+ * @param linkToken
+ * 		Pointer to a variable for the link token, -1 if the sender expects no ACK
+ * @return uint16_t
+ * 		Size of the v1 package, 0 if the package is invalid
+ */
+uint16_t decodeFrame(const uint8_t *wire, uint16_t size, uint8_t *frame, int32_t *linkToken)
+{
+	uint16_t v1Size = 0;
+
+	*linkToken = -1;
+	if ((size < 2) || (wire[0] != MESH_WIRE_MAGIC))
+	{
+		return 0;
+	}
+
+	frame[0] = 'L';
+	frame[1] = 'o';
+	frame[2] = 'R';
+	switch (wire[1] & 0x0F)
+	{
+	case LORA_NODEMAP:
+	case LORA_NODEMAP_DELTA:
+		if ((size + 2) > 255)
+		{
+			return 0;
+		}
+		frame[3] = wire[1] & 0x0F;
+		memcpy(&frame[4], &wire[2], size - 2);
+		v1Size = size + 2;
+		break;
+	case LORA_AGGREGATE:
+	{
+		if (size < 6)
+		{
+			return 0;
+		}
+		frame[3] = LORA_AGGREGATE;
+		memcpy(&frame[4], &wire[2], 4);
+		v1Size = AGGREGATE_HEADER_SIZE;
+		uint16_t pos = 6;
+		while (pos < size)
+		{
+			uint8_t wireItemSize = wire[pos];
+			if (((pos + 1 + wireItemSize) > size) || (v1Size >= 255))
+			{
+				return 0;
+			}
+			uint16_t itemSize = decodeItem(&wire[pos + 1], wireItemSize, &frame[v1Size + 1], 255 - v1Size - 1, NULL);
+			if (itemSize == 0)
+			{
+				return 0;
+			}
+			frame[v1Size] = itemSize;
+			v1Size += itemSize + 1;
+			pos += wireItemSize + 1;
+		}
+		break;
+	}
+	default:
+		v1Size = decodeItem(&wire[1], size - 1, &frame[3], 255 - 3, linkToken);
+		if (v1Size == 0)
+		{
+			return 0;
+		}
+		v1Size += 3;
+		break;
+	}
+
+	if (v1Size > 255)
+	{
+		return 0;
+	}
+	// Make sure the data is null terminated
+	frame[v1Size] = 0;
+	return v1Size;
+}
+
+/**
+ * Prepare a package from the send queue for sending
+ * Converts the package into the compact wire format if all nodes that have to read it understand it.
+ * Unicast packages only have to be understood by the next hop, all other packages by all direct nodes.
+ * ACKs are only sent to nodes that asked for them with a compact package.
+ * @param frame
+ * 		Buffer with the package, must hold 256 bytes
+ * @param size
+ * 		Size of the package
+ * @param linkToken
+ * 		Link token if the next hop should acknowledge the package, -1 if not
+ * @return uint16_t
+ * 		Size of the package that goes on air
+ */
+uint16_t wireFrame(uint8_t *frame, uint16_t size, int32_t linkToken)
+{
+#if MESH_PROTOCOL_VERSION >= 2
+	dataMsg *thisMsg = (dataMsg *)frame;
+	bool compact = (thisMsg->type == LORA_ACK) || (linkToken >= 0);
+	if (!compact && (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE))
+	{
+		if ((thisMsg->type == LORA_DIRECT) || (thisMsg->type == LORA_FORWARD) || (thisMsg->type == LORA_MAP_REQUEST))
+		{
+			compact = getNodeProtocol(thisMsg->dest) >= 2;
+		}
+		else
+		{
+			compact = neighbourProtocol() >= 2;
+		}
+		xSemaphoreGive(accessNodeList);
+	}
+	if (compact)
+	{
+		return encodeFrame(frame, size, linkToken);
+	}
+#endif
+	return size;
+}
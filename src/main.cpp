@@ -131,12 +131,14 @@ void loop()
 	delay(100);
 
 	// Handle LoRa data
-	if (newLoRaData)
+	if (loraRxCount() != 0)
 	{
 		handleLoraData();
-		newLoRaData = false;
 	}
 
+	// Request missing fragments of incomplete messages
+	checkFragments();
+
 	// Handle Mesh nodes list changes
 	if (nodesListChanged)
 	{
@@ -210,7 +212,7 @@ void loop()
 			// Send a direct package
 			if (xSemaphoreTake(accessNodeList, (TickType_t)1000) == pdTRUE)
 			{
-				uint8_t numElements = numOfNodes();
+				uint16_t numElements = numOfNodes();
 				// nodesList routeToNode;
 				uint32_t nodeId;
 				uint32_t firstHop;
@@ -28,6 +28,16 @@ extern TimerClass timer;
 #define NAME_TYPE 0x33
 #define MAP_TYPE 0x34
 #define SET_NAME_TYPE 0x35
+/** Part of a message that does not fit into one package */
+#define FRAGMENT_TYPE 0x36
+/** Request for missing fragments */
+#define FRAGMENT_NACK_TYPE 0x37
+/** Mesh statistics, the app sends the type alone as request and gets them in binary format */
+#define STATS_TYPE 0x38
+/** Version of the binary format of the mesh statistics */
+#define STATS_VERSION 2
+/** Flag in the package type, the text is compressed with the text codec */
+#define COMPRESSED_FLAG 0x80
 
 /** LoRa package types */
 #define LORA_INVALID 0
@@ -35,6 +45,10 @@ extern TimerClass timer;
 #define LORA_FORWARD 2
 #define LORA_BROADCAST 3
 #define LORA_NODEMAP 4
+#define LORA_NODEMAP_DELTA 5
+#define LORA_MAP_REQUEST 6
+#define LORA_AGGREGATE 7
+#define LORA_ACK 8
 
 // BLE
 #include "BLE/ble_uart.h"
@@ -53,11 +67,24 @@ extern bool bleUARTnotifyEnabled;
 
 bool initLoRa(void);
 void handleLoraData(void);
+uint16_t loraRxCount(void);
+uint32_t getLoraRxOverflows(void);
 void handleNodesListChanges(void);
 void sendLoRaData(uint32_t receiver, uint8_t type, char *data, size_t len);
-extern boolean newLoRaData;
+bool setRoute(uint32_t receiver, dataMsg *outData);
 extern boolean nodesListChanged;
-extern uint32_t loraSenderID;
+
+/** Max number of received messages waiting for the application, can be set in platformio.ini */
+#ifndef LORA_RX_QUEUE_SIZE
+#define LORA_RX_QUEUE_SIZE 8
+#endif
+
+/** Send chat messages compressed to receivers that advertise COMPRESSION_PROTOCOL, can be set in platformio.ini */
+#ifndef CHAT_COMPRESSION
+#define CHAT_COMPRESSION 1
+#endif
+/** Lowest wire protocol version of a node that expands compressed chat text */
+#define COMPRESSION_PROTOCOL 5
 
 // Console
 void handleConsoleData(void);
@@ -78,5 +105,8 @@ struct localMsg
 // Configuration
 #include <EmyChat/config.h>
 
-// Emy node names
-#include <EmyChat/node_names.h>
\ No newline at end of file
+// Chat text compression
+#include <EmyChat/text_codec.h>
+
+// Fragmentation of large messages
+#include <EmyChat/fragment.h>
\ No newline at end of file
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Turn a trace dump of an Emy-Chat node into a timeline and latency histograms.
+
+Build the node with -DMESH_TRACE=1, send /trace (or /trace clear) on the
+console and save the raw serial output to a file, e.g.
+
+    pio device monitor --raw | tee capture.bin
+
+The dump can be anywhere in the capture, the text around it is skipped.
+With --port the script sends /trace itself and reads the dump (needs pyserial).
+
+    tools/trace_timeline.py capture.bin
+    tools/trace_timeline.py --port /dev/ttyUSB0 --timeline
+"""
+
+import argparse
+import struct
+import sys
+
+# Must match src/Mesh/trace.h
+TRACE_MAGIC = b"EMTR"
+TRACE_VERSION = 1
+TRACE_EXIT_FLAG = 0x80
+HEADER = struct.Struct("<4sBBHI")
+RECORD = struct.Struct("<IBBH")
+
+EVENT_NAMES = {
+    1: "OnRxDone",
+    2: "addSendRequest",
+    3: "OnCadDone",
+    4: "Radio.Send",
+    5: "SX126xWriteBuffer",
+    6: "SX126xWaitOnBusy",
+}
+
+
+def read_port(port, baud, timeout):
+    """Send /trace on the console and return everything the node sends back."""
+    import serial
+
+    with serial.Serial(port, baud, timeout=timeout) as ser:
+        ser.reset_input_buffer()
+        ser.write(b"/trace\n")
+        data = bytearray()
+        while True:
+            chunk = ser.read(4096)
+            if not chunk:
+                break
+            data += chunk
+    return bytes(data)
+
+
+def parse_dump(data):
+    """Find the last dump in the capture and return (clock in Hz, records)."""
+    start = data.rfind(TRACE_MAGIC)
+    if start < 0:
+        sys.exit("No trace dump found, was the node built with -DMESH_TRACE=1?")
+    magic, version, record_size, count, clock_hz = HEADER.unpack_from(data, start)
+    if version != TRACE_VERSION or record_size != RECORD.size:
+        sys.exit("Unsupported trace version %d with %d byte records" % (version, record_size))
+    offset = start + HEADER.size
+    available = (len(data) - offset) // RECORD.size
+    if available < count:
+        print("Warning: dump is cut off, %d of %d records" % (available, count), file=sys.stderr)
+        count = available
+    records = [RECORD.unpack_from(data, offset + idx * RECORD.size) for idx in range(count)]
+    return clock_hz, records
+
+
+def unwrap(clock_hz, records):
+    """Return (time in us, core, event, exit, arg) with the 32 bit counter unwrapped per core.
+
+    The counter of each core is unwrapped on its own, consecutive events of a
+    core must be less than half a counter period apart. Events that were
+    stamped just before an interrupt took the next ring slot can be a few
+    cycles older than the record before them, they are not taken as a wrap.
+    """
+    last = {}
+    base = {}
+    events = []
+    for cycles, event, core, arg in records:
+        if core in last and cycles < last[core] and last[core] - cycles >= (1 << 31):
+            base[core] = base.get(core, 0) + (1 << 32)
+        last[core] = cycles
+        total = base.get(core, 0) + cycles
+        events.append((total * 1e6 / clock_hz, core, event & ~TRACE_EXIT_FLAG, bool(event & TRACE_EXIT_FLAG), arg))
+    return events
+
+
+def event_name(event):
+    return EVENT_NAMES.get(event, "event %d" % event)
+
+
+def pair_events(events, print_timeline):
+    """Match the entries and exits and return the durations in us per event.
+
+    Exits without an entry (the entry was overwritten in the ring) are skipped.
+    """
+    stacks = {}
+    durations = {}
+    origin = events[0][0] if events else 0
+    for time_us, core, event, is_exit, arg in events:
+        stack = stacks.setdefault(core, [])
+        if not is_exit:
+            if print_timeline:
+                print("%12.1f us  core %d  %s%s > (%d)" % (time_us - origin, core, "  " * len(stack), event_name(event), arg))
+            stack.append((event, time_us))
+            continue
+        # Drop entries whose exit is missing, e.g. a function left through an early return
+        while stack and stack[-1][0] != event:
+            stack.pop()
+        if not stack:
+            continue
+        _, start_us = stack.pop()
+        duration = time_us - start_us
+        durations.setdefault(event, []).append(duration)
+        if print_timeline:
+            print("%12.1f us  core %d  %s%s < %.1f us" % (time_us - origin, core, "  " * len(stack), event_name(event), duration))
+    return durations
+
+
+def percentile(values, share):
+    return values[min(len(values) - 1, int(share * len(values)))]
+
+
+def print_histograms(durations, width):
+    """Print count, average, percentiles and a log2 histogram of the durations per event."""
+    for event in sorted(durations):
+        values = sorted(durations[event])
+        print()
+        print("%s: %d calls, avg %.1f us, min %.1f us, p50 %.1f us, p95 %.1f us, max %.1f us" % (
+            event_name(event), len(values), sum(values) / len(values), values[0],
+            percentile(values, 0.5), percentile(values, 0.95), values[-1]))
+        buckets = {}
+        for value in values:
+            bucket = 0
+            while (1 << bucket) <= value:
+                bucket += 1
+            buckets[bucket] = buckets.get(bucket, 0) + 1
+        most = max(buckets.values())
+        for bucket in range(min(buckets), max(buckets) + 1):
+            count = buckets.get(bucket, 0)
+            low = 0 if bucket == 0 else 1 << (bucket - 1)
+            print("  %8d - %8d us %6d %s" % (low, 1 << bucket, count, "#" * ((count * width + most - 1) // most)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", nargs="?", help="raw serial capture with the output of /trace")
+    parser.add_argument("--port", help="serial port of the node, sends /trace and reads the dump")
+    parser.add_argument("--baud", type=int, default=115200, help="baud rate of the console (115200)")
+    parser.add_argument("--timeline", action="store_true", help="print every event")
+    parser.add_argument("--width", type=int, default=50, help="width of the histogram bars (50)")
+    args = parser.parse_args()
+
+    if args.port:
+        data = read_port(args.port, args.baud, 2)
+    elif args.capture:
+        with open(args.capture, "rb") as capture:
+            data = capture.read()
+    else:
+        parser.error("give a capture file or --port")
+
+    clock_hz, records = parse_dump(data)
+    events = unwrap(clock_hz, records)
+    print("%d records, counter at %.1f MHz" % (len(events), clock_hz / 1e6))
+    if events:
+        print("Time span: %.1f ms" % ((events[-1][0] - events[0][0]) / 1000))
+    durations = pair_events(events, args.timeline)
+    print_histograms(durations, args.width)
+
+
+if __name__ == "__main__":
+    main()